@@ -22,12 +22,9 @@ static uint8_t receiver[] = { 0x12, 0x34, 0x56, 0x78, 0x90, 0x12 };
 #define DEST_ADDR ESPNOW_BROADCAST_ADDRESS 
 #endif //USE_BROADCAST != 1
 
-bool sent = true;
-
 const unsigned int SEND_MSG_MSEC = 2000;
 
 void dataSent (uint8_t* address, uint8_t status) {
-    sent = true;
     Serial.printf ("Message sent to " MACSTR ", status: %d\n", MAC2STR (address), status);
 }
 
@@ -60,17 +57,15 @@ void loop () {
     static time_t lastSend = 0;
     static unsigned int counter = 0;
 
-     // Sent flag is needed to wait for the message to be actually sent. Avoids messages dropping, maximizing throughput.
-     // readyToSendData() is used to avoid sending messages too fast, which can lead to messages dropping.
-    if (quickEspNow.readyToSendData() && sent && ((millis () - lastSend) > SEND_MSG_MSEC)) {
+    // waitForQueueSpace() blocks until there is room for a message, instead of polling readyToSendData().
+    // Loop does not have to track sent messages to avoid dropping them when queue is full.
+    if ((millis () - lastSend) > SEND_MSG_MSEC && quickEspNow.waitForQueueSpace (100)) {
         lastSend = millis ();
         String message = String (msg) + " " + String (counter++);
-        sent = false;
         if (!quickEspNow.send (DEST_ADDR, (uint8_t*)message.c_str (), message.length ())) {
             Serial.printf (">>>>>>>>>> Message sent\n");
         } else {
             Serial.printf (">>>>>>>>>> Message not sent\n");
-            sent = true; // In case of error we need to set the flag to true to avoid blocking the loop
         }
 
     }
@@ -0,0 +1,84 @@
+// Runs QuickEspNow engine natively on a Linux host, on top of a simulated radio.
+//
+// Without arguments two nodes are created in the same process and connected through an in-process bus.
+// With arguments a single node is started that talks to other processes over loopback UDP:
+//     host_loopback <node id> <local port> <remote port> [<remote port> ...]
+// e.g. run `host_loopback 1 5001 5002` and `host_loopback 2 5002 5001` in two terminals
+#include <QuickEspNow.h>
+#include <stdlib.h>
+
+static const unsigned int SEND_MSG_MSEC = 1000;
+static const unsigned int BUS_MESSAGES = 10;
+
+void dataReceived (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    Serial.printf ("Received: %.*s\n", len, data);
+    Serial.printf ("RSSI: %d dBm\n", rssi);
+    Serial.printf ("From: " MACSTR "\n", MAC2STR (address));
+    Serial.printf ("%s\n", broadcast ? "Broadcast" : "Unicast");
+}
+
+void dataSent (uint8_t* address, uint8_t status) {
+    Serial.printf ("Message sent to " MACSTR ", status: %d\n", MAC2STR (address), status);
+}
+
+int runBus () {
+    static uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    static uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow receiver;
+
+    quickEspNow.setDriver (&senderRadio);
+    quickEspNow.onDataSent (dataSent);
+    quickEspNow.begin (1);
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (dataReceived);
+    receiver.begin (1);
+
+    for (unsigned int counter = 0; counter < BUS_MESSAGES; counter++) {
+        char message[32];
+        int len = snprintf (message, sizeof (message), "Hello ESP-NOW! %u", counter);
+        const uint8_t* dst = (counter % 2) ? ESPNOW_BROADCAST_ADDRESS : receiverMac;
+        if (quickEspNow.send (dst, (uint8_t*)message, len)) {
+            Serial.printf (">>>>>>>>>> Message not sent\n");
+        }
+    }
+    delay (100);
+    quickEspNow.stop ();
+    receiver.stop ();
+    return 0;
+}
+
+int runUdp (int argc, char** argv) {
+    uint8_t mac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, (uint8_t)atoi (argv[1]) };
+    EspNowUdpDriverClass radio (mac, (uint16_t)atoi (argv[2]));
+    for (int i = 3; i < argc; i++) {
+        radio.addRemote ((uint16_t)atoi (argv[i]));
+    }
+
+    quickEspNow.setDriver (&radio);
+    quickEspNow.onDataRcvd (dataReceived);
+    if (!quickEspNow.begin (1, 0, false)) {
+        Serial.printf ("Cannot start ESP-NOW\n");
+        return 1;
+    }
+    Serial.printf ("MAC address: " MACSTR "\n", MAC2STR (mac));
+
+    for (unsigned int counter = 0;; counter++) {
+        char message[32];
+        int len = snprintf (message, sizeof (message), "Hello ESP-NOW! %u", counter);
+        if (quickEspNow.sendBcast ((uint8_t*)message, len)) {
+            Serial.printf (">>>>>>>>>> Message not sent\n");
+        }
+        delay (SEND_MSG_MSEC);
+    }
+    return 0;
+}
+
+int main (int argc, char** argv) {
+    if (argc >= 4) {
+        return runUdp (argc, argv);
+    }
+    return runBus ();
+}
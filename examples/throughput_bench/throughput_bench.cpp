@@ -0,0 +1,459 @@
+// Throughput and latency benchmark for QuickEspNow.
+//
+// Every run prints one line of JSON with message rate, goodput, drop ratio and latency percentiles:
+//   - tx latency: from message queued by `send` until its `tx_cb`
+//   - rx latency: from frame received in `rx_cb` until it is passed to `dataRcvd`
+//
+// On ESP32/ESP8266 flash one board with BENCH_SENDER set to 1 and another one with 0. Sender sweeps payload
+// sizes and reports tx side, receiver reports rx side every BENCH_DURATION_MS.
+//
+// On Linux host both nodes run in the same process over a simulated radio and each run reports both sides.
+// Options:
+//   --payload 1,12,250   payload sizes to test (1..250)
+//   --duration 5000      run duration in ms
+//   --sync               use synchronous send mode
+//   --broadcast          send to broadcast address instead of unicast
+//   --zero-copy          write payload in place with reserve/commit instead of send
+//   --batch 0            queue this many messages at once with sendBatch (up to 32). 0 uses send
+//   --tx-bytes 1024      transmission queue size in bytes
+//   --rx-bytes 2048      reception queue size in bytes
+//   --queue-budget 0     let queues adapt their size within this RAM budget in bytes. 0 disables it
+//   --rate 0             messages per second. 0 sends as fast as queue accepts them
+//   --airtime 0          simulated per frame air time in us
+//   --byte-us 0          simulated per byte air time in us
+//   --loss 0             simulated frame loss ratio (0 to 1)
+//   --pacing 0           pace sender with AIMD rate up to this many frames per second. 0 disables pacing
+//   --trace prefix       append event trace of newest messages of every run to prefix_sender.bin and prefix_receiver.bin
+// Results of two library versions can be compared with tools/bench_compare.py. Traces are decoded with tools/trace_decode.py
+#ifdef ARDUINO
+#include <Arduino.h>
+#if defined ESP32
+#include <WiFi.h>
+#include <esp_wifi.h>
+#elif defined ESP8266
+#include <ESP8266WiFi.h>
+#define WIFI_MODE_STA WIFI_STA
+#else
+#error "Unsupported platform"
+#endif //ESP32
+#endif // ARDUINO
+#include <QuickEspNow.h>
+#include <stdlib.h>
+
+#define BENCH_SENDER 1 // Set this to 0 to flash receiver board
+#define USE_BROADCAST 1 // Set this to 1 to use broadcast communication
+#define BENCH_SYNC_SEND 0 // Set this to 1 to use synchronous send mode
+#define BENCH_ZERO_COPY 0 // Set this to 1 to use reserve/commit instead of send
+#define BENCH_BATCH 0 // Number of messages queued at once with sendBatch. 0 uses send
+
+#if USE_BROADCAST != 1
+// set the MAC address of the receiver for unicast
+static uint8_t receiver[] = { 0x12, 0x34, 0x56, 0x78, 0x90, 0x12 };
+#define DEST_ADDR receiver
+#else //USE_BROADCAST != 1
+#define DEST_ADDR ESPNOW_BROADCAST_ADDRESS
+#endif //USE_BROADCAST != 1
+
+static const uint32_t BENCH_DURATION_MS = 10000;
+static const uint8_t BENCH_PAYLOADS[] = { 250, 125, 75, 35, 12, 1 };
+static const uint8_t BENCH_CHANNEL = 1;
+static const uint8_t BENCH_MAX_BATCH = 32;
+
+/**
+  * @brief Log-linear latency histogram. Values are kept with about 6% resolution using 1.8 kB of RAM,
+  * so that it can be used on ESP8266 too
+  */
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = (32 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    void reset () {
+        memset (counts, 0, sizeof (counts));
+        total = 0;
+        maxValue = 0;
+    }
+
+    void record (uint32_t value) {
+        counts[index (value)]++;
+        total++;
+        if (value > maxValue) {
+            maxValue = value;
+        }
+    }
+
+    uint32_t percentile (float p) {
+        if (!total) {
+            return 0;
+        }
+        uint32_t rank = (uint32_t)(p * total);
+        if (rank >= total) {
+            rank = total - 1;
+        }
+        uint32_t accumulated = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            accumulated += counts[i];
+            if (accumulated > rank) {
+                uint32_t value = midpoint (i);
+                return value < maxValue ? value : maxValue;
+            }
+        }
+        return maxValue;
+    }
+
+    uint32_t count () { return total; }
+    uint32_t max () { return maxValue; }
+
+protected:
+    uint32_t counts[BUCKETS];
+    uint32_t total = 0;
+    uint32_t maxValue = 0;
+
+    static int index (uint32_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        int shift = (31 - __builtin_clz (value)) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint32_t midpoint (int index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+        int shift = index / SUB_BUCKETS - 1;
+        uint32_t low = (uint32_t)(SUB_BUCKETS | (index % SUB_BUCKETS)) << shift;
+        return low + ((1UL << shift) >> 1);
+    }
+};
+
+typedef struct {
+    uint8_t payload_len;
+    bool synchronous;
+    bool broadcast;
+    uint32_t duration_ms;
+    uint32_t rate;
+    bool zero_copy;
+    size_t tx_queue_bytes;
+    size_t rx_queue_bytes;
+    size_t queue_budget;
+    uint8_t batch;
+    uint32_t pacing;
+} bench_config_t;
+
+typedef struct {
+    uint32_t attempted;
+    uint32_t enqueued;
+    uint32_t queue_full;
+    uint32_t other_errors;
+    volatile uint32_t confirmed_ok;
+    volatile uint32_t confirmed_fail;
+    volatile uint32_t received;
+    uint32_t elapsed_ms;
+} bench_counters_t;
+
+static bench_counters_t counters;
+static LatencyHistogram txLatency;
+static LatencyHistogram rxLatency;
+
+void resetBench () {
+    memset (&counters, 0, sizeof (counters));
+    txLatency.reset ();
+    rxLatency.reset ();
+}
+
+void latencySample (espnow_latency_type_t type, uint32_t latency_us) {
+    if (type == ESPNOW_TX_LATENCY) {
+        txLatency.record (latency_us);
+    } else {
+        rxLatency.record (latency_us);
+    }
+}
+
+void dataSent (uint8_t* address, uint8_t status) {
+    if (status == ESP_NOW_SEND_SUCCESS) {
+        counters.confirmed_ok++;
+    } else {
+        counters.confirmed_fail++;
+    }
+}
+
+void dataReceived (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    counters.received++;
+}
+
+void printLatency (const char* name, LatencyHistogram& histogram) {
+    Serial.printf ("\"%s\":{\"samples\":%u,\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}", name,
+                   histogram.count (), histogram.percentile (0.5), histogram.percentile (0.99),
+                   histogram.percentile (0.999), histogram.max ());
+}
+
+/**
+  * @brief Prints result of a run as one line of JSON. Sides that have not been measured are omitted
+  */
+void printResult (const bench_config_t& config, const char* platform, bool txSide, bool rxSide) {
+    float seconds = counters.elapsed_ms / 1000.0;
+    Serial.printf ("{\"bench\":\"quickespnow\",\"platform\":\"%s\",", platform);
+    Serial.printf ("\"config\":{\"payload\":%u,\"mode\":\"%s\",\"dest\":\"%s\",\"api\":\"%s\",\"batch\":%u,\"tx_queue_bytes\":%u,\"rx_queue_bytes\":%u,\"queue_budget\":%u,\"rate\":%u,\"pacing\":%u,\"duration_ms\":%u},",
+                   config.payload_len, config.synchronous ? "sync" : "async", config.broadcast ? "broadcast" : "unicast",
+                   config.batch ? "batch" : config.zero_copy ? "reserve" : "send", config.batch, (unsigned)config.tx_queue_bytes, (unsigned)config.rx_queue_bytes, (unsigned)config.queue_budget,
+                   config.rate, config.pacing, counters.elapsed_ms);
+    if (txSide) {
+        Serial.printf ("\"tx\":{\"attempted\":%u,\"enqueued\":%u,\"queue_full\":%u,\"errors\":%u,\"confirmed_ok\":%u,\"confirmed_fail\":%u,\"msgs_per_s\":%.1f,\"goodput_kbps\":%.2f},",
+                       counters.attempted, counters.enqueued, counters.queue_full, counters.other_errors,
+                       counters.confirmed_ok, counters.confirmed_fail,
+                       counters.confirmed_ok / seconds, counters.confirmed_ok * config.payload_len * 8 / seconds / 1000);
+    }
+    if (rxSide) {
+        Serial.printf ("\"rx\":{\"received\":%u,\"msgs_per_s\":%.1f,\"goodput_kbps\":%.2f},",
+                       counters.received, counters.received / seconds, counters.received * config.payload_len * 8 / seconds / 1000);
+    }
+    if (txSide && rxSide) {
+        Serial.printf ("\"drop_ratio\":%.5f,", counters.attempted ? 1.0 - (float)counters.received / counters.attempted : 0.0);
+    } else if (txSide) {
+        Serial.printf ("\"drop_ratio\":%.5f,", counters.attempted ? 1.0 - (float)counters.confirmed_ok / counters.attempted : 0.0);
+    }
+    Serial.printf ("\"latency_us\":{");
+    if (txSide) {
+        printLatency ("enqueue_to_tx_cb", txLatency);
+    }
+    if (rxSide) {
+        Serial.printf (txSide ? "," : "");
+        printLatency ("rx_cb_to_dispatch", rxLatency);
+    }
+    Serial.printf ("}}\n");
+}
+
+/**
+  * @brief Sends messages for configured time. Without rate limit, it sends as fast as queue accepts them
+  */
+void runSender (QuickEspNow& espnow, const uint8_t* dst, const bench_config_t& config) {
+    uint8_t payload[ESPNOW_MAX_MESSAGE_LENGTH];
+    memset (payload, 'Q', sizeof (payload));
+
+    uint32_t start = millis ();
+    uint32_t startUs = micros ();
+    while (millis () - start < config.duration_ms) {
+        if (config.rate) {
+            uint32_t due = (uint32_t)((uint64_t)counters.attempted * 1000000 / config.rate);
+            if (micros () - startUs < due) {
+                taskYIELD ();
+                continue;
+            }
+        } else if (!espnow.readyToSendData ()) {
+            taskYIELD ();
+            continue;
+        }
+        comms_send_error_t error;
+        uint8_t messages = 1;
+        if (config.batch) {
+            // All messages share payload buffer, only queue and wakeup cost is measured
+            espnow_batch_entry_t entries[BENCH_MAX_BATCH];
+            messages = config.batch;
+            memcpy (payload, &counters.attempted, config.payload_len < sizeof (uint32_t) ? config.payload_len : sizeof (uint32_t));
+            for (uint8_t i = 0; i < messages; i++) {
+                entries[i].dstAddress = dst;
+                entries[i].payload = payload;
+                entries[i].payload_len = config.payload_len;
+            }
+            counters.attempted += messages;
+            error = espnow.sendBatch (entries, messages);
+        } else if (config.zero_copy) {
+            // Serializer writes straight into queue storage
+            uint8_t* buffer = espnow.reserve (dst, config.payload_len);
+            counters.attempted++;
+            if (buffer) {
+                memset (buffer, 'Q', config.payload_len);
+                memcpy (buffer, &counters.attempted, config.payload_len < sizeof (uint32_t) ? config.payload_len : sizeof (uint32_t));
+                error = espnow.commit (config.payload_len);
+            } else {
+                error = COMMS_SEND_QUEUE_FULL_ERROR;
+            }
+        } else {
+            memcpy (payload, &counters.attempted, config.payload_len < sizeof (uint32_t) ? config.payload_len : sizeof (uint32_t));
+            counters.attempted++;
+            error = espnow.send (dst, payload, config.payload_len);
+        }
+        if (error == COMMS_SEND_OK || error == COMMS_SEND_CONFIRM_ERROR) {
+            counters.enqueued += messages;
+        } else if (error == COMMS_SEND_QUEUE_FULL_ERROR) {
+            counters.queue_full += messages;
+        } else {
+            counters.other_errors += messages;
+        }
+    }
+    counters.elapsed_ms = millis () - start;
+}
+
+#ifdef ARDUINO
+
+bench_config_t benchConfig = { 0, BENCH_SYNC_SEND == 1, USE_BROADCAST == 1, BENCH_DURATION_MS, 0, BENCH_ZERO_COPY == 1,
+                               ESPNOW_TX_QUEUE_BYTES, ESPNOW_RX_QUEUE_BYTES, 0, BENCH_BATCH, 0 };
+
+void setup () {
+    Serial.begin (115200);
+    WiFi.mode (WIFI_MODE_STA);
+#if defined ESP32
+    WiFi.disconnect (false, true);
+#elif defined ESP8266
+    WiFi.disconnect (false);
+#endif //ESP32
+    Serial.printf ("MAC address: %s\n", WiFi.macAddress ().c_str ());
+    quickEspNow.onLatencySample (latencySample);
+#if BENCH_SENDER == 1
+    quickEspNow.onDataSent (dataSent);
+#else
+    quickEspNow.onDataRcvd (dataReceived);
+#endif // BENCH_SENDER
+    quickEspNow.begin (BENCH_CHANNEL, 0, benchConfig.synchronous, benchConfig.tx_queue_bytes, benchConfig.rx_queue_bytes);
+}
+
+void loop () {
+#if BENCH_SENDER == 1
+    for (uint8_t payload_len : BENCH_PAYLOADS) {
+        resetBench ();
+        benchConfig.payload_len = payload_len;
+        runSender (quickEspNow, DEST_ADDR, benchConfig);
+        delay (100);
+        printResult (benchConfig, "device", true, false);
+    }
+#else
+    resetBench ();
+    delay (BENCH_DURATION_MS);
+    counters.elapsed_ms = BENCH_DURATION_MS;
+    printResult (benchConfig, "device", false, true);
+#endif // BENCH_SENDER
+}
+
+#else // ARDUINO
+
+static uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+static const size_t BENCH_TRACE_RECORDS = 65536;
+static const char* tracePrefix = NULL;
+
+void writeTrace (QuickEspNow& node, const char* name) {
+    char path[256];
+    FILE* file;
+
+    snprintf (path, sizeof (path), "%s_%s.bin", tracePrefix, name);
+    if (!(file = fopen (path, "ab"))) {
+        fprintf (stderr, "Cannot open %s\n", path);
+        return;
+    }
+    node.dumpTrace ([file] (const uint8_t* data, size_t len) { fwrite (data, 1, len, file); });
+    fclose (file);
+}
+
+void runHost (EspNowBusClass& bus, const bench_config_t& config) {
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+
+    resetBench ();
+    sender.setDriver (&senderRadio);
+    sender.onDataSent (dataSent);
+    sender.onLatencySample ([] (espnow_latency_type_t type, uint32_t latency_us) {
+        if (type == ESPNOW_TX_LATENCY) {
+            txLatency.record (latency_us);
+        }
+    });
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (dataReceived);
+    receiver.onLatencySample ([] (espnow_latency_type_t type, uint32_t latency_us) {
+        if (type == ESPNOW_RX_LATENCY) {
+            rxLatency.record (latency_us);
+        }
+    });
+    if (config.queue_budget) {
+        receiver.enableAdaptiveQueues (config.queue_budget);
+        sender.enableAdaptiveQueues (config.queue_budget);
+    }
+    sender.enablePacing (config.pacing);
+    if (tracePrefix) {
+        sender.enableTrace (BENCH_TRACE_RECORDS);
+        receiver.enableTrace (BENCH_TRACE_RECORDS);
+    }
+    if (!receiver.begin (BENCH_CHANNEL, 0, false, config.tx_queue_bytes, config.rx_queue_bytes)
+        || !sender.begin (BENCH_CHANNEL, 0, config.synchronous, config.tx_queue_bytes, config.rx_queue_bytes)) {
+        fprintf (stderr, "Queues must be at least %u bytes for TX and %u bytes for RX\n", (unsigned)(2 * ESPNOW_TX_RECORD_LEN), (unsigned)(2 * ESPNOW_RX_RECORD_LEN));
+        exit (1);
+    }
+
+    runSender (sender, config.broadcast ? ESPNOW_BROADCAST_ADDRESS : receiverMac, config);
+    // Let queues drain before reading counters
+    delay (200);
+    sender.stop ();
+    receiver.stop ();
+    if (tracePrefix) {
+        writeTrace (sender, "sender");
+        writeTrace (receiver, "receiver");
+    }
+    printResult (config, "host", true, true);
+}
+
+int main (int argc, char** argv) {
+    bench_config_t config = { 0, false, false, 5000, 0, false, ESPNOW_TX_QUEUE_BYTES, ESPNOW_RX_QUEUE_BYTES, 0, 0, 0 };
+    const char* payloads = "1,12,35,75,125,250";
+    EspNowBusClass bus;
+    uint32_t airtime = 0;
+    float byteUs = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp (arg, "--sync")) {
+            config.synchronous = true;
+        } else if (!strcmp (arg, "--broadcast")) {
+            config.broadcast = true;
+        } else if (!strcmp (arg, "--zero-copy")) {
+            config.zero_copy = true;
+        } else if (value && !strcmp (arg, "--payload")) {
+            payloads = value; i++;
+        } else if (value && !strcmp (arg, "--duration")) {
+            config.duration_ms = strtoul (value, NULL, 10); i++;
+        } else if (value && !strcmp (arg, "--rate")) {
+            config.rate = strtoul (value, NULL, 10); i++;
+        } else if (value && !strcmp (arg, "--airtime")) {
+            airtime = strtoul (value, NULL, 10); i++;
+        } else if (value && !strcmp (arg, "--byte-us")) {
+            byteUs = strtof (value, NULL); i++;
+        } else if (value && !strcmp (arg, "--tx-bytes")) {
+            config.tx_queue_bytes = strtoul (value, NULL, 10); i++;
+        } else if (value && !strcmp (arg, "--rx-bytes")) {
+            config.rx_queue_bytes = strtoul (value, NULL, 10); i++;
+        } else if (value && !strcmp (arg, "--queue-budget")) {
+            config.queue_budget = strtoul (value, NULL, 10); i++;
+        } else if (value && !strcmp (arg, "--batch")) {
+            unsigned long batch = strtoul (value, NULL, 10);
+            config.batch = batch < BENCH_MAX_BATCH ? batch : BENCH_MAX_BATCH; i++;
+        } else if (value && !strcmp (arg, "--pacing")) {
+            config.pacing = strtoul (value, NULL, 10); i++;
+        } else if (value && !strcmp (arg, "--loss")) {
+            bus.setLossRatio (strtof (value, NULL)); i++;
+        } else if (value && !strcmp (arg, "--trace")) {
+            tracePrefix = value; i++;
+        } else {
+            fprintf (stderr, "Unknown option %s\n", arg);
+            return 1;
+        }
+    }
+    bus.setAirtime (airtime, byteUs);
+
+    for (const char* ptr = payloads; *ptr;) {
+        char* end;
+        unsigned long payload_len = strtoul (ptr, &end, 10);
+        if (end == ptr || payload_len < 1 || payload_len > ESP_NOW_MAX_DATA_LEN) {
+            fprintf (stderr, "Invalid payload size list %s\n", payloads);
+            return 1;
+        }
+        config.payload_len = (uint8_t)payload_len;
+        runHost (bus, config);
+        ptr = (*end == ',') ? end + 1 : end;
+    }
+    return 0;
+}
+
+#endif // ARDUINO
@@ -0,0 +1,267 @@
+/**
+  * @file BipBuffer.h
+  * @author German Martin
+  * @brief Variable length record queue for QuickEspNow message buffers
+  */
+
+#ifndef _BIPBUFFER_h
+#define _BIPBUFFER_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#elif defined QESPNOW_HOST
+#include "QuickEspNow_host.h"
+#else
+#include "WProgram.h"
+#endif
+#include <atomic>
+#include <new>
+
+/**
+  * @brief Lock-free single producer, single consumer queue of variable length records, sized in bytes.
+  *
+  * Every record is stored contiguously after a 4 byte header and rounded up to 4 bytes, so that payload can be
+  * cast to a struct. When a record does not fit before the end of storage, the remaining space is marked as padding
+  * and the record is written at the beginning, as in a bip-buffer.
+  *
+  * Positions run from 0 to twice the capacity, so that full and empty states can be told apart without modulo
+  * operations or power of two sizes.
+  *
+  * Producer may stage several records before making them visible together with `publish`, or drop all of them with
+  * `rollback`.
+  */
+class BipBuffer {
+public:
+    static const size_t HEADER_LEN = 4; ///< @brief Record header size
+    static const uint16_t PADDING = 0xFFFF; ///< @brief Header length that marks unused space until end of storage
+
+protected:
+    typedef struct {
+        uint16_t len; ///< @brief Record length as given to `commit`, or `PADDING`
+        uint16_t reserved;
+    } record_header_t;
+
+    size_t size; ///< @brief Storage size in bytes
+    std::atomic<size_t> head; ///< @brief Position of next record to write. Only modified by producer
+    std::atomic<size_t> tail; ///< @brief Position of oldest record. Only modified by consumer
+    size_t writePos; ///< @brief Position after last committed record, published or not. Producer side
+    uint32_t* buffer; ///< @brief Actual storage. Word aligned
+    size_t reservedPos = 0; ///< @brief Position where reserved record starts
+    bool reservedWraps = false; ///< @brief Reserved record needs padding at the end of storage
+
+    static constexpr size_t align (size_t len) { return (len + 3) & ~(size_t)3; }
+    static constexpr size_t recordSize (size_t len) { return HEADER_LEN + align (len); }
+
+    size_t offset (size_t position) { return position < size ? position : position - size; }
+
+    size_t advance (size_t position, size_t bytes) {
+        position += bytes;
+        return position < 2 * size ? position : position - 2 * size;
+    }
+
+    /**
+      * @brief Position where next lap of storage starts
+      */
+    size_t nextLap (size_t position) { return position < size ? size : 0; }
+
+    record_header_t* header (size_t position) { return (record_header_t*)((uint8_t*)buffer + offset (position)); }
+
+    size_t used (size_t headPos, size_t tailPos) { return headPos >= tailPos ? headPos - tailPos : headPos + 2 * size - tailPos; }
+
+public:
+    /**
+      * @brief Creates a record queue
+      * @param bytes Storage size. It is rounded down to a multiple of 4
+      */
+    BipBuffer (size_t bytes) : size (bytes & ~(size_t)3), head (0), tail (0), writePos (0) {
+        buffer = new uint32_t[size / 4];
+    }
+
+    ~BipBuffer () {
+        delete[] (buffer);
+    }
+
+    /**
+      * @brief Changes storage size. Stored records are discarded.
+      * Must not be called while producer or consumer are using the buffer
+      * @param bytes New storage size. It is rounded down to a multiple of 4
+      * @return `false` if there is not enough memory. Buffer keeps its previous storage and records in that case
+      */
+    bool setCapacity (size_t bytes) {
+        uint32_t* storage = new (std::nothrow) uint32_t[(bytes & ~(size_t)3) / 4];
+        if (!storage) {
+            return false;
+        }
+        delete[] (buffer);
+        buffer = storage;
+        size = bytes & ~(size_t)3;
+        head.store (0);
+        tail.store (0);
+        writePos = 0;
+        return true;
+    }
+
+    /**
+      * @brief Returns storage size in bytes
+      */
+    size_t capacity () { return size; }
+
+    /**
+      * @brief Returns number of bytes that records, their headers and padding are using
+      */
+    size_t bytesUsed () { return used (head.load (std::memory_order_acquire), tail.load (std::memory_order_acquire)); }
+
+    /**
+      * @brief Checks if buffer is empty
+      */
+    bool empty () { return head.load (std::memory_order_acquire) == tail.load (std::memory_order_acquire); }
+
+    /**
+      * @brief Number of storage bytes that a record of given length takes, including header
+      */
+    static constexpr size_t footprint (size_t len) { return recordSize (len); }
+
+    /**
+      * @brief Records up to this length can always be stored when buffer is empty
+      */
+    size_t maxRecordLen () { return size / 2 >= HEADER_LEN ? (size / 2 - HEADER_LEN) & ~(size_t)3 : 0; }
+
+    /**
+      * @brief Checks if a record of given length can be reserved now. Producer side
+      */
+    bool fits (size_t len) {
+        size_t headPos = writePos;
+        size_t free = size - used (headPos, tail.load (std::memory_order_acquire));
+        size_t toEnd = size - offset (headPos);
+        size_t need = recordSize (len);
+        return need <= toEnd ? need <= free : toEnd + need <= free;
+    }
+
+    /**
+      * @brief Gets a contiguous buffer for a record so that producer can write it in place.
+      * Record is not visible to consumer until `commit` is called
+      * @param len Maximum record length
+      * @return Pointer to record data, word aligned. `NULL` if there is no room for it
+      */
+    uint8_t* reserve (size_t len) {
+        size_t headPos = writePos;
+        size_t free = size - used (headPos, tail.load (std::memory_order_acquire));
+        size_t toEnd = size - offset (headPos);
+        size_t need = recordSize (len);
+
+        if (need <= toEnd) {
+            if (need > free) {
+                return NULL;
+            }
+            reservedPos = headPos;
+            reservedWraps = false;
+        } else {
+            if (toEnd + need > free) {
+                return NULL;
+            }
+            reservedPos = nextLap (headPos);
+            reservedWraps = true;
+        }
+        return (uint8_t*)header (reservedPos) + HEADER_LEN;
+    }
+
+    /**
+      * @brief Makes record got with `reserve` available to consumer. Producer side
+      * @param len Actual record length. Must not be greater than length given to `reserve`
+      * @param publish If `false`, record is only staged and it stays hidden from consumer until `publish` is called
+      */
+    void commit (size_t len, bool publish = true) {
+        if (reservedWraps) {
+            header (writePos)->len = PADDING;
+        }
+        header (reservedPos)->len = (uint16_t)len;
+        writePos = advance (reservedPos, recordSize (len));
+        if (publish) {
+            head.store (writePos, std::memory_order_release);
+        }
+    }
+
+    /**
+      * @brief Makes all staged records available to consumer at once. Producer side
+      */
+    void publish () { head.store (writePos, std::memory_order_release); }
+
+    /**
+      * @brief Discards all staged records. Producer side
+      */
+    void rollback () { writePos = head.load (std::memory_order_relaxed); }
+
+    /**
+      * @brief Gets record at a position, skipping padding. Consumer side.
+      * Lets consumer walk through records that are not released yet
+      * @param position Record position. It is moved forward if it points to padding
+      * @param len If not `NULL`, it gets record length
+      * @return Pointer to record data. `NULL` if there are no more records
+      */
+    uint8_t* read (size_t& position, size_t* len = NULL) {
+        size_t headPos = head.load (std::memory_order_acquire);
+        if (position == headPos) {
+            return NULL;
+        }
+        if (header (position)->len == PADDING) {
+            position = nextLap (position);
+            if (position == headPos) {
+                return NULL;
+            }
+        }
+        record_header_t* record = header (position);
+        if (len) {
+            *len = record->len;
+        }
+        return (uint8_t*)record + HEADER_LEN;
+    }
+
+    /**
+      * @brief Gets record at a position where `read` found it before. Consumer side.
+      * Lets consumer keep its own links between records that are not released yet
+      */
+    uint8_t* at (size_t position) { return (uint8_t*)header (position) + HEADER_LEN; }
+
+    /**
+      * @brief Returns position of record that follows the one got with `read`. Consumer side
+      */
+    size_t next (size_t position) {
+        return advance (position, recordSize (header (position)->len));
+    }
+
+    /**
+      * @brief Position of oldest record. Consumer side
+      */
+    size_t readPosition () { return tail.load (std::memory_order_relaxed); }
+
+    /**
+      * @brief Frees all records before a position so that producer may reuse their space. Consumer side
+      */
+    void release (size_t position) { tail.store (position, std::memory_order_release); }
+
+    /**
+      * @brief Gets oldest record, if buffer is not empty. Consumer side.
+      * Record stays valid and is not overwritten until `pop` is called
+      * @param len If not `NULL`, it gets record length
+      * @return Pointer to record data. `NULL` if buffer is empty
+      */
+    uint8_t* front (size_t* len = NULL) {
+        size_t position = tail.load (std::memory_order_relaxed);
+        return read (position, len);
+    }
+
+    /**
+      * @brief Deletes oldest record, if buffer is not empty. Consumer side
+      * @return Returns `false` if buffer was empty, `true` otherwise
+      */
+    bool pop () {
+        size_t position = tail.load (std::memory_order_relaxed);
+        if (!read (position)) {
+            return false;
+        }
+        tail.store (next (position), std::memory_order_release);
+        return true;
+    }
+};
+
+#endif // _BIPBUFFER_h
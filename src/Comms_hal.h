@@ -10,6 +10,8 @@
 
 #if defined(ARDUINO) && ARDUINO >= 100
 #include "Arduino.h"
+#elif defined QESPNOW_HOST
+#include "QuickEspNow_host.h"
 #else
 #include "WProgram.h"
 #endif
@@ -26,6 +28,7 @@ typedef enum {
     COMMS_SEND_QUEUE_FULL_ERROR = -3, /**< Data was not sent due to queue full */
     COMMS_SEND_MSG_ENQUEUE_ERROR = -4, /**< Data was not sent due to message queue push error */
     COMMS_SEND_CONFIRM_ERROR = -5, /**< Data was not sent due to confirmation error (only for synchronous send) */
+    COMMS_SEND_TIMEOUT_ERROR = -6, /**< Message did not complete before timeout expired (only when waiting for a message) */
 } comms_send_error_t;
 
 /**
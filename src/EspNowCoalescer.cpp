@@ -0,0 +1,241 @@
+#include "EspNowCoalescer.h"
+
+constexpr auto COALESCE_TAG = "COALESCE";
+
+EspNowCoalescerClass::EspNowCoalescerClass (QuickEspNow& espnow) : espnow (espnow) {
+    for (int i = 0; i < ESPNOW_COALESCE_BUFFERS; i++) {
+        buffers[i].len = 0;
+    }
+#ifndef ESP8266
+    mutex = xSemaphoreCreateMutex ();
+    timerEnded = xSemaphoreCreateBinary ();
+#endif
+}
+
+EspNowCoalescerClass::~EspNowCoalescerClass () {
+    stop ();
+#ifndef ESP8266
+    if (mutex) {
+        vSemaphoreDelete (mutex);
+    }
+    if (timerEnded) {
+        vSemaphoreDelete (timerEnded);
+    }
+#endif
+}
+
+void EspNowCoalescerClass::begin (uint32_t delay_ms) {
+    this->delay_ms = delay_ms;
+#ifdef ESP8266
+    os_timer_disarm (&timer);
+    os_timer_setfn (&timer, timer_cb, this);
+    os_timer_arm (&timer, delay_ms ? delay_ms : 1, true);
+#else
+    if (!timerTask) {
+        timerStopping = false;
+        xTaskCreateUniversal (timerTask_cb, "espnow_coalesce", 4 * 1024, this, 1, &timerTask, CONFIG_ARDUINO_RUNNING_CORE);
+    }
+#endif
+}
+
+void EspNowCoalescerClass::stop () {
+    flush ();
+#ifdef ESP8266
+    os_timer_disarm (&timer);
+#else
+    if (timerTask) {
+        // Timer task may be waiting inside QuickEspNow send, so it is asked to end instead of being deleted
+        timerStopping = true;
+        xTaskNotifyGive (timerTask);
+        xSemaphoreTake (timerEnded, portMAX_DELAY);
+        timerTask = NULL;
+    }
+#endif
+}
+
+void EspNowCoalescerClass::lock () {
+#ifndef ESP8266
+    xSemaphoreTake (mutex, portMAX_DELAY);
+#endif
+}
+
+void EspNowCoalescerClass::unlock () {
+#ifndef ESP8266
+    xSemaphoreGive (mutex);
+#endif
+}
+
+#ifdef ESP8266
+void EspNowCoalescerClass::timer_cb (void* param) {
+    ((EspNowCoalescerClass*)param)->flushExpired ();
+}
+#else
+void EspNowCoalescerClass::timerTask_cb (void* param) {
+    EspNowCoalescerClass* coalescer = (EspNowCoalescerClass*)param;
+    while (!coalescer->timerStopping) {
+        // Sleeps until oldest pending frame is due, or until a message is packed in an empty frame
+        uint32_t wait_ms = coalescer->flushExpired ();
+        ulTaskNotifyTake (pdTRUE, wait_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS (wait_ms));
+    }
+    xSemaphoreGive (coalescer->timerEnded);
+    vTaskDelete (NULL);
+}
+#endif
+
+comms_send_error_t EspNowCoalescerClass::flushBuffer (coalesce_buffer_t* buffer) {
+    comms_send_error_t error;
+
+    if (!buffer->len) {
+        return COMMS_SEND_OK;
+    }
+    // Sent under lock, so that a later frame to the same destination cannot go first. In synchronous mode
+    // this waits for confirmation, and other callers wait for it too
+    if ((error = espnow.send (buffer->dstAddress, buffer->frame, buffer->len)) != COMMS_SEND_OK) {
+        DEBUG_DBG (COALESCE_TAG, "Frame to " MACSTR " not sent. Error %d", MAC2STR (buffer->dstAddress), error);
+        return error;
+    }
+    DEBUG_VERBOSE (COALESCE_TAG, "%d messages to " MACSTR " sent in %d bytes", buffer->messages, MAC2STR (buffer->dstAddress), buffer->len);
+    buffer->len = 0;
+    sentFrames++;
+    return COMMS_SEND_OK;
+}
+
+uint32_t EspNowCoalescerClass::flushExpired () {
+    uint32_t wait_ms = UINT32_MAX;
+    uint32_t now = millis ();
+
+    lock ();
+    for (int i = 0; i < ESPNOW_COALESCE_BUFFERS; i++) {
+        coalesce_buffer_t* buffer = &buffers[i];
+        if (!buffer->len) {
+            continue;
+        }
+        uint32_t age = now - buffer->firstMessage;
+        if (age < delay_ms) {
+            if (delay_ms - age < wait_ms) {
+                wait_ms = delay_ms - age;
+            }
+        } else if (flushBuffer (buffer) != COMMS_SEND_OK) {
+            // Queue is full. Try again on next tick
+            wait_ms = 1;
+        }
+    }
+    unlock ();
+    return wait_ms;
+}
+
+comms_send_error_t EspNowCoalescerClass::flush () {
+    comms_send_error_t result = COMMS_SEND_OK;
+
+    lock ();
+    for (int i = 0; i < ESPNOW_COALESCE_BUFFERS; i++) {
+        comms_send_error_t error = flushBuffer (&buffers[i]);
+        if (error != COMMS_SEND_OK) {
+            result = error;
+        }
+    }
+    unlock ();
+    return result;
+}
+
+comms_send_error_t EspNowCoalescerClass::send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len) {
+    coalesce_buffer_t* buffer = NULL;
+    coalesce_buffer_t* available = NULL;
+    comms_send_error_t error;
+    bool wasEmpty;
+
+    if (!dstAddress || !payload || !payload_len || payload_len > ESP_NOW_MAX_DATA_LEN) {
+        DEBUG_WARN (COALESCE_TAG, "Length error. %d", payload_len);
+        return COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+    }
+
+    lock ();
+    for (int i = 0; i < ESPNOW_COALESCE_BUFFERS; i++) {
+        coalesce_buffer_t* candidate = &buffers[i];
+        if (candidate->len && !memcmp (candidate->dstAddress, dstAddress, ESP_NOW_ETH_ALEN)) {
+            buffer = candidate;
+            break;
+        }
+        // Free buffers first, then the one that has waited for longer
+        if (!available || (available->len && (!candidate->len || candidate->firstMessage - available->firstMessage > 0x80000000UL))) {
+            available = candidate;
+        }
+    }
+
+    if (payload_len > ESPNOW_COALESCE_MAX_RECORD) {
+        // Pending messages go first so that order is kept
+        if (!buffer || (error = flushBuffer (buffer)) == COMMS_SEND_OK) {
+            error = espnow.send (dstAddress, payload, payload_len);
+        }
+        unlock ();
+        return error;
+    }
+
+    if (!buffer || buffer->len + 1 + payload_len > ESP_NOW_MAX_DATA_LEN) {
+        if (!buffer) {
+            buffer = available;
+        }
+        if ((error = flushBuffer (buffer)) != COMMS_SEND_OK) {
+            unlock ();
+            return error;
+        }
+    }
+
+    wasEmpty = !buffer->len;
+    if (wasEmpty) {
+        memcpy (buffer->dstAddress, dstAddress, ESP_NOW_ETH_ALEN);
+        buffer->frame[0] = ESPNOW_COALESCE_MAGIC;
+        buffer->len = 1;
+        buffer->messages = 0;
+        buffer->firstMessage = millis ();
+    }
+    buffer->frame[buffer->len] = (uint8_t)payload_len;
+    memcpy (buffer->frame + buffer->len + 1, payload, payload_len);
+    buffer->len += 1 + payload_len;
+    buffer->messages++;
+    packedMessages++;
+
+    // No other message fits. If it cannot be queued now, flush timer tries again
+    if ((size_t)buffer->len + 2 > ESP_NOW_MAX_DATA_LEN) {
+        flushBuffer (buffer);
+    }
+    unlock ();
+
+#ifndef ESP8266
+    if (wasEmpty && timerTask) {
+        xTaskNotifyGive (timerTask);
+    }
+#endif
+    return COMMS_SEND_OK;
+}
+
+void EspNowCoalescerClass::onDataRcvd (comms_hal_rcvd_data dataRcvd) {
+    this->dataRcvd = dataRcvd;
+    espnow.onDataRcvd ([this] (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+        processFrame (address, data, len, rssi, broadcast);
+    });
+}
+
+void EspNowCoalescerClass::processFrame (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    size_t pos;
+
+    if (!dataRcvd) {
+        return;
+    }
+    if (len < 3 || data[0] != ESPNOW_COALESCE_MAGIC) {
+        dataRcvd (address, data, len, rssi, broadcast);
+        return;
+    }
+
+    // Whole frame is checked before any message is delivered
+    for (pos = 1; pos < len; pos += 1 + data[pos]) {
+        if (!data[pos] || pos + 1 + data[pos] > len) {
+            DEBUG_DBG (COALESCE_TAG, "Wrong packed frame from " MACSTR, MAC2STR (address));
+            droppedFrames++;
+            return;
+        }
+    }
+    for (pos = 1; pos < len; pos += 1 + data[pos]) {
+        dataRcvd (address, data + pos + 1, data[pos], rssi, broadcast);
+    }
+}
@@ -0,0 +1,125 @@
+/**
+  * @file EspNowCoalescer.h
+  * @author German Martin
+  * @brief Packs small messages to the same destination in a single ESP-NOW frame
+  */
+
+#ifndef _ESPNOWCOALESCER_h
+#define _ESPNOWCOALESCER_h
+
+#include "QuickEspNow.h"
+
+#ifndef ESPNOW_COALESCE_BUFFERS
+#define ESPNOW_COALESCE_BUFFERS 2 ///< @brief Destinations that may have messages waiting to be packed at the same time
+#endif
+#ifndef ESPNOW_COALESCE_DELAY_MS
+#define ESPNOW_COALESCE_DELAY_MS 5 ///< @brief Default maximum time a message waits for others before its frame is sent
+#endif
+
+static const uint8_t ESPNOW_COALESCE_MAGIC = 0xF7; ///< @brief First byte of every packed frame
+static const size_t ESPNOW_COALESCE_MAX_RECORD = ESP_NOW_MAX_DATA_LEN - 2; ///< @brief Longest message that may be packed. Longer ones are sent on their own
+
+/**
+  * @brief Packs small messages in full frames, like Nagle algorithm does for TCP.
+  *
+  * Every message to a destination is appended to a frame for that destination as a length byte and its data.
+  * Frame is sent when next message does not fit in it, when its first message has waited for the configured delay,
+  * or when `flush` is called. Receiver unpacks every frame and calls its callback once per message, in order.
+  *
+  * Both ends have to use it. Frames that do not start with `ESPNOW_COALESCE_MAGIC` are passed through unchanged.
+  * It works best in asynchronous mode, as in synchronous mode callers wait while a frame is confirmed.
+  */
+class EspNowCoalescerClass {
+protected:
+    typedef struct {
+        uint8_t dstAddress[ESP_NOW_ETH_ALEN];
+        uint8_t len; ///< @brief Bytes used in frame. 0 if buffer is free
+        uint8_t messages; ///< @brief Messages packed in frame
+        uint32_t firstMessage; ///< @brief Time when first message was packed, in milliseconds
+        uint8_t frame[ESP_NOW_MAX_DATA_LEN]; ///< @brief Packed frame. It is never longer than what radio can send
+    } coalesce_buffer_t;
+
+    QuickEspNow& espnow;
+    comms_hal_rcvd_data dataRcvd = 0;
+    coalesce_buffer_t buffers[ESPNOW_COALESCE_BUFFERS];
+    uint32_t delay_ms = ESPNOW_COALESCE_DELAY_MS;
+    uint32_t packedMessages = 0;
+    uint32_t sentFrames = 0;
+    uint32_t droppedFrames = 0;
+#ifdef ESP8266
+    os_timer_t timer; ///< @brief Sends frames that have waited for too long
+    static void timer_cb (void* param);
+#else
+    SemaphoreHandle_t mutex = NULL; ///< @brief Protects buffers. Held while a frame is sent, so that messages keep their order
+    TaskHandle_t timerTask = NULL; ///< @brief Sends frames that have waited for too long
+    std::atomic<bool> timerStopping { false }; ///< @brief Set by `stop`. Timer task ends itself, so that it is never deleted in the middle of a send
+    SemaphoreHandle_t timerEnded = NULL; ///< @brief Given by timer task when it ends
+    static void timerTask_cb (void* param);
+#endif
+
+    void lock ();
+    void unlock ();
+    comms_send_error_t flushBuffer (coalesce_buffer_t* buffer);
+    uint32_t flushExpired ();
+    void processFrame (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast);
+
+public:
+    /**
+      * @brief Creates a coalescing stage over a QuickEspNow instance
+      * @param espnow QuickEspNow instance used to send and receive frames
+      */
+    EspNowCoalescerClass (QuickEspNow& espnow);
+
+    ~EspNowCoalescerClass ();
+
+    /**
+      * @brief Starts flush timer. QuickEspNow has to be started too
+      * @param delay_ms Maximum time a message waits for others to be packed with it
+      */
+    void begin (uint32_t delay_ms = ESPNOW_COALESCE_DELAY_MS);
+
+    /**
+      * @brief Sends pending frames and stops flush timer
+      */
+    void stop ();
+
+    /**
+      * @brief Packs a message in frame to its destination. Messages longer than `ESPNOW_COALESCE_MAX_RECORD` are
+      * sent on their own, after pending ones to the same destination
+      * @param dstAddress Destination address
+      * @param payload Message
+      * @param payload_len Message length
+      * @return `COMMS_SEND_OK` if message has been packed or queued. Error of `QuickEspNow::send` if a full frame
+      * had to be sent to make room for it and it could not be queued. In that case message is not packed
+      */
+    comms_send_error_t send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len);
+
+    /**
+      * @brief Sends every pending frame now
+      * @return `COMMS_SEND_OK` if every frame has been queued. Frames that could not be queued are kept for flush timer
+      */
+    comms_send_error_t flush ();
+
+    /**
+      * @brief Attach a function to be called on every received message. It replaces QuickEspNow `onDataRcvd` callback
+      * @param dataRcvd Callback function
+      */
+    void onDataRcvd (comms_hal_rcvd_data dataRcvd);
+
+    /**
+      * @brief Number of messages that have been packed
+      */
+    uint32_t getPackedMessages () { return packedMessages; }
+
+    /**
+      * @brief Number of packed frames that have been queued
+      */
+    uint32_t getSentFrames () { return sentFrames; }
+
+    /**
+      * @brief Number of received packed frames discarded because they were malformed
+      */
+    uint32_t getDroppedFrames () { return droppedFrames; }
+};
+
+#endif // _ESPNOWCOALESCER_h
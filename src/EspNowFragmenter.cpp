@@ -0,0 +1,182 @@
+#include "EspNowFragmenter.h"
+
+constexpr auto FRAGMENT_TAG = "FRAGMENT";
+
+EspNowFragmenterClass::EspNowFragmenterClass (QuickEspNow& espnow) : espnow (espnow) {
+    for (int i = 0; i < ESPNOW_REASSEMBLY_BUFFERS; i++) {
+        buffers[i].used = false;
+    }
+#ifndef ESP8266
+    sendMutex = xSemaphoreCreateMutex ();
+#endif
+}
+
+EspNowFragmenterClass::~EspNowFragmenterClass () {
+#ifndef ESP8266
+    if (sendMutex) {
+        vSemaphoreDelete (sendMutex);
+    }
+#endif
+}
+
+comms_send_error_t EspNowFragmenterClass::send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len) {
+    comms_send_error_t error;
+
+    if (!dstAddress || !payload || !payload_len || payload_len > ESPNOW_MAX_FRAGMENTED_LENGTH) {
+        DEBUG_WARN (FRAGMENT_TAG, "Length error. %d", payload_len);
+        return COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+    }
+
+#ifndef ESP8266
+    if (!xSemaphoreTake (sendMutex, pdMS_TO_TICKS (ESPNOW_FRAGMENT_SEND_TIMEOUT_MS))) {
+        DEBUG_WARN (FRAGMENT_TAG, "Fragmenter busy");
+        return COMMS_SEND_MSG_ENQUEUE_ERROR;
+    }
+#endif
+    error = sendFragments (dstAddress, payload, payload_len);
+#ifndef ESP8266
+    xSemaphoreGive (sendMutex);
+#endif
+    return error;
+}
+
+comms_send_error_t EspNowFragmenterClass::sendFragments (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len) {
+    espnow_batch_entry_t entries[ESPNOW_FRAGMENT_BATCH];
+    comms_send_error_t error = COMMS_SEND_OK;
+    uint8_t count = (payload_len + ESPNOW_FRAGMENT_PAYLOAD - 1) / ESPNOW_FRAGMENT_PAYLOAD;
+    uint8_t id = nextId++;
+    // A batch has to fit in empty transmission queue even if it wraps around its end
+    size_t batchSize = (espnow.getTxQueueBytes () - ESPNOW_TX_RECORD_LEN) / ESPNOW_TX_RECORD_LEN;
+
+    if (batchSize > ESPNOW_FRAGMENT_BATCH) {
+        batchSize = ESPNOW_FRAGMENT_BATCH;
+    }
+
+    for (uint8_t index = 0; index < count;) {
+        uint8_t batch;
+        for (batch = 0; batch < batchSize && index + batch < count; batch++) {
+            espnow_fragment_header_t* header = (espnow_fragment_header_t*)frames[batch];
+            size_t offset = (index + batch) * ESPNOW_FRAGMENT_PAYLOAD;
+            size_t len = payload_len - offset < ESPNOW_FRAGMENT_PAYLOAD ? payload_len - offset : ESPNOW_FRAGMENT_PAYLOAD;
+            header->magic = ESPNOW_FRAGMENT_MAGIC;
+            header->id = id;
+            header->index = index + batch;
+            header->count = count;
+            memcpy (frames[batch] + sizeof (espnow_fragment_header_t), payload + offset, len);
+            entries[batch].dstAddress = dstAddress;
+            entries[batch].payload = frames[batch];
+            entries[batch].payload_len = sizeof (espnow_fragment_header_t) + len;
+        }
+
+        uint32_t start = millis ();
+        while ((error = espnow.sendBatch (entries, batch)) == COMMS_SEND_QUEUE_FULL_ERROR
+               && millis () - start < ESPNOW_FRAGMENT_SEND_TIMEOUT_MS) {
+            delay (1);
+        }
+        if (error != COMMS_SEND_OK) {
+            DEBUG_WARN (FRAGMENT_TAG, "Error %d sending fragment %d of message %d", error, index, id);
+            return error;
+        }
+        index += batch;
+    }
+    DEBUG_DBG (FRAGMENT_TAG, "Message %d queued in %d fragments", id, count);
+    return COMMS_SEND_OK;
+}
+
+void EspNowFragmenterClass::onDataRcvd (espnow_fragmented_rcvd_cb_t dataRcvd) {
+    this->dataRcvd = dataRcvd;
+    espnow.onDataRcvd ([this] (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+        processFrame (address, data, len, rssi, broadcast);
+    });
+}
+
+EspNowFragmenterClass::reassembly_buffer_t* EspNowFragmenterClass::getBuffer (const uint8_t* address, uint8_t id, uint8_t count) {
+    reassembly_buffer_t* sameSource = NULL;
+    reassembly_buffer_t* available = NULL;
+    uint32_t now = millis ();
+
+    for (int i = 0; i < ESPNOW_REASSEMBLY_BUFFERS; i++) {
+        reassembly_buffer_t* buffer = &buffers[i];
+        bool expired = !buffer->used || now - buffer->lastFragment >= ESPNOW_REASSEMBLY_TIMEOUT_MS;
+        if (buffer->used && !memcmp (buffer->srcAddress, address, ESP_NOW_ETH_ALEN)) {
+            if (buffer->id == id && buffer->count == count && !expired) {
+                return buffer;
+            }
+            // Sender started a new message, or this one timed out
+            sameSource = buffer;
+            break;
+        }
+        if (!available && expired) {
+            available = buffer;
+        }
+    }
+
+    reassembly_buffer_t* buffer = sameSource ? sameSource : available;
+    if (!buffer) {
+        return NULL;
+    }
+    if (buffer->used && buffer->received) {
+        DEBUG_DBG (FRAGMENT_TAG, "Incomplete message %d from " MACSTR " discarded", buffer->id, MAC2STR (buffer->srcAddress));
+    }
+    memcpy (buffer->srcAddress, address, ESP_NOW_ETH_ALEN);
+    buffer->id = id;
+    buffer->count = count;
+    buffer->received = 0;
+    buffer->len = 0;
+    buffer->used = true;
+    return buffer;
+}
+
+void EspNowFragmenterClass::processFrame (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    espnow_fragment_header_t* header = (espnow_fragment_header_t*)data;
+    reassembly_buffer_t* buffer;
+    size_t fragmentLen;
+    size_t offset;
+
+    if (!dataRcvd) {
+        return;
+    }
+    if (len < sizeof (espnow_fragment_header_t) || header->magic != ESPNOW_FRAGMENT_MAGIC) {
+        dataRcvd (address, data, len, rssi, broadcast);
+        return;
+    }
+
+    fragmentLen = len - sizeof (espnow_fragment_header_t);
+    offset = header->index * ESPNOW_FRAGMENT_PAYLOAD;
+    // Every fragment but last one is full
+    if (!fragmentLen || !header->count || header->count > ESPNOW_MAX_FRAGMENTS || header->index >= header->count
+        || (header->index < header->count - 1 && fragmentLen != ESPNOW_FRAGMENT_PAYLOAD)
+        || offset + fragmentLen > ESPNOW_MAX_FRAGMENTED_LENGTH) {
+        DEBUG_DBG (FRAGMENT_TAG, "Wrong fragment from " MACSTR, MAC2STR (address));
+        droppedFragments++;
+        return;
+    }
+
+    if (header->count == 1) {
+        dataRcvd (address, data + sizeof (espnow_fragment_header_t), fragmentLen, rssi, broadcast);
+        return;
+    }
+
+    if (!(buffer = getBuffer (address, header->id, header->count))) {
+        DEBUG_DBG (FRAGMENT_TAG, "No reassembly buffer for " MACSTR, MAC2STR (address));
+        droppedFragments++;
+        return;
+    }
+
+    if (!(buffer->received & (1UL << header->index))) {
+        memcpy (buffer->data + offset, data + sizeof (espnow_fragment_header_t), fragmentLen);
+        buffer->received |= 1UL << header->index;
+        if (header->index == header->count - 1) {
+            buffer->len = offset + fragmentLen;
+        }
+    }
+    buffer->lastFragment = millis ();
+    buffer->broadcast = broadcast;
+
+    if (buffer->received == (header->count == 32 ? 0xFFFFFFFFUL : (1UL << header->count) - 1)) {
+        // Buffer is only reused from this task, so data stays valid while callback runs
+        buffer->used = false;
+        DEBUG_DBG (FRAGMENT_TAG, "Message %d from " MACSTR " reassembled. %d bytes", buffer->id, MAC2STR (address), buffer->len);
+        dataRcvd (address, buffer->data, buffer->len, rssi, buffer->broadcast);
+    }
+}
@@ -0,0 +1,121 @@
+/**
+  * @file EspNowFragmenter.h
+  * @author German Martin
+  * @brief Fragmentation and reassembly of messages longer than an ESP-NOW frame
+  */
+
+#ifndef _ESPNOWFRAGMENTER_h
+#define _ESPNOWFRAGMENTER_h
+
+#include "QuickEspNow.h"
+
+#ifndef ESPNOW_MAX_FRAGMENTED_LENGTH
+#define ESPNOW_MAX_FRAGMENTED_LENGTH 2048 ///< @brief Longest message that can be fragmented. Up to 32 fragments
+#endif
+#ifndef ESPNOW_REASSEMBLY_BUFFERS
+#define ESPNOW_REASSEMBLY_BUFFERS 2 ///< @brief Number of sources whose messages may be reassembled at the same time
+#endif
+#ifndef ESPNOW_REASSEMBLY_TIMEOUT_MS
+#define ESPNOW_REASSEMBLY_TIMEOUT_MS 500 ///< @brief Incomplete messages older than this are discarded when their buffer is needed
+#endif
+#ifndef ESPNOW_FRAGMENT_SEND_TIMEOUT_MS
+#define ESPNOW_FRAGMENT_SEND_TIMEOUT_MS 1000 ///< @brief Maximum time that `send` waits for transmission queue space
+#endif
+
+static const uint8_t ESPNOW_FRAGMENT_MAGIC = 0xF5; ///< @brief First byte of every fragment
+static const uint8_t ESPNOW_FRAGMENT_BATCH = 4; ///< @brief Maximum number of fragments queued together
+
+/**
+  * @brief Header that precedes every fragment
+  */
+typedef struct {
+    uint8_t magic; /**< Always `ESPNOW_FRAGMENT_MAGIC` */
+    uint8_t id; /**< Message number. It is increased by sender for every message */
+    uint8_t index; /**< Fragment number, starting on 0 */
+    uint8_t count; /**< Number of fragments of the message */
+} espnow_fragment_header_t;
+
+static const size_t ESPNOW_FRAGMENT_PAYLOAD = ESP_NOW_MAX_DATA_LEN - sizeof (espnow_fragment_header_t); ///< @brief Message bytes carried by every fragment
+static const size_t ESPNOW_MAX_FRAGMENTS = (ESPNOW_MAX_FRAGMENTED_LENGTH + ESPNOW_FRAGMENT_PAYLOAD - 1) / ESPNOW_FRAGMENT_PAYLOAD; ///< @brief Fragments of a message of maximum length
+
+static_assert (ESPNOW_MAX_FRAGMENTS <= 32, "ESPNOW_MAX_FRAGMENTED_LENGTH must fit in 32 fragments");
+
+/**
+  * @brief Called for every reassembled message
+  * @param address Source address
+  * @param data Message. It is only valid until callback returns
+  * @param len Message length, up to `ESPNOW_MAX_FRAGMENTED_LENGTH`
+  * @param rssi RSSI of last fragment
+  * @param broadcast `true` if message was sent to broadcast address
+  */
+typedef std::function<void (uint8_t* address, uint8_t* data, size_t len, signed int rssi, bool broadcast)> espnow_fragmented_rcvd_cb_t;
+
+/**
+  * @brief Sends messages of up to `ESPNOW_MAX_FRAGMENTED_LENGTH` bytes over QuickEspNow.
+  *
+  * Messages are split in numbered fragments that are queued in batches, so that they are sent back to back instead
+  * of one per confirmation. Receiver keeps one reassembly buffer per source and gives up an incomplete message when
+  * a new one from the same source starts or when its buffer is needed after `ESPNOW_REASSEMBLY_TIMEOUT_MS`.
+  * Both ends have to use it. Frames that do not start with `ESPNOW_FRAGMENT_MAGIC` are passed through unchanged.
+  */
+class EspNowFragmenterClass {
+protected:
+    typedef struct {
+        uint8_t srcAddress[ESP_NOW_ETH_ALEN];
+        uint8_t id;
+        uint8_t count;
+        bool used;
+        bool broadcast;
+        uint32_t received; ///< @brief One bit per fragment already stored
+        size_t len; ///< @brief Message length. Known when last fragment arrives
+        uint32_t lastFragment; ///< @brief Time of last fragment, in milliseconds
+        uint8_t data[ESPNOW_MAX_FRAGMENTED_LENGTH];
+    } reassembly_buffer_t;
+
+    QuickEspNow& espnow;
+    espnow_fragmented_rcvd_cb_t dataRcvd = 0;
+    reassembly_buffer_t buffers[ESPNOW_REASSEMBLY_BUFFERS];
+    uint8_t frames[ESPNOW_FRAGMENT_BATCH][ESP_NOW_MAX_DATA_LEN]; ///< @brief Fragments being queued by `send`
+    uint8_t nextId = 0;
+    uint32_t droppedFragments = 0;
+#ifndef ESP8266
+    SemaphoreHandle_t sendMutex = NULL; ///< @brief Keeps fragments of a message together in transmission queue
+#endif
+
+    void processFrame (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast);
+    reassembly_buffer_t* getBuffer (const uint8_t* address, uint8_t id, uint8_t count);
+    comms_send_error_t sendFragments (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len);
+
+public:
+    /**
+      * @brief Creates a fragmentation layer over a QuickEspNow instance
+      * @param espnow QuickEspNow instance used to send and receive fragments
+      */
+    EspNowFragmenterClass (QuickEspNow& espnow);
+
+    ~EspNowFragmenterClass ();
+
+    /**
+      * @brief Sends a message, in several fragments if needed. It may wait for transmission queue space up to
+      * `ESPNOW_FRAGMENT_SEND_TIMEOUT_MS`
+      * @param dstAddress Destination address
+      * @param payload Message
+      * @param payload_len Message length, up to `ESPNOW_MAX_FRAGMENTED_LENGTH`
+      * @return `COMMS_SEND_OK` if every fragment was queued, or confirmed in synchronous mode. Otherwise, error of the
+      * first fragment that failed. Fragments queued before it are still sent
+      */
+    comms_send_error_t send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len);
+
+    /**
+      * @brief Attach a function to be called on every reassembled message. It replaces QuickEspNow `onDataRcvd` callback
+      * @param dataRcvd Callback function
+      */
+    void onDataRcvd (espnow_fragmented_rcvd_cb_t dataRcvd);
+
+    /**
+      * @brief Number of received fragments dropped because they were wrong or no reassembly buffer was available
+      */
+    uint32_t getDroppedFragments () { return droppedFragments; }
+};
+
+#endif // _ESPNOWFRAGMENTER_h
@@ -0,0 +1,410 @@
+#include "EspNowReliable.h"
+
+constexpr auto RELIABLE_TAG = "RELIABLE";
+
+EspNowReliableClass::EspNowReliableClass (QuickEspNow& espnow) : espnow (espnow) {
+    for (int i = 0; i < ESPNOW_RELIABLE_PEERS; i++) {
+        txPeers[i].used = false;
+        txPeers[i].session = 0;
+        rxPeers[i].used = false;
+    }
+#ifndef ESP8266
+    mutex = xSemaphoreCreateMutex ();
+    timerEnded = xSemaphoreCreateBinary ();
+#endif
+}
+
+EspNowReliableClass::~EspNowReliableClass () {
+    stop ();
+#ifndef ESP8266
+    if (mutex) {
+        vSemaphoreDelete (mutex);
+    }
+    if (timerEnded) {
+        vSemaphoreDelete (timerEnded);
+    }
+#endif
+}
+
+void EspNowReliableClass::begin () {
+#ifdef ESP8266
+    os_timer_disarm (&timer);
+    os_timer_setfn (&timer, timer_cb, this);
+    os_timer_arm (&timer, ESPNOW_RELIABLE_TICK_MS, true);
+#else
+    if (!timerTask) {
+        timerStopping = false;
+        xTaskCreateUniversal (timerTask_cb, "espnow_reliable", 4 * 1024, this, 1, &timerTask, CONFIG_ARDUINO_RUNNING_CORE);
+    }
+#endif
+}
+
+void EspNowReliableClass::stop () {
+#ifdef ESP8266
+    os_timer_disarm (&timer);
+#else
+    if (timerTask) {
+        // Timer task may be waiting inside QuickEspNow send, so it is asked to end instead of being deleted
+        timerStopping = true;
+        xTaskNotifyGive (timerTask);
+        xSemaphoreTake (timerEnded, portMAX_DELAY);
+        timerTask = NULL;
+    }
+#endif
+}
+
+void EspNowReliableClass::lock () {
+#ifndef ESP8266
+    xSemaphoreTake (mutex, portMAX_DELAY);
+#endif
+}
+
+void EspNowReliableClass::unlock () {
+#ifndef ESP8266
+    xSemaphoreGive (mutex);
+#endif
+}
+
+#ifdef ESP8266
+void EspNowReliableClass::timer_cb (void* param) {
+    ((EspNowReliableClass*)param)->checkTimers ();
+}
+#else
+void EspNowReliableClass::timerTask_cb (void* param) {
+    EspNowReliableClass* reliable = (EspNowReliableClass*)param;
+    while (!reliable->timerStopping) {
+        ulTaskNotifyTake (pdTRUE, pdMS_TO_TICKS (ESPNOW_RELIABLE_TICK_MS));
+        if (!reliable->timerStopping) {
+            reliable->checkTimers ();
+        }
+    }
+    xSemaphoreGive (reliable->timerEnded);
+    vTaskDelete (NULL);
+}
+#endif
+
+comms_send_error_t EspNowReliableClass::send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len) {
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    tx_peer_t* peer;
+    uint32_t start = millis ();
+    size_t len;
+
+    if (!dstAddress || !payload || !payload_len || payload_len > ESPNOW_RELIABLE_PAYLOAD) {
+        DEBUG_WARN (RELIABLE_TAG, "Length error. %d", payload_len);
+        return COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+    }
+    if (!memcmp (dstAddress, ESPNOW_BROADCAST_ADDRESS, ESP_NOW_ETH_ALEN)) {
+        DEBUG_WARN (RELIABLE_TAG, "Broadcast cannot be acknowledged");
+        return COMMS_SEND_PARAM_ERROR;
+    }
+
+    for (;;) {
+        lock ();
+        if ((peer = getTxPeer (dstAddress, true)) && (uint16_t)(peer->nextSeq - peer->base) < ESPNOW_RELIABLE_WINDOW) {
+            break;
+        }
+        unlock ();
+        if (millis () - start >= ESPNOW_RELIABLE_SEND_TIMEOUT_MS) {
+            DEBUG_WARN (RELIABLE_TAG, "Window to " MACSTR " is full", MAC2STR (dstAddress));
+            return COMMS_SEND_QUEUE_FULL_ERROR;
+        }
+        delay (1);
+    }
+
+    uint16_t seq = peer->nextSeq++;
+    tx_slot_t* slot = &peer->slots[seq % ESPNOW_RELIABLE_WINDOW];
+    slot->state = TX_SLOT_SENT;
+    slot->len = payload_len;
+    slot->retries = 0;
+    slot->fastRetransmitted = false;
+    memcpy (slot->payload, payload, payload_len);
+    len = prepareFrame (peer, seq, frame);
+    unlock ();
+    transmit (dstAddress, frame, len, seq);
+    return COMMS_SEND_OK;
+}
+
+bool EspNowReliableClass::flush (uint32_t timeout_ms) {
+    uint32_t start = millis ();
+
+    for (;;) {
+        bool idle = true;
+        lock ();
+        for (int i = 0; i < ESPNOW_RELIABLE_PEERS; i++) {
+            if (txPeers[i].used && txPeers[i].base != txPeers[i].nextSeq) {
+                idle = false;
+            }
+        }
+        unlock ();
+        if (idle) {
+            return true;
+        }
+        if (millis () - start >= timeout_ms) {
+            return false;
+        }
+        delay (1);
+    }
+}
+
+void EspNowReliableClass::onDataRcvd (comms_hal_rcvd_data dataRcvd) {
+    this->dataRcvd = dataRcvd;
+    espnow.onDataRcvd ([this] (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+        processFrame (address, data, len, rssi, broadcast);
+    });
+}
+
+EspNowReliableClass::tx_peer_t* EspNowReliableClass::getTxPeer (const uint8_t* address, bool create) {
+    tx_peer_t* candidate = NULL;
+
+    for (int i = 0; i < ESPNOW_RELIABLE_PEERS; i++) {
+        tx_peer_t* peer = &txPeers[i];
+        if (peer->used && !memcmp (peer->mac, address, ESP_NOW_ETH_ALEN)) {
+            return peer;
+        }
+        // Only peers without messages in flight may be replaced
+        if (!peer->used) {
+            if (!candidate || candidate->used) {
+                candidate = peer;
+            }
+        } else if (peer->base == peer->nextSeq && (!candidate || (candidate->used && peer->lastActivity - candidate->lastActivity > 0x80000000UL))) {
+            candidate = peer;
+        }
+    }
+    if (!create || !candidate) {
+        return NULL;
+    }
+
+    memcpy (candidate->mac, address, ESP_NOW_ETH_ALEN);
+    candidate->used = true;
+    // A new session makes receiver drop state left by a previous one
+    candidate->session = (uint8_t)(candidate->session + 1 + micros ());
+    candidate->base = 0;
+    candidate->nextSeq = 0;
+    candidate->lastActivity = millis ();
+    for (int i = 0; i < ESPNOW_RELIABLE_WINDOW; i++) {
+        candidate->slots[i].state = TX_SLOT_FREE;
+    }
+    DEBUG_DBG (RELIABLE_TAG, "Session %d to " MACSTR, candidate->session, MAC2STR (address));
+    return candidate;
+}
+
+size_t EspNowReliableClass::prepareFrame (tx_peer_t* peer, uint16_t seq, uint8_t* frame) {
+    tx_slot_t* slot = &peer->slots[seq % ESPNOW_RELIABLE_WINDOW];
+    espnow_reliable_header_t header = { ESPNOW_RELIABLE_MAGIC, ESPNOW_RELIABLE_DATA, peer->session, 0, seq, peer->base };
+
+    memcpy (frame, &header, sizeof (espnow_reliable_header_t));
+    memcpy (frame + sizeof (espnow_reliable_header_t), slot->payload, slot->len);
+    slot->sentTime = millis ();
+    peer->lastActivity = slot->sentTime;
+    return sizeof (espnow_reliable_header_t) + slot->len;
+}
+
+void EspNowReliableClass::transmit (const uint8_t* address, const uint8_t* frame, size_t len, uint16_t seq) {
+    comms_send_error_t error;
+
+    // Called without lock, as send may wait for queue room or for confirmation in synchronous mode.
+    // If it cannot be queued now, retransmission timer tries again
+    if ((error = espnow.send (address, frame, len)) != COMMS_SEND_OK) {
+        DEBUG_DBG (RELIABLE_TAG, "Message %d to " MACSTR " not sent. Error %d", seq, MAC2STR (address), error);
+    }
+}
+
+void EspNowReliableClass::slideWindow (tx_peer_t* peer) {
+    while (peer->base != peer->nextSeq && peer->slots[peer->base % ESPNOW_RELIABLE_WINDOW].state == TX_SLOT_FAILED) {
+        peer->slots[peer->base % ESPNOW_RELIABLE_WINDOW].state = TX_SLOT_FREE;
+        peer->base++;
+    }
+}
+
+void EspNowReliableClass::checkTimers () {
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    uint8_t address[ESP_NOW_ETH_ALEN];
+    uint32_t now = millis ();
+
+    lock ();
+    for (int i = 0; i < ESPNOW_RELIABLE_PEERS; i++) {
+        tx_peer_t* peer = &txPeers[i];
+        if (!peer->used) {
+            continue;
+        }
+        for (uint16_t seq = peer->base; seq != peer->nextSeq; seq++) {
+            tx_slot_t* slot = &peer->slots[seq % ESPNOW_RELIABLE_WINDOW];
+            // A selectively acknowledged message at window base carries news of skipped ones to receiver
+            if ((slot->state != TX_SLOT_SENT && !(slot->state == TX_SLOT_SACKED && seq == peer->base))
+                || now - slot->sentTime < ESPNOW_RELIABLE_RTO_MS) {
+                continue;
+            }
+            if (slot->retries >= ESPNOW_RELIABLE_MAX_RETRIES) {
+                DEBUG_WARN (RELIABLE_TAG, "Message %d to " MACSTR " failed", seq, MAC2STR (peer->mac));
+                slot->state = TX_SLOT_FAILED;
+                failedMessages++;
+                continue;
+            }
+            slot->retries++;
+            retransmissions++;
+            uint8_t session = peer->session;
+            size_t len = prepareFrame (peer, seq, frame);
+            memcpy (address, peer->mac, ESP_NOW_ETH_ALEN);
+            unlock ();
+            transmit (address, frame, len, seq);
+            lock ();
+            // Peer may have been given to another session while unlocked
+            if (!peer->used || peer->session != session) {
+                break;
+            }
+        }
+        slideWindow (peer);
+    }
+    unlock ();
+}
+
+void EspNowReliableClass::processFrame (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    espnow_reliable_header_t header;
+
+    if (len < sizeof (espnow_reliable_header_t) || data[0] != ESPNOW_RELIABLE_MAGIC) {
+        if (dataRcvd) {
+            dataRcvd (address, data, len, rssi, broadcast);
+        }
+        return;
+    }
+
+    // Frames are copied to get aligned fields
+    memcpy (&header, data, sizeof (espnow_reliable_header_t));
+    if (header.type == ESPNOW_RELIABLE_ACK && len >= sizeof (espnow_reliable_ack_t)) {
+        espnow_reliable_ack_t ack;
+        memcpy (&ack, data, sizeof (espnow_reliable_ack_t));
+        processAck (address, ack);
+    } else if (header.type == ESPNOW_RELIABLE_DATA && !broadcast && len > sizeof (espnow_reliable_header_t)) {
+        processData (address, header, data + sizeof (espnow_reliable_header_t), len - sizeof (espnow_reliable_header_t), rssi);
+    }
+}
+
+void EspNowReliableClass::processAck (uint8_t* address, espnow_reliable_ack_t& ack) {
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    tx_peer_t* peer;
+    uint16_t acked = ack.header.seq;
+    uint16_t highest;
+    bool sacked = false;
+
+    lock ();
+    if (!(peer = getTxPeer (address, false)) || peer->session != ack.header.session
+        || (uint16_t)(acked - peer->base) > (uint16_t)(peer->nextSeq - peer->base)) {
+        unlock ();
+        return;
+    }
+
+    while (peer->base != acked) {
+        peer->slots[peer->base % ESPNOW_RELIABLE_WINDOW].state = TX_SLOT_FREE;
+        peer->base++;
+    }
+    highest = peer->base;
+    // Selective acknowledgements are taken again from every ack, so receiver may revoke them
+    for (uint16_t seq = peer->base; seq != peer->nextSeq; seq++) {
+        tx_slot_t* slot = &peer->slots[seq % ESPNOW_RELIABLE_WINDOW];
+        uint16_t bit = seq - acked - 1;
+        if (slot->state == TX_SLOT_FAILED) {
+            continue;
+        }
+        if (seq != acked && bit < 32 && (ack.sack & (1UL << bit))) {
+            slot->state = TX_SLOT_SACKED;
+            highest = seq;
+            sacked = true;
+        } else {
+            slot->state = TX_SLOT_SENT;
+        }
+    }
+    // Holes before a message that got through are sent again at once, but only once
+    for (uint16_t seq = peer->base; sacked && seq != highest; seq++) {
+        tx_slot_t* slot = &peer->slots[seq % ESPNOW_RELIABLE_WINDOW];
+        if (slot->state == TX_SLOT_SENT && !slot->fastRetransmitted) {
+            slot->fastRetransmitted = true;
+            retransmissions++;
+            size_t len = prepareFrame (peer, seq, frame);
+            unlock ();
+            transmit (address, frame, len, seq);
+            lock ();
+            if (!peer->used || peer->session != ack.header.session) {
+                unlock ();
+                return;
+            }
+        }
+    }
+    slideWindow (peer);
+    unlock ();
+}
+
+EspNowReliableClass::rx_peer_t* EspNowReliableClass::getRxPeer (const uint8_t* address, uint8_t session, uint16_t base) {
+    rx_peer_t* candidate = NULL;
+
+    for (int i = 0; i < ESPNOW_RELIABLE_PEERS; i++) {
+        rx_peer_t* peer = &rxPeers[i];
+        if (peer->used && !memcmp (peer->mac, address, ESP_NOW_ETH_ALEN)) {
+            if (peer->session == session) {
+                return peer;
+            }
+            candidate = peer;
+            break;
+        }
+        if (!candidate || (candidate->used && (!peer->used || peer->lastActivity - candidate->lastActivity > 0x80000000UL))) {
+            candidate = peer;
+        }
+    }
+
+    // Sender restarted or this is a new one. Sequence numbers start on sender window base
+    memcpy (candidate->mac, address, ESP_NOW_ETH_ALEN);
+    candidate->used = true;
+    candidate->session = session;
+    candidate->expected = base;
+    for (int i = 0; i < ESPNOW_RELIABLE_WINDOW; i++) {
+        candidate->slots[i].received = false;
+    }
+    DEBUG_DBG (RELIABLE_TAG, "Session %d from " MACSTR, session, MAC2STR (address));
+    return candidate;
+}
+
+void EspNowReliableClass::deliver (rx_peer_t* peer, signed int rssi) {
+    rx_slot_t* slot = &peer->slots[peer->expected % ESPNOW_RELIABLE_WINDOW];
+
+    peer->expected++;
+    if (slot->received) {
+        slot->received = false;
+        if (dataRcvd) {
+            dataRcvd (peer->mac, slot->payload, slot->len, rssi, false);
+        }
+    }
+}
+
+void EspNowReliableClass::processData (uint8_t* address, espnow_reliable_header_t& header, uint8_t* payload, uint8_t len, signed int rssi) {
+    rx_peer_t* peer = getRxPeer (address, header.session, header.base);
+    espnow_reliable_ack_t ack;
+    uint16_t offset;
+
+    peer->lastActivity = millis ();
+    // Sender gave up messages before its window base. Whatever arrived after them is delivered
+    while ((int16_t)(header.base - peer->expected) > 0) {
+        deliver (peer, rssi);
+    }
+
+    offset = header.seq - peer->expected;
+    if (offset < ESPNOW_RELIABLE_WINDOW) {
+        rx_slot_t* slot = &peer->slots[header.seq % ESPNOW_RELIABLE_WINDOW];
+        if (!slot->received) {
+            memcpy (slot->payload, payload, len);
+            slot->len = len;
+            slot->received = true;
+        }
+    }
+    while (peer->slots[peer->expected % ESPNOW_RELIABLE_WINDOW].received) {
+        deliver (peer, rssi);
+    }
+
+    // Every message is acknowledged, also duplicates, as previous ack may have been lost
+    ack.header = { ESPNOW_RELIABLE_MAGIC, ESPNOW_RELIABLE_ACK, header.session, 0, peer->expected, 0 };
+    ack.sack = 0;
+    for (uint16_t i = 0; i + 1 < ESPNOW_RELIABLE_WINDOW; i++) {
+        if (peer->slots[(uint16_t)(peer->expected + 1 + i) % ESPNOW_RELIABLE_WINDOW].received) {
+            ack.sack |= 1UL << i;
+        }
+    }
+    espnow.send (address, (uint8_t*)&ack, sizeof (ack));
+}
@@ -0,0 +1,199 @@
+/**
+  * @file EspNowReliable.h
+  * @author German Martin
+  * @brief Sliding window reliable delivery for unicast messages
+  */
+
+#ifndef _ESPNOWRELIABLE_h
+#define _ESPNOWRELIABLE_h
+
+#include "QuickEspNow.h"
+
+#ifndef ESPNOW_RELIABLE_WINDOW
+#define ESPNOW_RELIABLE_WINDOW 8 ///< @brief Messages that may be sent to a peer before they are acknowledged. Power of two, up to 32
+#endif
+#ifndef ESPNOW_RELIABLE_PEERS
+#define ESPNOW_RELIABLE_PEERS 2 ///< @brief Peers that may have messages in flight at the same time, in each direction
+#endif
+#ifndef ESPNOW_RELIABLE_RTO_MS
+#define ESPNOW_RELIABLE_RTO_MS 50 ///< @brief Time without acknowledgement before a message is sent again
+#endif
+#ifndef ESPNOW_RELIABLE_MAX_RETRIES
+#define ESPNOW_RELIABLE_MAX_RETRIES 5 ///< @brief Retransmissions before a message is given as failed and skipped
+#endif
+#ifndef ESPNOW_RELIABLE_SEND_TIMEOUT_MS
+#define ESPNOW_RELIABLE_SEND_TIMEOUT_MS 1000 ///< @brief Maximum time that `send` waits for room in window
+#endif
+
+static const uint8_t ESPNOW_RELIABLE_MAGIC = 0xF6; ///< @brief First byte of every reliable channel frame
+static const uint32_t ESPNOW_RELIABLE_TICK_MS = 10; ///< @brief Retransmission timers resolution
+
+// Sequence numbers map to window slots with a modulo, that has to stay consistent when they wrap around
+static_assert (ESPNOW_RELIABLE_WINDOW <= 32 && (ESPNOW_RELIABLE_WINDOW & (ESPNOW_RELIABLE_WINDOW - 1)) == 0, "ESPNOW_RELIABLE_WINDOW must be a power of two up to 32");
+
+typedef enum {
+    ESPNOW_RELIABLE_DATA = 0, /**< Message with sequence number */
+    ESPNOW_RELIABLE_ACK = 1, /**< Acknowledgement */
+} espnow_reliable_frame_type_t;
+
+/**
+  * @brief Header of every reliable channel frame
+  */
+typedef struct {
+    uint8_t magic; /**< Always `ESPNOW_RELIABLE_MAGIC` */
+    uint8_t type; /**< `espnow_reliable_frame_type_t` */
+    uint8_t session; /**< Picked by sender for every peer, so that receiver notices when sender restarts */
+    uint8_t reserved;
+    uint16_t seq; /**< Message sequence number. In acknowledgements, next sequence number that receiver expects */
+    uint16_t base; /**< Oldest message that sender still waits acknowledgement for. Older ones must not be waited for */
+} espnow_reliable_header_t;
+
+/**
+  * @brief Acknowledgement frame. It acknowledges every message before `header.seq` and the ones marked in `sack`
+  */
+typedef struct {
+    espnow_reliable_header_t header;
+    uint32_t sack; /**< Bit i is set if message `header.seq + 1 + i` has been received */
+} espnow_reliable_ack_t;
+
+static const size_t ESPNOW_RELIABLE_PAYLOAD = ESP_NOW_MAX_DATA_LEN - sizeof (espnow_reliable_header_t); ///< @brief Maximum message length
+
+/**
+  * @brief Reliable, in order delivery of unicast messages over QuickEspNow.
+  *
+  * Every message gets a per peer sequence number. Up to `ESPNOW_RELIABLE_WINDOW` messages are in flight, so that link
+  * is kept busy instead of waiting for every acknowledgement. Receiver acknowledges every message with the next
+  * sequence number it expects and a bitmap of later messages it already has. Messages that are not acknowledged in
+  * `ESPNOW_RELIABLE_RTO_MS` are sent again, and holes reported by selective acknowledgements are sent again at once.
+  * After `ESPNOW_RELIABLE_MAX_RETRIES` a message is given as failed and receiver is told to skip it.
+  *
+  * Both ends have to use it. Frames that do not start with `ESPNOW_RELIABLE_MAGIC` are passed through unchanged.
+  * It works best in asynchronous mode.
+  */
+class EspNowReliableClass {
+protected:
+    typedef enum {
+        TX_SLOT_FREE = 0, /**< Not in use */
+        TX_SLOT_SENT = 1, /**< Waiting for acknowledgement */
+        TX_SLOT_SACKED = 2, /**< Selectively acknowledged. Receiver may still drop it if it restarts */
+        TX_SLOT_FAILED = 3, /**< Given up */
+    } tx_slot_state_t;
+
+    typedef struct {
+        uint8_t state;
+        uint8_t len;
+        uint8_t retries;
+        bool fastRetransmitted;
+        uint32_t sentTime; ///< @brief Time of last transmission, in milliseconds
+        uint8_t payload[ESPNOW_RELIABLE_PAYLOAD];
+    } tx_slot_t;
+
+    typedef struct {
+        uint8_t mac[ESP_NOW_ETH_ALEN];
+        bool used;
+        uint8_t session;
+        uint16_t base; ///< @brief Oldest message in window
+        uint16_t nextSeq; ///< @brief Sequence number of next message
+        uint32_t lastActivity;
+        tx_slot_t slots[ESPNOW_RELIABLE_WINDOW];
+    } tx_peer_t;
+
+    typedef struct {
+        bool received;
+        uint8_t len;
+        uint8_t payload[ESPNOW_RELIABLE_PAYLOAD];
+    } rx_slot_t;
+
+    typedef struct {
+        uint8_t mac[ESP_NOW_ETH_ALEN];
+        bool used;
+        uint8_t session;
+        uint16_t expected; ///< @brief Next sequence number to deliver
+        uint32_t lastActivity;
+        rx_slot_t slots[ESPNOW_RELIABLE_WINDOW];
+    } rx_peer_t;
+
+    QuickEspNow& espnow;
+    comms_hal_rcvd_data dataRcvd = 0;
+    tx_peer_t txPeers[ESPNOW_RELIABLE_PEERS]; ///< @brief Sender state. Protected by `mutex`
+    rx_peer_t rxPeers[ESPNOW_RELIABLE_PEERS]; ///< @brief Receiver state. Only used from reception callback
+    uint32_t retransmissions = 0;
+    uint32_t failedMessages = 0;
+#ifdef ESP8266
+    os_timer_t timer; ///< @brief Runs retransmission timers
+    static void timer_cb (void* param);
+#else
+    SemaphoreHandle_t mutex = NULL; ///< @brief Protects sender state. It is never held while a frame is sent
+    TaskHandle_t timerTask = NULL; ///< @brief Runs retransmission timers
+    std::atomic<bool> timerStopping { false }; ///< @brief Set by `stop`. Timer task ends itself, so that it is never deleted in the middle of a send
+    SemaphoreHandle_t timerEnded = NULL; ///< @brief Given by timer task when it ends
+    static void timerTask_cb (void* param);
+#endif
+
+    void lock ();
+    void unlock ();
+    tx_peer_t* getTxPeer (const uint8_t* address, bool create);
+    rx_peer_t* getRxPeer (const uint8_t* address, uint8_t session, uint16_t base);
+    size_t prepareFrame (tx_peer_t* peer, uint16_t seq, uint8_t* frame);
+    void transmit (const uint8_t* address, const uint8_t* frame, size_t len, uint16_t seq);
+    void slideWindow (tx_peer_t* peer);
+    void checkTimers ();
+    void processFrame (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast);
+    void processData (uint8_t* address, espnow_reliable_header_t& header, uint8_t* payload, uint8_t len, signed int rssi);
+    void processAck (uint8_t* address, espnow_reliable_ack_t& ack);
+    void deliver (rx_peer_t* peer, signed int rssi);
+
+public:
+    /**
+      * @brief Creates a reliable channel over a QuickEspNow instance
+      * @param espnow QuickEspNow instance used to send and receive frames
+      */
+    EspNowReliableClass (QuickEspNow& espnow);
+
+    ~EspNowReliableClass ();
+
+    /**
+      * @brief Starts retransmission timers. QuickEspNow has to be started too
+      */
+    void begin ();
+
+    /**
+      * @brief Stops retransmission timers. Messages in flight are not sent again
+      */
+    void stop ();
+
+    /**
+      * @brief Sends a message reliably. It may wait for room in window up to `ESPNOW_RELIABLE_SEND_TIMEOUT_MS`
+      * @param dstAddress Destination address. Broadcast is not allowed
+      * @param payload Message
+      * @param payload_len Message length, up to `ESPNOW_RELIABLE_PAYLOAD`
+      * @return `COMMS_SEND_OK` if message has been taken. It is sent again until it is acknowledged.
+      * `COMMS_SEND_QUEUE_FULL_ERROR` if window to this peer is still full after timeout, or all peers have messages in flight
+      */
+    comms_send_error_t send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len);
+
+    /**
+      * @brief Waits until every message is acknowledged or given as failed
+      * @param timeout_ms Maximum time to wait
+      * @return `true` if no message is in flight
+      */
+    bool flush (uint32_t timeout_ms);
+
+    /**
+      * @brief Attach a function to be called on every received message, in order. It replaces QuickEspNow `onDataRcvd` callback
+      * @param dataRcvd Callback function
+      */
+    void onDataRcvd (comms_hal_rcvd_data dataRcvd);
+
+    /**
+      * @brief Number of messages sent again
+      */
+    uint32_t getRetransmissions () { return retransmissions; }
+
+    /**
+      * @brief Number of messages given as failed after `ESPNOW_RELIABLE_MAX_RETRIES`
+      */
+    uint32_t getFailedMessages () { return failedMessages; }
+};
+
+#endif // _ESPNOWRELIABLE_h
@@ -0,0 +1,185 @@
+/**
+  * @file EspNowTrace.h
+  * @author German Martin
+  * @brief Binary event trace of QuickEspNow transmission and reception pipeline
+  */
+
+#ifndef _ESPNOWTRACE_h
+#define _ESPNOWTRACE_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#elif defined QESPNOW_HOST
+#include "QuickEspNow_host.h"
+#else
+#include "WProgram.h"
+#endif
+#include <atomic>
+#include <functional>
+#include <new>
+
+#ifndef ESPNOW_TRACE_RECORDS
+#define ESPNOW_TRACE_RECORDS 512 ///< @brief Default trace size in records. 12 bytes each
+#endif
+
+static const uint8_t ESPNOW_TRACE_VERSION = 1; ///< @brief Version of dump format
+
+/**
+  * @brief Pipeline stages that leave a trace record
+  */
+typedef enum {
+    ESPNOW_TRACE_ENQUEUE = 0, /**< Message is queued for transmission. Status is 0 */
+    ESPNOW_TRACE_DEQUEUE = 1, /**< Tx task takes message from queue. Status is 0, or `espnow_drop_reason_t` plus 1 if it is dropped instead of sent */
+    ESPNOW_TRACE_SEND = 2, /**< Driver has been given the frame. Status is 0 or `espnow_driver_error_t` plus 1 */
+    ESPNOW_TRACE_TX_CB = 3, /**< Transmission is confirmed. Status is the one given to tx_cb. Length and queue are 0 */
+    ESPNOW_TRACE_RX_CB = 4, /**< Frame is received. Status is 0 if it was queued, or `espnow_drop_reason_t` plus 1 */
+    ESPNOW_TRACE_DISPATCH = 5, /**< Received message is handed to user callback. Status is 0, or `espnow_drop_reason_t` plus 1 if it is skipped */
+} espnow_trace_event_t;
+
+/**
+  * @brief Trace record. Records of the same message share MAC hash and `id`
+  */
+typedef struct {
+    uint32_t time; /**< Time of event, in microseconds */
+    uint16_t id; /**< Lowest bits of queue or reception time of message, so that its records can be told apart */
+    uint16_t macHash; /**< Hash of destination or source address */
+    uint8_t event; /**< `espnow_trace_event_t` */
+    uint8_t len; /**< Payload length */
+    uint8_t status; /**< Event status */
+    uint8_t queue; /**< `espnow_queue_id_t` of message */
+} espnow_trace_record_t;
+
+/**
+  * @brief Dump header. Every dump is a header followed by `records` records, oldest first. Both are little endian
+  */
+typedef struct {
+    char magic[4]; /**< "QETR" */
+    uint8_t version; /**< `ESPNOW_TRACE_VERSION` */
+    uint8_t recordSize; /**< `sizeof (espnow_trace_record_t)` */
+    uint16_t reserved;
+    uint32_t records; /**< Records in this dump */
+    uint32_t lost; /**< Records overwritten since previous dump, before they could be dumped */
+} espnow_trace_header_t;
+
+typedef std::function<void (const uint8_t* data, size_t len)> espnow_trace_writer_t;
+
+/**
+  * @brief Fixed ring of trace records in RAM. Recording a record is a relaxed atomic increment and 12 bytes of
+  * stores, with no formatting nor locks, so that it may be called from WiFi task context without changing timing.
+  *
+  * Every context may record at the same time. Oldest records are overwritten when ring is full. Records written
+  * while a dump is running may come out torn, so recording should be paused before dumping if that matters.
+  */
+class EspNowTraceClass {
+protected:
+    espnow_trace_record_t* records = NULL;
+    uint32_t mask = 0; ///< @brief Ring size minus one. Ring size is a power of two
+    std::atomic<uint32_t> head; ///< @brief Records written ever
+    uint32_t dumped = 0; ///< @brief Records written when last dump was taken
+    std::atomic<bool> enabled;
+
+public:
+    EspNowTraceClass () : head (0), enabled (false) {}
+
+    ~EspNowTraceClass () {
+        delete[] (records);
+    }
+
+    /**
+      * @brief Allocates ring on first call, and starts or pauses recording
+      * @param size Ring size in records, rounded up to a power of two. It is only used on first call. 0 pauses recording
+      * @return `false` if there is not enough memory
+      */
+    bool enable (size_t size) {
+        if (!size) {
+            enabled.store (false, std::memory_order_relaxed);
+            return true;
+        }
+        if (!records) {
+            uint32_t ringSize = 1;
+            while (ringSize < size) {
+                ringSize <<= 1;
+            }
+            if (!(records = new (std::nothrow) espnow_trace_record_t[ringSize])) {
+                return false;
+            }
+            mask = ringSize - 1;
+        }
+        // Release lets recorders that see the flag also see ring
+        enabled.store (true, std::memory_order_release);
+        return true;
+    }
+
+    /**
+      * @brief Checks if records are being recorded
+      */
+    bool isEnabled () { return enabled.load (std::memory_order_acquire); }
+
+    /**
+      * @brief 16 bit FNV-1a hash of an address, as found in trace records
+      */
+    static uint16_t macHash (const uint8_t* mac) {
+        uint32_t value = 2166136261UL;
+        for (int i = 0; i < 6; i++) {
+            value = (value ^ mac[i]) * 16777619UL;
+        }
+        return (value ^ (value >> 16)) & 0xFFFF;
+    }
+
+    /**
+      * @brief Adds a record. It does nothing if recording is paused
+      * @param event Pipeline stage
+      * @param mac Destination or source address
+      * @param id Queue or reception time of message
+      * @param len Payload length
+      * @param status Event status
+      * @param queue Queue of message
+      */
+    void record (espnow_trace_event_t event, const uint8_t* mac, uint32_t id, uint8_t len, uint8_t status, uint8_t queue) {
+        espnow_trace_record_t* slot;
+
+        if (!enabled.load (std::memory_order_acquire)) {
+            return;
+        }
+        slot = &records[head.fetch_add (1, std::memory_order_relaxed) & mask];
+        slot->time = micros ();
+        slot->id = id;
+        slot->macHash = macHash (mac);
+        slot->event = event;
+        slot->len = len;
+        slot->status = status;
+        slot->queue = queue;
+    }
+
+    /**
+      * @brief Writes records taken since previous dump, oldest first, after a header
+      * @param write Function that gets dump bytes. It may be called several times
+      * @return Number of records written
+      */
+    size_t dump (espnow_trace_writer_t write) {
+        espnow_trace_header_t header = { { 'Q', 'E', 'T', 'R' }, ESPNOW_TRACE_VERSION, sizeof (espnow_trace_record_t), 0, 0, 0 };
+        uint32_t end = head.load (std::memory_order_acquire);
+        uint32_t start = dumped;
+
+        if (!records || !write) {
+            return 0;
+        }
+        if (end - start > mask + 1) {
+            header.lost = end - start - (mask + 1);
+            start = end - (mask + 1);
+        }
+        header.records = end - start;
+        write ((const uint8_t*)&header, sizeof (header));
+        // Ring may wrap around, so it is written in up to two pieces
+        if ((start & mask) + header.records > mask + 1) {
+            write ((const uint8_t*)&records[start & mask], (mask + 1 - (start & mask)) * sizeof (espnow_trace_record_t));
+            write ((const uint8_t*)records, (end & mask) * sizeof (espnow_trace_record_t));
+        } else {
+            write ((const uint8_t*)&records[start & mask], header.records * sizeof (espnow_trace_record_t));
+        }
+        dumped = end;
+        return header.records;
+    }
+};
+
+#endif // _ESPNOWTRACE_h
@@ -0,0 +1,186 @@
+/**
+  * @file LzCodec.h
+  * @author German Martin
+  * @brief Small LZ77 codec with static dictionary for QuickEspNow payloads
+  */
+
+#ifndef _LZCODEC_h
+#define _LZCODEC_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#elif defined QESPNOW_HOST
+#include "QuickEspNow_host.h"
+#else
+#include "WProgram.h"
+#endif
+
+/**
+  * @brief Default dictionary. Common tokens of JSON messages, so that short ones compress too
+  */
+static const char LZ_DEFAULT_DICTIONARY[] = "{\"id\":\"name\":\"type\":\"value\":\"data\":\"status\":\"time\":\"temp\":\"humidity\":\"battery\":\"rssi\":"
+                                            "true,false,null,\"ok\",\"error\",\"on\",\"off\",0.00,\"},{\"";
+
+/**
+  * @brief Byte oriented LZ77 codec. It uses no heap and about 512 bytes of stack, and it is meant for single frames.
+  *
+  * Stream is a sequence of tokens. A control byte below 0x80 is followed by `control + 1` literal bytes. Otherwise
+  * it is a match of `((control >> 2) & 0x1F) + 3` bytes, whose distance minus one is `(control & 0x03) << 8` plus
+  * next byte. Matches may reach back into a static dictionary that both ends have to share, as if it preceded data.
+  */
+class LzCodec {
+public:
+    static const size_t MIN_MATCH = 3; ///< @brief Shorter matches do not save anything
+    static const size_t MAX_MATCH = 34; ///< @brief Longest match a token can carry
+    static const size_t MAX_DISTANCE = 1024; ///< @brief Farthest match a token can carry
+    static const size_t MAX_LITERALS = 128; ///< @brief Longest literal run a token can carry
+    static const size_t MAX_DICTIONARY = 512; ///< @brief Longest dictionary. Older bytes could not be reached anyway
+
+    /**
+      * @brief Compresses a buffer
+      * @param in Data to compress
+      * @param len Data length
+      * @param out Output buffer
+      * @param maxOut Output buffer size. Compression fails if output does not fit
+      * @param dictionary Static dictionary. `NULL` for none
+      * @param dictLen Dictionary length. Up to `MAX_DICTIONARY`
+      * @return Compressed length. 0 if it does not fit in `maxOut` bytes
+      */
+    static size_t compress (const uint8_t* in, size_t len, uint8_t* out, size_t maxOut, const uint8_t* dictionary = NULL, size_t dictLen = 0) {
+        uint16_t table[HASH_SIZE]; ///< @brief Last position of every 3 byte hash. Positions count from dictionary start
+        size_t outLen = 0;
+        size_t total;
+        size_t literalStart;
+        size_t pos;
+
+        if (!dictionary) {
+            dictLen = 0;
+        }
+        if (!len || dictLen > MAX_DICTIONARY) {
+            return 0;
+        }
+        total = dictLen + len;
+        literalStart = dictLen;
+        for (size_t i = 0; i < HASH_SIZE; i++) {
+            table[i] = NO_POSITION;
+        }
+        for (pos = 0; pos + MIN_MATCH <= dictLen; pos++) {
+            table[hash (in, dictionary, dictLen, pos)] = pos;
+        }
+
+        pos = dictLen;
+        while (pos < total) {
+            size_t matchLen = 0;
+            size_t distance = 0;
+            if (pos + MIN_MATCH <= total) {
+                uint16_t h = hash (in, dictionary, dictLen, pos);
+                size_t candidate = table[h];
+                table[h] = pos;
+                if (candidate != NO_POSITION && pos - candidate <= MAX_DISTANCE) {
+                    while (matchLen < MAX_MATCH && pos + matchLen < total
+                           && at (in, dictionary, dictLen, candidate + matchLen) == at (in, dictionary, dictLen, pos + matchLen)) {
+                        matchLen++;
+                    }
+                    distance = pos - candidate;
+                }
+            }
+            if (matchLen < MIN_MATCH) {
+                pos++;
+                if (pos - literalStart == MAX_LITERALS) {
+                    if (!(outLen = literals (in + literalStart - dictLen, pos - literalStart, out, outLen, maxOut))) {
+                        return 0;
+                    }
+                    literalStart = pos;
+                }
+                continue;
+            }
+            if (pos > literalStart && !(outLen = literals (in + literalStart - dictLen, pos - literalStart, out, outLen, maxOut))) {
+                return 0;
+            }
+            if (outLen + 2 > maxOut) {
+                return 0;
+            }
+            out[outLen++] = 0x80 | ((matchLen - MIN_MATCH) << 2) | ((distance - 1) >> 8);
+            out[outLen++] = (distance - 1) & 0xFF;
+            // Positions inside match are indexed too, so that repeated runs are found again
+            for (size_t i = 1; i < matchLen && pos + i + MIN_MATCH <= total; i++) {
+                table[hash (in, dictionary, dictLen, pos + i)] = pos + i;
+            }
+            pos += matchLen;
+            literalStart = pos;
+        }
+        if (pos > literalStart && !(outLen = literals (in + literalStart - dictLen, pos - literalStart, out, outLen, maxOut))) {
+            return 0;
+        }
+        return outLen;
+    }
+
+    /**
+      * @brief Decompresses a buffer compressed with the same dictionary
+      * @param in Compressed data
+      * @param len Compressed length
+      * @param out Output buffer
+      * @param maxOut Output buffer size
+      * @param dictionary Static dictionary used to compress it. `NULL` for none
+      * @param dictLen Dictionary length
+      * @return Decompressed length. 0 if stream is malformed or it does not fit in `maxOut` bytes
+      */
+    static size_t decompress (const uint8_t* in, size_t len, uint8_t* out, size_t maxOut, const uint8_t* dictionary = NULL, size_t dictLen = 0) {
+        size_t inPos = 0;
+        size_t outLen = 0;
+
+        if (!dictionary) {
+            dictLen = 0;
+        }
+        while (inPos < len) {
+            uint8_t control = in[inPos++];
+            if (control < 0x80) {
+                size_t count = control + 1;
+                if (inPos + count > len || outLen + count > maxOut) {
+                    return 0;
+                }
+                memcpy (out + outLen, in + inPos, count);
+                inPos += count;
+                outLen += count;
+            } else {
+                if (inPos >= len) {
+                    return 0;
+                }
+                size_t count = ((control >> 2) & 0x1F) + MIN_MATCH;
+                size_t distance = (((control & 0x03) << 8) | in[inPos++]) + 1;
+                if (distance > outLen + dictLen || outLen + count > maxOut) {
+                    return 0;
+                }
+                // Byte by byte, as match may overlap bytes it produces
+                for (size_t i = 0; i < count; i++, outLen++) {
+                    out[outLen] = distance > outLen ? dictionary[dictLen + outLen - distance] : out[outLen - distance];
+                }
+            }
+        }
+        return outLen;
+    }
+
+protected:
+    static const size_t HASH_SIZE = 256;
+    static const uint16_t NO_POSITION = 0xFFFF;
+
+    static uint8_t at (const uint8_t* in, const uint8_t* dictionary, size_t dictLen, size_t pos) {
+        return pos < dictLen ? dictionary[pos] : in[pos - dictLen];
+    }
+
+    static uint16_t hash (const uint8_t* in, const uint8_t* dictionary, size_t dictLen, size_t pos) {
+        uint32_t value = at (in, dictionary, dictLen, pos) | (at (in, dictionary, dictLen, pos + 1) << 8) | (at (in, dictionary, dictLen, pos + 2) << 16);
+        return (uint32_t)(value * 2654435761UL) >> 24;
+    }
+
+    static size_t literals (const uint8_t* data, size_t count, uint8_t* out, size_t outLen, size_t maxOut) {
+        if (outLen + 1 + count > maxOut) {
+            return 0;
+        }
+        out[outLen++] = count - 1;
+        memcpy (out + outLen, data, count);
+        return outLen + count;
+    }
+};
+
+#endif // _LZCODEC_h
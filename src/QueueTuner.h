@@ -0,0 +1,109 @@
+/**
+  * @file QueueTuner.h
+  * @author German Martin
+  * @brief Adaptive sizing policy for QuickEspNow message queues
+  */
+
+#ifndef _QUEUETUNER_h
+#define _QUEUETUNER_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#elif defined QESPNOW_HOST
+#include "QuickEspNow_host.h"
+#else
+#include "WProgram.h"
+#endif
+#include <atomic>
+
+#ifndef ESPNOW_QUEUE_TUNE_PERIOD_MS
+#define ESPNOW_QUEUE_TUNE_PERIOD_MS 1000 ///< @brief Queue usage is evaluated this often when adaptive queues are enabled
+#endif
+#ifndef ESPNOW_QUEUE_SHRINK_PERIODS
+#define ESPNOW_QUEUE_SHRINK_PERIODS 10 ///< @brief Number of consecutive periods with low usage and no drops before a queue shrinks
+#endif
+
+/**
+  * @brief Decides queue size from drops and burst size observed in every period.
+  *
+  * Producer side reports every dropped message and queue usage after every queued one. Consumer side calls `evaluate`
+  * once per period. A queue that dropped messages doubles its size. A queue that used less than a quarter of its
+  * storage during `ESPNOW_QUEUE_SHRINK_PERIODS` periods in a row is halved, but never below twice the biggest burst
+  * seen in last period.
+  */
+class QueueTunerClass {
+protected:
+    std::atomic<uint32_t> drops; ///< @brief Messages dropped in current period
+    std::atomic<size_t> peak; ///< @brief Maximum bytes used in current period
+    uint32_t lastEvaluation = 0; ///< @brief Time of last evaluation, in milliseconds
+    uint8_t quietPeriods = 0; ///< @brief Consecutive periods with low usage
+
+public:
+    QueueTunerClass () : drops (0), peak (0) {}
+
+    /**
+      * @brief Starts a new observation period
+      */
+    void reset () {
+        drops.store (0, std::memory_order_relaxed);
+        peak.store (0, std::memory_order_relaxed);
+        quietPeriods = 0;
+        lastEvaluation = millis ();
+    }
+
+    /**
+      * @brief Counts a message that did not fit in queue. Producer side
+      */
+    void recordDrop () { drops.fetch_add (1, std::memory_order_relaxed); }
+
+    /**
+      * @brief Tracks burst size. Producer side
+      * @param bytesUsed Queue usage after a message has been queued
+      */
+    void recordUsage (size_t bytesUsed) {
+        if (bytesUsed > peak.load (std::memory_order_relaxed)) {
+            peak.store (bytesUsed, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+      * @brief Checks if current period is over. Consumer side
+      */
+    bool periodElapsed () { return millis () - lastEvaluation >= ESPNOW_QUEUE_TUNE_PERIOD_MS; }
+
+    /**
+      * @brief Ends current period and gets size that queue should have. Consumer side
+      * @param capacity Current queue size in bytes
+      * @param minBytes Minimum queue size
+      * @param maxBytes Maximum queue size, given by RAM budget
+      * @return Queue size in bytes. It is equal to `capacity` if queue should not change
+      */
+    size_t evaluate (size_t capacity, size_t minBytes, size_t maxBytes) {
+        uint32_t periodDrops = drops.exchange (0, std::memory_order_relaxed);
+        size_t periodPeak = peak.exchange (0, std::memory_order_relaxed);
+        size_t target = capacity;
+
+        lastEvaluation = millis ();
+        if (periodDrops) {
+            quietPeriods = 0;
+            target = capacity * 2;
+        } else if (periodPeak < capacity / 4) {
+            if (++quietPeriods >= ESPNOW_QUEUE_SHRINK_PERIODS) {
+                quietPeriods = 0;
+                target = capacity / 2 > periodPeak * 2 ? capacity / 2 : periodPeak * 2;
+            }
+        } else {
+            quietPeriods = 0;
+        }
+
+        if (target > maxBytes) {
+            target = maxBytes;
+        }
+        if (target < minBytes) {
+            target = minBytes;
+        }
+        return target & ~(size_t)3;
+    }
+};
+
+#endif // _QUEUETUNER_h
@@ -5,6 +5,12 @@
 #include "QuickEspNow_esp32.h"
 #elif defined ESP8266
 #include "QuickEspNow_esp8266.h"
+#elif defined __linux__
+#ifndef QESPNOW_HOST
+#define QESPNOW_HOST
+#endif // QESPNOW_HOST
+#include "QuickEspNow_esp32.h"
+#include "QuickEspNow_driver_host.h"
 #else
 #error "Unsupported platform"
 #endif //ESP32
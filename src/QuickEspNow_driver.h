@@ -0,0 +1,118 @@
+/**
+  * @file QuickEspNow_driver.h
+  * @author German Martin
+  * @brief Radio driver abstraction used by QuickEspNow engine
+  *
+  * Every call that engine makes to ESP-NOW or WiFi driver goes through this interface, so that queues,
+  * peer management and tx/rx handlers can run on top of real hardware or on a simulated radio on a host
+  */
+#ifndef _QUICK_ESPNOW_DRIVER_h
+#define _QUICK_ESPNOW_DRIVER_h
+
+#if defined ESP32
+#include <esp_now.h>
+#include <esp_wifi.h>
+#elif defined QESPNOW_HOST
+#include "QuickEspNow_host.h"
+#endif
+
+#if defined ESP32 || defined QESPNOW_HOST
+
+/**
+  * @brief Function called by driver on every received frame
+  * @param ctx Context registered along with the callback
+  * @param src Source address
+  * @param dst Destination address. It is broadcast address for broadcast frames
+  * @param data Frame payload
+  * @param len Payload length
+  * @param rssi Received signal strength in dBm
+  */
+typedef void (*espnow_driver_rx_cb_t)(void* ctx, const uint8_t* src, const uint8_t* dst, const uint8_t* data, uint8_t len, int8_t rssi);
+
+/**
+  * @brief Function called by driver after a frame has been transmitted
+  * @param ctx Context registered along with the callback
+  * @param dst Destination address of transmitted frame
+  * @param status `ESP_NOW_SEND_SUCCESS` or `ESP_NOW_SEND_FAIL`
+  */
+typedef void (*espnow_driver_tx_cb_t)(void* ctx, const uint8_t* dst, uint8_t status);
+
+/**
+  * @brief Interface that a radio backend has to implement to be used by QuickEspNow
+  *
+  * Semantics of every method match its ESP-NOW counterpart, including returned error codes
+  */
+class EspNowDriverClass {
+public:
+    virtual ~EspNowDriverClass () {}
+
+    /**
+      * @brief Starts radio driver. Equivalent to `esp_now_init`
+      * @return `ESP_OK` on success
+      */
+    virtual esp_err_t init () = 0;
+
+    /**
+      * @brief Stops radio driver and unregisters callbacks. Equivalent to `esp_now_deinit`
+      */
+    virtual void deinit () = 0;
+
+    /**
+      * @brief Registers functions to be called on frame reception and on transmission confirmation
+      * @param rx_cb Receive callback
+      * @param tx_cb Transmit confirmation callback
+      * @param ctx Context that will be passed back on every callback
+      */
+    virtual void registerCallbacks (espnow_driver_rx_cb_t rx_cb, espnow_driver_tx_cb_t tx_cb, void* ctx) = 0;
+
+    /**
+      * @brief Sends a frame. Equivalent to `esp_now_send`
+      * @param dst Destination address. Must be registered as peer before
+      * @param data Payload
+      * @param len Payload length
+      * @return `ESP_OK` if frame was accepted by driver. Transmission result is notified later using tx callback
+      */
+    virtual esp_err_t send (const uint8_t* dst, const uint8_t* data, size_t len) = 0;
+
+    virtual esp_err_t addPeer (const esp_now_peer_info_t* peer) = 0; ///< @brief Equivalent to `esp_now_add_peer`
+    virtual esp_err_t getPeer (const uint8_t* mac, esp_now_peer_info_t* peer) = 0; ///< @brief Equivalent to `esp_now_get_peer`
+    virtual esp_err_t modPeer (const esp_now_peer_info_t* peer) = 0; ///< @brief Equivalent to `esp_now_mod_peer`
+    virtual esp_err_t delPeer (const uint8_t* mac) = 0; ///< @brief Equivalent to `esp_now_del_peer`
+
+    virtual esp_err_t getChannel (uint8_t* primary, wifi_second_chan_t* second) = 0; ///< @brief Equivalent to `esp_wifi_get_channel`
+    virtual esp_err_t setChannel (uint8_t primary, wifi_second_chan_t second) = 0; ///< @brief Sets radio channel
+    virtual esp_err_t setBandwidth (wifi_interface_t iface, wifi_bandwidth_t bw) = 0; ///< @brief Equivalent to `esp_wifi_set_bandwidth`
+};
+
+#ifdef ESP32
+/**
+  * @brief ESP-NOW driver for ESP32 series, using ESP-IDF API
+  */
+class EspNowEsp32DriverClass : public EspNowDriverClass {
+public:
+    esp_err_t init () override;
+    void deinit () override;
+    void registerCallbacks (espnow_driver_rx_cb_t rx_cb, espnow_driver_tx_cb_t tx_cb, void* ctx) override;
+    esp_err_t send (const uint8_t* dst, const uint8_t* data, size_t len) override;
+    esp_err_t addPeer (const esp_now_peer_info_t* peer) override;
+    esp_err_t getPeer (const uint8_t* mac, esp_now_peer_info_t* peer) override;
+    esp_err_t modPeer (const esp_now_peer_info_t* peer) override;
+    esp_err_t delPeer (const uint8_t* mac) override;
+    esp_err_t getChannel (uint8_t* primary, wifi_second_chan_t* second) override;
+    esp_err_t setChannel (uint8_t primary, wifi_second_chan_t second) override;
+    esp_err_t setBandwidth (wifi_interface_t iface, wifi_bandwidth_t bw) override;
+
+protected:
+    espnow_driver_rx_cb_t rxCb = NULL;
+    espnow_driver_tx_cb_t txCb = NULL;
+    void* cbCtx = NULL;
+
+    static void ICACHE_FLASH_ATTR rx_cb (uint8_t* mac_addr, uint8_t* data, uint8_t len);
+    static void ICACHE_FLASH_ATTR tx_cb (uint8_t* mac_addr, uint8_t status);
+};
+
+extern EspNowEsp32DriverClass espNowEsp32Driver;
+#endif // ESP32
+
+#endif // ESP32 || QESPNOW_HOST
+#endif // _QUICK_ESPNOW_DRIVER_h
@@ -0,0 +1,108 @@
+#include "QuickEspNow.h"
+
+#ifdef ESP32
+
+typedef struct {
+    uint16_t frame_head;
+    uint16_t duration;
+    uint8_t destination_address[6];
+    uint8_t source_address[6];
+    uint8_t broadcast_address[6];
+    uint16_t sequence_control;
+
+    uint8_t category_code;
+    uint8_t organization_identifier[3]; // 0x18fe34
+    uint8_t random_values[4];
+    struct {
+        uint8_t element_id;                 // 0xdd
+        uint8_t lenght;                     //
+        uint8_t organization_identifier[3]; // 0x18fe34
+        uint8_t type;                       // 4
+        uint8_t version;
+        uint8_t body[0];
+    } vendor_specific_content;
+} __attribute__ ((packed)) espnow_frame_format_t;
+
+EspNowEsp32DriverClass espNowEsp32Driver;
+
+esp_err_t EspNowEsp32DriverClass::init () {
+    esp_err_t error = esp_now_init ();
+    if (error != ESP_OK) {
+        return error;
+    }
+    // ESP-NOW callbacks do not carry user context. There is only one radio so the global driver is used
+    esp_now_register_recv_cb (reinterpret_cast<esp_now_recv_cb_t>(rx_cb));
+    esp_now_register_send_cb (reinterpret_cast<esp_now_send_cb_t>(tx_cb));
+    return ESP_OK;
+}
+
+void EspNowEsp32DriverClass::deinit () {
+    esp_now_unregister_recv_cb ();
+    esp_now_unregister_send_cb ();
+    esp_now_deinit ();
+}
+
+void EspNowEsp32DriverClass::registerCallbacks (espnow_driver_rx_cb_t rx_cb, espnow_driver_tx_cb_t tx_cb, void* ctx) {
+    rxCb = rx_cb;
+    txCb = tx_cb;
+    cbCtx = ctx;
+}
+
+esp_err_t EspNowEsp32DriverClass::send (const uint8_t* dst, const uint8_t* data, size_t len) {
+    return esp_now_send (dst, data, len);
+}
+
+esp_err_t EspNowEsp32DriverClass::addPeer (const esp_now_peer_info_t* peer) {
+    return esp_now_add_peer (peer);
+}
+
+esp_err_t EspNowEsp32DriverClass::getPeer (const uint8_t* mac, esp_now_peer_info_t* peer) {
+    return esp_now_get_peer (mac, peer);
+}
+
+esp_err_t EspNowEsp32DriverClass::modPeer (const esp_now_peer_info_t* peer) {
+    return esp_now_mod_peer (peer);
+}
+
+esp_err_t EspNowEsp32DriverClass::delPeer (const uint8_t* mac) {
+    return esp_now_del_peer (mac);
+}
+
+esp_err_t EspNowEsp32DriverClass::getChannel (uint8_t* primary, wifi_second_chan_t* second) {
+    return esp_wifi_get_channel (primary, second);
+}
+
+esp_err_t EspNowEsp32DriverClass::setChannel (uint8_t primary, wifi_second_chan_t second) {
+    esp_err_t err_ok;
+    if ((err_ok = esp_wifi_set_promiscuous (true))) {
+        return err_ok;
+    }
+    // This is needed even in STA mode. If not done and using IDF > 4.0, the ESP-NOW will not work.
+    esp_err_t err_ch = esp_wifi_set_channel (primary, second);
+    if ((err_ok = esp_wifi_set_promiscuous (false))) {
+        return err_ok;
+    }
+    return err_ch;
+}
+
+esp_err_t EspNowEsp32DriverClass::setBandwidth (wifi_interface_t iface, wifi_bandwidth_t bw) {
+    return esp_wifi_set_bandwidth (iface, bw);
+}
+
+void EspNowEsp32DriverClass::rx_cb (uint8_t* mac_addr, uint8_t* data, uint8_t len) {
+    espnow_frame_format_t* espnow_data = (espnow_frame_format_t*)(data - sizeof (espnow_frame_format_t));
+    wifi_promiscuous_pkt_t* promiscuous_pkt = (wifi_promiscuous_pkt_t*)(data - sizeof (wifi_pkt_rx_ctrl_t) - sizeof (espnow_frame_format_t));
+    wifi_pkt_rx_ctrl_t* rx_ctrl = &promiscuous_pkt->rx_ctrl;
+
+    if (espNowEsp32Driver.rxCb) {
+        espNowEsp32Driver.rxCb (espNowEsp32Driver.cbCtx, mac_addr, espnow_data->destination_address, data, len, rx_ctrl->rssi);
+    }
+}
+
+void EspNowEsp32DriverClass::tx_cb (uint8_t* mac_addr, uint8_t status) {
+    if (espNowEsp32Driver.txCb) {
+        espNowEsp32Driver.txCb (espNowEsp32Driver.cbCtx, mac_addr, status);
+    }
+}
+
+#endif // ESP32
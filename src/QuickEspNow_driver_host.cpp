@@ -0,0 +1,407 @@
+#include "QuickEspNow.h"
+
+#ifdef QESPNOW_HOST
+
+#include "QuickEspNow_driver_host.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+
+static const uint8_t HOST_BROADCAST_ADDRESS[ESP_NOW_ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+static const uint8_t UDP_FRAME_MAGIC[] = { 'Q', 'E' };
+static const size_t UDP_FRAME_HEADER = sizeof (UDP_FRAME_MAGIC) + 1 + 2 * ESP_NOW_ETH_ALEN; ///< @brief magic, channel, dst, src
+static const int8_t UDP_RSSI = -40;
+
+// ---------------- EspNowHostDriverClass ----------------
+
+EspNowHostDriverClass::EspNowHostDriverClass (const uint8_t* mac) {
+    memcpy (this->mac, mac, ESP_NOW_ETH_ALEN);
+}
+
+EspNowHostDriverClass::~EspNowHostDriverClass () {
+    EspNowHostDriverClass::deinit ();
+}
+
+esp_err_t EspNowHostDriverClass::init () {
+    if (running) {
+        return ESP_OK;
+    }
+    running = true;
+    worker = std::thread (&EspNowHostDriverClass::workerLoop, this);
+    return ESP_OK;
+}
+
+void EspNowHostDriverClass::deinit () {
+    if (!running) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock (eventMutex);
+        running = false;
+        events.clear ();
+        pendingTx = 0;
+        pendingRx = 0;
+    }
+    eventCv.notify_all ();
+    if (worker.joinable () && worker.get_id () != std::this_thread::get_id ()) {
+        worker.join ();
+    }
+    rxCb = NULL;
+    txCb = NULL;
+}
+
+void EspNowHostDriverClass::registerCallbacks (espnow_driver_rx_cb_t rx_cb, espnow_driver_tx_cb_t tx_cb, void* ctx) {
+    rxCb = rx_cb;
+    txCb = tx_cb;
+    cbCtx = ctx;
+}
+
+esp_err_t EspNowHostDriverClass::send (const uint8_t* dst, const uint8_t* data, size_t len) {
+    if (!running) {
+        return ESP_ERR_ESPNOW_NOT_INIT;
+    }
+    if (!dst || !data || !len || len > ESP_NOW_MAX_DATA_LEN) {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+    {
+        std::lock_guard<std::mutex> lock (peerMutex);
+        std::vector<esp_now_peer_info_t>::iterator peer = std::find_if (peers.begin (), peers.end (), [dst] (const esp_now_peer_info_t& peer) {
+            return !memcmp (peer.peer_addr, dst, ESP_NOW_ETH_ALEN);
+        });
+        if (peer == peers.end ()) {
+            return ESP_ERR_ESPNOW_NOT_FOUND;
+        }
+        // Channel 0 means current one
+        if (peer->channel && peer->channel != channel) {
+            return ESP_ERR_ESPNOW_CHAN;
+        }
+    }
+
+    espnow_host_frame_t frame;
+    memcpy (frame.srcAddress, mac, ESP_NOW_ETH_ALEN);
+    memcpy (frame.dstAddress, dst, ESP_NOW_ETH_ALEN);
+    memcpy (frame.payload, data, len);
+    frame.payload_len = (uint8_t)len;
+    frame.rssi = 0;
+    frame.tx = true;
+    {
+        std::lock_guard<std::mutex> lock (eventMutex);
+        if (pendingTx >= txBufferSize) {
+            return ESP_ERR_ESPNOW_NO_MEM;
+        }
+        pendingTx++;
+        events.push_back (frame);
+    }
+    eventCv.notify_one ();
+    return ESP_OK;
+}
+
+esp_err_t EspNowHostDriverClass::addPeer (const esp_now_peer_info_t* peer) {
+    if (!peer) {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+    std::lock_guard<std::mutex> lock (peerMutex);
+    for (const esp_now_peer_info_t& existing : peers) {
+        if (!memcmp (existing.peer_addr, peer->peer_addr, ESP_NOW_ETH_ALEN)) {
+            return ESP_ERR_ESPNOW_EXIST;
+        }
+    }
+    if (peers.size () >= ESP_NOW_MAX_TOTAL_PEER_NUM) {
+        return ESP_ERR_ESPNOW_FULL;
+    }
+    peers.push_back (*peer);
+    return ESP_OK;
+}
+
+esp_err_t EspNowHostDriverClass::getPeer (const uint8_t* mac, esp_now_peer_info_t* peer) {
+    if (!mac || !peer) {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+    std::lock_guard<std::mutex> lock (peerMutex);
+    for (const esp_now_peer_info_t& existing : peers) {
+        if (!memcmp (existing.peer_addr, mac, ESP_NOW_ETH_ALEN)) {
+            *peer = existing;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+esp_err_t EspNowHostDriverClass::modPeer (const esp_now_peer_info_t* peer) {
+    if (!peer) {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+    std::lock_guard<std::mutex> lock (peerMutex);
+    for (esp_now_peer_info_t& existing : peers) {
+        if (!memcmp (existing.peer_addr, peer->peer_addr, ESP_NOW_ETH_ALEN)) {
+            existing = *peer;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+esp_err_t EspNowHostDriverClass::delPeer (const uint8_t* mac) {
+    if (!mac) {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+    std::lock_guard<std::mutex> lock (peerMutex);
+    for (std::vector<esp_now_peer_info_t>::iterator it = peers.begin (); it != peers.end (); ++it) {
+        if (!memcmp (it->peer_addr, mac, ESP_NOW_ETH_ALEN)) {
+            peers.erase (it);
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+esp_err_t EspNowHostDriverClass::getChannel (uint8_t* primary, wifi_second_chan_t* second) {
+    if (primary) {
+        *primary = channel;
+    }
+    if (second) {
+        *second = WIFI_SECOND_CHAN_NONE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t EspNowHostDriverClass::setChannel (uint8_t primary, wifi_second_chan_t second) {
+    if (primary < 1 || primary > 14) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    channel = primary;
+    return ESP_OK;
+}
+
+esp_err_t EspNowHostDriverClass::setBandwidth (wifi_interface_t iface, wifi_bandwidth_t bw) {
+    return ESP_OK;
+}
+
+bool EspNowHostDriverClass::receive (const espnow_host_frame_t* frame) {
+    {
+        std::lock_guard<std::mutex> lock (eventMutex);
+        if (!running) {
+            return false;
+        }
+        // Own frame on air has been popped already but is still counted in pendingTx, so received ones have their own count
+        if (pendingRx >= HOST_DRIVER_RX_BUFFER) {
+            rxOverflows++;
+            return false;
+        }
+        pendingRx++;
+        events.push_back (*frame);
+        events.back ().tx = false;
+    }
+    eventCv.notify_one ();
+    return true;
+}
+
+bool EspNowHostDriverClass::acceptsFrame (const uint8_t* dst, uint8_t frameChannel) {
+    if (!running || frameChannel != channel) {
+        return false;
+    }
+    return !memcmp (dst, mac, ESP_NOW_ETH_ALEN) || !memcmp (dst, HOST_BROADCAST_ADDRESS, ESP_NOW_ETH_ALEN);
+}
+
+void EspNowHostDriverClass::workerLoop () {
+    for (;;) {
+        espnow_host_frame_t frame;
+        {
+            std::unique_lock<std::mutex> lock (eventMutex);
+            eventCv.wait (lock, [this] () { return !running || !events.empty (); });
+            if (!running) {
+                return;
+            }
+            frame = events.front ();
+            events.pop_front ();
+            if (!frame.tx) {
+                pendingRx--;
+            }
+        }
+        if (frame.tx) {
+            uint8_t status = transmit (&frame);
+            {
+                std::lock_guard<std::mutex> lock (eventMutex);
+                if (pendingTx) {
+                    pendingTx--;
+                }
+            }
+            if (txCb) {
+                txCb (cbCtx, frame.dstAddress, status);
+            }
+        } else if (rxCb) {
+            rxCb (cbCtx, frame.srcAddress, frame.dstAddress, frame.payload, frame.payload_len, frame.rssi);
+        }
+    }
+}
+
+// ---------------- EspNowBusClass ----------------
+
+void EspNowBusClass::attach (EspNowBusDriverClass* node) {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (std::find (nodes.begin (), nodes.end (), node) == nodes.end ()) {
+        nodes.push_back (node);
+    }
+}
+
+void EspNowBusClass::detach (EspNowBusDriverClass* node) {
+    std::lock_guard<std::mutex> lock (mutex);
+    nodes.erase (std::remove (nodes.begin (), nodes.end (), node), nodes.end ());
+}
+
+bool EspNowBusClass::lost () {
+    if (lossRatio <= 0) {
+        return false;
+    }
+    // xorshift32 keeps runs reproducible
+    lossSeed ^= lossSeed << 13;
+    lossSeed ^= lossSeed >> 17;
+    lossSeed ^= lossSeed << 5;
+    return (float)(lossSeed & 0xFFFFFF) / (float)0x1000000 < lossRatio;
+}
+
+uint8_t EspNowBusClass::deliver (EspNowBusDriverClass* from, const espnow_host_frame_t* frame, uint8_t frameChannel) {
+    bool broadcast = !memcmp (frame->dstAddress, HOST_BROADCAST_ADDRESS, ESP_NOW_ETH_ALEN);
+    bool delivered = false;
+    espnow_host_frame_t rxFrame = *frame;
+    rxFrame.rssi = rssi;
+
+    std::lock_guard<std::mutex> lock (mutex);
+    for (EspNowBusDriverClass* node : nodes) {
+        if (node == from || !node->acceptsFrame (frame->dstAddress, frameChannel)) {
+            continue;
+        }
+        if (lossFilter ? lossFilter (frame) : lost ()) {
+            continue;
+        }
+        // Frames that do not fit in receiver buffer are not acknowledged
+        if (node->receive (&rxFrame)) {
+            delivered = true;
+        }
+    }
+    return (broadcast || delivered) ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL;
+}
+
+// ---------------- EspNowBusDriverClass ----------------
+
+esp_err_t EspNowBusDriverClass::init () {
+    esp_err_t error = EspNowHostDriverClass::init ();
+    if (error == ESP_OK) {
+        bus.attach (this);
+    }
+    return error;
+}
+
+void EspNowBusDriverClass::deinit () {
+    bus.detach (this);
+    EspNowHostDriverClass::deinit ();
+}
+
+uint8_t EspNowBusDriverClass::transmit (const espnow_host_frame_t* frame) {
+    uint32_t airtime = bus.airtimeFrameUs + (uint32_t)(bus.airtimeByteUs * frame->payload_len);
+    if (airtime) {
+        std::this_thread::sleep_for (std::chrono::microseconds (airtime));
+    }
+    uint8_t status = bus.deliver (this, frame, channel);
+    if (status != ESP_NOW_SEND_SUCCESS && bus.retryUs) {
+        std::this_thread::sleep_for (std::chrono::microseconds (bus.retryUs));
+    }
+    return status;
+}
+
+// ---------------- EspNowUdpDriverClass ----------------
+
+esp_err_t EspNowUdpDriverClass::init () {
+    if (running) {
+        return ESP_OK;
+    }
+    sock = socket (AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return ESP_FAIL;
+    }
+    struct sockaddr_in addr;
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons (localPort);
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    // Receive timeout lets rx thread notice deinit
+    struct timeval timeout = { 0, 100000 };
+    setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+    if (bind (sock, (struct sockaddr*)&addr, sizeof (addr)) < 0) {
+        close (sock);
+        sock = -1;
+        return ESP_FAIL;
+    }
+    esp_err_t error = EspNowHostDriverClass::init ();
+    rxThread = std::thread (&EspNowUdpDriverClass::rxLoop, this);
+    return error;
+}
+
+void EspNowUdpDriverClass::deinit () {
+    EspNowHostDriverClass::deinit ();
+    if (rxThread.joinable ()) {
+        rxThread.join ();
+    }
+    if (sock >= 0) {
+        close (sock);
+        sock = -1;
+    }
+}
+
+uint8_t EspNowUdpDriverClass::transmit (const espnow_host_frame_t* frame) {
+    uint8_t datagram[UDP_FRAME_HEADER + ESP_NOW_MAX_DATA_LEN];
+    uint8_t* ptr = datagram;
+    memcpy (ptr, UDP_FRAME_MAGIC, sizeof (UDP_FRAME_MAGIC));
+    ptr += sizeof (UDP_FRAME_MAGIC);
+    *ptr++ = channel;
+    memcpy (ptr, frame->dstAddress, ESP_NOW_ETH_ALEN);
+    ptr += ESP_NOW_ETH_ALEN;
+    memcpy (ptr, frame->srcAddress, ESP_NOW_ETH_ALEN);
+    ptr += ESP_NOW_ETH_ALEN;
+    memcpy (ptr, frame->payload, frame->payload_len);
+
+    struct sockaddr_in addr;
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    bool sent = false;
+    for (uint16_t port : remotePorts) {
+        addr.sin_port = htons (port);
+        if (sendto (sock, datagram, UDP_FRAME_HEADER + frame->payload_len, 0, (struct sockaddr*)&addr, sizeof (addr)) >= 0) {
+            sent = true;
+        }
+    }
+    // There is no link layer acknowledge over UDP. Datagram accepted by kernel counts as success
+    return sent ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL;
+}
+
+void EspNowUdpDriverClass::rxLoop () {
+    uint8_t datagram[UDP_FRAME_HEADER + ESP_NOW_MAX_DATA_LEN];
+    espnow_host_frame_t frame;
+
+    while (running) {
+        ssize_t len = recv (sock, datagram, sizeof (datagram), 0);
+        if (len <= (ssize_t)UDP_FRAME_HEADER || memcmp (datagram, UDP_FRAME_MAGIC, sizeof (UDP_FRAME_MAGIC))) {
+            continue;
+        }
+        const uint8_t* ptr = datagram + sizeof (UDP_FRAME_MAGIC);
+        uint8_t frameChannel = *ptr++;
+        memcpy (frame.dstAddress, ptr, ESP_NOW_ETH_ALEN);
+        ptr += ESP_NOW_ETH_ALEN;
+        memcpy (frame.srcAddress, ptr, ESP_NOW_ETH_ALEN);
+        ptr += ESP_NOW_ETH_ALEN;
+        if (!acceptsFrame (frame.dstAddress, frameChannel) || !memcmp (frame.srcAddress, mac, ESP_NOW_ETH_ALEN)) {
+            continue;
+        }
+        frame.payload_len = (uint8_t)(len - UDP_FRAME_HEADER);
+        memcpy (frame.payload, ptr, frame.payload_len);
+        frame.rssi = UDP_RSSI;
+        receive (&frame);
+    }
+}
+
+#endif // QESPNOW_HOST
@@ -0,0 +1,209 @@
+/**
+  * @file QuickEspNow_driver_host.h
+  * @author German Martin
+  * @brief Simulated ESP-NOW radios to run QuickEspNow on a Linux host
+  *
+  * `EspNowBusDriverClass` connects any number of nodes in the same process through an `EspNowBusClass`.
+  * `EspNowUdpDriverClass` exchanges frames with other processes over loopback UDP.
+  * Both emulate ESP-NOW peer table, channel filtering, limited driver buffer and asynchronous send confirmation
+  */
+#ifndef _QUICK_ESPNOW_DRIVER_HOST_h
+#define _QUICK_ESPNOW_DRIVER_HOST_h
+#ifdef QESPNOW_HOST
+
+#include "QuickEspNow_driver.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const size_t HOST_DRIVER_TX_BUFFER = 8; ///< @brief Frames that driver accepts before returning `ESP_ERR_ESPNOW_NO_MEM`
+static const size_t HOST_DRIVER_RX_BUFFER = 32; ///< @brief Received frames pending to be delivered before dropping new ones
+
+typedef struct {
+    uint8_t srcAddress[ESP_NOW_ETH_ALEN]; /**< Source Address */
+    uint8_t dstAddress[ESP_NOW_ETH_ALEN]; /**< Destination Address */
+    uint8_t payload[ESP_NOW_MAX_DATA_LEN]; /**< Frame payload */
+    uint8_t payload_len; /**< Payload length */
+    int8_t rssi; /**< RSSI */
+    bool tx; /**< `true` if this is a frame to transmit, `false` if it has been received */
+} espnow_host_frame_t;
+
+typedef std::function<bool (const espnow_host_frame_t* frame)> espnow_bus_loss_filter_t;
+
+/**
+  * @brief Common part of host drivers. A worker thread plays the role of WiFi task: it transmits queued frames
+  * and runs rx and tx callbacks, always serialized as ESP-NOW does
+  */
+class EspNowHostDriverClass : public EspNowDriverClass {
+public:
+    EspNowHostDriverClass (const uint8_t* mac);
+    virtual ~EspNowHostDriverClass ();
+
+    esp_err_t init () override;
+    void deinit () override;
+    void registerCallbacks (espnow_driver_rx_cb_t rx_cb, espnow_driver_tx_cb_t tx_cb, void* ctx) override;
+    esp_err_t send (const uint8_t* dst, const uint8_t* data, size_t len) override;
+    esp_err_t addPeer (const esp_now_peer_info_t* peer) override;
+    esp_err_t getPeer (const uint8_t* mac, esp_now_peer_info_t* peer) override;
+    esp_err_t modPeer (const esp_now_peer_info_t* peer) override;
+    esp_err_t delPeer (const uint8_t* mac) override;
+    esp_err_t getChannel (uint8_t* primary, wifi_second_chan_t* second) override;
+    esp_err_t setChannel (uint8_t primary, wifi_second_chan_t second) override;
+    esp_err_t setBandwidth (wifi_interface_t iface, wifi_bandwidth_t bw) override;
+
+    /**
+      * @brief Gets simulated MAC address of this node
+      */
+    const uint8_t* getMac () { return mac; }
+
+    /**
+      * @brief Sets how many frames driver can hold before `send` returns `ESP_ERR_ESPNOW_NO_MEM`
+      */
+    void setTxBufferSize (size_t frames) { txBufferSize = frames; }
+
+    /**
+      * @brief Number of received frames that were dropped because callbacks were not consumed fast enough
+      */
+    unsigned long getRxOverflows () { return rxOverflows; }
+
+protected:
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    std::atomic<uint8_t> channel { 1 };
+    std::atomic<bool> running { false };
+    size_t txBufferSize = HOST_DRIVER_TX_BUFFER;
+    std::atomic<unsigned long> rxOverflows { 0 };
+
+    espnow_driver_rx_cb_t rxCb = NULL;
+    espnow_driver_tx_cb_t txCb = NULL;
+    void* cbCtx = NULL;
+
+    std::mutex peerMutex;
+    std::vector<esp_now_peer_info_t> peers;
+
+    std::mutex eventMutex;
+    std::condition_variable eventCv;
+    std::deque<espnow_host_frame_t> events;
+    size_t pendingTx = 0; ///< @brief Frames to transmit that have not got their tx callback yet
+    size_t pendingRx = 0; ///< @brief Received frames in `events`
+    std::thread worker;
+
+    /**
+      * @brief Puts a frame on the air. Runs on worker thread
+      * @return `ESP_NOW_SEND_SUCCESS` or `ESP_NOW_SEND_FAIL` as it would be reported by tx callback
+      */
+    virtual uint8_t transmit (const espnow_host_frame_t* frame) = 0;
+
+    /**
+      * @brief Queues a frame received from the air to be delivered on worker thread
+      * @return `true` if frame was queued, `false` if it was dropped
+      */
+    bool receive (const espnow_host_frame_t* frame);
+
+    bool acceptsFrame (const uint8_t* dst, uint8_t frameChannel);
+    void workerLoop ();
+};
+
+class EspNowBusDriverClass;
+
+/**
+  * @brief Shared medium for nodes that live in the same process
+  */
+class EspNowBusClass {
+    friend class EspNowBusDriverClass;
+public:
+    /**
+      * @brief Simulates air time. Transmission of each frame blocks sender for `perFrameUs + len * perByteUs`
+      */
+    void setAirtime (uint32_t perFrameUs, float perByteUs) { airtimeFrameUs = perFrameUs; airtimeByteUs = perByteUs; }
+
+    /**
+      * @brief Probability (0 to 1) that a frame is not received by a destination. Unicast frames that are lost report a failure
+      */
+    void setLossRatio (float ratio) { lossRatio = ratio; }
+
+    /**
+      * @brief Decides which frames are lost instead of loss ratio, so that tests lose the same frames whatever
+      * thread timing is. It is called with bus locked, once per receiver
+      * @param filter Returns `true` if frame is lost. `NULL` goes back to loss ratio
+      */
+    void setLossFilter (espnow_bus_loss_filter_t filter) { lossFilter = filter; }
+
+    /**
+      * @brief Extra air time of unicast frames that nobody acknowledges, as radio retries them before reporting failure
+      */
+    void setRetryTime (uint32_t us) { retryUs = us; }
+
+    /**
+      * @brief RSSI reported to receivers, in dBm
+      */
+    void setRssi (int8_t rssi) { this->rssi = rssi; }
+
+protected:
+    std::mutex mutex;
+    std::vector<EspNowBusDriverClass*> nodes;
+    uint32_t airtimeFrameUs = 0;
+    float airtimeByteUs = 0;
+    float lossRatio = 0;
+    uint32_t retryUs = 0;
+    int8_t rssi = -50;
+    uint32_t lossSeed = 0x12345678;
+    espnow_bus_loss_filter_t lossFilter = NULL;
+
+    void attach (EspNowBusDriverClass* node);
+    void detach (EspNowBusDriverClass* node);
+    uint8_t deliver (EspNowBusDriverClass* from, const espnow_host_frame_t* frame, uint8_t frameChannel);
+    bool lost ();
+};
+
+/**
+  * @brief Simulated radio connected to an in-process bus
+  */
+class EspNowBusDriverClass : public EspNowHostDriverClass {
+    friend class EspNowBusClass;
+public:
+    EspNowBusDriverClass (EspNowBusClass& bus, const uint8_t* mac) : EspNowHostDriverClass (mac), bus (bus) {}
+    ~EspNowBusDriverClass () { deinit (); }
+
+    esp_err_t init () override;
+    void deinit () override;
+
+protected:
+    EspNowBusClass& bus;
+
+    uint8_t transmit (const espnow_host_frame_t* frame) override;
+};
+
+/**
+  * @brief Simulated radio that sends frames to other processes using UDP datagrams on loopback interface.
+  * Every frame is sent to all registered remote ports, which filter it by destination address as a radio would do
+  */
+class EspNowUdpDriverClass : public EspNowHostDriverClass {
+public:
+    EspNowUdpDriverClass (const uint8_t* mac, uint16_t localPort) : EspNowHostDriverClass (mac), localPort (localPort) {}
+    ~EspNowUdpDriverClass () { deinit (); }
+
+    /**
+      * @brief Adds a UDP port in loopback interface where another node is listening
+      */
+    void addRemote (uint16_t port) { remotePorts.push_back (port); }
+
+    esp_err_t init () override;
+    void deinit () override;
+
+protected:
+    uint16_t localPort;
+    std::vector<uint16_t> remotePorts;
+    int sock = -1;
+    std::thread rxThread;
+
+    uint8_t transmit (const espnow_host_frame_t* frame) override;
+    void rxLoop ();
+};
+
+#endif // QESPNOW_HOST
+#endif // _QUICK_ESPNOW_DRIVER_HOST_h
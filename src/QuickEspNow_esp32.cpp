@@ -1,17 +1,73 @@
 #include "QuickEspNow.h"
 
-#ifdef ESP32
+#if defined ESP32 || defined QESPNOW_HOST
+
+#ifdef QESPNOW_RAM_REPORT
+#define QESPNOW_STR_(x) #x
+#define QESPNOW_STR(x) QESPNOW_STR_(x)
+#pragma message ("QuickEspNow queue RAM: TX " QESPNOW_STR (ESPNOW_TX_QUEUE_BYTES) " bytes, control " QESPNOW_STR (ESPNOW_TX_CONTROL_QUEUE_BYTES) " bytes, bulk " QESPNOW_STR (ESPNOW_TX_BULK_QUEUE_BYTES) " bytes, RX " QESPNOW_STR (ESPNOW_RX_QUEUE_BYTES) " bytes")
+#endif // QESPNOW_RAM_REPORT
+static_assert (ESPNOW_TX_QUEUE_BYTES >= 2 * ESPNOW_TX_RECORD_LEN, "ESPNOW_TX_QUEUE_BYTES must hold at least two messages of maximum length");
+static_assert (ESPNOW_RX_QUEUE_BYTES >= 2 * ESPNOW_RX_RECORD_LEN, "ESPNOW_RX_QUEUE_BYTES must hold at least two messages of maximum length");
+static_assert (ESPNOW_TX_CONTROL_QUEUE_BYTES >= 2 * ESPNOW_TX_RECORD_LEN, "ESPNOW_TX_CONTROL_QUEUE_BYTES must hold at least two messages of maximum length");
+static_assert (ESPNOW_TX_BULK_QUEUE_BYTES >= 2 * ESPNOW_TX_RECORD_LEN, "ESPNOW_TX_BULK_QUEUE_BYTES must hold at least two messages of maximum length");
 
 QuickEspNow quickEspNow;
 
 constexpr auto PEERLIST_TAG = "PEERLIST";
 
+QuickEspNow::QuickEspNow () :
+    tx_queue (ESPNOW_TX_QUEUE_BYTES), txControlQueue (ESPNOW_TX_CONTROL_QUEUE_BYTES), txBulkQueue (ESPNOW_TX_BULK_QUEUE_BYTES), rx_queue (ESPNOW_RX_QUEUE_BYTES), linkSamples (ESPNOW_LINK_SAMPLES) {
+    txClasses[ESPNOW_PRIORITY_CONTROL].queue = &txControlQueue;
+    txClasses[ESPNOW_PRIORITY_NORMAL].queue = &tx_queue;
+    txClasses[ESPNOW_PRIORITY_BULK].queue = &txBulkQueue;
+    for (int i = 0; i < ESPNOW_PRIORITY_CLASSES; i++) {
+        txClasses[i].maxAge_ms = 0;
+        roomRequest[i] = 0;
+        resetFlows (txClasses[i]);
+    }
+    for (int i = 0; i < ESPNOW_QUEUES; i++) {
+        watermarks[i].high = 0;
+        watermarks[i].low = 0;
+        watermarks[i].above = false;
+        overflow[i].policy = ESPNOW_OVERFLOW_DROP_NEWEST;
+        overflow[i].timeout_ms = 0;
+    }
+    resetStats ();
+}
+
 
 bool QuickEspNow::begin (uint8_t channel, uint32_t wifi_interface, bool synchronousSend) {
+    return begin (channel, wifi_interface, synchronousSend, tx_queue.capacity (), rx_queue.capacity ());
+}
+
+bool QuickEspNow::begin (uint8_t channel, uint32_t wifi_interface, bool synchronousSend, size_t txQueueBytes, size_t rxQueueBytes) {
 
     wifi_second_chan_t ch2 = WIFI_SECOND_CHAN_NONE;
     this->synchronousSend = synchronousSend;
 
+    if (!driver) {
+        DEBUG_ERROR (QESPNOW_TAG, "No radio driver set");
+        return false;
+    }
+
+    if (txQueueBytes < 2 * ESPNOW_TX_RECORD_LEN || rxQueueBytes < 2 * ESPNOW_RX_RECORD_LEN) {
+        DEBUG_ERROR (QESPNOW_TAG, "Queues must hold at least two messages of maximum length");
+        return false;
+    }
+    // Tasks are not running yet, so queues may be replaced
+    if ((txQueueBytes != tx_queue.capacity () && !tx_queue.setCapacity (txQueueBytes))
+        || (rxQueueBytes != rx_queue.capacity () && !rx_queue.setCapacity (rxQueueBytes))) {
+        DEBUG_ERROR (QESPNOW_TAG, "Not enough memory for queues");
+        return false;
+    }
+    rxDispatchPosition = 0;
+    for (int i = 0; i < ESPNOW_PRIORITY_CLASSES; i++) {
+        resetFlows (txClasses[i]);
+    }
+    queueRamBytes = tx_queue.capacity () + rx_queue.capacity ();
+    DEBUG_DBG (QESPNOW_TAG, "Queue sizes: TX %u bytes, RX %u bytes", tx_queue.capacity (), rx_queue.capacity ());
+
     DEBUG_DBG (QESPNOW_TAG, "Channel: %d, Interface: %d", channel, wifi_interface);
     // Set the wifi interface
     switch (wifi_interface) {
@@ -36,7 +92,7 @@ bool QuickEspNow::begin (uint8_t channel, uint32_t wifi_interface, bool synchron
     // use current channel
     if (channel == CURRENT_WIFI_CHANNEL) {
         uint8_t ch;
-        esp_wifi_get_channel (&ch, &ch2);
+        driver->getChannel (&ch, &ch2);
         channel = ch;
         DEBUG_DBG (QESPNOW_TAG, "Current channel: %d : %d", channel, ch2);
         followWiFiChannel = true;
@@ -52,15 +108,210 @@ bool QuickEspNow::begin (uint8_t channel, uint32_t wifi_interface, bool synchron
 
 void QuickEspNow::stop () {
     DEBUG_INFO (QESPNOW_TAG, "-------------> ESP-NOW STOP");
+    // Tx task is not deleted while it changes peer list or in-flight message, as that would leave their mutex taken
+    xSemaphoreTake (peerListMutex, portMAX_DELAY);
+    xSemaphoreTake (inflightMutex, portMAX_DELAY);
     vTaskDelete (espnowTxTask);
+    xSemaphoreGive (inflightMutex);
     vTaskDelete (espnowRxTask);
-    esp_now_unregister_recv_cb ();
-    esp_now_unregister_send_cb ();
-    esp_now_deinit ();
+#ifdef ESP32
+    if (followWiFiChannel) {
+        esp_event_handler_unregister (WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, wifiEvent_cb);
+        esp_event_handler_unregister (WIFI_EVENT, WIFI_EVENT_AP_START, wifiEvent_cb);
+    }
+#endif // ESP32
+    driver->deinit ();
+    // Driver forgets every peer, so they have to be registered again
+    while (peer_list.delete_peer ()) {
+    }
+    xSemaphoreGive (peerListMutex);
+}
+
+bool QuickEspNow::setPriorityQueue (espnow_priority_t priority, size_t bytes, uint32_t maxAge_ms) {
+    espnow_tx_class_t* txClass;
+
+    if (priority >= ESPNOW_PRIORITY_CLASSES || bytes < 2 * ESPNOW_TX_RECORD_LEN) {
+        DEBUG_ERROR (QESPNOW_TAG, "Queues must hold at least two messages of maximum length");
+        return false;
+    }
+    txClass = &txClasses[priority];
+    // Tasks are not running, so queue may be replaced
+    if (bytes != txClass->queue->capacity () && !txClass->queue->setCapacity (bytes)) {
+        DEBUG_ERROR (QESPNOW_TAG, "Not enough memory for queue");
+        return false;
+    }
+    resetFlows (*txClass);
+    txClass->maxAge_ms = maxAge_ms;
+    return true;
 }
 
 bool QuickEspNow::readyToSendData () {
-    return uxQueueMessagesWaiting (tx_queue) < queueSize;
+    return tx_queue.fits (sizeof (comms_tx_queue_item_t) + ESPNOW_MAX_MESSAGE_LENGTH);
+}
+
+bool QuickEspNow::waitForQueueSpace (uint32_t timeout_ms, espnow_priority_t priority) {
+    BipBuffer* queue;
+    uint32_t start = millis ();
+    uint32_t elapsed;
+
+    if (priority >= ESPNOW_PRIORITY_CLASSES || !queueSpace) {
+        return false;
+    }
+    queue = txClasses[priority].queue;
+    // Bit is cleared before checking, so that space freed after the check always wakes caller up
+    for (;;) {
+        xEventGroupClearBits (queueSpace, 1 << priority);
+        if (queue->fits (sizeof (comms_tx_queue_item_t) + ESPNOW_MAX_MESSAGE_LENGTH)) {
+            return true;
+        }
+        elapsed = millis () - start;
+        if (elapsed >= timeout_ms) {
+            return false;
+        }
+        xEventGroupWaitBits (queueSpace, 1 << priority, pdTRUE, pdTRUE, pdMS_TO_TICKS (timeout_ms - elapsed));
+    }
+}
+
+bool QuickEspNow::setQueueWatermarks (espnow_queue_id_t queue, uint8_t highPercent, uint8_t lowPercent) {
+    if (queue >= ESPNOW_QUEUES || highPercent > 100 || (highPercent && lowPercent >= highPercent)) {
+        DEBUG_WARN (QESPNOW_TAG, "Wrong watermarks");
+        return false;
+    }
+    watermarks[queue].high = highPercent;
+    watermarks[queue].low = lowPercent;
+    watermarks[queue].above = false;
+    return true;
+}
+
+bool QuickEspNow::setOverflowPolicy (espnow_queue_id_t queue, espnow_overflow_policy_t policy, uint32_t timeout_ms) {
+    // rx_cb runs in WiFi task, that must never wait
+    if (queue >= ESPNOW_QUEUES || (queue == ESPNOW_QUEUE_RX && policy == ESPNOW_OVERFLOW_BLOCK)) {
+        DEBUG_WARN (QESPNOW_TAG, "Wrong overflow policy");
+        return false;
+    }
+    overflow[queue].policy = policy;
+    overflow[queue].timeout_ms = timeout_ms;
+    return true;
+}
+
+bool QuickEspNow::waitForRoom (espnow_priority_t priority, size_t len, uint32_t start, size_t messages) {
+    espnow_overflow_t* queueOverflow = &overflow[priority];
+    // Tx task may be waiting for a confirmation before it can drop anything
+    uint32_t timeout_ms = queueOverflow->policy == ESPNOW_OVERFLOW_BLOCK ? queueOverflow->timeout_ms : ESPNOW_TX_CONFIRM_TIMEOUT_MS;
+    uint32_t elapsed = millis () - start;
+
+    if (queueOverflow->policy == ESPNOW_OVERFLOW_DROP_NEWEST || elapsed >= timeout_ms) {
+        stats.drops[priority][queueOverflow->policy == ESPNOW_OVERFLOW_BLOCK ? ESPNOW_DROP_TIMEOUT : ESPNOW_DROP_NEWEST] += messages;
+        return false;
+    }
+    if (queueOverflow->policy == ESPNOW_OVERFLOW_DROP_OLDEST) {
+        roomRequest[priority] = len;
+        xTaskNotifyGive (espnowTxTask);
+    }
+    // Bit was cleared before queue was checked, so space freed since then is not missed
+    xEventGroupWaitBits (queueSpace, 1 << priority, pdTRUE, pdTRUE, pdMS_TO_TICKS (timeout_ms - elapsed));
+    return true;
+}
+
+void QuickEspNow::getStats (espnow_stats_t& snapshot) {
+    snapshot.txFrames = stats.txFrames.load (std::memory_order_relaxed);
+    snapshot.txBytes = stats.txBytes.load (std::memory_order_relaxed);
+    snapshot.rxFrames = stats.rxFrames.load (std::memory_order_relaxed);
+    snapshot.rxBytes = stats.rxBytes.load (std::memory_order_relaxed);
+    snapshot.txConfirmed = stats.txConfirmed.load (std::memory_order_relaxed);
+    snapshot.txFailed = stats.txFailed.load (std::memory_order_relaxed);
+    snapshot.txTimeouts = stats.txTimeouts.load (std::memory_order_relaxed);
+    for (int i = 0; i < ESPNOW_DRIVER_ERRORS; i++) {
+        snapshot.driverErrors[i] = stats.driverErrors[i].load (std::memory_order_relaxed);
+    }
+    for (int i = 0; i < ESPNOW_QUEUES; i++) {
+        for (int j = 0; j < ESPNOW_DROP_REASONS; j++) {
+            snapshot.drops[i][j] = stats.drops[i][j].load (std::memory_order_relaxed);
+        }
+        snapshot.queueHighWater[i] = stats.queueHighWater[i].load (std::memory_order_relaxed);
+    }
+    snapshot.peersAdded = stats.peersAdded.load (std::memory_order_relaxed);
+    snapshot.peersEvicted = stats.peersEvicted.load (std::memory_order_relaxed);
+    for (int i = 0; i < ESPNOW_LATENCY_BUCKETS; i++) {
+        snapshot.txLatency[i] = stats.txLatency[i].load (std::memory_order_relaxed);
+    }
+}
+
+void QuickEspNow::resetStats () {
+    stats.txFrames = 0;
+    stats.txBytes = 0;
+    stats.rxFrames = 0;
+    stats.rxBytes = 0;
+    stats.txConfirmed = 0;
+    stats.txFailed = 0;
+    stats.txTimeouts = 0;
+    for (int i = 0; i < ESPNOW_DRIVER_ERRORS; i++) {
+        stats.driverErrors[i] = 0;
+    }
+    for (int i = 0; i < ESPNOW_QUEUES; i++) {
+        for (int j = 0; j < ESPNOW_DROP_REASONS; j++) {
+            stats.drops[i][j] = 0;
+        }
+        stats.queueHighWater[i] = 0;
+    }
+    stats.peersAdded = 0;
+    stats.peersEvicted = 0;
+    for (int i = 0; i < ESPNOW_LATENCY_BUCKETS; i++) {
+        stats.txLatency[i] = 0;
+    }
+}
+
+void QuickEspNow::recordQueueUsage (espnow_queue_id_t queue, size_t bytesUsed) {
+    // Every queue has a single producer, so no other task raises its mark at the same time
+    if (bytesUsed > stats.queueHighWater[queue].load (std::memory_order_relaxed)) {
+        stats.queueHighWater[queue].store (bytesUsed, std::memory_order_relaxed);
+    }
+}
+
+espnow_driver_error_t QuickEspNow::driverErrorKind (int32_t error) {
+    switch (error) {
+    case ESP_ERR_ESPNOW_NO_MEM:
+        return ESPNOW_DRIVER_ERROR_NO_MEM;
+    case ESP_ERR_ESPNOW_NOT_FOUND:
+#ifdef ESP_ERR_ESPNOW_CHAN
+    case ESP_ERR_ESPNOW_CHAN:
+#endif
+        return ESPNOW_DRIVER_ERROR_NOT_FOUND;
+    case ESP_ERR_ESPNOW_ARG:
+    case ESP_ERR_ESPNOW_IF:
+    case ESP_ERR_INVALID_ARG:
+        return ESPNOW_DRIVER_ERROR_ARG;
+    default:
+        return ESPNOW_DRIVER_ERROR_OTHER;
+    }
+}
+
+void QuickEspNow::recordDriverError (int32_t error) {
+    stats.driverErrors[driverErrorKind (error)].fetch_add (1, std::memory_order_relaxed);
+}
+
+void QuickEspNow::onQueueWatermark (espnow_watermark_cb_t queueWatermark) {
+    this->queueWatermark = queueWatermark;
+}
+
+void QuickEspNow::checkWatermarks (espnow_queue_id_t queue, BipBuffer& buffer, bool full) {
+    espnow_queue_watermark_t& watermark = watermarks[queue];
+    size_t used;
+
+    if (!watermark.high || !queueWatermark) {
+        return;
+    }
+    used = buffer.bytesUsed ();
+    // Producer and consumer may check at the same time. Exchange lets only one of them report each crossing
+    if (full || used * 100 >= buffer.capacity () * watermark.high) {
+        if (!watermark.above.exchange (true)) {
+            queueWatermark (queue, ESPNOW_WATERMARK_HIGH, used);
+        }
+    } else if (used * 100 <= buffer.capacity () * watermark.low) {
+        if (watermark.above.exchange (false)) {
+            queueWatermark (queue, ESPNOW_WATERMARK_LOW, used);
+        }
+    }
 }
 
 bool QuickEspNow::setChannel (uint8_t channel, wifi_second_chan_t ch2) {
@@ -71,18 +322,10 @@ bool QuickEspNow::setChannel (uint8_t channel, wifi_second_chan_t ch2) {
     }
     
     esp_err_t err_ok;
-    if ((err_ok = esp_wifi_set_promiscuous (true))) {
-        DEBUG_ERROR (QESPNOW_TAG, "Error setting promiscuous mode: %s", esp_err_to_name (err_ok));
-        return false;
-    }
-    if ((err_ok = esp_wifi_set_channel (channel, ch2))) { // This is needed even in STA mode. If not done and using IDF > 4.0, the ESP-NOW will not work.
+    if ((err_ok = driver->setChannel (channel, ch2))) {
         DEBUG_DBG (QESPNOW_TAG, "Error setting wifi channel: %d - %s", err_ok, esp_err_to_name (err_ok));
         return false;
     }
-    if ((err_ok = esp_wifi_set_promiscuous (false))) {
-        DEBUG_ERROR (QESPNOW_TAG, "Error setting promiscuous mode off: %s", esp_err_to_name (err_ok));
-        return false;
-    }
 
     this->channel = channel;
 
@@ -90,7 +333,17 @@ bool QuickEspNow::setChannel (uint8_t channel, wifi_second_chan_t ch2) {
 }
 
 comms_send_error_t QuickEspNow::send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len) {
-    comms_tx_queue_item_t message;
+    return send (dstAddress, payload, payload_len, NULL, NULL);
+}
+
+comms_send_error_t QuickEspNow::send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len, espnow_send_handle_t* handle, void* ctx) {
+    return send (dstAddress, payload, payload_len, ESPNOW_PRIORITY_NORMAL, handle, ctx);
+}
+
+comms_send_error_t QuickEspNow::send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len, espnow_priority_t priority, espnow_send_handle_t* handle, void* ctx) {
+    uint8_t* buffer;
+    comms_send_error_t error;
+    size_t len;
 
     if (!dstAddress || !payload || !payload_len) {
         DEBUG_WARN (QESPNOW_TAG, "Parameters error");
@@ -102,39 +355,332 @@ comms_send_error_t QuickEspNow::send (const uint8_t* dstAddress, const uint8_t*
         return COMMS_SEND_PAYLOAD_LENGTH_ERROR;
     }
 
-    if (uxQueueMessagesWaiting (tx_queue) >= queueSize) {
-        // comms_tx_queue_item_t tempBuffer;
-        // xQueueReceive (tx_queue, &tempBuffer, 0);
-#ifdef MEAS_TPUT
-        //txDataDropped += tempBuffer.payload_len;
-#endif // MEAS_TPUT
-        //DEBUG_DBG (QESPNOW_TAG, "Message dropped");
-        return COMMS_SEND_QUEUE_FULL_ERROR;
-    }
-    memcpy (message.dstAddress, dstAddress, ESP_NOW_ETH_ALEN);
-    message.payload_len = payload_len;
-    memcpy (message.payload, payload, payload_len);
-
-    if (xQueueSend (tx_queue, &message, pdMS_TO_TICKS (10))) {
-#ifdef MEAS_TPUT
-        txDataSent += message.payload_len;
-#endif // MEAS_TPUT
-        DEBUG_DBG (QESPNOW_TAG, "--------- %d Comms messages queued. Len: %d", uxQueueMessagesWaiting (tx_queue), payload_len);
-        DEBUG_VERBOSE (QESPNOW_TAG, "--------- Ready to send is %s", readyToSend ? "true" : "false");
-        DEBUG_VERBOSE (QESPNOW_TAG, "--------- SyncronousSend is %s", synchronousSend ? "true" : "false");
-        if (synchronousSend) {
-            waitingForConfirmation = true;
-            DEBUG_INFO (QESPNOW_TAG, "--------- Waiting for send confirmation");
-            while (waitingForConfirmation) {
-                taskYIELD ();
+    if (!(buffer = reserveMessage (dstAddress, encodedMaxLength (payload, payload_len), priority, error))) {
+        if (error != COMMS_SEND_QUEUE_FULL_ERROR) {
+            DEBUG_WARN (QESPNOW_TAG, "Error queuing Comms message to " MACSTR, MAC2STR (dstAddress));
+        }
+        return error;
+    }
+    if (!(len = encodePayload (buffer, payload, payload_len))) {
+        DEBUG_WARN (QESPNOW_TAG, "Length error. %d", payload_len);
+        cancel ();
+        return COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+    }
+    return commitMessage (len, handle, ctx);
+}
+
+void QuickEspNow::enableCompression (bool enable, const uint8_t* dictionary, size_t dictLen) {
+    if (!dictionary) {
+        dictionary = (const uint8_t*)LZ_DEFAULT_DICTIONARY;
+        dictLen = sizeof (LZ_DEFAULT_DICTIONARY) - 1;
+    }
+    if (dictLen > LzCodec::MAX_DICTIONARY) {
+        // Matches cannot reach farther than this, so only the end of dictionary is useful
+        dictionary += dictLen - LzCodec::MAX_DICTIONARY;
+        dictLen = LzCodec::MAX_DICTIONARY;
+    }
+    compressionDictionary = dictionary;
+    compressionDictLen = dictLen;
+    compression = enable;
+}
+
+size_t QuickEspNow::encodedMaxLength (const uint8_t* payload, size_t payload_len) {
+    // Messages that look like a compressed frame are always sent compressed, even if that makes them longer
+    if (compression && payload[0] == ESPNOW_COMPRESSED_MAGIC) {
+        size_t len = 1 + payload_len + (payload_len + LzCodec::MAX_LITERALS - 1) / LzCodec::MAX_LITERALS;
+        return len < ESPNOW_MAX_MESSAGE_LENGTH ? len : ESPNOW_MAX_MESSAGE_LENGTH;
+    }
+    return payload_len;
+}
+
+size_t QuickEspNow::encodePayload (uint8_t* buffer, const uint8_t* payload, size_t payload_len) {
+    bool mustCompress = compression && payload[0] == ESPNOW_COMPRESSED_MAGIC;
+    size_t len;
+
+    if (mustCompress || (compression && payload_len >= ESPNOW_COMPRESSION_MIN_LEN)) {
+        // Compressed frame has to be smaller than message, header included
+        size_t maxLen = mustCompress ? encodedMaxLength (payload, payload_len) : payload_len - 1;
+        if ((len = LzCodec::compress (payload, payload_len, buffer + 1, maxLen - 1, compressionDictionary, compressionDictLen))) {
+            buffer[0] = ESPNOW_COMPRESSED_MAGIC;
+            DEBUG_VERBOSE (QESPNOW_TAG, "Message compressed from %d to %d bytes", payload_len, len + 1);
+            return len + 1;
+        }
+        if (mustCompress) {
+            return 0;
+        }
+    }
+    memcpy (buffer, payload, payload_len);
+    return payload_len;
+}
+
+uint8_t* QuickEspNow::reserve (const uint8_t* dstAddress, size_t maxLen, espnow_priority_t priority) {
+    comms_send_error_t error;
+    return reserveMessage (dstAddress, maxLen, priority, error);
+}
+
+uint8_t* QuickEspNow::reserveMessage (const uint8_t* dstAddress, size_t maxLen, espnow_priority_t priority, comms_send_error_t& error) {
+    comms_tx_queue_item_t* message;
+    BipBuffer* queue;
+    uint32_t start = millis ();
+
+    if (!dstAddress || !maxLen || maxLen > ESPNOW_MAX_MESSAGE_LENGTH || priority >= ESPNOW_PRIORITY_CLASSES || !txProducerMutex) {
+        DEBUG_WARN (QESPNOW_TAG, "Parameters error");
+        error = COMMS_SEND_PARAM_ERROR;
+        return NULL;
+    }
+
+    for (;;) {
+        if (overflow[priority].policy != ESPNOW_OVERFLOW_DROP_NEWEST) {
+            xEventGroupClearBits (queueSpace, 1 << priority);
+        }
+        if (!xSemaphoreTake (txProducerMutex, pdMS_TO_TICKS (10))) {
+            DEBUG_WARN (QESPNOW_TAG, "Transmission queue busy");
+            error = COMMS_SEND_MSG_ENQUEUE_ERROR;
+            return NULL;
+        }
+        // Queue is only checked while holding the mutex, as tx task may resize it otherwise
+        queue = txClasses[priority].queue;
+        if ((message = (comms_tx_queue_item_t*)queue->reserve (sizeof (comms_tx_queue_item_t) + maxLen))) {
+            break;
+        }
+        xSemaphoreGive (txProducerMutex);
+        if (!waitForRoom (priority, sizeof (comms_tx_queue_item_t) + maxLen, start, 1)) {
+            if (queue == &tx_queue) {
+                txTuner.recordDrop ();
             }
-            DEBUG_INFO (QESPNOW_TAG, "--------- Confirmation is %s", sentStatus == ESP_NOW_SEND_SUCCESS ? "true" : "false");
-            return (sentStatus == ESP_NOW_SEND_SUCCESS) ? COMMS_SEND_OK : COMMS_SEND_CONFIRM_ERROR;
+            checkWatermarks ((espnow_queue_id_t)priority, *queue, true);
+            error = COMMS_SEND_QUEUE_FULL_ERROR;
+            return NULL;
         }
-        return COMMS_SEND_OK;
-    } else {
-        DEBUG_WARN (QESPNOW_TAG, "Error queuing Comms message to " MACSTR, MAC2STR (dstAddress));
-        return COMMS_SEND_MSG_ENQUEUE_ERROR;
+    }
+    error = COMMS_SEND_OK;
+    memcpy (message->dstAddress, dstAddress, ESP_NOW_ETH_ALEN);
+    message->tracking = ESPNOW_UNTRACKED;
+    reservedMessage = message;
+    reservedQueue = queue;
+    reservedPriority = priority;
+    reservedLen = maxLen;
+    return message->payload;
+}
+
+comms_send_error_t QuickEspNow::commit (size_t payload_len, espnow_send_handle_t* handle, void* ctx) {
+    // Receiver would try to expand a raw message that starts like a compressed frame
+    if (compression && reservedMessage && payload_len && reservedMessage->payload[0] == ESPNOW_COMPRESSED_MAGIC) {
+        DEBUG_WARN (QESPNOW_TAG, "Message written in place starts with compression magic");
+        cancel ();
+        return COMMS_SEND_PARAM_ERROR;
+    }
+    return commitMessage (payload_len, handle, ctx);
+}
+
+comms_send_error_t QuickEspNow::commitMessage (size_t payload_len, espnow_send_handle_t* handle, void* ctx) {
+    comms_tx_queue_item_t* message = reservedMessage;
+    espnow_send_handle_t messageHandle = ESPNOW_NO_HANDLE;
+    BipBuffer* queue = reservedQueue;
+    espnow_priority_t priority = reservedPriority;
+
+    if (!message) {
+        DEBUG_WARN (QESPNOW_TAG, "Nothing reserved");
+        return COMMS_SEND_PARAM_ERROR;
+    }
+
+    if (!payload_len || payload_len > reservedLen) {
+        DEBUG_WARN (QESPNOW_TAG, "Length error. %d", payload_len);
+        cancel ();
+        return COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+    }
+
+    // Synchronous send is a tracked message whose result is collected here
+    if (handle || ctx || synchronousSend) {
+        message->tracking = sendTracker.allocate (ctx, handle || synchronousSend);
+        if (message->tracking == ESPNOW_UNTRACKED) {
+            DEBUG_WARN (QESPNOW_TAG, "Too many messages tracked");
+            cancel ();
+            return COMMS_SEND_QUEUE_FULL_ERROR;
+        }
+        xEventGroupClearBits (sendDone, 1 << message->tracking);
+        messageHandle = sendTracker.handle (message->tracking);
+        if (handle) {
+            *handle = messageHandle;
+        }
+    }
+
+    message->payload_len = payload_len;
+    message->enqueue_time = micros ();
+    trace.record (ESPNOW_TRACE_ENQUEUE, message->dstAddress, message->enqueue_time, payload_len, 0, priority);
+    reservedMessage = NULL;
+    reservedQueue->commit (sizeof (comms_tx_queue_item_t) + payload_len);
+    if (reservedQueue == &tx_queue) {
+        txTuner.recordUsage (tx_queue.bytesUsed ());
+    }
+    recordQueueUsage ((espnow_queue_id_t)priority, reservedQueue->bytesUsed ());
+    DEBUG_DBG (QESPNOW_TAG, "--------- %d bytes in queue. Len: %d", reservedQueue->bytesUsed (), payload_len);
+    xSemaphoreGive (txProducerMutex);
+    checkWatermarks ((espnow_queue_id_t)priority, *queue);
+    xTaskNotifyGive (espnowTxTask);
+
+    DEBUG_VERBOSE (QESPNOW_TAG, "--------- SyncronousSend is %s", synchronousSend ? "true" : "false");
+    if (synchronousSend) {
+        comms_send_error_t result;
+        DEBUG_INFO (QESPNOW_TAG, "--------- Waiting for send confirmation");
+        // Every queued message is tracked and each one takes at most a confirmation timeout
+        if ((result = wait (messageHandle, (ESPNOW_MAX_TRACKED_MESSAGES + 1) * ESPNOW_TX_CONFIRM_TIMEOUT_MS)) == COMMS_SEND_TIMEOUT_ERROR) {
+            sendTracker.detach (messageHandle & 0xFF);
+            result = COMMS_SEND_CONFIRM_ERROR;
+        }
+        DEBUG_INFO (QESPNOW_TAG, "--------- Confirmation is %s", result == COMMS_SEND_OK ? "true" : "false");
+        return result;
+    }
+    return COMMS_SEND_OK;
+}
+
+comms_send_error_t QuickEspNow::sendBatch (espnow_batch_entry_t* entries, size_t count, espnow_priority_t priority) {
+    comms_send_error_t result = COMMS_SEND_OK;
+    comms_tx_queue_item_t* message;
+    uint8_t slots[ESPNOW_MAX_TRACKED_MESSAGES];
+    size_t staged = 0;
+    size_t batchBytes = 0;
+    BipBuffer* queue;
+    uint32_t start = millis ();
+    uint32_t batchTime;
+
+    if (!entries || !count || !txProducerMutex || priority >= ESPNOW_PRIORITY_CLASSES || (synchronousSend && count > ESPNOW_MAX_TRACKED_MESSAGES)) {
+        DEBUG_WARN (QESPNOW_TAG, "Parameters error");
+        return COMMS_SEND_PARAM_ERROR;
+    }
+    queue = txClasses[priority].queue;
+
+    // Whole batch is checked before anything is queued
+    for (size_t i = 0; i < count; i++) {
+        entries[i].status = COMMS_SEND_OK;
+        if (!entries[i].dstAddress || !entries[i].payload || !entries[i].payload_len || entries[i].payload_len > ESP_NOW_MAX_DATA_LEN) {
+            DEBUG_WARN (QESPNOW_TAG, "Length error in batch message %d", i);
+            entries[i].status = COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+            if (result == COMMS_SEND_OK) {
+                result = COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+            }
+        } else {
+            batchBytes += BipBuffer::footprint (sizeof (comms_tx_queue_item_t) + encodedMaxLength (entries[i].payload, entries[i].payload_len));
+        }
+    }
+
+    while (result == COMMS_SEND_OK) {
+        bool full = false;
+        if (overflow[priority].policy != ESPNOW_OVERFLOW_DROP_NEWEST) {
+            xEventGroupClearBits (queueSpace, 1 << priority);
+        }
+        if (!xSemaphoreTake (txProducerMutex, pdMS_TO_TICKS (10))) {
+            DEBUG_WARN (QESPNOW_TAG, "Transmission queue busy");
+            result = COMMS_SEND_MSG_ENQUEUE_ERROR;
+            break;
+        }
+        // Messages are staged in queue and only published when all of them fit. Their queue times differ, so that they can be told apart in trace
+        batchTime = micros ();
+        for (staged = 0; staged < count; staged++) {
+            size_t len;
+            if (!(message = (comms_tx_queue_item_t*)queue->reserve (sizeof (comms_tx_queue_item_t) + encodedMaxLength (entries[staged].payload, entries[staged].payload_len)))) {
+                full = true;
+                result = COMMS_SEND_QUEUE_FULL_ERROR;
+                break;
+            }
+            if (!(len = encodePayload (message->payload, entries[staged].payload, entries[staged].payload_len))) {
+                DEBUG_WARN (QESPNOW_TAG, "Length error in batch message %d", staged);
+                result = entries[staged].status = COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+                break;
+            }
+            message->tracking = ESPNOW_UNTRACKED;
+            if (synchronousSend) {
+                if ((message->tracking = sendTracker.allocate (NULL, true)) == ESPNOW_UNTRACKED) {
+                    DEBUG_WARN (QESPNOW_TAG, "Too many messages tracked");
+                    result = COMMS_SEND_QUEUE_FULL_ERROR;
+                    break;
+                }
+                xEventGroupClearBits (sendDone, 1 << message->tracking);
+                slots[staged] = message->tracking;
+            }
+            memcpy (message->dstAddress, entries[staged].dstAddress, ESP_NOW_ETH_ALEN);
+            message->payload_len = len;
+            message->enqueue_time = batchTime + staged;
+            queue->commit (sizeof (comms_tx_queue_item_t) + len, false);
+        }
+        if (result == COMMS_SEND_OK) {
+            queue->publish ();
+            for (size_t i = 0; i < count; i++) {
+                trace.record (ESPNOW_TRACE_ENQUEUE, entries[i].dstAddress, batchTime + i, entries[i].payload_len, 0, priority);
+            }
+            if (queue == &tx_queue) {
+                txTuner.recordUsage (tx_queue.bytesUsed ());
+            }
+            recordQueueUsage ((espnow_queue_id_t)priority, queue->bytesUsed ());
+        } else {
+            queue->rollback ();
+            for (size_t i = 0; synchronousSend && i < staged; i++) {
+                sendTracker.cancel (slots[i]);
+            }
+        }
+        xSemaphoreGive (txProducerMutex);
+        if (!full) {
+            checkWatermarks ((espnow_queue_id_t)priority, *queue);
+            break;
+        }
+        // Batch is tried again as a whole once there is room for it
+        if (!waitForRoom (priority, batchBytes, start, count)) {
+            if (queue == &tx_queue) {
+                txTuner.recordDrop ();
+            }
+            checkWatermarks ((espnow_queue_id_t)priority, *queue, true);
+            break;
+        }
+        result = COMMS_SEND_OK;
+    }
+
+    if (result != COMMS_SEND_OK) {
+        // Messages that were right are not queued either
+        for (size_t i = 0; i < count; i++) {
+            if (entries[i].status == COMMS_SEND_OK) {
+                entries[i].status = result == COMMS_SEND_PAYLOAD_LENGTH_ERROR ? COMMS_SEND_MSG_ENQUEUE_ERROR : result;
+            }
+        }
+        return result;
+    }
+
+    xTaskNotifyGive (espnowTxTask);
+    DEBUG_DBG (QESPNOW_TAG, "--------- %d messages queued. %d bytes in queue", count, queue->bytesUsed ());
+
+    if (synchronousSend) {
+        for (size_t i = 0; i < count; i++) {
+            if ((entries[i].status = wait (sendTracker.handle (slots[i]), (ESPNOW_MAX_TRACKED_MESSAGES + 1) * ESPNOW_TX_CONFIRM_TIMEOUT_MS)) == COMMS_SEND_TIMEOUT_ERROR) {
+                sendTracker.detach (slots[i]);
+                entries[i].status = COMMS_SEND_CONFIRM_ERROR;
+            }
+            if (result == COMMS_SEND_OK) {
+                result = entries[i].status;
+            }
+        }
+    }
+    return result;
+}
+
+comms_send_error_t QuickEspNow::wait (espnow_send_handle_t handle, uint32_t timeout_ms) {
+    uint8_t slot = sendTracker.find (handle);
+    uint8_t status;
+
+    if (slot == ESPNOW_UNTRACKED) {
+        return COMMS_SEND_PARAM_ERROR;
+    }
+    // Bit stays set if message completed before this call
+    xEventGroupWaitBits (sendDone, 1 << slot, pdTRUE, pdTRUE, pdMS_TO_TICKS (timeout_ms));
+    if (!sendTracker.collect (slot, status)) {
+        return COMMS_SEND_TIMEOUT_ERROR;
+    }
+    return status == ESP_NOW_SEND_SUCCESS ? COMMS_SEND_OK : COMMS_SEND_CONFIRM_ERROR;
+}
+
+void QuickEspNow::cancel () {
+    if (reservedMessage) {
+        reservedMessage = NULL;
+        reservedQueue = NULL;
+        xSemaphoreGive (txProducerMutex);
     }
 }
 
@@ -142,45 +688,161 @@ void QuickEspNow::onDataRcvd (comms_hal_rcvd_data dataRcvd) {
     this->dataRcvd = dataRcvd;
 }
 
-#ifdef MEAS_TPUT
-void QuickEspNow::calculateDataTP () {
-    time_t measTime = (millis () - lastDataTPMeas);
-    lastDataTPMeas = millis ();
+void QuickEspNow::onDataRcvdView (espnow_rx_view_cb_t dataRcvdView) {
+    this->dataRcvdView = dataRcvdView;
+}
 
-    if (txDataSent > 0) {
-        txDataTP = txDataSent * 1000 / measTime;
-        //DEBUG_WARN("Meas time: %d, Data sent: %d, Data TP: %f", measTime, txDataSent, txDataTP);
-        txDroppedDataRatio = (float)txDataDropped / (float)txDataSent;
-        //DEBUG_WARN("Data dropped: %d, Drop ratio: %f", txDataDropped, txDroppedDataRatio);
-        txDataSent = 0;
-    } else {
-        txDataTP = 0;
-        txDroppedDataRatio = 0;
+void QuickEspNow::keep (espnow_rx_message_t* message) {
+    message->state = ESPNOW_RX_BUFFER_KEPT;
+}
+
+void QuickEspNow::release (espnow_rx_message_t* message) {
+    message->state = ESPNOW_RX_BUFFER_FREE;
+    // Only rx task may free queue space
+    xTaskNotifyGive (espnowRxTask);
+}
+
+void QuickEspNow::enableAdaptiveQueues (size_t ramBudget) {
+    txTuner.reset ();
+    rxTuner.reset ();
+    queueRamBudget = ramBudget;
+}
+
+void QuickEspNow::enablePacing (uint32_t maxRate, uint32_t minRate) {
+    pacingMaxRate = maxRate;
+    pacingMinRate = minRate < maxRate ? minRate : maxRate;
+    txBucket.begin (maxRate, micros ());
+    broadcastBucket.begin (0, 0);
+}
+
+uint32_t QuickEspNow::getTxRate (const uint8_t* dstAddress) {
+    peer_t* peer;
+    uint32_t rate;
+
+    if (!dstAddress || !pacingMaxRate || !peerListMutex) {
+        return 0;
     }
-    if (rxDataReceived > 0) {
-        rxDataTP = rxDataReceived * 1000 / measTime;
-        //DEBUG_WARN("Meas time: %d, Data received: %d, Data TP: %f", measTime, rxDataReceived, rxDataTP);
-        rxDataReceived = 0;
+    if (!memcmp (dstAddress, ESPNOW_BROADCAST_ADDRESS, ESP_NOW_ETH_ALEN)) {
+        return broadcastBucket.getRate ();
+    }
+    // Tx task may move or reuse entries while looking for a peer
+    xSemaphoreTake (peerListMutex, portMAX_DELAY);
+    rate = (peer = peer_list.find_peer (dstAddress)) ? peer->txBucket.getRate () : 0;
+    xSemaphoreGive (peerListMutex);
+    return rate;
+}
+
+bool QuickEspNow::getLinkQuality (const uint8_t* address, espnow_link_quality_t& quality) {
+    peer_t* peer;
+    uint32_t elapsed;
+
+    if (!address || !peerListMutex) {
+        return false;
+    }
+    // Tx task may move or reuse entries while looking for a peer
+    xSemaphoreTake (peerListMutex, portMAX_DELAY);
+    if (!(peer = peer_list.find_peer (address))) {
+        xSemaphoreGive (peerListMutex);
+        return false;
+    }
+    quality.rssi = peer->rssiAvg / 16;
+    quality.txSuccess = (peer->txSuccessAvg + 128) / 256;
+    quality.txFrames = peer->txFrames;
+    quality.txFailures = peer->txFailures;
+    quality.txRetries = peer->txRetries;
+    quality.rxFrames = peer->rxFrames;
+    // Tx task only closes a period when a frame comes, so a peer that went quiet is measured here
+    elapsed = millis () - peer->rateStart;
+    if (elapsed >= ESPNOW_LINK_RATE_PERIOD_MS) {
+        quality.txRate = peer->txPeriodFrames * 1000UL / elapsed;
+        quality.rxRate = peer->rxPeriodFrames * 1000UL / elapsed;
     } else {
-        rxDataTP = 0;
+        quality.txRate = peer->txRate;
+        quality.rxRate = peer->rxRate;
     }
-    txDataDropped = 0;
+    xSemaphoreGive (peerListMutex);
+    return true;
 }
 
-void QuickEspNow::tp_timer_cb (void* param) {
-    quickEspNow.calculateDataTP ();
-    DEBUG_WARN (QESPNOW_TAG, "TxData TP: %.3f kbps, Drop Ratio: %.2f %%, RxDataTP: %.3f kbps",
-                quickEspNow.txDataTP * 8 / 1000,
-                quickEspNow.txDroppedDataRatio * 100,
-                quickEspNow.rxDataTP * 8 / 1000);
+bool QuickEspNow::resizeQueue (BipBuffer& queue, size_t bytes) {
+    size_t capacity = queue.capacity ();
+
+    // Growth is accounted before allocation so that both tasks together never exceed budget
+    if (bytes > capacity && queueRamBytes.fetch_add (bytes - capacity) + bytes - capacity > queueRamBudget) {
+        queueRamBytes.fetch_sub (bytes - capacity);
+        return false;
+    }
+    if (!queue.setCapacity (bytes)) {
+        DEBUG_WARN (QESPNOW_TAG, "Not enough memory to resize queue to %u bytes", bytes);
+        if (bytes > capacity) {
+            queueRamBytes.fetch_sub (bytes - capacity);
+        }
+        return false;
+    }
+    if (bytes < capacity) {
+        queueRamBytes.fetch_sub (capacity - bytes);
+    }
+    return true;
 }
 
-#endif // MEAS_TPUT
+void QuickEspNow::tuneTxQueue () {
+    size_t capacity = tx_queue.capacity ();
+    size_t others = queueRamBytes - capacity;
+    size_t bytes;
+
+    // Period is extended until queue gets empty, so that decision is not lost
+    if (!tx_queue.empty ()) {
+        return;
+    }
+    bytes = txTuner.evaluate (capacity, 2 * ESPNOW_TX_RECORD_LEN, queueRamBudget > others ? queueRamBudget - others : 0);
+    // Holding producer mutex while queue is empty guarantees that nobody is using it
+    if (bytes == capacity || !xSemaphoreTake (txProducerMutex, 0)) {
+        return;
+    }
+    if (tx_queue.empty () && resizeQueue (tx_queue, bytes)) {
+        resetFlows (txClasses[ESPNOW_PRIORITY_NORMAL]);
+        DEBUG_INFO (QESPNOW_TAG, "TX queue resized from %u to %u bytes", capacity, bytes);
+    }
+    xSemaphoreGive (txProducerMutex);
+}
+
+void QuickEspNow::tuneRxQueue () {
+    size_t capacity = rx_queue.capacity ();
+    size_t others = queueRamBytes - capacity;
+    size_t bytes;
+
+    // Kept messages block resizing too. Period is extended until queue gets empty
+    if (!rx_queue.empty ()) {
+        return;
+    }
+    bytes = rxTuner.evaluate (capacity, 2 * ESPNOW_RX_RECORD_LEN, queueRamBudget > others ? queueRamBudget - others : 0);
+    if (bytes == capacity) {
+        return;
+    }
+    // rx_cb cannot be blocked, so it drops messages until queue has been replaced
+    rxQueuePaused = true;
+    while (rxCbRunning) {
+        taskYIELD ();
+    }
+    if (rx_queue.empty () && resizeQueue (rx_queue, bytes)) {
+        rxDispatchPosition = 0;
+        DEBUG_INFO (QESPNOW_TAG, "RX queue resized from %u to %u bytes", capacity, bytes);
+    }
+    rxQueuePaused = false;
+}
+
+void QuickEspNow::onLatencySample (espnow_latency_probe_t latencyProbe) {
+    this->latencyProbe = latencyProbe;
+}
 
 void QuickEspNow::onDataSent (comms_hal_sent_data sentResult) {
     this->sentResult = sentResult;
 }
 
+void QuickEspNow::onSendComplete (espnow_send_complete_cb_t sendComplete) {
+    this->sendComplete = sendComplete;
+}
+
 int32_t QuickEspNow::sendEspNowMessage (comms_tx_queue_item_t* message) {
     int32_t error;
 
@@ -195,47 +857,468 @@ int32_t QuickEspNow::sendEspNowMessage (comms_tx_queue_item_t* message) {
 
     DEBUG_VERBOSE (QESPNOW_TAG, "ESP-NOW message to " MACSTR, MAC2STR (message->dstAddress));
 
-
-    addPeer (message->dstAddress);
-    DEBUG_DBG (QESPNOW_TAG, "Peer added " MACSTR, MAC2STR (message->dstAddress));
-    readyToSend = false;
-    DEBUG_VERBOSE (QESPNOW_TAG, "-------------- Ready to send: false");
-
-    error = esp_now_send (message->dstAddress, message->payload, message->payload_len);
+    // Broadcast peer is registered on begin and follows radio channel, so broadcast frames need no peer work
+    bool broadcast = !memcmp (message->dstAddress, ESPNOW_BROADCAST_ADDRESS, ESP_NOW_ETH_ALEN);
+    if (!broadcast) {
+        addPeer (message->dstAddress);
+        DEBUG_DBG (QESPNOW_TAG, "Peer added " MACSTR, MAC2STR (message->dstAddress));
+    }
+    // tx_cb may come before driver returns
+    xSemaphoreTake (inflightMutex, portMAX_DELAY);
+    memcpy (inflightDstAddress, message->dstAddress, ESP_NOW_ETH_ALEN);
+    inflightEnqueueTime = message->enqueue_time;
+    inflight = true;
+    xSemaphoreGive (inflightMutex);
+
+    error = driver->send (message->dstAddress, message->payload, message->payload_len);
+    if (broadcast) {
+        if (error == ESP_ERR_ESPNOW_NOT_FOUND) {
+            DEBUG_WARN (QESPNOW_TAG, "Broadcast peer lost. Adding again");
+            addBroadcastPeer ();
+            error = driver->send (message->dstAddress, message->payload, message->payload_len);
+        }
+#ifdef ESP_ERR_ESPNOW_CHAN
+    } else if (error == ESP_ERR_ESPNOW_NOT_FOUND || error == ESP_ERR_ESPNOW_CHAN) {
+#else
+    } else if (error == ESP_ERR_ESPNOW_NOT_FOUND) {
+#endif
+        // Cached peer state is stale. Peer was removed from driver or radio changed channel behind our back
+        DEBUG_WARN (QESPNOW_TAG, "Peer " MACSTR " state is stale: %s", MAC2STR (message->dstAddress), esp_err_to_name (error));
+        if (peer_t* entry = peer_list.get_peer (message->dstAddress)) {
+            entry->channel = 0;
+        }
+        wifiChannelChanged = true;
+        addPeer (message->dstAddress);
+        error = driver->send (message->dstAddress, message->payload, message->payload_len);
+    }
     DEBUG_DBG (QESPNOW_TAG, "esp now send result = %s", esp_err_to_name (error));
     if (error != ESP_OK) {
         DEBUG_WARN (QESPNOW_TAG, "Error sending message: %s", esp_err_to_name (error));
+        clearInflight ();
+    }
+    if (error == ESP_OK) {
+        stats.txFrames.fetch_add (1, std::memory_order_relaxed);
+        stats.txBytes.fetch_add (message->payload_len, std::memory_order_relaxed);
+    } else {
+        recordDriverError (error);
     }
-    // if (error == ESP_OK) {
-    //     txDataSent += message->payload_len;
-    // }
-    if (error == ESP_ERR_ESPNOW_NO_MEM) {
+    if (error == ESP_ERR_ESPNOW_NO_MEM && !pacingMaxRate) {
         delay (2);
     }
 
     return error;
 }
 
+bool QuickEspNow::clearInflight () {
+    bool waiting;
+
+    xSemaphoreTake (inflightMutex, portMAX_DELAY);
+    waiting = inflight;
+    inflight = false;
+    xSemaphoreGive (inflightMutex);
+    if (!waiting) {
+        // tx_cb took message first and has already given its confirmation
+        xSemaphoreTake (txConfirmed, 0);
+    }
+    return waiting;
+}
+
+void QuickEspNow::completeMessage (comms_tx_queue_item_t* message) {
+    uint8_t slot = message->tracking;
+
+    // Callback is called first, while handle is still valid
+    if (sendComplete) {
+        sendComplete (sendTracker.handle (slot), message->dstAddress, sentStatus, sendTracker.context (slot));
+    }
+    if (sendTracker.complete (slot, sentStatus)) {
+        xEventGroupSetBits (sendDone, 1 << slot);
+    }
+}
+
+void QuickEspNow::resetFlows (espnow_tx_class_t& txClass) {
+    // Messages left in queue are scheduled again
+    txClass.scheduledPosition = txClass.queue->readPosition ();
+    txClass.activeFlows = 0;
+    txClass.cursor = 0;
+    txClass.skipped = 0;
+    for (int i = 0; i < ESPNOW_TX_FLOWS; i++) {
+        txClass.flows[i].messages = 0;
+    }
+}
+
+void QuickEspNow::scheduleMessages (espnow_tx_class_t& txClass) {
+    comms_tx_queue_item_t* message;
+
+    while ((message = (comms_tx_queue_item_t*)txClass.queue->read (txClass.scheduledPosition))) {
+        espnow_tx_flow_t* flow = NULL;
+        for (int i = 0; i < ESPNOW_TX_FLOWS; i++) {
+            if (txClass.flows[i].messages && !memcmp (txClass.flows[i].dstAddress, message->dstAddress, ESP_NOW_ETH_ALEN)) {
+                flow = &txClass.flows[i];
+                break;
+            }
+            if (!flow && !txClass.flows[i].messages) {
+                flow = &txClass.flows[i];
+            }
+        }
+        if (!flow) {
+            // Every flow is busy. Message waits until one of them is drained
+            return;
+        }
+        message->sent = false;
+        if (flow->messages) {
+            ((comms_tx_queue_item_t*)txClass.queue->at (flow->last))->next = txClass.scheduledPosition;
+        } else {
+            peer_t* peer = peer_list.find_peer (message->dstAddress);
+            uint8_t failures = peer ? peer->tx_failures : 0;
+            memcpy (flow->dstAddress, message->dstAddress, ESP_NOW_ETH_ALEN);
+            flow->penalty = failures < ESPNOW_TX_MAX_PENALTY ? failures : ESPNOW_TX_MAX_PENALTY;
+            flow->deficit = 0;
+            flow->first = txClass.scheduledPosition;
+            txClass.activeFlows++;
+        }
+        flow->last = txClass.scheduledPosition;
+        flow->messages++;
+        txClass.scheduledPosition = txClass.queue->next (txClass.scheduledPosition);
+    }
+}
+
+TokenBucketClass* QuickEspNow::destinationBucket (const uint8_t* dstAddress, uint32_t now) {
+    TokenBucketClass* bucket;
+    peer_t* peer;
+
+    if (!memcmp (dstAddress, ESPNOW_BROADCAST_ADDRESS, ESP_NOW_ETH_ALEN)) {
+        bucket = &broadcastBucket;
+    } else if ((peer = peer_list.find_peer (dstAddress))) {
+        bucket = &peer->txBucket;
+    } else {
+        // Peer is created by its first frame
+        return NULL;
+    }
+    if (!bucket->getRate ()) {
+        bucket->begin (pacingMaxRate, now);
+    }
+    return bucket;
+}
+
+espnow_tx_class_t* QuickEspNow::nextClass (espnow_tx_flow_t*& flow) {
+    espnow_tx_class_t* selected = NULL;
+    espnow_tx_class_t* candidates[ESPNOW_PRIORITY_CLASSES + 1];
+    uint32_t now = micros ();
+    int count = 0;
+
+    for (int i = 0; i < ESPNOW_PRIORITY_CLASSES; i++) {
+        scheduleMessages (txClasses[i]);
+    }
+    txPacingWait = 0;
+    if (pacingMaxRate && (txPacingWait = txBucket.wait (now))) {
+        return NULL;
+    }
+    // Strict priority. A class that has been passed over too many times goes first, so that it is never starved
+    for (int i = ESPNOW_PRIORITY_CLASSES - 1; i >= 0 && !count; i--) {
+        if (txClasses[i].activeFlows && txClasses[i].skipped >= ESPNOW_TX_STARVATION_LIMIT) {
+            candidates[count++] = &txClasses[i];
+        }
+    }
+    for (int i = 0; i < ESPNOW_PRIORITY_CLASSES; i++) {
+        if (txClasses[i].activeFlows) {
+            candidates[count++] = &txClasses[i];
+        }
+    }
+    // A class whose destinations are all paced lets next one send
+    for (int i = 0; i < count && !selected; i++) {
+        if ((flow = nextFlow (*candidates[i], now))) {
+            selected = candidates[i];
+        }
+    }
+    if (!selected) {
+        return NULL;
+    }
+    txPacingWait = 0;
+    // A class held back by pacing is not being starved, so it is only passed over if it could have sent
+    for (int i = 0; i < ESPNOW_PRIORITY_CLASSES; i++) {
+        if (&txClasses[i] == selected) {
+            txClasses[i].skipped = 0;
+        } else if (txClasses[i].skipped < UINT8_MAX && classReady (txClasses[i], now)) {
+            txClasses[i].skipped++;
+        }
+    }
+    return selected;
+}
+
+uint32_t QuickEspNow::flowWait (espnow_tx_flow_t& flow, uint32_t now) {
+    TokenBucketClass* bucket;
+
+    if (!pacingMaxRate) {
+        return 0;
+    }
+    bucket = destinationBucket (flow.dstAddress, now);
+    return bucket ? bucket->wait (now) : 0;
+}
+
+bool QuickEspNow::classReady (espnow_tx_class_t& txClass, uint32_t now) {
+    if (!txClass.activeFlows) {
+        return false;
+    }
+    for (int i = 0; i < ESPNOW_TX_FLOWS; i++) {
+        if (txClass.flows[i].messages && !flowWait (txClass.flows[i], now)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+espnow_tx_flow_t* QuickEspNow::nextFlow (espnow_tx_class_t& txClass, uint32_t now) {
+    bool ready[ESPNOW_TX_FLOWS];
+    bool anyReady = false;
+
+    for (int i = 0; i < ESPNOW_TX_FLOWS; i++) {
+        ready[i] = txClass.flows[i].messages > 0;
+        if (ready[i]) {
+            uint32_t wait = flowWait (txClass.flows[i], now);
+            if (wait) {
+                ready[i] = false;
+                if (!txPacingWait || wait < txPacingWait) {
+                    txPacingWait = wait;
+                }
+            }
+        }
+        anyReady = anyReady || ready[i];
+    }
+    if (!anyReady) {
+        return NULL;
+    }
+    // Every flow gets its quantum when its turn comes and keeps it while it has messages. It always ends, as
+    // deficit of every ready flow grows on each round
+    for (;;) {
+        espnow_tx_flow_t* flow = &txClass.flows[txClass.cursor];
+        if (ready[txClass.cursor] && ((comms_tx_queue_item_t*)txClass.queue->at (flow->first))->payload_len <= flow->deficit) {
+            return flow;
+        }
+        txClass.cursor = (txClass.cursor + 1) % ESPNOW_TX_FLOWS;
+        flow = &txClass.flows[txClass.cursor];
+        if (ready[txClass.cursor]) {
+            flow->deficit += ESPNOW_TX_QUANTUM >> flow->penalty;
+        }
+    }
+}
+
+void QuickEspNow::adaptRate (const uint8_t* dstAddress, bool success, bool firstFailure) {
+    TokenBucketClass* bucket = destinationBucket (dstAddress, micros ());
+
+    if (success) {
+        txBucket.increase (pacingMaxRate);
+        if (bucket) {
+            bucket->increase (pacingMaxRate);
+        }
+        return;
+    }
+    if (bucket) {
+        bucket->decrease (pacingMinRate, 4);
+    }
+    // A destination that keeps failing is likely gone. Only a failure after a success hints at a busy channel
+    if (firstFailure) {
+        txBucket.decrease (pacingMinRate, 6);
+    }
+}
+
+void QuickEspNow::updateLinkRates (peer_t* peer, uint32_t now) {
+    uint32_t elapsed = now - peer->rateStart;
+
+    if (elapsed >= ESPNOW_LINK_RATE_PERIOD_MS) {
+        peer->txRate = peer->txPeriodFrames * 1000UL / elapsed;
+        peer->rxRate = peer->rxPeriodFrames * 1000UL / elapsed;
+        peer->txPeriodFrames = 0;
+        peer->rxPeriodFrames = 0;
+        peer->rateStart = now;
+    }
+}
+
+void QuickEspNow::recordLinkTx (peer_t* peer, bool success) {
+    xSemaphoreTake (peerListMutex, portMAX_DELAY);
+    updateLinkRates (peer, millis ());
+    peer->txFrames++;
+    peer->txPeriodFrames++;
+    if (!success) {
+        peer->txFailures++;
+    }
+    peer->txSuccessAvg += ((success ? 100 * 256 : 0) - (int32_t)peer->txSuccessAvg) >> ESPNOW_LINK_EWMA_SHIFT;
+    xSemaphoreGive (peerListMutex);
+}
+
+void QuickEspNow::recordLinkSamples () {
+    espnow_link_sample_t sample;
+
+    if (linkSamples.empty ()) {
+        return;
+    }
+    xSemaphoreTake (peerListMutex, portMAX_DELAY);
+    while (linkSamples.try_pop (sample)) {
+        peer_t* peer = peer_list.track_peer (sample.mac);
+        updateLinkRates (peer, millis ());
+        // First sample sets average, so that it does not start from 0 dBm
+        peer->rssiAvg = peer->rxFrames ? peer->rssiAvg + ((sample.rssi * 16 - peer->rssiAvg) >> ESPNOW_LINK_EWMA_SHIFT) : sample.rssi * 16;
+        peer->rxFrames++;
+        peer->rxPeriodFrames++;
+    }
+    xSemaphoreGive (peerListMutex);
+}
+
+void QuickEspNow::releaseSentMessages (espnow_tx_class_t& txClass) {
+    comms_tx_queue_item_t* message;
+    size_t position = txClass.queue->readPosition ();
+
+    // Space is freed in order. A message that is still waiting holds space of those after it
+    while (position != txClass.scheduledPosition && (message = (comms_tx_queue_item_t*)txClass.queue->read (position)) && message->sent) {
+        position = txClass.queue->next (position);
+    }
+    if (position != txClass.queue->readPosition ()) {
+        txClass.queue->release (position);
+        xEventGroupSetBits (queueSpace, 1 << (&txClass - txClasses));
+    }
+}
+
+bool QuickEspNow::dropOldestMessage (espnow_tx_class_t& txClass) {
+    size_t position = txClass.queue->readPosition ();
+    comms_tx_queue_item_t* message = (comms_tx_queue_item_t*)txClass.queue->read (position);
+    espnow_tx_flow_t* flow;
+
+    if (!message) {
+        return false;
+    }
+    // Messages before it are released, so it is either first of its flow or not scheduled yet
+    for (flow = txClass.flows; flow < txClass.flows + ESPNOW_TX_FLOWS; flow++) {
+        if (flow->messages && flow->first == position) {
+            flow->first = message->next;
+            if (!--flow->messages) {
+                txClass.activeFlows--;
+            }
+            break;
+        }
+    }
+    if (flow == txClass.flows + ESPNOW_TX_FLOWS) {
+        txClass.scheduledPosition = txClass.queue->next (position);
+    }
+    DEBUG_DBG (QESPNOW_TAG, "Message to " MACSTR " dropped to make room", MAC2STR (message->dstAddress));
+    stats.drops[&txClass - txClasses][ESPNOW_DROP_OLDEST]++;
+    trace.record (ESPNOW_TRACE_DEQUEUE, message->dstAddress, message->enqueue_time, message->payload_len, ESPNOW_DROP_OLDEST + 1, &txClass - txClasses);
+    if (message->tracking != ESPNOW_UNTRACKED) {
+        sentStatus = ESP_NOW_SEND_FAIL;
+        completeMessage (message);
+    }
+    message->sent = true;
+    releaseSentMessages (txClass);
+    return true;
+}
+
+void QuickEspNow::dropOldestMessages () {
+    for (int i = 0; i < ESPNOW_PRIORITY_CLASSES; i++) {
+        size_t len = roomRequest[i].exchange (0);
+        if (len) {
+            while (!txClasses[i].queue->fits (len) && dropOldestMessage (txClasses[i])) {
+            }
+        }
+    }
+}
+
 void QuickEspNow::espnowTxHandle () {
-    if (readyToSend) {
-    //DEBUG_WARN ("Process queue: Elements: %d", tx_queue.size ());
-        comms_tx_queue_item_t message;
-        while (xQueueReceive (tx_queue, &message, pdMS_TO_TICKS (1000))) {
-            DEBUG_DBG (QESPNOW_TAG, "Comms message got from queue. %d left", uxQueueMessagesWaiting (tx_queue));
-            while (!readyToSend && !synchronousSend) {
-                delay (0);
+    comms_tx_queue_item_t* message;
+    espnow_tx_class_t* txClass;
+    espnow_tx_flow_t* flow;
+    peer_t* peer;
+    TickType_t wait;
+    int32_t error;
+    bool firstFailure;
+
+    // Task always blocks here, waiting for producers to commit a message or for pacing to let next frame go
+    if (txPacingWait) {
+        wait = pdMS_TO_TICKS ((txPacingWait + 999) / 1000);
+        wait = wait ? wait : 1;
+    } else {
+        wait = pdMS_TO_TICKS (queueRamBudget ? ESPNOW_QUEUE_TUNE_PERIOD_MS : 1000);
+    }
+    ulTaskNotifyTake (pdTRUE, wait);
+    dropOldestMessages ();
+    recordLinkSamples ();
+    // Message is sent from queue storage. Slot is not reused by producers until it is released
+    while ((txClass = nextClass (flow))) {
+        message = (comms_tx_queue_item_t*)txClass->queue->at (flow->first);
+        DEBUG_DBG (QESPNOW_TAG, "Comms message got from queue. %d bytes in queue", txClass->queue->bytesUsed ());
+        if (txClass->maxAge_ms && (micros () - message->enqueue_time) / 1000 > txClass->maxAge_ms) {
+            // Stale message is not worth air time. It does not count against its destination
+            DEBUG_DBG (QESPNOW_TAG, "Message to " MACSTR " expired", MAC2STR (message->dstAddress));
+            stats.drops[txClass - txClasses][ESPNOW_DROP_EXPIRED]++;
+            trace.record (ESPNOW_TRACE_DEQUEUE, message->dstAddress, message->enqueue_time, message->payload_len, ESPNOW_DROP_EXPIRED + 1, txClass - txClasses);
+            sentStatus = ESP_NOW_SEND_FAIL;
+        } else {
+            trace.record (ESPNOW_TRACE_DEQUEUE, message->dstAddress, message->enqueue_time, message->payload_len, 0, txClass - txClasses);
+            if (pacingMaxRate) {
+                uint32_t now = micros ();
+                TokenBucketClass* bucket = destinationBucket (message->dstAddress, now);
+                txBucket.take (now);
+                if (bucket) {
+                    bucket->take (now);
+                }
             }
-            if (!sendEspNowMessage (&message)) {
-                DEBUG_DBG (QESPNOW_TAG, "Message to " MACSTR " sent. Len: %u", MAC2STR (message.dstAddress), message.payload_len);
+            error = sendEspNowMessage (message);
+            trace.record (ESPNOW_TRACE_SEND, message->dstAddress, message->enqueue_time, message->payload_len, error ? driverErrorKind (error) + 1 : 0, txClass - txClasses);
+            if (!error) {
+                DEBUG_DBG (QESPNOW_TAG, "Message to " MACSTR " sent. Len: %u", MAC2STR (message->dstAddress), message->payload_len);
+                // Next message is not sent until this one is confirmed
+                // A confirmation that comes right at timeout is still taken
+                if (xSemaphoreTake (txConfirmed, pdMS_TO_TICKS (ESPNOW_TX_CONFIRM_TIMEOUT_MS)) || !clearInflight ()) {
+                    sentStatus = confirmedStatus;
+                } else {
+                    DEBUG_WARN (QESPNOW_TAG, "Confirmation timeout for message to " MACSTR, MAC2STR (message->dstAddress));
+                    stats.txTimeouts.fetch_add (1, std::memory_order_relaxed);
+                    sentStatus = ESP_NOW_SEND_FAIL;
+                }
+            } else if (error == ESP_ERR_ESPNOW_NO_MEM && pacingMaxRate) {
+                // Driver cannot keep up with our rate. Frame stays first in its flow and waits for next token
+                txBucket.decrease (pacingMinRate, 4);
+                if ((peer = peer_list.find_peer (message->dstAddress))) {
+                    peer->txRetries++;
+                }
+                DEBUG_DBG (QESPNOW_TAG, "Driver out of memory. Global rate cut to %u", txBucket.getRate ());
+                continue;
             } else {
-                DEBUG_WARN (QESPNOW_TAG, "Error sending message to " MACSTR ". Len: %u", MAC2STR (message.dstAddress), message.payload_len);
+                DEBUG_WARN (QESPNOW_TAG, "Error sending message to " MACSTR ". Len: %u", MAC2STR (message->dstAddress), message->payload_len);
+                // There will be no confirmation for this message
+                sentStatus = ESP_NOW_SEND_FAIL;
+            }
+            // A failure ends the turn of its destination, and its share is cut while it keeps failing
+            flow->deficit -= message->payload_len;
+            firstFailure = true;
+            if ((peer = peer_list.find_peer (message->dstAddress))) {
+                firstFailure = !peer->tx_failures;
+                peer->tx_failures = sentStatus == ESP_NOW_SEND_SUCCESS ? 0 : (peer->tx_failures < UINT8_MAX ? peer->tx_failures + 1 : UINT8_MAX);
+                flow->penalty = peer->tx_failures < ESPNOW_TX_MAX_PENALTY ? peer->tx_failures : ESPNOW_TX_MAX_PENALTY;
+                recordLinkTx (peer, sentStatus == ESP_NOW_SEND_SUCCESS);
             }
-        //message.payload_len = 0;
-            DEBUG_DBG (QESPNOW_TAG, "Comms message pop. Queue size %d", uxQueueMessagesWaiting (tx_queue));
+            if (sentStatus != ESP_NOW_SEND_SUCCESS) {
+                flow->deficit = 0;
+            }
+            if (pacingMaxRate) {
+                adaptRate (message->dstAddress, sentStatus == ESP_NOW_SEND_SUCCESS, firstFailure);
+            }
+        }
+        if (message->tracking != ESPNOW_UNTRACKED) {
+            completeMessage (message);
         }
 
-    } else {
-        DEBUG_DBG (QESPNOW_TAG, "Not ready to send");
+        flow->first = message->next;
+        if (!--flow->messages) {
+            txClass->activeFlows--;
+        }
+        message->sent = true;
+        releaseSentMessages (*txClass);
+        checkWatermarks ((espnow_queue_id_t)(txClass - txClasses), *txClass->queue);
+        DEBUG_DBG (QESPNOW_TAG, "Comms message done. %d bytes in queue", txClass->queue->bytesUsed ());
+        // Producers of queues that drop oldest messages should not wait for whole queue to be sent
+        dropOldestMessages ();
+        recordLinkSamples ();
+    }
+    if (queueRamBudget && txTuner.periodElapsed ()) {
+        tuneTxQueue ();
     }
 }
 
@@ -253,23 +1336,29 @@ void QuickEspNow::enableTransmit (bool enable) {
 bool QuickEspNow::addPeer (const uint8_t* peer_addr) {
     esp_now_peer_info_t peer;
     esp_err_t error = ESP_OK;
+    peer_t* entry;
 
-    if (peer_list.get_peer_number () >= ESP_NOW_MAX_TOTAL_PEER_NUM) {
-        DEBUG_VERBOSE (QESPNOW_TAG, "Peer list full. Deleting older");
-        if (uint8_t* deleted_mac = peer_list.delete_peer ()) {
-            esp_now_del_peer (deleted_mac);
-        } else {
-            DEBUG_ERROR (QESPNOW_TAG, "Error deleting peer");
-            return false;
-        }
+    if (followWiFiChannel && wifiChannelChanged.exchange (false)) {
+        uint8_t ch;
+        wifi_second_chan_t secondCh;
+        driver->getChannel (&ch, &secondCh);
+        DEBUG_DBG (QESPNOW_TAG, "WiFi channel is %d", ch);
+        this->channel = ch;
     }
 
     if (peer_list.peer_exists (peer_addr)) {
         DEBUG_VERBOSE (QESPNOW_TAG, "Peer already exists");
+        entry = peer_list.get_peer (peer_addr);
+        // Driver is only asked again if channel or interface have changed since peer was registered
+        if (entry->channel == this->channel && entry->ifidx == wifi_if) {
+            return true;
+        }
 
-        error = esp_now_get_peer (peer_addr, &peer);
+        error = driver->getPeer (peer_addr, &peer);
         if (error == ESP_ERR_ESPNOW_NOT_FOUND) {
+          xSemaphoreTake (peerListMutex, portMAX_DELAY);
           peer_list.delete_peer (peer_addr);
+          xSemaphoreGive (peerListMutex);
           DEBUG_ERROR (QESPNOW_TAG, "Peer not found. Adding again");
           return addPeer(peer_addr);
         } else if (error != ESP_OK) {
@@ -278,172 +1367,469 @@ bool QuickEspNow::addPeer (const uint8_t* peer_addr) {
 
         uint8_t currentChannel = peer.channel;
         DEBUG_DBG (QESPNOW_TAG, "Peer " MACSTR " is using channel %d", MAC2STR (peer_addr), currentChannel);
-        if (currentChannel != this->channel) {
+        if (currentChannel != this->channel || peer.ifidx != wifi_if) {
             DEBUG_DBG (QESPNOW_TAG, "Peer channel has to change from %d to %d", currentChannel, this->channel);
-            ESP_ERROR_CHECK_WITHOUT_ABORT (esp_now_get_peer (peer_addr, &peer));
             peer.channel = this->channel;
-            ESP_ERROR_CHECK_WITHOUT_ABORT (esp_now_mod_peer (&peer));
+            peer.ifidx = wifi_if;
+            if (ESP_ERROR_CHECK_WITHOUT_ABORT (driver->modPeer (&peer)) != ESP_OK) {
+                return true;
+            }
             DEBUG_ERROR (QESPNOW_TAG, "Peer channel changed to %d", this->channel);
         }
+        entry->channel = peer.channel;
+        entry->ifidx = peer.ifidx;
         return true;
     }
 
+    // Only new peers need room. Known ones must not evict others on every message
+    if (peer_list.get_peer_number () >= ESPNOW_MAX_UNICAST_PEERS) {
+        DEBUG_VERBOSE (QESPNOW_TAG, "Peer list full. Deleting older");
+        xSemaphoreTake (peerListMutex, portMAX_DELAY);
+        uint8_t* deleted_mac = peer_list.delete_peer ();
+        xSemaphoreGive (peerListMutex);
+        if (deleted_mac) {
+            driver->delPeer (deleted_mac);
+            stats.peersEvicted.fetch_add (1, std::memory_order_relaxed);
+        } else {
+            DEBUG_ERROR (QESPNOW_TAG, "Error deleting peer");
+            return false;
+        }
+    }
+
+    memset (&peer, 0, sizeof (peer));
     memcpy (peer.peer_addr, peer_addr, ESP_NOW_ETH_ALEN);
-    uint8_t ch;
-    wifi_second_chan_t secondCh;
-    esp_wifi_get_channel (&ch, &secondCh);
-    peer.channel = ch;
+    peer.channel = this->channel;
     peer.ifidx = wifi_if;
     peer.encrypt = false;
-    error = esp_now_add_peer (&peer);
+    error = driver->addPeer (&peer);
     if (!error) {
         DEBUG_DBG (QESPNOW_TAG, "Peer added");
+        stats.peersAdded.fetch_add (1, std::memory_order_relaxed);
+        xSemaphoreTake (peerListMutex, portMAX_DELAY);
         peer_list.add_peer (peer_addr);
+        entry = peer_list.get_peer (peer_addr);
+        entry->channel = peer.channel;
+        entry->ifidx = peer.ifidx;
+        xSemaphoreGive (peerListMutex);
     } else {
         DEBUG_ERROR (QESPNOW_TAG, "Error adding peer: %s", esp_err_to_name (error));
         return false;
     }
-    DEBUG_DBG (QESPNOW_TAG, "Peer " MACSTR " added on channel %u. Result 0x%X %s", MAC2STR (peer_addr), ch, error, esp_err_to_name (error));
+    DEBUG_DBG (QESPNOW_TAG, "Peer " MACSTR " added on channel %u. Result 0x%X %s", MAC2STR (peer_addr), peer.channel, error, esp_err_to_name (error));
     return error == ESP_OK;
 }
 
+bool QuickEspNow::addBroadcastPeer () {
+    esp_now_peer_info_t peer;
+    esp_err_t error;
+
+    // Channel 0 is the one radio is using, so this peer never has to be checked again
+    memset (&peer, 0, sizeof (peer));
+    memcpy (peer.peer_addr, ESPNOW_BROADCAST_ADDRESS, ESP_NOW_ETH_ALEN);
+    peer.channel = 0;
+    peer.ifidx = wifi_if;
+    peer.encrypt = false;
+    error = driver->addPeer (&peer);
+    if (error == ESP_ERR_ESPNOW_EXIST) {
+        error = driver->modPeer (&peer);
+    }
+    if (error != ESP_OK) {
+        DEBUG_ERROR (QESPNOW_TAG, "Error adding broadcast peer: %s", esp_err_to_name (error));
+        return false;
+    }
+    return true;
+}
+
 void QuickEspNow::initComms () {
-    if (esp_now_init ()) {
+    if (driver->init ()) {
         DEBUG_ERROR (QESPNOW_TAG, "Failed to init ESP-NOW");
+#ifdef ESP32
         ESP.restart ();
         delay (1);
+#else
+        return;
+#endif // ESP32
     }
 
-    esp_now_register_recv_cb (reinterpret_cast<esp_now_recv_cb_t>(rx_cb));
-    esp_now_register_send_cb (reinterpret_cast<esp_now_send_cb_t>(tx_cb));
+    addBroadcastPeer ();
 
-    int txQueueSize = queueSize;
-    if (synchronousSend) {
-        txQueueSize = 1;
+    if (!txProducerMutex) {
+        txProducerMutex = xSemaphoreCreateMutex ();
+        peerListMutex = xSemaphoreCreateMutex ();
+        inflightMutex = xSemaphoreCreateMutex ();
+        txConfirmed = xSemaphoreCreateBinary ();
+        sendDone = xEventGroupCreate ();
+        queueSpace = xEventGroupCreate ();
     }
-    
-    tx_queue = xQueueCreate (txQueueSize, sizeof (comms_tx_queue_item_t));
-    xTaskCreateUniversal (espnowTxTask_cb, "espnow_loop", 8 * 1024, NULL, 1, &espnowTxTask, CONFIG_ARDUINO_RUNNING_CORE);
+    xTaskCreateUniversal (espnowTxTask_cb, "espnow_loop", 8 * 1024, this, 1, &espnowTxTask, CONFIG_ARDUINO_RUNNING_CORE);
 
-    rx_queue = xQueueCreate (queueSize, sizeof (comms_rx_queue_item_t));
-    xTaskCreateUniversal (espnowRxTask_cb, "receive_handle", 4 * 1024, NULL, 1, &espnowRxTask, CONFIG_ARDUINO_RUNNING_CORE);
+    xTaskCreateUniversal (espnowRxTask_cb, "receive_handle", 4 * 1024, this, 1, &espnowRxTask, CONFIG_ARDUINO_RUNNING_CORE);
 
-#ifdef MEAS_TPUT
-    dataTPTimer = xTimerCreate ("espnow_tp_timer", pdMS_TO_TICKS (MEAS_TP_EVERY_MS), pdTRUE, NULL, tp_timer_cb);
-    xTimerStart (dataTPTimer, 0);
-#endif // MEAS_TPUT
+    // Callbacks are enabled once tasks exist, as rx_cb notifies rx task
+    driver->registerCallbacks (rx_cb, tx_cb, this);
+#ifdef ESP32
+    if (followWiFiChannel) {
+        wifiChannelChanged = false;
+        esp_event_handler_register (WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, wifiEvent_cb, this);
+        esp_event_handler_register (WIFI_EVENT, WIFI_EVENT_AP_START, wifiEvent_cb, this);
+    }
+#endif // ESP32
 }
 
+#ifdef ESP32
+void QuickEspNow::wifiEvent_cb (void* arg, esp_event_base_t base, int32_t id, void* data) {
+    // Channel is read again by tx task before next peer check, so that event task is not blocked
+    ((QuickEspNow*)arg)->wifiChannelChanged = true;
+}
+#endif // ESP32
+
 void QuickEspNow::espnowTxTask_cb (void* param) {
+    QuickEspNow* espnow = (QuickEspNow*)param;
     for (;;) {
-        quickEspNow.espnowTxHandle ();
+        espnow->espnowTxHandle ();
     }
 
 }
 
 void QuickEspNow::espnowRxHandle () {
-    comms_rx_queue_item_t rxMessage;
-
-    if (xQueueReceive (rx_queue, &rxMessage, portMAX_DELAY)) {
-        DEBUG_DBG (QESPNOW_TAG, "Comms message got from queue. %d left", uxQueueMessagesWaiting (rx_queue));
-        DEBUG_VERBOSE (QESPNOW_TAG, "Received message from " MACSTR " Len: %u", MAC2STR (rxMessage.srcAddress), rxMessage.payload_len);
-        DEBUG_VERBOSE (QESPNOW_TAG, "Message: %.*s", rxMessage.payload_len, rxMessage.payload);
+    comms_rx_queue_item_t* rxMessage;
+    size_t position;
+    size_t following;
+
+    // Adaptive queues need a periodic wake up to be evaluated
+    ulTaskNotifyTake (pdTRUE, queueRamBudget ? pdMS_TO_TICKS (ESPNOW_QUEUE_TUNE_PERIOD_MS) : portMAX_DELAY);
+    // rx_cb runs in WiFi task, so its watermark events are reported from here
+    checkWatermarks (ESPNOW_QUEUE_RX, rx_queue, rxOverflow.exchange (false));
+    // Messages are processed in place. Their space is not reused by rx_cb until it is released
+    while ((rxMessage = (comms_rx_queue_item_t*)rx_queue.read (rxDispatchPosition))) {
+        // When user callback falls behind, stale messages are skipped so that rx_cb always has room for newest one.
+        // Free space of two records is enough for one, wherever queue wraps around
+        following = rx_queue.next (rxDispatchPosition);
+        if (overflow[ESPNOW_QUEUE_RX].policy == ESPNOW_OVERFLOW_DROP_OLDEST && rx_queue.read (following)
+            && rx_queue.capacity () - rx_queue.bytesUsed () < 2 * ESPNOW_RX_RECORD_LEN) {
+            DEBUG_DBG (QESPNOW_TAG, "Message from " MACSTR " dropped to make room", MAC2STR (rxMessage->srcAddress));
+            stats.drops[ESPNOW_QUEUE_RX][ESPNOW_DROP_OLDEST]++;
+            trace.record (ESPNOW_TRACE_DISPATCH, rxMessage->srcAddress, rxMessage->rx_time, rxMessage->payload_len, ESPNOW_DROP_OLDEST + 1, ESPNOW_QUEUE_RX);
+            rxMessage->state = ESPNOW_RX_BUFFER_FREE;
+            rxDispatchPosition = rx_queue.next (rxDispatchPosition);
+            continue;
+        }
+        DEBUG_DBG (QESPNOW_TAG, "Comms message got from queue. %d bytes in queue", rx_queue.bytesUsed ());
+        DEBUG_VERBOSE (QESPNOW_TAG, "Received message from " MACSTR " Len: %u", MAC2STR (rxMessage->srcAddress), rxMessage->payload_len);
+        DEBUG_VERBOSE (QESPNOW_TAG, "Message: %.*s", rxMessage->payload_len, rxMessage->payload);
 
-        if (quickEspNow.dataRcvd) {
-            bool broadcast = !memcmp (rxMessage.dstAddress, ESPNOW_BROADCAST_ADDRESS, ESP_NOW_ETH_ALEN);
-            quickEspNow.dataRcvd (rxMessage.srcAddress, rxMessage.payload, rxMessage.payload_len, rxMessage.rssi, broadcast); // rssi should be in dBm but it has added almost 100 dB. Do not know why
+        if (latencyProbe) {
+            latencyProbe (ESPNOW_RX_LATENCY, micros () - rxMessage->rx_time);
         }
-    } else {
-        DEBUG_DBG (QESPNOW_TAG, "No message in queue");
+        trace.record (ESPNOW_TRACE_DISPATCH, rxMessage->srcAddress, rxMessage->rx_time, rxMessage->payload_len, 0, ESPNOW_QUEUE_RX);
+        if (dataRcvdView) {
+            dataRcvdView (rxMessage);
+        } else if (dataRcvd) {
+            bool broadcast = !memcmp (rxMessage->dstAddress, ESPNOW_BROADCAST_ADDRESS, ESP_NOW_ETH_ALEN);
+            dataRcvd (rxMessage->srcAddress, rxMessage->payload, rxMessage->payload_len, rxMessage->rssi, broadcast); // rssi should be in dBm but it has added almost 100 dB. Do not know why
+        }
+        uint8_t state = ESPNOW_RX_BUFFER_USED;
+        rxMessage->state.compare_exchange_strong (state, ESPNOW_RX_BUFFER_FREE);
+        rxDispatchPosition = rx_queue.next (rxDispatchPosition);
+    }
+
+    // Release space of oldest messages up to first one that is still kept
+    position = rx_queue.readPosition ();
+    while (position != rxDispatchPosition && (rxMessage = (comms_rx_queue_item_t*)rx_queue.read (position))
+           && rxMessage->state == ESPNOW_RX_BUFFER_FREE) {
+        position = rx_queue.next (position);
     }
+    rx_queue.release (position);
+    checkWatermarks (ESPNOW_QUEUE_RX, rx_queue);
 
+    if (queueRamBudget && rxTuner.periodElapsed ()) {
+        tuneRxQueue ();
+    }
 }
 
 void QuickEspNow::espnowRxTask_cb (void* param) {
+    QuickEspNow* espnow = (QuickEspNow*)param;
     for (;;) {
-        quickEspNow.espnowRxHandle ();
+        espnow->espnowRxHandle ();
     }
 }
 
-void QuickEspNow::rx_cb (uint8_t* mac_addr, uint8_t* data, uint8_t len) {
-    espnow_frame_format_t* espnow_data = (espnow_frame_format_t*)(data - sizeof (espnow_frame_format_t));
-    wifi_promiscuous_pkt_t* promiscuous_pkt = (wifi_promiscuous_pkt_t*)(data - sizeof (wifi_pkt_rx_ctrl_t) - sizeof (espnow_frame_format_t));
-    wifi_pkt_rx_ctrl_t* rx_ctrl = &promiscuous_pkt->rx_ctrl;
+void QuickEspNow::rx_cb (void* ctx, const uint8_t* mac_addr, const uint8_t* dst_addr, const uint8_t* data, uint8_t len, int8_t rssi) {
+    QuickEspNow* espnow = (QuickEspNow*)ctx;
+    comms_rx_queue_item_t* message;
+    bool compressed = espnow->compression && len > 1 && data[0] == ESPNOW_COMPRESSED_MAGIC;
 
-    comms_rx_queue_item_t message;
+    DEBUG_DBG (QESPNOW_TAG, "Received message with RSSI %d from " MACSTR " Len: %u", rssi, MAC2STR (mac_addr), len);
 
-    DEBUG_DBG (QESPNOW_TAG, "Received message with RSSI %d from " MACSTR " Len: %u", rx_ctrl->rssi, MAC2STR (mac_addr), len);
+    // Link quality counts every frame heard, even if it is dropped later. Sample is lost if tx task falls behind
+    espnow_link_sample_t* sample = espnow->linkSamples.reserve ();
+    if (sample) {
+        memcpy (sample->mac, mac_addr, ESP_NOW_ETH_ALEN);
+        sample->rssi = rssi;
+        espnow->linkSamples.commit ();
+        xTaskNotifyGive (espnow->espnowTxTask);
+    }
 
-    memcpy (message.srcAddress, mac_addr, ESP_NOW_ETH_ALEN);
-    memcpy (message.payload, data, len);
-    message.payload_len = len;
-    message.rssi = rx_ctrl->rssi;
-    memcpy (message.dstAddress, espnow_data->destination_address, ESP_NOW_ETH_ALEN);
+    // Flag has to be set before checking pause, so that rx task and rx_cb never use queue at the same time
+    espnow->rxCbRunning = true;
+    if (espnow->rxQueuePaused) {
+        espnow->rxCbRunning = false;
+        espnow->stats.drops[ESPNOW_QUEUE_RX][ESPNOW_DROP_RESIZE]++;
+        espnow->trace.record (ESPNOW_TRACE_RX_CB, mac_addr, micros (), len, ESPNOW_DROP_RESIZE + 1, ESPNOW_QUEUE_RX);
+        DEBUG_DBG (QESPNOW_TAG, "Rx Message dropped while resizing queue");
+        return;
+    }
 
-    if (uxQueueMessagesWaiting (quickEspNow.rx_queue) >= quickEspNow.queueSize) {
-        comms_rx_queue_item_t tempBuffer;
-        xQueueReceive (quickEspNow.rx_queue, &tempBuffer, 0);
+    // Only rx task may free queue space, so when it is full newest message is dropped
+    if (!(message = (comms_rx_queue_item_t*)espnow->rx_queue.reserve (sizeof (comms_rx_queue_item_t) + (compressed ? ESPNOW_MAX_MESSAGE_LENGTH : len)))) {
+        espnow->rxCbRunning = false;
+        espnow->rxTuner.recordDrop ();
+        espnow->stats.drops[ESPNOW_QUEUE_RX][ESPNOW_DROP_NEWEST]++;
+        espnow->trace.record (ESPNOW_TRACE_RX_CB, mac_addr, micros (), len, ESPNOW_DROP_NEWEST + 1, ESPNOW_QUEUE_RX);
+        espnow->rxOverflow = true;
         DEBUG_DBG (QESPNOW_TAG, "Rx Message dropped");
+        xTaskNotifyGive (espnow->espnowRxTask);
+        return;
     }
-#ifdef MEAS_TPUT
-    quickEspNow.rxDataReceived += len;
-#endif // MEAS_TPUT
 
-    if (!xQueueSend (quickEspNow.rx_queue, &message, pdMS_TO_TICKS (100))) {
-        DEBUG_WARN (QESPNOW_TAG, "Error sending message to queue");
+    // This is the only copy of payload until it reaches user callback. Compressed ones are expanded in place
+    if (compressed) {
+        size_t expanded = LzCodec::decompress (data + 1, len - 1, message->payload, ESPNOW_MAX_MESSAGE_LENGTH, espnow->compressionDictionary, espnow->compressionDictLen);
+        if (!expanded) {
+            espnow->rxCbRunning = false;
+            espnow->stats.drops[ESPNOW_QUEUE_RX][ESPNOW_DROP_DECODE]++;
+            espnow->trace.record (ESPNOW_TRACE_RX_CB, mac_addr, micros (), len, ESPNOW_DROP_DECODE + 1, ESPNOW_QUEUE_RX);
+            DEBUG_DBG (QESPNOW_TAG, "Wrong compressed message from " MACSTR, MAC2STR (mac_addr));
+            return;
+        }
+        len = expanded;
+    } else {
+        memcpy (message->payload, data, len);
     }
+    message->state = ESPNOW_RX_BUFFER_USED;
+    message->rx_time = micros ();
+    memcpy (message->srcAddress, mac_addr, ESP_NOW_ETH_ALEN);
+    message->payload_len = len;
+    message->rssi = rssi;
+    memcpy (message->dstAddress, dst_addr, ESP_NOW_ETH_ALEN);
+
+    espnow->trace.record (ESPNOW_TRACE_RX_CB, mac_addr, message->rx_time, len, 0, ESPNOW_QUEUE_RX);
+    espnow->rx_queue.commit (sizeof (comms_rx_queue_item_t) + len);
+    espnow->rxTuner.recordUsage (espnow->rx_queue.bytesUsed ());
+    espnow->recordQueueUsage (ESPNOW_QUEUE_RX, espnow->rx_queue.bytesUsed ());
+    espnow->stats.rxFrames.fetch_add (1, std::memory_order_relaxed);
+    espnow->stats.rxBytes.fetch_add (len, std::memory_order_relaxed);
+    espnow->rxCbRunning = false;
+    xTaskNotifyGive (espnow->espnowRxTask);
 }
 
-void QuickEspNow::tx_cb (uint8_t* mac_addr, uint8_t status) {
-    quickEspNow.readyToSend = true;
-    quickEspNow.sentStatus = status;
-    quickEspNow.waitingForConfirmation = false;
-    DEBUG_DBG (QESPNOW_TAG, "-------------- Ready to send: true. Status: %d", status);
-    if (quickEspNow.sentResult) {
-        quickEspNow.sentResult (mac_addr, status);
+void QuickEspNow::tx_cb (void* ctx, const uint8_t* mac_addr, uint8_t status) {
+    QuickEspNow* espnow = (QuickEspNow*)ctx;
+    uint32_t enqueueTime;
+    uint32_t latency;
+    uint8_t bucket = 0;
+
+    xSemaphoreTake (espnow->inflightMutex, portMAX_DELAY);
+    if (!espnow->inflight || memcmp (mac_addr, espnow->inflightDstAddress, ESP_NOW_ETH_ALEN)) {
+        // Its message has already been given as failed, and next one must not take this result
+        xSemaphoreGive (espnow->inflightMutex);
+        DEBUG_DBG (QESPNOW_TAG, "Late confirmation from " MACSTR " ignored", MAC2STR (mac_addr));
+        return;
+    }
+    espnow->inflight = false;
+    enqueueTime = espnow->inflightEnqueueTime;
+    // Recorded before tx task is woken up, so that it comes before next message records
+    espnow->trace.record (ESPNOW_TRACE_TX_CB, mac_addr, enqueueTime, 0, status, 0);
+    espnow->confirmedStatus = status;
+    xSemaphoreGive (espnow->txConfirmed);
+    xSemaphoreGive (espnow->inflightMutex);
+    latency = micros () - enqueueTime;
+    DEBUG_DBG (QESPNOW_TAG, "-------------- Message confirmed. Status: %d", status);
+    if (status == ESP_NOW_SEND_SUCCESS) {
+        espnow->stats.txConfirmed.fetch_add (1, std::memory_order_relaxed);
+    } else {
+        espnow->stats.txFailed.fetch_add (1, std::memory_order_relaxed);
+    }
+    // Logarithmic buckets. First one takes everything under 512 us
+    while (bucket < ESPNOW_LATENCY_BUCKETS - 1 && latency >= (512UL << bucket)) {
+        bucket++;
+    }
+    espnow->stats.txLatency[bucket].fetch_add (1, std::memory_order_relaxed);
+    if (espnow->latencyProbe) {
+        espnow->latencyProbe (ESPNOW_TX_LATENCY, latency);
+    }
+    if (espnow->sentResult) {
+        espnow->sentResult ((uint8_t*)mac_addr, status);
+    }
+}
+
+PeerListClass::PeerListClass () {
+    peer_list.peer_number = 0;
+    peer_list.known_peers = 0;
+    peer_list.active = { ESPNOW_NO_PEER, ESPNOW_NO_PEER };
+    peer_list.inactive = { ESPNOW_NO_PEER, ESPNOW_NO_PEER };
+    peer_list.free = { ESPNOW_NO_PEER, ESPNOW_NO_PEER };
+    for (size_t i = 0; i < peerHashSize (); i++) {
+        peer_list.index[i] = ESPNOW_NO_PEER;
+    }
+    for (uint16_t i = 0; i < ESPNOW_MAX_PEERS; i++) {
+        peer_list.peer[i].active = false;
+        push_front (peer_list.free, i);
     }
 }
 
+uint16_t PeerListClass::hash (const uint8_t* mac) {
+    // FNV-1a over whole address, as nodes of the same vendor share first bytes
+    uint32_t value = 2166136261UL;
+    for (int i = 0; i < ESP_NOW_ETH_ALEN; i++) {
+        value = (value ^ mac[i]) * 16777619UL;
+    }
+    return (value ^ (value >> 16)) & (peerHashSize () - 1);
+}
+
+uint16_t PeerListClass::lookup (const uint8_t* mac) {
+    // Table is never more than half full, so an empty slot is always found
+    for (uint16_t slot = hash (mac);; slot = (slot + 1) & (peerHashSize () - 1)) {
+        uint16_t peer = peer_list.index[slot];
+        if (peer == ESPNOW_NO_PEER || !memcmp (peer_list.peer[peer].mac, mac, ESP_NOW_ETH_ALEN)) {
+            return peer;
+        }
+    }
+}
+
+void PeerListClass::unlink (peer_lru_t& list, uint16_t peer) {
+    peer_t* entry = &peer_list.peer[peer];
+    if (entry->prev != ESPNOW_NO_PEER) {
+        peer_list.peer[entry->prev].next = entry->next;
+    } else {
+        list.head = entry->next;
+    }
+    if (entry->next != ESPNOW_NO_PEER) {
+        peer_list.peer[entry->next].prev = entry->prev;
+    } else {
+        list.tail = entry->prev;
+    }
+}
+
+void PeerListClass::push_front (peer_lru_t& list, uint16_t peer) {
+    peer_t* entry = &peer_list.peer[peer];
+    entry->prev = ESPNOW_NO_PEER;
+    entry->next = list.head;
+    if (list.head != ESPNOW_NO_PEER) {
+        peer_list.peer[list.head].prev = peer;
+    } else {
+        list.tail = peer;
+    }
+    list.head = peer;
+}
+
+void PeerListClass::remove_index (uint16_t peer) {
+    const uint16_t mask = peerHashSize () - 1;
+    uint16_t slot = hash (peer_list.peer[peer].mac);
+
+    while (peer_list.index[slot] != peer) {
+        slot = (slot + 1) & mask;
+    }
+    // Backward shift deletion. Later peers of the same probe run are moved back so that no tombstones are needed
+    for (uint16_t next = (slot + 1) & mask; peer_list.index[next] != ESPNOW_NO_PEER; next = (next + 1) & mask) {
+        uint16_t home = hash (peer_list.peer[peer_list.index[next]].mac);
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            peer_list.index[slot] = peer_list.index[next];
+            slot = next;
+        }
+    }
+    peer_list.index[slot] = ESPNOW_NO_PEER;
+}
+
+uint16_t PeerListClass::create_peer (const uint8_t* mac) {
+    uint16_t peer = peer_list.free.head;
+    uint16_t slot;
+
+    if (peer != ESPNOW_NO_PEER) {
+        unlink (peer_list.free, peer);
+    } else {
+        // Least recently used unregistered peer is forgotten. There is always one, as only a few may be registered
+        peer = peer_list.inactive.tail;
+        unlink (peer_list.inactive, peer);
+        remove_index (peer);
+        peer_list.known_peers--;
+        DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " forgotten", MAC2STR (peer_list.peer[peer].mac));
+    }
+    memcpy (peer_list.peer[peer].mac, mac, ESP_NOW_ETH_ALEN);
+    peer_list.peer[peer].active = false;
+    peer_list.peer[peer].tx_failures = 0;
+    peer_list.peer[peer].txBucket.begin (0, 0);
+    peer_list.peer[peer].rssiAvg = 0;
+    peer_list.peer[peer].txSuccessAvg = 100 * 256;
+    peer_list.peer[peer].txFrames = 0;
+    peer_list.peer[peer].txFailures = 0;
+    peer_list.peer[peer].txRetries = 0;
+    peer_list.peer[peer].rxFrames = 0;
+    peer_list.peer[peer].rateStart = millis ();
+    peer_list.peer[peer].txPeriodFrames = 0;
+    peer_list.peer[peer].rxPeriodFrames = 0;
+    peer_list.peer[peer].txRate = 0;
+    peer_list.peer[peer].rxRate = 0;
+    for (slot = hash (mac); peer_list.index[slot] != ESPNOW_NO_PEER; slot = (slot + 1) & (peerHashSize () - 1)) {
+    }
+    peer_list.index[slot] = peer;
+    peer_list.known_peers++;
+    return peer;
+}
+
 uint8_t PeerListClass::get_peer_number () {
     return peer_list.peer_number;
 }
 
 bool PeerListClass::peer_exists (const uint8_t* mac) {
-    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
-        if (memcmp (peer_list.peer[i].mac, mac, ESP_NOW_ETH_ALEN) == 0) {
-            if (peer_list.peer[i].active) {
-                peer_list.peer[i].last_msg = millis ();
-                DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " found. Updated last_msg", MAC2STR (mac));
-                return true;
-            }
-        }
+    uint16_t peer = lookup (mac);
+    if (peer != ESPNOW_NO_PEER && peer_list.peer[peer].active) {
+        peer_list.peer[peer].last_msg = millis ();
+        unlink (peer_list.active, peer);
+        push_front (peer_list.active, peer);
+        DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " found. Updated last_msg", MAC2STR (mac));
+        return true;
     }
     return false;
 }
 
 peer_t* PeerListClass::get_peer (const uint8_t* mac) {
-    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
-        if (memcmp (peer_list.peer[i].mac, mac, ESP_NOW_ETH_ALEN) == 0) {
-            if (peer_list.peer[i].active) {
-                DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " found", MAC2STR (mac));
-                return &(peer_list.peer[i]);
-            }
-        }
+    peer_t* peer = find_peer (mac);
+    if (peer && peer->active) {
+        DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " found", MAC2STR (mac));
+        return peer;
     }
     return NULL;
 }
 
+peer_t* PeerListClass::find_peer (const uint8_t* mac) {
+    uint16_t peer = lookup (mac);
+    return peer != ESPNOW_NO_PEER ? &peer_list.peer[peer] : NULL;
+}
+
 bool PeerListClass::update_peer_use (const uint8_t* mac) {
-    peer_t* peer = get_peer (mac);
-    if (peer) {
-        peer->last_msg = millis ();
-        return true;
+    return peer_exists (mac);
+}
+
+peer_t* PeerListClass::track_peer (const uint8_t* mac) {
+    uint16_t peer = lookup (mac);
+
+    if (peer == ESPNOW_NO_PEER) {
+        peer = create_peer (mac);
+    } else if (peer_list.peer[peer].active) {
+        return &peer_list.peer[peer];
+    } else {
+        unlink (peer_list.inactive, peer);
     }
-    return false;
+    // Peers that are heard are forgotten last among unregistered ones
+    push_front (peer_list.inactive, peer);
+    return &peer_list.peer[peer];
 }
 
 bool PeerListClass::add_peer (const uint8_t* mac) {
-    if (peer_exists (mac)) {
+    uint16_t peer = lookup (mac);
+
+    if (peer != ESPNOW_NO_PEER && peer_list.peer[peer].active) {
         DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " already exists", MAC2STR (mac));
         return false;
     }
@@ -456,57 +1842,51 @@ bool PeerListClass::add_peer (const uint8_t* mac) {
         // delete_peer (); // Delete should happen in higher level
     }
 
-    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
-        if (!peer_list.peer[i].active) {
-            memcpy (peer_list.peer[i].mac, mac, ESP_NOW_ETH_ALEN);
-            peer_list.peer[i].active = true;
-            peer_list.peer[i].last_msg = millis ();
-            peer_list.peer_number++;
-            DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " added. Total peers = %d", MAC2STR (mac), peer_list.peer_number);
-            return true;
-        }
+    if (peer == ESPNOW_NO_PEER) {
+        peer = create_peer (mac);
+    } else {
+        unlink (peer_list.inactive, peer);
     }
-
-    return false;
+    peer_list.peer[peer].active = true;
+    peer_list.peer[peer].channel = 0;
+    peer_list.peer[peer].last_msg = millis ();
+    push_front (peer_list.active, peer);
+    peer_list.peer_number++;
+    DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " added. Total peers = %d", MAC2STR (mac), peer_list.peer_number);
+    return true;
 }
 
 bool PeerListClass::delete_peer (const uint8_t* mac) {
-    peer_t* peer = get_peer (mac);
-    if (peer) {
-        peer->active = false;
-        peer_list.peer_number--;
-        DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " deleted. Total peers = %d", MAC2STR (mac), peer_list.peer_number);
-        return true;
+    uint16_t peer = lookup (mac);
+    if (peer == ESPNOW_NO_PEER || !peer_list.peer[peer].active) {
+        return false;
     }
-    return false;
+    // Peer stays known so that its state is kept if it is registered again
+    unlink (peer_list.active, peer);
+    peer_list.peer[peer].active = false;
+    push_front (peer_list.inactive, peer);
+    peer_list.peer_number--;
+    DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " deleted. Total peers = %d", MAC2STR (mac), peer_list.peer_number);
+    return true;
 }
 
-// Delete peer with older message
+// Delete least recently used peer
 uint8_t* PeerListClass::delete_peer () {
-    uint32_t oldest_msg = 0;
-    int oldest_index = -1;
-    uint8_t* mac = NULL;
-    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
-        if (peer_list.peer[i].active) {
-            if (peer_list.peer[i].last_msg < oldest_msg || oldest_msg == 0) {
-                oldest_msg = peer_list.peer[i].last_msg;
-                oldest_index = i;
-                DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " is %d ms old. Deleting", MAC2STR (peer_list.peer[i].mac), oldest_msg);
-            }
-        }
-    }
-    if (oldest_index != -1) {
-        peer_list.peer[oldest_index].active = false;
-        peer_list.peer_number--;
-        mac = peer_list.peer[oldest_index].mac;
-        DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " deleted. Last message %d ms ago. Total peers = %d", MAC2STR (mac), millis () - peer_list.peer[oldest_index].last_msg, peer_list.peer_number);
+    uint16_t peer = peer_list.active.tail;
+    uint8_t* mac;
+
+    if (peer == ESPNOW_NO_PEER) {
+        return NULL;
     }
+    mac = peer_list.peer[peer].mac;
+    delete_peer (mac);
+    DEBUG_VERBOSE (PEERLIST_TAG, "Peer " MACSTR " deleted. Last message %d ms ago. Total peers = %d", MAC2STR (mac), millis () - peer_list.peer[peer].last_msg, peer_list.peer_number);
     return mac;
 }
 
 bool QuickEspNow::setWiFiBandwidth (wifi_interface_t iface, wifi_bandwidth_t bw) {
     esp_err_t err_ok;
-    if ((err_ok = esp_wifi_set_bandwidth (iface, bw))) {
+    if ((err_ok = driver->setBandwidth (iface, bw))) {
         DEBUG_ERROR (QESPNOW_TAG, "Error setting wifi bandwidth: %s", esp_err_to_name (err_ok));
     }
     return !err_ok;
@@ -514,12 +1894,10 @@ bool QuickEspNow::setWiFiBandwidth (wifi_interface_t iface, wifi_bandwidth_t bw)
 
 #ifdef UNIT_TEST
 void PeerListClass::dump_peer_list () {
-    Serial.printf ("Number of peers %d\n", peer_list.peer_number);
-    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
-        if (peer_list.peer[i].active) {
-            Serial.printf ("Peer " MACSTR " is %d ms old\n", MAC2STR (peer_list.peer[i].mac), millis () - peer_list.peer[i].last_msg);
-        }
+    Serial.printf ("Number of peers %d. Known peers %d\n", peer_list.peer_number, peer_list.known_peers);
+    for (uint16_t i = peer_list.active.head; i != ESPNOW_NO_PEER; i = peer_list.peer[i].next) {
+        Serial.printf ("Peer " MACSTR " is %d ms old\n", MAC2STR (peer_list.peer[i].mac), millis () - peer_list.peer[i].last_msg);
     }
 }
 #endif // UNIT_TEST
-#endif // ESP32
\ No newline at end of file
+#endif // ESP32 || QESPNOW_HOST
\ No newline at end of file
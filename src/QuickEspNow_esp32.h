@@ -1,17 +1,28 @@
 #ifndef _QUICK_ESPNOW_ESP32_h
 #define _QUICK_ESPNOW_ESP32_h
-#ifdef ESP32
+#if defined ESP32 || defined QESPNOW_HOST
 
+#ifdef ESP32
 #include "Arduino.h"
+#endif // ESP32
 #include "Comms_hal.h"
+#include "QuickEspNow_driver.h"
+#include "BipBuffer.h"
+#include "QueueTuner.h"
+#include "SendTracker.h"
+#include "LzCodec.h"
+#include "TxPacer.h"
+#include "RingBuffer.h"
+#include "EspNowTrace.h"
 
-#include <esp_now.h>
-#include <esp_wifi.h>
-
+#ifdef ESP32
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
+#include <freertos/event_groups.h>
+#include <esp_event.h>
+#endif // ESP32
 
 // Disable debug dependency if debug level is 0
 #if CORE_DEBUG_LEVEL > 0
@@ -25,77 +36,382 @@ constexpr auto QESPNOW_TAG = "QESPNOW";
 #define DEBUG_DBG(...)
 #endif
 
-//#define MEAS_TPUT
-
 static uint8_t ESPNOW_BROADCAST_ADDRESS[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 static const uint8_t MIN_WIFI_CHANNEL = 0;
 static const uint8_t MAX_WIFI_CHANNEL = 14;
 static const uint8_t CURRENT_WIFI_CHANNEL = 255;
 static const size_t ESPNOW_MAX_MESSAGE_LENGTH = 250; ///< @brief Maximum message length
 static const uint8_t ESPNOW_ADDR_LEN = 6; ///< @brief Address length
-static const uint8_t ESPNOW_QUEUE_SIZE = 3; ///< @brief Queue size
+#ifndef ESPNOW_TX_QUEUE_BYTES
+#define ESPNOW_TX_QUEUE_BYTES 1024 ///< @brief Transmission queue size in bytes. Holds at least 2 messages of maximum length
+#endif
+#ifndef ESPNOW_RX_QUEUE_BYTES
+#define ESPNOW_RX_QUEUE_BYTES 2048 ///< @brief Reception queue size in bytes. Messages kept by user stay here until released
+#endif
+#ifndef ESPNOW_TX_CONFIRM_TIMEOUT_MS
+#define ESPNOW_TX_CONFIRM_TIMEOUT_MS 100 ///< @brief Maximum time to wait for transmission confirmation before message is given as failed
+#endif
+#ifndef ESPNOW_COMPRESSION_MIN_LEN
+#define ESPNOW_COMPRESSION_MIN_LEN 16 ///< @brief Shorter messages are not worth compressing
+#endif
+static const uint8_t ESPNOW_COMPRESSED_MAGIC = 0xF8; ///< @brief First byte of compressed frames
+static const size_t ESPNOW_COMPRESSED_MAGIC_MAX_LEN = 247; ///< @brief With compression enabled, longest message starting with `ESPNOW_COMPRESSED_MAGIC` that always fits in a frame
+static_assert (1 + ESPNOW_COMPRESSED_MAGIC_MAX_LEN + (ESPNOW_COMPRESSED_MAGIC_MAX_LEN + LzCodec::MAX_LITERALS - 1) / LzCodec::MAX_LITERALS <= ESP_NOW_MAX_DATA_LEN,
+               "Incompressible message starting with compression magic must fit in a frame");
+#ifndef ESPNOW_TX_FLOWS
+#define ESPNOW_TX_FLOWS 8 ///< @brief Destinations that may have messages scheduled at the same time. Messages to others wait in queue until a flow is free
+#endif
+#ifndef ESPNOW_TX_QUANTUM
+#define ESPNOW_TX_QUANTUM 250 ///< @brief Bytes that every destination may send on each scheduling round
+#endif
+#ifndef ESPNOW_TX_MAX_PENALTY
+#define ESPNOW_TX_MAX_PENALTY 3 ///< @brief Quantum of a destination is halved for every consecutive failure, up to this many times
+#endif
+#ifndef ESPNOW_TX_CONTROL_QUEUE_BYTES
+#define ESPNOW_TX_CONTROL_QUEUE_BYTES 576 ///< @brief Transmission queue size in bytes for control class. Holds at least 2 messages of maximum length
+#endif
+#ifndef ESPNOW_TX_BULK_QUEUE_BYTES
+#define ESPNOW_TX_BULK_QUEUE_BYTES 1024 ///< @brief Transmission queue size in bytes for bulk class. Holds at least 2 messages of maximum length
+#endif
+#ifndef ESPNOW_TX_STARVATION_LIMIT
+#define ESPNOW_TX_STARVATION_LIMIT 16 ///< @brief A waiting class gets a message sent after this many messages of higher classes, so that it is never starved
+#endif
+
+/**
+  * @brief Transmission queue record. Only `payload_len` bytes of payload are stored
+  */
+typedef struct {
+    uint32_t enqueue_time; /**< Time when message was queued, in microseconds */
+    uint32_t next; /**< Queue position of next message to the same destination. Set by tx task */
+    uint8_t dstAddress[ESPNOW_ADDR_LEN]; /**< Destination Address */
+    uint8_t payload_len; /**< Payload length */
+    uint8_t tracking; /**< Slot in send tracker. `ESPNOW_UNTRACKED` if nobody waits for result */
+    bool sent; /**< Message is done and its space may be reused. Set by tx task */
+    uint8_t payload[]; /**< Message payload */
+} comms_tx_queue_item_t;
+
+/**
+  * @brief Messages to a destination that are waiting in transmission queue. They are linked through their `next` field
+  */
+typedef struct {
+    uint8_t dstAddress[ESPNOW_ADDR_LEN]; /**< Destination address */
+    uint8_t penalty; /**< Quantum is shifted right by this. It grows with consecutive failures */
+    uint16_t messages; /**< Number of messages. 0 if flow is free */
+    int32_t deficit; /**< Bytes it may still send in current round */
+    uint32_t first; /**< Queue position of oldest message */
+    uint32_t last; /**< Queue position of newest message */
+} espnow_tx_flow_t;
+
+/**
+  * @brief Priority class of a message. Every class has its own transmission queue
+  */
+typedef enum {
+    ESPNOW_PRIORITY_CONTROL = 0, /**< Alarms and commands. Served before any other class */
+    ESPNOW_PRIORITY_NORMAL = 1, /**< Default class. Its queue is the one sized by `begin` and by adaptive queues */
+    ESPNOW_PRIORITY_BULK = 2, /**< Telemetry and transfers. Served when other classes have nothing to send */
+} espnow_priority_t;
 
-#ifdef MEAS_TPUT
-static const time_t MEAS_TP_EVERY_MS = 10000; ///< @brief Measurement time period
-#endif // MEAS_TPUT
+static const uint8_t ESPNOW_PRIORITY_CLASSES = 3; ///< @brief Number of priority classes
 
+/**
+  * @brief Transmission queue of a priority class and its scheduling state. Scheduling state is only used by tx task
+  */
 typedef struct {
-    uint16_t frame_head;
-    uint16_t duration;
-    uint8_t destination_address[6];
-    uint8_t source_address[6];
-    uint8_t broadcast_address[6];
-    uint16_t sequence_control;
-
-    uint8_t category_code;
-    uint8_t organization_identifier[3]; // 0x18fe34
-    uint8_t random_values[4];
-    struct {
-        uint8_t element_id;                 // 0xdd
-        uint8_t lenght;                     //
-        uint8_t organization_identifier[3]; // 0x18fe34
-        uint8_t type;                       // 4
-        uint8_t version;
-        uint8_t body[0];
-    } vendor_specific_content;
-} __attribute__ ((packed)) espnow_frame_format_t;
+    BipBuffer* queue; /**< Messages of this class */
+    uint32_t maxAge_ms; /**< Messages that have waited longer are dropped instead of sent. 0 to send them all */
+    size_t scheduledPosition; /**< Next message to be put in its flow. Messages before it are scheduled, sent or not */
+    espnow_tx_flow_t flows[ESPNOW_TX_FLOWS]; /**< Served with deficit round robin, so that a slow destination does not block others */
+    uint8_t activeFlows; /**< Flows that have messages */
+    uint8_t cursor; /**< Flow being served */
+    uint8_t skipped; /**< Messages of higher classes sent while this one was waiting */
+} espnow_tx_class_t;
 
+/**
+  * @brief Message of a batch given to `sendBatch`
+  */
 typedef struct {
-    uint8_t dstAddress[ESPNOW_ADDR_LEN]; /**< Message topic*/
-    uint8_t payload[ESPNOW_MAX_MESSAGE_LENGTH]; /**< Message payload*/
-    size_t payload_len; /**< Payload length*/
-} comms_tx_queue_item_t;
+    const uint8_t* dstAddress; /**< Destination address */
+    const uint8_t* payload; /**< Message payload */
+    size_t payload_len; /**< Payload length */
+    comms_send_error_t status; /**< Result for this message. Set by `sendBatch` */
+} espnow_batch_entry_t;
 
+/**
+  * @brief Reception queue record. Only `payload_len` bytes of payload are stored
+  */
 typedef struct {
+    uint32_t rx_time; /**< Time when message was received, in microseconds */
     uint8_t srcAddress[ESPNOW_ADDR_LEN]; /**< Source Address */
     uint8_t dstAddress[ESPNOW_ADDR_LEN]; /**< Destination Address */
-    uint8_t payload[ESPNOW_MAX_MESSAGE_LENGTH]; /**< Message payload */
-    size_t payload_len; /**< Payload length */
     int8_t rssi; /**< RSSI */
+    uint8_t payload_len; /**< Payload length */
+    std::atomic<uint8_t> state; /**< `espnow_rx_buffer_state_t` */
+    uint8_t reserved;
+    uint8_t payload[]; /**< Message payload */
 } comms_rx_queue_item_t;
 
+static const size_t ESPNOW_TX_RECORD_LEN = BipBuffer::footprint (sizeof (comms_tx_queue_item_t) + ESPNOW_MAX_MESSAGE_LENGTH); ///< @brief Queue bytes used by a message of maximum length
+static const size_t ESPNOW_RX_RECORD_LEN = BipBuffer::footprint (sizeof (comms_rx_queue_item_t) + ESPNOW_MAX_MESSAGE_LENGTH); ///< @brief Queue bytes used by a message of maximum length
+static const size_t ESPNOW_QUEUE_RAM_BYTES = ESPNOW_TX_QUEUE_BYTES + ESPNOW_TX_CONTROL_QUEUE_BYTES + ESPNOW_TX_BULK_QUEUE_BYTES + ESPNOW_RX_QUEUE_BYTES; ///< @brief RAM allocated for message queues
+
+typedef comms_rx_queue_item_t espnow_rx_message_t; ///< @brief Received message as seen by `onDataRcvdView` callback. It lives in reception queue
+
+typedef std::function<void (espnow_rx_message_t* message)> espnow_rx_view_cb_t;
+
+typedef enum {
+    ESPNOW_RX_BUFFER_FREE = 0, /**< Message has been processed. Its space may be reused */
+    ESPNOW_RX_BUFFER_USED = 1, /**< Message is queued or being dispatched */
+    ESPNOW_RX_BUFFER_KEPT = 2, /**< User kept the message. Its space, and the one of messages after it, is not reused until it is released */
+} espnow_rx_buffer_state_t;
+
+typedef enum {
+    ESPNOW_TX_LATENCY = 0, /**< Time from message queued by `send` until its transmission is confirmed */
+    ESPNOW_RX_LATENCY = 1, /**< Time from message received by radio until it is passed to `dataRcvd` callback */
+} espnow_latency_type_t;
+
+typedef std::function<void (espnow_latency_type_t type, uint32_t latency_us)> espnow_latency_probe_t;
+
+/**
+  * @brief Queues that may report watermarks. Transmission ones match their priority class
+  */
+typedef enum {
+    ESPNOW_QUEUE_TX_CONTROL = ESPNOW_PRIORITY_CONTROL, /**< Control class transmission queue */
+    ESPNOW_QUEUE_TX = ESPNOW_PRIORITY_NORMAL, /**< Normal class transmission queue */
+    ESPNOW_QUEUE_TX_BULK = ESPNOW_PRIORITY_BULK, /**< Bulk class transmission queue */
+    ESPNOW_QUEUE_RX = ESPNOW_PRIORITY_BULK + 1, /**< Reception queue */
+} espnow_queue_id_t;
+
+static const uint8_t ESPNOW_QUEUES = ESPNOW_QUEUE_RX + 1; ///< @brief Number of queues
+
+typedef enum {
+    ESPNOW_WATERMARK_LOW = 0, /**< Queue has drained down to its low watermark after reaching the high one */
+    ESPNOW_WATERMARK_HIGH = 1, /**< Queue has filled up to its high watermark, or it has rejected a message */
+} espnow_watermark_t;
+
+typedef std::function<void (espnow_queue_id_t queue, espnow_watermark_t level, size_t bytesUsed)> espnow_watermark_cb_t;
+
+/**
+  * @brief What a queue does when a message does not fit in it
+  */
+typedef enum {
+    ESPNOW_OVERFLOW_DROP_NEWEST = 0, /**< New message is rejected. Default */
+    ESPNOW_OVERFLOW_DROP_OLDEST = 1, /**< Oldest messages are dropped to make room, so latest data wins */
+    ESPNOW_OVERFLOW_BLOCK = 2, /**< Producer waits for room up to a timeout. Only for transmission queues */
+} espnow_overflow_policy_t;
+
+/**
+  * @brief Reasons why a message is dropped
+  */
+typedef enum {
+    ESPNOW_DROP_NEWEST = 0, /**< New message did not fit in queue */
+    ESPNOW_DROP_OLDEST = 1, /**< Queued message was dropped to make room for a new one */
+    ESPNOW_DROP_TIMEOUT = 2, /**< Producer waited for room until timeout */
+    ESPNOW_DROP_EXPIRED = 3, /**< Message waited longer than maximum age of its class */
+    ESPNOW_DROP_RESIZE = 4, /**< Message arrived while queue was being resized */
+    ESPNOW_DROP_DECODE = 5, /**< Compressed message could not be expanded */
+} espnow_drop_reason_t;
+
+static const uint8_t ESPNOW_DROP_REASONS = ESPNOW_DROP_DECODE + 1; ///< @brief Number of drop reasons
+
+/**
+  * @brief Overflow policy of a queue
+  */
+typedef struct {
+    espnow_overflow_policy_t policy; /**< What to do when a message does not fit */
+    uint32_t timeout_ms; /**< Maximum time a producer waits for room with `ESPNOW_OVERFLOW_BLOCK` */
+} espnow_overflow_t;
+
+/**
+  * @brief Watermarks of a queue. High and low events always alternate, starting with a high one
+  */
+typedef struct {
+    uint8_t high; /**< Percentage of queue size. 0 if watermarks are disabled */
+    uint8_t low; /**< Percentage of queue size */
+    std::atomic<bool> above; /**< High watermark has been reported and low one has not */
+} espnow_queue_watermark_t;
+
+#ifndef ESPNOW_LATENCY_BUCKETS
+#define ESPNOW_LATENCY_BUCKETS 12 ///< @brief Buckets of transmission latency histogram. Bucket `i` counts latencies from `2^(i+8)` to `2^(i+9)` microseconds. First and last ones are open
+#endif
+
+/**
+  * @brief Errors returned by radio driver when a frame is handed to it
+  */
+typedef enum {
+    ESPNOW_DRIVER_ERROR_NO_MEM = 0, /**< Driver has no buffer for the frame. Channel is congested */
+    ESPNOW_DRIVER_ERROR_NOT_FOUND = 1, /**< Peer is not registered, or it is on another channel */
+    ESPNOW_DRIVER_ERROR_ARG = 2, /**< Wrong argument or interface */
+    ESPNOW_DRIVER_ERROR_OTHER = 3, /**< Any other error */
+} espnow_driver_error_t;
+
+static const uint8_t ESPNOW_DRIVER_ERRORS = ESPNOW_DRIVER_ERROR_OTHER + 1; ///< @brief Number of driver error kinds
+
+/**
+  * @brief Snapshot of engine statistics. Counters wrap around, so rates should be taken from differences between snapshots
+  */
+typedef struct {
+    uint32_t txFrames; /**< Frames accepted by driver */
+    uint32_t txBytes; /**< Payload bytes of frames accepted by driver */
+    uint32_t rxFrames; /**< Frames received and queued */
+    uint32_t rxBytes; /**< Payload bytes of frames received and queued */
+    uint32_t txConfirmed; /**< Frames confirmed by tx_cb */
+    uint32_t txFailed; /**< Frames given as failed by tx_cb */
+    uint32_t txTimeouts; /**< Frames whose confirmation did not arrive in `ESPNOW_TX_CONFIRM_TIMEOUT_MS` */
+    uint32_t driverErrors[ESPNOW_DRIVER_ERRORS]; /**< Frames rejected by driver, by error */
+    uint32_t drops[ESPNOW_QUEUES][ESPNOW_DROP_REASONS]; /**< Dropped messages by queue and reason */
+    uint32_t queueHighWater[ESPNOW_QUEUES]; /**< Maximum bytes used by every queue */
+    uint32_t peersAdded; /**< Peers registered in driver */
+    uint32_t peersEvicted; /**< Peers deleted from driver to make room for others */
+    uint32_t txLatency[ESPNOW_LATENCY_BUCKETS]; /**< Histogram of time from message queued until its transmission is confirmed */
+} espnow_stats_t;
+
+/**
+  * @brief Engine statistics as they are counted. Every counter is updated on its own without locks
+  */
+typedef struct {
+    std::atomic<uint32_t> txFrames;
+    std::atomic<uint32_t> txBytes;
+    std::atomic<uint32_t> rxFrames;
+    std::atomic<uint32_t> rxBytes;
+    std::atomic<uint32_t> txConfirmed;
+    std::atomic<uint32_t> txFailed;
+    std::atomic<uint32_t> txTimeouts;
+    std::atomic<uint32_t> driverErrors[ESPNOW_DRIVER_ERRORS];
+    std::atomic<uint32_t> drops[ESPNOW_QUEUES][ESPNOW_DROP_REASONS];
+    std::atomic<uint32_t> queueHighWater[ESPNOW_QUEUES]; /**< Only raised by queue producer */
+    std::atomic<uint32_t> peersAdded;
+    std::atomic<uint32_t> peersEvicted;
+    std::atomic<uint32_t> txLatency[ESPNOW_LATENCY_BUCKETS];
+} espnow_stats_counters_t;
+
+#ifndef ESPNOW_MAX_PEERS
+#define ESPNOW_MAX_PEERS 64 ///< @brief Peers whose state is remembered. Only up to `ESP_NOW_MAX_TOTAL_PEER_NUM` of them are registered in driver at the same time
+#endif
+static_assert (ESPNOW_MAX_PEERS > ESP_NOW_MAX_TOTAL_PEER_NUM && ESPNOW_MAX_PEERS < 0x8000, "ESPNOW_MAX_PEERS must be greater than ESP_NOW_MAX_TOTAL_PEER_NUM");
+
+#ifndef ESPNOW_LINK_EWMA_SHIFT
+#define ESPNOW_LINK_EWMA_SHIFT 3 ///< @brief Moving averages of link quality give every new sample a weight of `1 / 2^ESPNOW_LINK_EWMA_SHIFT`
+#endif
+#ifndef ESPNOW_LINK_RATE_PERIOD_MS
+#define ESPNOW_LINK_RATE_PERIOD_MS 1000 ///< @brief Period over which frame rates of every peer are measured
+#endif
+#ifndef ESPNOW_LINK_SAMPLES
+#define ESPNOW_LINK_SAMPLES 16 ///< @brief Received frames whose RSSI may wait for tx task to record it
+#endif
+
+/**
+  * @brief Quality of the link with a peer, as given by `getLinkQuality`
+  */
+typedef struct {
+    int8_t rssi; /**< Moving average of RSSI of received frames, in dBm. 0 if nothing has been received */
+    uint8_t txSuccess; /**< Moving average of confirmed transmissions, in percent. 100 if nothing has been sent */
+    uint16_t txRate; /**< Frames per second sent in last period */
+    uint16_t rxRate; /**< Frames per second received in last period */
+    uint32_t txFrames; /**< Frames sent, confirmed or not */
+    uint32_t txFailures; /**< Frames not confirmed */
+    uint32_t txRetries; /**< Frames sent again after driver ran out of memory */
+    uint32_t rxFrames; /**< Frames received */
+} espnow_link_quality_t;
+
+/**
+  * @brief RSSI of a received frame, handed from rx_cb to tx task, that owns peer list
+  */
+typedef struct {
+    uint8_t mac[ESP_NOW_ETH_ALEN]; /**< Source address */
+    int8_t rssi; /**< RSSI in dBm */
+} espnow_link_sample_t;
+
+static const uint16_t ESPNOW_NO_PEER = 0xFFFF; ///< @brief Null peer index
+static const uint8_t ESPNOW_MAX_UNICAST_PEERS = ESP_NOW_MAX_TOTAL_PEER_NUM - 1; ///< @brief Driver slots left for peer list. Broadcast peer keeps one for itself
+
+/**
+  * @brief Hash table size. Power of two that keeps load factor under 50%
+  */
+static constexpr size_t peerHashSize (size_t size = 1) { return size >= 2 * ESPNOW_MAX_PEERS ? size : peerHashSize (size * 2); }
+
 typedef struct {
     uint8_t mac[ESP_NOW_ETH_ALEN];
     time_t last_msg;
-    bool active;
+    bool active; ///< @brief Peer is registered in driver
+    uint8_t channel; ///< @brief Channel peer is registered with in driver. 0 if it has to be checked again
+    uint8_t ifidx; ///< @brief Interface peer is registered with in driver
+    uint8_t tx_failures; ///< @brief Consecutive failed transmissions
+    TokenBucketClass txBucket; ///< @brief Pacing of frames to this peer. Its rate is 0 until first frame is paced
+    int16_t rssiAvg; ///< @brief Moving average of RSSI, in 1/16 dBm. 0 if nothing has been received
+    uint16_t txSuccessAvg; ///< @brief Moving average of confirmed transmissions, in 1/256 percent
+    uint32_t txFrames; ///< @brief Frames sent
+    uint32_t txFailures; ///< @brief Frames not confirmed
+    uint32_t txRetries; ///< @brief Frames sent again after driver ran out of memory
+    uint32_t rxFrames; ///< @brief Frames received
+    uint32_t rateStart; ///< @brief Start of current rate period, in milliseconds
+    uint16_t txPeriodFrames; ///< @brief Frames sent in current rate period
+    uint16_t rxPeriodFrames; ///< @brief Frames received in current rate period
+    uint16_t txRate; ///< @brief Frames per second sent in last period
+    uint16_t rxRate; ///< @brief Frames per second received in last period
+    uint16_t prev; ///< @brief Previous peer in its list, more recently used. `ESPNOW_NO_PEER` if first
+    uint16_t next; ///< @brief Next peer in its list, less recently used. `ESPNOW_NO_PEER` if last
 } peer_t;
+
+typedef struct {
+    uint16_t head; ///< @brief Most recently used peer
+    uint16_t tail; ///< @brief Least recently used peer
+} peer_lru_t;
+
 typedef struct {
-    uint8_t peer_number;
-    peer_t peer[ESP_NOW_MAX_TOTAL_PEER_NUM];
+    uint8_t peer_number; ///< @brief Peers registered in driver
+    uint16_t known_peers; ///< @brief Peers remembered, registered or not
+    peer_t peer[ESPNOW_MAX_PEERS];
+    uint16_t index[peerHashSize ()]; ///< @brief Open addressing hash table on MAC address, with linear probing. It holds peer indexes
+    peer_lru_t active; ///< @brief Peers registered in driver, by last use
+    peer_lru_t inactive; ///< @brief Peers remembered but not registered, by last use
+    peer_lru_t free; ///< @brief Unused entries
 } peer_list_t;
 
+/**
+  * @brief Peers known by QuickEspNow. Lookup is a hash on MAC address, and every peer is linked in a least recently
+  * used list, so that adding, finding and evicting peers take constant time.
+  *
+  * Driver only accepts `ESP_NOW_MAX_TOTAL_PEER_NUM` peers. Registered peers are the hot subset of up to
+  * `ESPNOW_MAX_PEERS` remembered ones. When a peer is deleted from driver it stays known, so that its state survives,
+  * until its entry is needed for a new peer
+  */
 class PeerListClass {
 protected:
     peer_list_t peer_list;
 
+    static uint16_t hash (const uint8_t* mac);
+    uint16_t lookup (const uint8_t* mac);
+    void unlink (peer_lru_t& list, uint16_t peer);
+    void push_front (peer_lru_t& list, uint16_t peer);
+    void remove_index (uint16_t peer);
+    uint16_t create_peer (const uint8_t* mac);
+
 public:
+    PeerListClass ();
     bool peer_exists (const uint8_t* mac);
     peer_t* get_peer (const uint8_t* mac);
+    /**
+      * @brief Finds a known peer, registered in driver or not
+      * @param mac Peer address
+      * @return Peer state. `NULL` if it is not known
+      */
+    peer_t* find_peer (const uint8_t* mac);
     bool update_peer_use (const uint8_t* mac);
+    /**
+      * @brief Finds a peer, or remembers it without registering it in driver, so that link quality of nodes that
+      * are only heard is kept too. Registered peers keep their place in use order
+      * @param mac Peer address
+      * @return Peer state
+      */
+    peer_t* track_peer (const uint8_t* mac);
     bool delete_peer (const uint8_t* mac);
     uint8_t* delete_peer ();
     bool add_peer (const uint8_t* mac);
     uint8_t get_peer_number ();
+    /**
+      * @brief Number of known peers, registered in driver or not
+      */
+    uint16_t get_known_peer_number () { return peer_list.known_peers; }
 #ifdef UNIT_TEST
     void dump_peer_list ();
 #endif
@@ -103,67 +419,377 @@ public:
 
 class QuickEspNow : public Comms_halClass {
 public:
+    QuickEspNow ();
+    /**
+      * @brief Selects radio driver. Must be called before `begin`. ESP32 uses ESP-NOW driver by default
+      * @param driver Radio driver to use
+      */
+    void setDriver (EspNowDriverClass* driver) { this->driver = driver; }
     bool begin (uint8_t channel = CURRENT_WIFI_CHANNEL, uint32_t interface = 0, bool synchronousSend = true) override;
+    /**
+      * @brief Starts ESP-NOW with given queue sizes
+      * @param txQueueBytes Transmission queue size in bytes. It has to hold at least 2 messages of maximum length (`ESPNOW_TX_RECORD_LEN` bytes each)
+      * @param rxQueueBytes Reception queue size in bytes. It has to hold at least 2 messages of maximum length (`ESPNOW_RX_RECORD_LEN` bytes each)
+      * @return Returns `true` if ESP-NOW was started, `false` otherwise
+      */
+    bool begin (uint8_t channel, uint32_t interface, bool synchronousSend, size_t txQueueBytes, size_t rxQueueBytes);
     void stop () override;
     comms_send_error_t send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len) override;
+    /**
+      * @brief Sends a message and gets a handle to learn its result
+      * @param dstAddress Destination address
+      * @param payload Message payload
+      * @param payload_len Payload length
+      * @param handle If not `NULL`, it gets message handle. Result has to be collected with `wait`
+      * @param ctx User context passed to `onSendComplete` callback
+      * @return Same result as `send`. `COMMS_SEND_QUEUE_FULL_ERROR` also if `ESPNOW_MAX_TRACKED_MESSAGES` are already tracked
+      */
+    comms_send_error_t send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len, espnow_send_handle_t* handle, void* ctx = NULL);
+    /**
+      * @brief Sends a message in a priority class. Control messages are sent before normal ones, and those before bulk ones
+      * @param dstAddress Destination address
+      * @param payload Message payload
+      * @param payload_len Payload length
+      * @param priority Priority class. Message goes to queue of that class
+      * @param handle If not `NULL`, it gets message handle. Result has to be collected with `wait`
+      * @param ctx User context passed to `onSendComplete` callback
+      * @return Same result as `send`. `COMMS_SEND_QUEUE_FULL_ERROR` refers to queue of given class
+      */
+    comms_send_error_t send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len, espnow_priority_t priority, espnow_send_handle_t* handle = NULL, void* ctx = NULL);
+    /**
+      * @brief Queues several messages at once. Either all of them are queued or none is.
+      * Queue space for the whole batch is taken before any message is visible to tx task, that is woken up only once
+      * @param entries Messages to send. Their `status` gets the result of each one
+      * @param count Number of messages
+      * @param priority Priority class of all messages in batch
+      * @return `COMMS_SEND_OK` if every message was queued, or confirmed in synchronous mode. Otherwise, error of the
+      * first failed message. Whole batch fails with `COMMS_SEND_QUEUE_FULL_ERROR` if it does not fit in queue. Batch
+      * may need one more message of space when it wraps around the end of queue storage, so it only fits for sure if
+      * it takes less than queue size minus `ESPNOW_TX_RECORD_LEN`. In synchronous mode a batch may have up to
+      * `ESPNOW_MAX_TRACKED_MESSAGES` messages
+      */
+    comms_send_error_t sendBatch (espnow_batch_entry_t* entries, size_t count, espnow_priority_t priority = ESPNOW_PRIORITY_NORMAL);
     comms_send_error_t sendBcast (const uint8_t* payload, size_t payload_len) {
         return send (ESPNOW_BROADCAST_ADDRESS, payload, payload_len);
     }
+    /**
+      * @brief Gets a buffer inside transmission queue so that message can be written in place, without copies.
+      * Every successful call has to be followed by `commit` or `cancel` from the same task. Other tasks calling
+      * `send` or `reserve` wait until then
+      * @param dstAddress Destination address
+      * @param maxLen Maximum number of bytes that will be written. Up to `ESPNOW_MAX_MESSAGE_LENGTH`
+      * @param priority Priority class of message
+      * @return Pointer to payload buffer. `NULL` if parameters are wrong or queue is full
+      */
+    uint8_t* reserve (const uint8_t* dstAddress, size_t maxLen = ESPNOW_MAX_MESSAGE_LENGTH, espnow_priority_t priority = ESPNOW_PRIORITY_NORMAL);
+    /**
+      * @brief Queues message written in buffer got with `reserve`. Messages written in place are not compressed, so
+      * with compression enabled a message that starts with `ESPNOW_COMPRESSED_MAGIC` is rejected with `COMMS_SEND_PARAM_ERROR`
+      * and reservation is cancelled, as receiver would take it as a compressed one. Use `send` for those
+      * @param payload_len Number of bytes actually written. Must not be greater than `maxLen` given to `reserve`
+      * @param handle If not `NULL`, it gets message handle. Result has to be collected with `wait`
+      * @param ctx User context passed to `onSendComplete` callback
+      * @return Same result as `send` would give
+      */
+    comms_send_error_t commit (size_t payload_len, espnow_send_handle_t* handle = NULL, void* ctx = NULL);
+    /**
+      * @brief Waits for a message to be confirmed or given as failed, and collects its result. Handle is not valid after that.
+      * In synchronous mode `send` collects result itself
+      * @param handle Handle got from `send` or `commit`
+      * @param timeout_ms Maximum time to wait. 0 just checks if result is ready
+      * @return `COMMS_SEND_OK` if message was confirmed, `COMMS_SEND_CONFIRM_ERROR` if it failed,
+      * `COMMS_SEND_TIMEOUT_ERROR` if it has not completed yet and `COMMS_SEND_PARAM_ERROR` if handle is not valid
+      */
+    comms_send_error_t wait (espnow_send_handle_t handle, uint32_t timeout_ms);
+    /**
+      * @brief Releases buffer got with `reserve` without sending anything
+      */
+    void cancel ();
     void onDataRcvd (comms_hal_rcvd_data dataRcvd) override;
+    /**
+      * @brief Attach a function to be called on every received message with a view of the receive buffer, without copies.
+      * When it is set, `onDataRcvd` callback is not called.
+      * Message is only valid until callback returns, unless `keep` is called on it
+      * @param dataRcvdView Callback function
+      */
+    void onDataRcvdView (espnow_rx_view_cb_t dataRcvdView);
+    /**
+      * @brief Keeps a received message after view callback returns, so that it can be handed off to another task.
+      * Reception queue space is freed in order, so kept messages hold back space of newer ones until `release` is called
+      * @param message Message got in view callback
+      */
+    void keep (espnow_rx_message_t* message);
+    /**
+      * @brief Frees a kept message. It may be called from any task
+      * @param message Message previously kept
+      */
+    void release (espnow_rx_message_t* message);
     void onDataSent (comms_hal_sent_data sentResult) override;
+    /**
+      * @brief Attach a function to be called when every message sent with a handle or a context completes
+      * @param sendComplete Callback function. It is called from tx task and should return quickly
+      */
+    void onSendComplete (espnow_send_complete_cb_t sendComplete);
+    /**
+      * @brief Attach a function to be called with latency of every message that goes through the queues
+      * @param latencyProbe Callback function. Transmission latency is reported from WiFi task context, it should return quickly
+      */
+    void onLatencySample (espnow_latency_probe_t latencyProbe);
     uint8_t getAddressLength ()  override { return ESPNOW_ADDR_LEN; }
     uint8_t getMaxMessageLength ()  override { return ESPNOW_MAX_MESSAGE_LENGTH; }
     void enableTransmit (bool enable) override;
     bool setChannel (uint8_t channel, wifi_second_chan_t ch2 = WIFI_SECOND_CHAN_NONE);
     bool setWiFiBandwidth (wifi_interface_t iface = WIFI_IF_AP, wifi_bandwidth_t bw = WIFI_BW_HT20);
     bool readyToSendData ();
+    /**
+      * @brief Blocks until a message of maximum length fits in transmission queue of a priority class, so that
+      * producers do not have to poll `readyToSendData`. Caller is woken up as soon as tx task frees space
+      * @param timeout_ms Maximum time to wait. 0 just checks if there is space
+      * @param priority Priority class
+      * @return `true` if there is space, `false` on timeout or if ESP-NOW has not been started
+      */
+    bool waitForQueueSpace (uint32_t timeout_ms, espnow_priority_t priority = ESPNOW_PRIORITY_NORMAL);
+    /**
+      * @brief Sets watermarks of a queue. A high event is reported when queue usage reaches `highPercent` of its size
+      * or when it rejects a message, and a low event when usage goes down to `lowPercent` after that
+      * @param queue Queue to watch
+      * @param highPercent High watermark, as a percentage of queue size. 0 disables watermarks of this queue
+      * @param lowPercent Low watermark, as a percentage of queue size. Must be lower than `highPercent`
+      * @return `false` if parameters are wrong
+      */
+    bool setQueueWatermarks (espnow_queue_id_t queue, uint8_t highPercent, uint8_t lowPercent);
+    /**
+      * @brief Attach a function to be called when a queue crosses its watermarks. Transmission high events come from
+      * task that queues the message and low events from tx task. Reception events come from rx task. It should not
+      * block nor send in synchronous mode, and it should return quickly
+      * @param queueWatermark Callback function
+      */
+    void onQueueWatermark (espnow_watermark_cb_t queueWatermark);
+    /**
+      * @brief Lets queues grow when messages are dropped and shrink when they stay mostly empty.
+      * Queues are only resized while they are empty
+      * @param ramBudget Maximum RAM that both queues may use together, in bytes. 0 disables adaptive sizing
+      */
+    void enableAdaptiveQueues (size_t ramBudget);
+    /**
+      * @brief Returns current transmission queue size in bytes
+      */
+    size_t getTxQueueBytes () { return tx_queue.capacity (); }
+    /**
+      * @brief Sets queue size and drop policy of a priority class. Must be called before `begin` or while stopped.
+      * A full queue rejects new messages with `COMMS_SEND_QUEUE_FULL_ERROR`
+      * @param priority Priority class
+      * @param bytes Queue size in bytes. It has to hold at least 2 messages of maximum length (`ESPNOW_TX_RECORD_LEN` bytes each).
+      * Normal class size may also be given to `begin`
+      * @param maxAge_ms Messages that have waited longer than this are dropped instead of sent, and complete as failed. 0 sends them all
+      * @return `false` if size is too small or there is not enough memory
+      */
+    bool setPriorityQueue (espnow_priority_t priority, size_t bytes, uint32_t maxAge_ms = 0);
+    /**
+      * @brief Number of messages of a priority class dropped because they waited longer than its maximum age
+      */
+    uint32_t getExpiredMessages (espnow_priority_t priority) { return getDroppedMessages ((espnow_queue_id_t)priority, ESPNOW_DROP_EXPIRED); }
+    /**
+      * @brief Sets what a queue does when a message does not fit. Transmission queues may block the producer, that
+      * then gets `COMMS_SEND_QUEUE_FULL_ERROR` only after timeout. Oldest messages dropped from a transmission queue
+      * complete as failed. A reception queue that drops oldest messages skips stale ones when user callback falls behind
+      * @param queue Queue to configure
+      * @param policy Overflow policy
+      * @param timeout_ms Maximum time to wait with `ESPNOW_OVERFLOW_BLOCK`
+      * @return `false` if queue cannot use that policy
+      */
+    bool setOverflowPolicy (espnow_queue_id_t queue, espnow_overflow_policy_t policy, uint32_t timeout_ms = 0);
+    /**
+      * @brief Number of messages of a queue dropped for a reason
+      * @param queue Queue
+      * @param reason Drop reason
+      */
+    uint32_t getDroppedMessages (espnow_queue_id_t queue, espnow_drop_reason_t reason) {
+        return queue < ESPNOW_QUEUES && reason < ESPNOW_DROP_REASONS ? stats.drops[queue][reason].load () : 0;
+    }
+    /**
+      * @brief Gets a snapshot of engine statistics. Counters are always kept and they are read without locking, so
+      * it may be called from any task at any time. Counters are not read all at the same instant
+      * @param snapshot Statistics are copied here
+      */
+    void getStats (espnow_stats_t& snapshot);
+    /**
+      * @brief Sets every statistics counter to 0, including drop counters and queue high-water marks
+      */
+    void resetStats ();
+    /**
+      * @brief Returns current reception queue size in bytes
+      */
+    size_t getRxQueueBytes () { return rx_queue.capacity (); }
+    /**
+      * @brief Compresses messages given to `send` and `sendBatch` when that makes them smaller, and decompresses
+      * received ones before they reach callbacks. Compressed frames start with `ESPNOW_COMPRESSED_MAGIC`, other frames
+      * are sent unchanged. Both ends need it enabled with the same dictionary. Messages written with `reserve` are not compressed,
+      * so `commit` rejects them if they start with `ESPNOW_COMPRESSED_MAGIC`. A message given to `send` that starts with
+      * `ESPNOW_COMPRESSED_MAGIC` is always sent compressed, so that receiver does not take it as compressed. Up to
+      * `ESPNOW_COMPRESSED_MAGIC_MAX_LEN` bytes it always fits. Longer ones fail with `COMMS_SEND_PAYLOAD_LENGTH_ERROR`
+      * unless they compress
+      * @param enable `true` to enable compression
+      * @param dictionary Static dictionary. `NULL` uses `LZ_DEFAULT_DICTIONARY`
+      * @param dictLen Dictionary length. Up to `LzCodec::MAX_DICTIONARY`
+      */
+    void enableCompression (bool enable, const uint8_t* dictionary = NULL, size_t dictLen = 0);
+    /**
+      * @brief Paces transmission with a global token bucket and one per destination. Rates start at `maxRate` and
+      * adapt AIMD style: every confirmed frame adds `ESPNOW_PACING_STEP` frames per second, a failed frame cuts
+      * rate of its destination by half, and `ESP_ERR_ESPNOW_NO_MEM` cuts global rate by half. A frame rejected with
+      * `ESP_ERR_ESPNOW_NO_MEM` is kept in queue and sent again. Failures to a destination that keeps failing do not
+      * reduce global rate. Must be called before `begin`
+      * @param maxRate Maximum rate in frames per second. 0 disables pacing
+      * @param minRate Minimum rate in frames per second
+      */
+    void enablePacing (uint32_t maxRate, uint32_t minRate = ESPNOW_PACING_MIN_RATE);
+    /**
+      * @brief Current global transmission rate, in frames per second. 0 if pacing is disabled
+      */
+    uint32_t getTxRate () { return txBucket.getRate (); }
+    /**
+      * @brief Current transmission rate to a destination, in frames per second. It may be slightly out of date
+      * @param dstAddress Destination address
+      * @return Rate in frames per second. 0 if pacing is disabled or nothing has been sent to that destination yet
+      */
+    uint32_t getTxRate (const uint8_t* dstAddress);
+    /**
+      * @brief Gets quality of the link with a peer. Every sent and received frame updates it in constant time.
+      * Peer list is locked while it is copied, so it may wait for tx task to finish recording a frame
+      * @param address Peer address
+      * @param quality Link quality is copied here
+      * @return `false` if peer is not known. Up to `ESPNOW_MAX_PEERS` peers, sent to or heard from, are remembered
+      */
+    bool getLinkQuality (const uint8_t* address, espnow_link_quality_t& quality);
+    /**
+      * @brief Starts recording a binary trace of every message at enqueue, dequeue, driver send, tx_cb, rx_cb and
+      * dispatch. Every record takes 12 bytes and a few stores, so it may be left enabled while measuring latency.
+      * Use `tools/trace_decode.py` to render dumps as per message timelines
+      * @param records Trace size in records. It is only used on first call. 0 pauses recording
+      * @return `false` if there is not enough memory
+      */
+    bool enableTrace (size_t records = ESPNOW_TRACE_RECORDS) { return trace.enable (records); }
+    /**
+      * @brief Writes records taken since previous dump, after an `espnow_trace_header_t`. Records written during
+      * dump may come out torn, so pause recording with `enableTrace (0)` first if that matters
+      * @param write Function that gets dump bytes, i.e. to write them to a file or to serial port
+      * @return Number of records written
+      */
+    size_t dumpTrace (espnow_trace_writer_t write) { return trace.dump (write); }
 
 protected:
+#ifdef ESP32
+    EspNowDriverClass* driver = &espNowEsp32Driver;
+#else
+    EspNowDriverClass* driver = NULL;
+#endif // ESP32
     wifi_interface_t wifi_if;
     PeerListClass peer_list;
     TaskHandle_t espnowTxTask;
     TaskHandle_t espnowRxTask;
 
-#ifdef MEAS_TPUT
-    unsigned long txDataSent = 0;
-    unsigned long rxDataReceived = 0;
-    unsigned long txDataDropped = 0;
-    time_t lastDataTPMeas = 0;
-    TimerHandle_t dataTPTimer;
-    float txDataTP = 0;
-    float rxDataTP = 0;
-    float txDroppedDataRatio = 0;
-
-    static void tp_timer_cb (void* param);
-    void calculateDataTP ();
-#endif // MEAS_TPUT
-
-    bool readyToSend = true;
-    bool waitingForConfirmation = false;
+
     bool synchronousSend = false;
-    uint8_t sentStatus;
-    int queueSize = ESPNOW_QUEUE_SIZE;
+    uint8_t sentStatus; ///< @brief Result of last message processed by tx task
+    uint8_t confirmedStatus; ///< @brief Status given by last tx_cb
+    SemaphoreHandle_t txConfirmed = NULL; ///< @brief Given by tx_cb. Tx task waits for it before sending next message
+    SendTrackerClass sendTracker;
+    EventGroupHandle_t sendDone = NULL; ///< @brief One bit per tracking slot. Set by tx task when message result is ready
+    espnow_send_complete_cb_t sendComplete = 0;
+    SemaphoreHandle_t inflightMutex = NULL; ///< @brief Protects in-flight message fields, that tx task and tx_cb share
+    bool inflight = false; ///< @brief Sent message waits for tx_cb. Cleared by tx_cb or by tx task on timeout, whichever comes first
+    uint8_t inflightDstAddress[ESP_NOW_ETH_ALEN]; ///< @brief tx_cb calls for other addresses belong to messages that already timed out
+    uint32_t inflightEnqueueTime = 0; ///< @brief Also identifies message waiting for confirmation in trace records
+    espnow_latency_probe_t latencyProbe = 0;
+    espnow_watermark_cb_t queueWatermark = 0;
+    espnow_queue_watermark_t watermarks[ESPNOW_QUEUES];
+    EventGroupHandle_t queueSpace = NULL; ///< @brief One bit per priority class. Set by tx task every time it frees space in that class queue
+    std::atomic<bool> rxOverflow { false }; ///< @brief rx_cb has dropped a message since rx task last checked watermarks
+    espnow_overflow_t overflow[ESPNOW_QUEUES];
+    espnow_stats_counters_t stats;
+    EspNowTraceClass trace;
+    std::atomic<size_t> roomRequest[ESPNOW_PRIORITY_CLASSES]; ///< @brief Room a producer waits for in a queue that drops oldest messages. Tx task drops them until it fits
 
-    QueueHandle_t tx_queue;
-    QueueHandle_t rx_queue;
+    BipBuffer tx_queue; ///< @brief Normal class queue. Producers of every class are serialized by `txProducerMutex`. Consumer is tx task
+    BipBuffer txControlQueue;
+    BipBuffer txBulkQueue;
+    espnow_tx_class_t txClasses[ESPNOW_PRIORITY_CLASSES]; ///< @brief Served in strict priority order, with starvation protection
+    SemaphoreHandle_t txProducerMutex = NULL;
+    SemaphoreHandle_t peerListMutex = NULL; ///< @brief Held by tx task while it changes peer list, and by other tasks while they read it
+    comms_tx_queue_item_t* reservedMessage = NULL; ///< @brief Record got by `reserve` and not committed yet
+    BipBuffer* reservedQueue = NULL; ///< @brief Queue where `reservedMessage` lives
+    espnow_priority_t reservedPriority = ESPNOW_PRIORITY_NORMAL; ///< @brief Priority class of `reservedQueue`
+    size_t reservedLen = 0;
+    bool compression = false;
+    const uint8_t* compressionDictionary = NULL;
+    size_t compressionDictLen = 0;
+    BipBuffer rx_queue; ///< @brief Messages are written once by rx_cb (single producer) and dispatched in place by rx task (single consumer)
+    size_t rxDispatchPosition = 0; ///< @brief Next message to dispatch. Messages between queue read position and this one are dispatched but may be kept
+    espnow_rx_view_cb_t dataRcvdView = 0;
+    size_t queueRamBudget = 0; ///< @brief RAM budget for adaptive queues. 0 if they are disabled
+    uint32_t pacingMaxRate = 0; ///< @brief Maximum transmission rate in frames per second. 0 if pacing is disabled
+    uint32_t pacingMinRate = ESPNOW_PACING_MIN_RATE;
+    TokenBucketClass txBucket; ///< @brief Global pacing
+    TokenBucketClass broadcastBucket; ///< @brief Pacing of broadcast frames, that have no peer
+    uint32_t txPacingWait = 0; ///< @brief Time until next frame may be sent, in microseconds. 0 if tx task is not waiting for pacing
+    std::atomic<size_t> queueRamBytes { 0 }; ///< @brief RAM used by both queues
+    QueueTunerClass txTuner;
+    QueueTunerClass rxTuner;
+    std::atomic<bool> rxQueuePaused { false }; ///< @brief rx_cb drops messages while rx task resizes reception queue
+    std::atomic<bool> rxCbRunning { false }; ///< @brief rx_cb is writing into reception queue
     //SemaphoreHandle_t espnow_send_mutex;
     //uint8_t channel;
     bool followWiFiChannel = false;
+    std::atomic<bool> wifiChannelChanged { false }; ///< @brief WiFi connection may have moved radio to another channel
+    RingBuffer<espnow_link_sample_t> linkSamples; ///< @brief Filled by rx_cb and emptied by tx task, so that only tx task changes peer list
 
     void initComms ();
     bool addPeer (const uint8_t* peer_addr);
+    bool addBroadcastPeer ();
+    uint8_t* reserveMessage (const uint8_t* dstAddress, size_t maxLen, espnow_priority_t priority, comms_send_error_t& error);
+    size_t encodedMaxLength (const uint8_t* payload, size_t payload_len);
+    size_t encodePayload (uint8_t* buffer, const uint8_t* payload, size_t payload_len);
+    comms_send_error_t commitMessage (size_t payload_len, espnow_send_handle_t* handle, void* ctx);
+    bool resizeQueue (BipBuffer& queue, size_t bytes);
+    void tuneTxQueue ();
+    void tuneRxQueue ();
+    void checkWatermarks (espnow_queue_id_t queue, BipBuffer& buffer, bool full = false);
+    void recordQueueUsage (espnow_queue_id_t queue, size_t bytesUsed);
+    void recordDriverError (int32_t error);
+    static espnow_driver_error_t driverErrorKind (int32_t error);
+    bool waitForRoom (espnow_priority_t priority, size_t len, uint32_t start, size_t messages);
+    void dropOldestMessages ();
+    bool dropOldestMessage (espnow_tx_class_t& txClass);
     static void espnowTxTask_cb (void* param);
     int32_t sendEspNowMessage (comms_tx_queue_item_t* message);
+    bool clearInflight ();
+    void completeMessage (comms_tx_queue_item_t* message);
+    void resetFlows (espnow_tx_class_t& txClass);
+    void scheduleMessages (espnow_tx_class_t& txClass);
+    TokenBucketClass* destinationBucket (const uint8_t* dstAddress, uint32_t now);
+    espnow_tx_class_t* nextClass (espnow_tx_flow_t*& flow);
+    espnow_tx_flow_t* nextFlow (espnow_tx_class_t& txClass, uint32_t now);
+    uint32_t flowWait (espnow_tx_flow_t& flow, uint32_t now);
+    bool classReady (espnow_tx_class_t& txClass, uint32_t now);
+    void adaptRate (const uint8_t* dstAddress, bool success, bool firstFailure);
+    void updateLinkRates (peer_t* peer, uint32_t now);
+    void recordLinkTx (peer_t* peer, bool success);
+    void recordLinkSamples ();
+    void releaseSentMessages (espnow_tx_class_t& txClass);
     void espnowTxHandle ();
 
     static void espnowRxTask_cb (void* param);
     void espnowRxHandle ();
 
-    static void ICACHE_FLASH_ATTR rx_cb (uint8_t* mac_addr, uint8_t* data, uint8_t len);
-    static void ICACHE_FLASH_ATTR tx_cb (uint8_t* mac_addr, uint8_t status);
+    static void ICACHE_FLASH_ATTR rx_cb (void* ctx, const uint8_t* mac_addr, const uint8_t* dst_addr, const uint8_t* data, uint8_t len, int8_t rssi);
+    static void ICACHE_FLASH_ATTR tx_cb (void* ctx, const uint8_t* mac_addr, uint8_t status);
+#ifdef ESP32
+    static void wifiEvent_cb (void* arg, esp_event_base_t base, int32_t id, void* data);
+#endif
 };
 
 extern QuickEspNow quickEspNow;
 
-#endif // ESP32
+#endif // ESP32 || QESPNOW_HOST
 #endif // _QUICK_ESPNOW_ESP32_h
\ No newline at end of file
@@ -2,6 +2,16 @@
 
 #ifdef ESP8266
 
+#ifdef QESPNOW_RAM_REPORT
+#define QESPNOW_STR_(x) #x
+#define QESPNOW_STR(x) QESPNOW_STR_(x)
+#pragma message ("QuickEspNow queue RAM: TX " QESPNOW_STR (ESPNOW_TX_QUEUE_BYTES) " bytes, control " QESPNOW_STR (ESPNOW_TX_CONTROL_QUEUE_BYTES) " bytes, bulk " QESPNOW_STR (ESPNOW_TX_BULK_QUEUE_BYTES) " bytes, RX " QESPNOW_STR (ESPNOW_RX_QUEUE_BYTES) " bytes")
+#endif // QESPNOW_RAM_REPORT
+static_assert (ESPNOW_TX_QUEUE_BYTES >= 2 * ESPNOW_TX_RECORD_LEN, "ESPNOW_TX_QUEUE_BYTES must hold at least two messages of maximum length");
+static_assert (ESPNOW_RX_QUEUE_BYTES >= 2 * ESPNOW_RX_RECORD_LEN, "ESPNOW_RX_QUEUE_BYTES must hold at least two messages of maximum length");
+static_assert (ESPNOW_TX_CONTROL_QUEUE_BYTES >= 2 * ESPNOW_TX_RECORD_LEN, "ESPNOW_TX_CONTROL_QUEUE_BYTES must hold at least two messages of maximum length");
+static_assert (ESPNOW_TX_BULK_QUEUE_BYTES >= 2 * ESPNOW_TX_RECORD_LEN, "ESPNOW_TX_BULK_QUEUE_BYTES must hold at least two messages of maximum length");
+
 typedef struct {
     signed rssi : 8;
     unsigned rate : 4;
@@ -36,10 +46,44 @@ typedef struct {
 
 QuickEspNow quickEspNow;
 
+QuickEspNow::QuickEspNow () :
+    tx_queue (ESPNOW_TX_QUEUE_BYTES), txControlQueue (ESPNOW_TX_CONTROL_QUEUE_BYTES), txBulkQueue (ESPNOW_TX_BULK_QUEUE_BYTES), rx_queue (ESPNOW_RX_QUEUE_BYTES) {
+    txClasses[ESPNOW_PRIORITY_CONTROL].queue = &txControlQueue;
+    txClasses[ESPNOW_PRIORITY_NORMAL].queue = &tx_queue;
+    txClasses[ESPNOW_PRIORITY_BULK].queue = &txBulkQueue;
+    for (int i = 0; i < ESPNOW_PRIORITY_CLASSES; i++) {
+        txClasses[i].maxAge_ms = 0;
+        txClasses[i].skipped = 0;
+    }
+    for (int i = 0; i < ESPNOW_QUEUES; i++) {
+        watermarks[i].high = 0;
+        watermarks[i].low = 0;
+        watermarks[i].above = false;
+        overflow[i].policy = ESPNOW_OVERFLOW_DROP_NEWEST;
+        overflow[i].timeout_ms = 0;
+    }
+    resetStats ();
+}
+
 bool QuickEspNow::begin (uint8_t channel, uint32_t wifi_interface, bool synchronousSend) {
+    return begin (channel, wifi_interface, synchronousSend, tx_queue.capacity (), rx_queue.capacity ());
+}
+
+bool QuickEspNow::begin (uint8_t channel, uint32_t wifi_interface, bool synchronousSend, size_t txQueueBytes, size_t rxQueueBytes) {
 
     this->synchronousSend = synchronousSend;
 
+    if (txQueueBytes < 2 * ESPNOW_TX_RECORD_LEN || rxQueueBytes < 2 * ESPNOW_RX_RECORD_LEN) {
+        DEBUG_ERROR (QESPNOW_TAG, "Queues must hold at least two messages of maximum length");
+        return false;
+    }
+    if ((txQueueBytes != tx_queue.capacity () && !tx_queue.setCapacity (txQueueBytes))
+        || (rxQueueBytes != rx_queue.capacity () && !rx_queue.setCapacity (rxQueueBytes))) {
+        DEBUG_ERROR (QESPNOW_TAG, "Not enough memory for queues");
+        return false;
+    }
+    queueRamBytes = tx_queue.capacity () + rx_queue.capacity ();
+
     DEBUG_DBG (QESPNOW_TAG, "Channel: %d, Interface: %d", channel, wifi_interface);
     // Set the wifi interface
     switch (wifi_interface) {
@@ -88,8 +132,128 @@ void QuickEspNow::stop () {
     esp_now_deinit ();
 }
 
+bool QuickEspNow::setPriorityQueue (espnow_priority_t priority, size_t bytes, uint32_t maxAge_ms) {
+    espnow_tx_class_t* txClass;
+
+    if (priority >= ESPNOW_PRIORITY_CLASSES || bytes < 2 * ESPNOW_TX_RECORD_LEN) {
+        DEBUG_ERROR (QESPNOW_TAG, "Queues must hold at least two messages of maximum length");
+        return false;
+    }
+    txClass = &txClasses[priority];
+    if (bytes != txClass->queue->capacity () && !txClass->queue->setCapacity (bytes)) {
+        DEBUG_ERROR (QESPNOW_TAG, "Not enough memory for queue");
+        return false;
+    }
+    txClass->skipped = 0;
+    txClass->maxAge_ms = maxAge_ms;
+    return true;
+}
+
 bool QuickEspNow::readyToSendData () {
-    return tx_queue.size () < queueSize;
+    return tx_queue.fits (sizeof (comms_tx_queue_item_t) + ESPNOW_MAX_MESSAGE_LENGTH);
+}
+
+bool QuickEspNow::waitForQueueSpace (uint32_t timeout_ms, espnow_priority_t priority) {
+    uint32_t start = millis ();
+
+    if (priority >= ESPNOW_PRIORITY_CLASSES) {
+        return false;
+    }
+    // Transmission handler is a timer, so it only frees space while this yields
+    while (!txClasses[priority].queue->fits (sizeof (comms_tx_queue_item_t) + ESPNOW_MAX_MESSAGE_LENGTH)) {
+        if (millis () - start >= timeout_ms) {
+            return false;
+        }
+        delay (1);
+    }
+    return true;
+}
+
+bool QuickEspNow::setQueueWatermarks (espnow_queue_id_t queue, uint8_t highPercent, uint8_t lowPercent) {
+    if (queue >= ESPNOW_QUEUES || highPercent > 100 || (highPercent && lowPercent >= highPercent)) {
+        DEBUG_WARN (QESPNOW_TAG, "Wrong watermarks");
+        return false;
+    }
+    watermarks[queue].high = highPercent;
+    watermarks[queue].low = lowPercent;
+    watermarks[queue].above = false;
+    return true;
+}
+
+bool QuickEspNow::setOverflowPolicy (espnow_queue_id_t queue, espnow_overflow_policy_t policy, uint32_t timeout_ms) {
+    // rx_cb runs in WiFi context, that must never wait
+    if (queue >= ESPNOW_QUEUES || (queue == ESPNOW_QUEUE_RX && policy == ESPNOW_OVERFLOW_BLOCK)) {
+        DEBUG_WARN (QESPNOW_TAG, "Wrong overflow policy");
+        return false;
+    }
+    overflow[queue].policy = policy;
+    overflow[queue].timeout_ms = timeout_ms;
+    return true;
+}
+
+bool QuickEspNow::makeRoom (espnow_priority_t priority, size_t len, size_t messages) {
+    BipBuffer* queue = txClasses[priority].queue;
+    uint32_t start = millis ();
+
+    switch (overflow[priority].policy) {
+    case ESPNOW_OVERFLOW_DROP_OLDEST:
+        // Message in flight has been popped already, so every queued message may go
+        while (!queue->fits (len) && !queue->empty ()) {
+            comms_tx_queue_item_t* message = (comms_tx_queue_item_t*)queue->front ();
+            DEBUG_DBG (QESPNOW_TAG, "Message to " MACSTR " dropped to make room", MAC2STR (message->dstAddress));
+            stats.drops[priority][ESPNOW_DROP_OLDEST]++;
+            trace.record (ESPNOW_TRACE_DEQUEUE, message->dstAddress, message->enqueue_time, message->payload_len, ESPNOW_DROP_OLDEST + 1, priority);
+            completeMessage (message->tracking, message->dstAddress, ESP_NOW_SEND_FAIL);
+            queue->pop ();
+        }
+        break;
+    case ESPNOW_OVERFLOW_BLOCK:
+        // Transmission handler is a timer, so it only frees space while this yields
+        while (!queue->fits (len) && millis () - start < overflow[priority].timeout_ms) {
+            delay (1);
+        }
+        if (!queue->fits (len)) {
+            stats.drops[priority][ESPNOW_DROP_TIMEOUT] += messages;
+            return false;
+        }
+        break;
+    default:
+        break;
+    }
+    if (!queue->fits (len)) {
+        stats.drops[priority][ESPNOW_DROP_NEWEST] += messages;
+        return false;
+    }
+    return true;
+}
+
+void QuickEspNow::recordQueueUsage (espnow_queue_id_t queue, size_t bytesUsed) {
+    if (bytesUsed > stats.queueHighWater[queue]) {
+        stats.queueHighWater[queue] = bytesUsed;
+    }
+}
+
+void QuickEspNow::onQueueWatermark (espnow_watermark_cb_t queueWatermark) {
+    this->queueWatermark = queueWatermark;
+}
+
+void QuickEspNow::checkWatermarks (espnow_queue_id_t queue, BipBuffer& buffer, bool full) {
+    espnow_queue_watermark_t& watermark = watermarks[queue];
+    size_t used;
+
+    if (!watermark.high || !queueWatermark) {
+        return;
+    }
+    used = buffer.bytesUsed ();
+    if (full || used * 100 >= buffer.capacity () * watermark.high) {
+        if (!watermark.above) {
+            watermark.above = true;
+            queueWatermark (queue, ESPNOW_WATERMARK_HIGH, used);
+        }
+    } else if (watermark.above && used * 100 <= buffer.capacity () * watermark.low) {
+        watermark.above = false;
+        queueWatermark (queue, ESPNOW_WATERMARK_LOW, used);
+    }
 }
 
 bool QuickEspNow::setChannel (uint8_t channel) {
@@ -110,9 +274,19 @@ bool QuickEspNow::setChannel (uint8_t channel) {
 }
 
 comms_send_error_t QuickEspNow::send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len) {
-    comms_tx_queue_item_t message;
+    return send (dstAddress, payload, payload_len, NULL, NULL);
+}
 
-    if (!dstAddress || !payload || !payload_len) {
+comms_send_error_t QuickEspNow::send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len, espnow_send_handle_t* handle, void* ctx) {
+    return send (dstAddress, payload, payload_len, ESPNOW_PRIORITY_NORMAL, handle, ctx);
+}
+
+comms_send_error_t QuickEspNow::send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len, espnow_priority_t priority, espnow_send_handle_t* handle, void* ctx) {
+    uint8_t* buffer;
+    size_t maxLen;
+    size_t len;
+
+    if (!dstAddress || !payload || !payload_len || priority >= ESPNOW_PRIORITY_CLASSES) {
         DEBUG_WARN (QESPNOW_TAG, "Parameters error");
         return COMMS_SEND_PARAM_ERROR;
     }
@@ -122,85 +296,371 @@ comms_send_error_t QuickEspNow::send (const uint8_t* dstAddress, const uint8_t*
         return COMMS_SEND_PAYLOAD_LENGTH_ERROR;
     }
 
-    if (tx_queue.size () >= ESPNOW_QUEUE_SIZE) {
-#ifdef MEAS_TPUT
-        //comms_tx_queue_item_t* tempBuffer;
-        //tempBuffer = tx_queue.front ();
-        //txDataDropped += tempBuffer->payload_len;
-#endif // MEAS_TPUT
-        // tx_queue.pop ();
-        // DEBUG_DBG (QESPNOW_TAG, "Message dropped");
+    maxLen = encodedMaxLength (payload, payload_len);
+    if (!txClasses[priority].queue->fits (sizeof (comms_tx_queue_item_t) + maxLen) && !makeRoom (priority, sizeof (comms_tx_queue_item_t) + maxLen, 1)) {
+        if (priority == ESPNOW_PRIORITY_NORMAL) {
+            txTuner.recordDrop ();
+        }
+        checkWatermarks ((espnow_queue_id_t)priority, *txClasses[priority].queue, true);
         return COMMS_SEND_QUEUE_FULL_ERROR;
     }
 
-    memcpy (message.dstAddress, dstAddress, ESP_NOW_ETH_ALEN);
-    message.payload_len = payload_len;
-    memcpy (message.payload, payload, payload_len);
-
-    if (tx_queue.push (&message)) {
-#ifdef MEAS_TPUT
-        txDataSent += message.payload_len;
-#endif // MEAS_TPUT
-        DEBUG_DBG (QESPNOW_TAG, "--------- %d Comms messages queued. Len: %d", tx_queue.size (), payload_len);
-        DEBUG_VERBOSE (QESPNOW_TAG, "--------- Ready to send is %s", readyToSend ? "true" : "false");
-        if (synchronousSend) {
-            waitingForConfirmation = true;
-            DEBUG_INFO (QESPNOW_TAG, "--------- Waiting for send confirmation");
-            while (waitingForConfirmation) {
-                esp_yield ();
-            }
-            DEBUG_INFO (QESPNOW_TAG, "--------- Confirmation is %s", sentStatus == ESP_NOW_SEND_SUCCESS ? "true" : "false");
-            return (sentStatus == ESP_NOW_SEND_SUCCESS) ? COMMS_SEND_OK : COMMS_SEND_CONFIRM_ERROR;
-        }
-        return COMMS_SEND_OK;
-    } else {
+    if (!(buffer = reserve (dstAddress, maxLen, priority))) {
         DEBUG_WARN (QESPNOW_TAG, "Error queuing Comms message to " MACSTR, MAC2STR (dstAddress));
         return COMMS_SEND_MSG_ENQUEUE_ERROR;
     }
+    if (!(len = encodePayload (buffer, payload, payload_len))) {
+        DEBUG_WARN (QESPNOW_TAG, "Length error. %d", payload_len);
+        cancel ();
+        return COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+    }
+    return commitMessage (len, handle, ctx);
+}
+
+void QuickEspNow::enableCompression (bool enable, const uint8_t* dictionary, size_t dictLen) {
+    if (!dictionary) {
+        dictionary = (const uint8_t*)LZ_DEFAULT_DICTIONARY;
+        dictLen = sizeof (LZ_DEFAULT_DICTIONARY) - 1;
+    }
+    if (dictLen > LzCodec::MAX_DICTIONARY) {
+        // Matches cannot reach farther than this, so only the end of dictionary is useful
+        dictionary += dictLen - LzCodec::MAX_DICTIONARY;
+        dictLen = LzCodec::MAX_DICTIONARY;
+    }
+    compressionDictionary = dictionary;
+    compressionDictLen = dictLen;
+    compression = enable;
+}
+
+size_t QuickEspNow::encodedMaxLength (const uint8_t* payload, size_t payload_len) {
+    // Messages that look like a compressed frame are always sent compressed, even if that makes them longer
+    if (compression && payload[0] == ESPNOW_COMPRESSED_MAGIC) {
+        size_t len = 1 + payload_len + (payload_len + LzCodec::MAX_LITERALS - 1) / LzCodec::MAX_LITERALS;
+        return len < ESP_NOW_MAX_DATA_LEN ? len : ESP_NOW_MAX_DATA_LEN;
+    }
+    return payload_len;
+}
+
+size_t QuickEspNow::encodePayload (uint8_t* buffer, const uint8_t* payload, size_t payload_len) {
+    bool mustCompress = compression && payload[0] == ESPNOW_COMPRESSED_MAGIC;
+    size_t len;
+
+    if (mustCompress || (compression && payload_len >= ESPNOW_COMPRESSION_MIN_LEN)) {
+        // Compressed frame has to be smaller than message, header included
+        size_t maxLen = mustCompress ? encodedMaxLength (payload, payload_len) : payload_len - 1;
+        if ((len = LzCodec::compress (payload, payload_len, buffer + 1, maxLen - 1, compressionDictionary, compressionDictLen))) {
+            buffer[0] = ESPNOW_COMPRESSED_MAGIC;
+            DEBUG_VERBOSE (QESPNOW_TAG, "Message compressed from %d to %d bytes", payload_len, len + 1);
+            return len + 1;
+        }
+        if (mustCompress) {
+            return 0;
+        }
+    }
+    memcpy (buffer, payload, payload_len);
+    return payload_len;
+}
+
+uint8_t* QuickEspNow::reserve (const uint8_t* dstAddress, size_t maxLen, espnow_priority_t priority) {
+    comms_tx_queue_item_t* message;
+    BipBuffer* queue;
+
+    if (!dstAddress || !maxLen || maxLen > ESP_NOW_MAX_DATA_LEN || priority >= ESPNOW_PRIORITY_CLASSES) {
+        DEBUG_WARN (QESPNOW_TAG, "Parameters error");
+        return NULL;
+    }
+
+    queue = txClasses[priority].queue;
+    if (!queue->fits (sizeof (comms_tx_queue_item_t) + maxLen) && !makeRoom (priority, sizeof (comms_tx_queue_item_t) + maxLen, 1)) {
+        checkWatermarks ((espnow_queue_id_t)priority, *queue, true);
+        return NULL;
+    }
+    if (!(message = (comms_tx_queue_item_t*)queue->reserve (sizeof (comms_tx_queue_item_t) + maxLen))) {
+        return NULL;
+    }
+    memcpy (message->dstAddress, dstAddress, ESP_NOW_ETH_ALEN);
+    message->tracking = ESPNOW_UNTRACKED;
+    reservedMessage = message;
+    reservedQueue = queue;
+    reservedPriority = priority;
+    reservedLen = maxLen;
+    return message->payload;
+}
+
+comms_send_error_t QuickEspNow::commit (size_t payload_len, espnow_send_handle_t* handle, void* ctx) {
+    // Receiver would try to expand a raw message that starts like a compressed frame
+    if (compression && reservedMessage && payload_len && reservedMessage->payload[0] == ESPNOW_COMPRESSED_MAGIC) {
+        DEBUG_WARN (QESPNOW_TAG, "Message written in place starts with compression magic");
+        cancel ();
+        return COMMS_SEND_PARAM_ERROR;
+    }
+    return commitMessage (payload_len, handle, ctx);
+}
+
+comms_send_error_t QuickEspNow::commitMessage (size_t payload_len, espnow_send_handle_t* handle, void* ctx) {
+    comms_tx_queue_item_t* message = reservedMessage;
+    espnow_send_handle_t messageHandle = ESPNOW_NO_HANDLE;
+
+    if (!message) {
+        DEBUG_WARN (QESPNOW_TAG, "Nothing reserved");
+        return COMMS_SEND_PARAM_ERROR;
+    }
+
+    if (!payload_len || payload_len > reservedLen) {
+        DEBUG_WARN (QESPNOW_TAG, "Length error. %d", payload_len);
+        cancel ();
+        return COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+    }
+
+    // Synchronous send is a tracked message whose result is collected here
+    if (handle || ctx || synchronousSend) {
+        message->tracking = sendTracker.allocate (ctx, handle || synchronousSend);
+        if (message->tracking == ESPNOW_UNTRACKED) {
+            DEBUG_WARN (QESPNOW_TAG, "Too many messages tracked");
+            cancel ();
+            return COMMS_SEND_QUEUE_FULL_ERROR;
+        }
+        messageHandle = sendTracker.handle (message->tracking);
+        if (handle) {
+            *handle = messageHandle;
+        }
+    }
+
+    message->payload_len = payload_len;
+    message->enqueue_time = micros ();
+    trace.record (ESPNOW_TRACE_ENQUEUE, message->dstAddress, message->enqueue_time, payload_len, 0, reservedPriority);
+    reservedMessage = NULL;
+    reservedQueue->commit (sizeof (comms_tx_queue_item_t) + payload_len);
+    if (reservedQueue == &tx_queue) {
+        txTuner.recordUsage (tx_queue.bytesUsed ());
+    }
+    recordQueueUsage ((espnow_queue_id_t)reservedPriority, reservedQueue->bytesUsed ());
+    checkWatermarks ((espnow_queue_id_t)reservedPriority, *reservedQueue);
+
+    DEBUG_DBG (QESPNOW_TAG, "--------- %d bytes in queue. Len: %d", reservedQueue->bytesUsed (), payload_len);
+    DEBUG_VERBOSE (QESPNOW_TAG, "--------- Ready to send is %s", readyToSend ? "true" : "false");
+    if (synchronousSend) {
+        comms_send_error_t result;
+        DEBUG_INFO (QESPNOW_TAG, "--------- Waiting for send confirmation");
+        // Every queued message is tracked and each one takes at most a confirmation timeout
+        if ((result = wait (messageHandle, (ESPNOW_MAX_TRACKED_MESSAGES + 1) * ESPNOW_TX_CONFIRM_TIMEOUT_MS + TASK_PERIOD)) == COMMS_SEND_TIMEOUT_ERROR) {
+            sendTracker.detach (messageHandle & 0xFF);
+            result = COMMS_SEND_CONFIRM_ERROR;
+        }
+        DEBUG_INFO (QESPNOW_TAG, "--------- Confirmation is %s", result == COMMS_SEND_OK ? "true" : "false");
+        return result;
+    }
+    return COMMS_SEND_OK;
+}
+
+comms_send_error_t QuickEspNow::sendBatch (espnow_batch_entry_t* entries, size_t count, espnow_priority_t priority) {
+    comms_send_error_t result = COMMS_SEND_OK;
+    comms_tx_queue_item_t* message;
+    uint8_t slots[ESPNOW_MAX_TRACKED_MESSAGES];
+    size_t staged = 0;
+    size_t batchBytes = 0;
+    bool retried = false;
+    uint32_t batchTime;
+    BipBuffer* queue;
+
+    if (!entries || !count || reservedMessage || priority >= ESPNOW_PRIORITY_CLASSES || (synchronousSend && count > ESPNOW_MAX_TRACKED_MESSAGES)) {
+        DEBUG_WARN (QESPNOW_TAG, "Parameters error");
+        return COMMS_SEND_PARAM_ERROR;
+    }
+    queue = txClasses[priority].queue;
+
+    // Whole batch is checked before anything is queued
+    for (size_t i = 0; i < count; i++) {
+        entries[i].status = COMMS_SEND_OK;
+        if (!entries[i].dstAddress || !entries[i].payload || !entries[i].payload_len || entries[i].payload_len > ESP_NOW_MAX_DATA_LEN) {
+            DEBUG_WARN (QESPNOW_TAG, "Length error in batch message %d", i);
+            entries[i].status = COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+            if (result == COMMS_SEND_OK) {
+                result = COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+            }
+        } else {
+            batchBytes += BipBuffer::footprint (sizeof (comms_tx_queue_item_t) + encodedMaxLength (entries[i].payload, entries[i].payload_len));
+        }
+    }
+
+    while (result == COMMS_SEND_OK) {
+        bool full = false;
+        // Messages are staged in queue and only published when all of them fit. Their queue times differ, so that they can be told apart in trace
+        batchTime = micros ();
+        for (staged = 0; staged < count; staged++) {
+            size_t len;
+            if (!(message = (comms_tx_queue_item_t*)queue->reserve (sizeof (comms_tx_queue_item_t) + encodedMaxLength (entries[staged].payload, entries[staged].payload_len)))) {
+                full = true;
+                result = COMMS_SEND_QUEUE_FULL_ERROR;
+                break;
+            }
+            if (!(len = encodePayload (message->payload, entries[staged].payload, entries[staged].payload_len))) {
+                DEBUG_WARN (QESPNOW_TAG, "Length error in batch message %d", staged);
+                result = entries[staged].status = COMMS_SEND_PAYLOAD_LENGTH_ERROR;
+                break;
+            }
+            message->tracking = ESPNOW_UNTRACKED;
+            if (synchronousSend) {
+                if ((message->tracking = sendTracker.allocate (NULL, true)) == ESPNOW_UNTRACKED) {
+                    DEBUG_WARN (QESPNOW_TAG, "Too many messages tracked");
+                    result = COMMS_SEND_QUEUE_FULL_ERROR;
+                    break;
+                }
+                slots[staged] = message->tracking;
+            }
+            memcpy (message->dstAddress, entries[staged].dstAddress, ESP_NOW_ETH_ALEN);
+            message->payload_len = len;
+            message->enqueue_time = batchTime + staged;
+            queue->commit (sizeof (comms_tx_queue_item_t) + len, false);
+        }
+        if (result == COMMS_SEND_OK) {
+            queue->publish ();
+            for (size_t i = 0; i < count; i++) {
+                trace.record (ESPNOW_TRACE_ENQUEUE, entries[i].dstAddress, batchTime + i, entries[i].payload_len, 0, priority);
+            }
+            if (queue == &tx_queue) {
+                txTuner.recordUsage (tx_queue.bytesUsed ());
+            }
+            recordQueueUsage ((espnow_queue_id_t)priority, queue->bytesUsed ());
+            checkWatermarks ((espnow_queue_id_t)priority, *queue);
+            break;
+        }
+        queue->rollback ();
+        for (size_t i = 0; synchronousSend && i < staged; i++) {
+            sendTracker.cancel (slots[i]);
+        }
+        // Batch is tried again as a whole once, after overflow policy has made room for it
+        if (!full || retried || !makeRoom (priority, batchBytes, count)) {
+            if (full && queue == &tx_queue) {
+                txTuner.recordDrop ();
+            }
+            checkWatermarks ((espnow_queue_id_t)priority, *queue, full);
+            break;
+        }
+        retried = true;
+        result = COMMS_SEND_OK;
+    }
+
+    if (result != COMMS_SEND_OK) {
+        // Messages that were right are not queued either
+        for (size_t i = 0; i < count; i++) {
+            if (entries[i].status == COMMS_SEND_OK) {
+                entries[i].status = result == COMMS_SEND_PAYLOAD_LENGTH_ERROR ? COMMS_SEND_MSG_ENQUEUE_ERROR : result;
+            }
+        }
+        return result;
+    }
+
+    DEBUG_DBG (QESPNOW_TAG, "--------- %d messages queued. %d bytes in queue", count, queue->bytesUsed ());
+
+    if (synchronousSend) {
+        for (size_t i = 0; i < count; i++) {
+            if ((entries[i].status = wait (sendTracker.handle (slots[i]), (ESPNOW_MAX_TRACKED_MESSAGES + 1) * ESPNOW_TX_CONFIRM_TIMEOUT_MS + TASK_PERIOD)) == COMMS_SEND_TIMEOUT_ERROR) {
+                sendTracker.detach (slots[i]);
+                entries[i].status = COMMS_SEND_CONFIRM_ERROR;
+            }
+            if (result == COMMS_SEND_OK) {
+                result = entries[i].status;
+            }
+        }
+    }
+    return result;
+}
+
+comms_send_error_t QuickEspNow::wait (espnow_send_handle_t handle, uint32_t timeout_ms) {
+    uint8_t slot = sendTracker.find (handle);
+    uint8_t status;
+
+    if (slot == ESPNOW_UNTRACKED) {
+        return COMMS_SEND_PARAM_ERROR;
+    }
+    // Sleeps until tx_cb schedules this context again
+    esp_delay (timeout_ms, [this, slot] () { return !sendTracker.completed (slot); });
+    if (!sendTracker.collect (slot, status)) {
+        return COMMS_SEND_TIMEOUT_ERROR;
+    }
+    return status == ESP_NOW_SEND_SUCCESS ? COMMS_SEND_OK : COMMS_SEND_CONFIRM_ERROR;
+}
+
+void QuickEspNow::cancel () {
+    reservedMessage = NULL;
+    reservedQueue = NULL;
 }
 
 void QuickEspNow::onDataRcvd (comms_hal_rcvd_data dataRcvd) {
     this->dataRcvd = dataRcvd;
 }
 
-#ifdef MEAS_TPUT
-void QuickEspNow::calculateDataTP () {
-    time_t measTime = (millis () - lastDataTPMeas);
-    lastDataTPMeas = millis ();
+void QuickEspNow::enableAdaptiveQueues (size_t ramBudget) {
+    txTuner.reset ();
+    rxTuner.reset ();
+    queueRamBudget = ramBudget;
+}
+
+bool QuickEspNow::resizeQueue (BipBuffer& queue, size_t bytes) {
+    size_t capacity = queue.capacity ();
 
-    if (txDataSent > 0) {
-        txDataTP = txDataSent * 1000 / measTime;
-        //DEBUG_WARN(QESPNOW_TAG, "Meas time: %d, Data sent: %d, Data TP: %f", measTime, txDataSent, txDataTP);
-        txDroppedDataRatio = (float)txDataDropped / (float)txDataSent;
-        //DEBUG_WARN(QESPNOW_TAG, "Data dropped: %d, Drop ratio: %f", txDataDropped, txDroppedDataRatio);
-        txDataSent = 0;
-    } else {
-        txDataTP = 0;
-        txDroppedDataRatio = 0;
+    if (bytes > capacity && queueRamBytes + bytes - capacity > queueRamBudget) {
+        return false;
     }
-    if (rxDataReceived > 0) {
-        rxDataTP = rxDataReceived * 1000 / measTime;
-        //DEBUG_WARN(QESPNOW_TAG, "Meas time: %d, Data received: %d, Data TP: %f", measTime, rxDataReceived, rxDataTP);
-        rxDataReceived = 0;
-    } else {
-        rxDataTP = 0;
+    if (!queue.setCapacity (bytes)) {
+        DEBUG_WARN (QESPNOW_TAG, "Not enough memory to resize queue to %u bytes", bytes);
+        return false;
+    }
+    queueRamBytes = queueRamBytes + bytes - capacity;
+    return true;
+}
+
+void QuickEspNow::tuneQueue (BipBuffer& queue, QueueTunerClass& tuner, size_t minBytes) {
+    size_t capacity = queue.capacity ();
+    size_t others = queueRamBytes - capacity;
+    size_t bytes;
+
+    // Callbacks and timers run in the same context, so an empty queue is not being used.
+    // Period is extended until queue gets empty, so that decision is not lost
+    if (!queue.empty () || (&queue == &tx_queue && reservedMessage)) {
+        return;
+    }
+    bytes = tuner.evaluate (capacity, minBytes, queueRamBudget > others ? queueRamBudget - others : 0);
+    if (bytes != capacity && resizeQueue (queue, bytes)) {
+        DEBUG_INFO (QESPNOW_TAG, "%s queue resized from %u to %u bytes", &queue == &tx_queue ? "TX" : "RX", capacity, bytes);
     }
-    txDataDropped = 0;
 }
 
-void QuickEspNow::tp_timer_cb (void* param) {
-    quickEspNow.calculateDataTP ();
-    DEBUG_WARN (QESPNOW_TAG, "TxData TP: %.3f kbps, Drop Ratio: %.2f %%, RxDataTP: %.3f kbps",
-                quickEspNow.txDataTP * 8 / 1000,
-                quickEspNow.txDroppedDataRatio * 100,
-                quickEspNow.rxDataTP * 8 / 1000);
+void QuickEspNow::onLatencySample (espnow_latency_probe_t latencyProbe) {
+    this->latencyProbe = latencyProbe;
 }
-#endif // MEAS_TPUT
 
 void QuickEspNow::onDataSent (comms_hal_sent_data sentResult) {
     this->sentResult = sentResult;
 }
 
+void QuickEspNow::onSendComplete (espnow_send_complete_cb_t sendComplete) {
+    this->sendComplete = sendComplete;
+}
+
+void QuickEspNow::completeMessage (uint8_t status) {
+    uint8_t slot = inflightTracking;
+
+    sentStatus = status;
+    inflightTracking = ESPNOW_UNTRACKED;
+    completeMessage (slot, inflightDstAddress, status);
+}
+
+void QuickEspNow::completeMessage (uint8_t slot, const uint8_t* dstAddress, uint8_t status) {
+    if (slot == ESPNOW_UNTRACKED) {
+        return;
+    }
+    // Callback is called first, while handle is still valid
+    if (sendComplete) {
+        sendComplete (sendTracker.handle (slot), dstAddress, status, sendTracker.context (slot));
+    }
+    if (sendTracker.complete (slot, status)) {
+        // Wakes up sender waiting for this message
+        esp_schedule ();
+    }
+}
+
 int32_t QuickEspNow::sendEspNowMessage (comms_tx_queue_item_t* message) {
     int32_t error;
 
@@ -210,6 +670,9 @@ int32_t QuickEspNow::sendEspNowMessage (comms_tx_queue_item_t* message) {
     }
     if (!(message->payload_len) || (message->payload_len > ESP_NOW_MAX_DATA_LEN)) {
         DEBUG_WARN (QESPNOW_TAG, "Message length error");
+        // It is popped without being sent, so whoever waits for it has to be told
+        stats.driverErrors[ESPNOW_DRIVER_ERROR_OTHER]++;
+        completeMessage (ESP_NOW_SEND_FAIL);
         return -1;
     }
 
@@ -218,35 +681,95 @@ int32_t QuickEspNow::sendEspNowMessage (comms_tx_queue_item_t* message) {
     readyToSend = false;
     DEBUG_VERBOSE (QESPNOW_TAG, "-------------- Ready to send: false");
 
+    inflightSendTime = millis ();
     error = esp_now_send (message->dstAddress, message->payload, message->payload_len);
     DEBUG_DBG (QESPNOW_TAG, "esp now send result = %d", error);
+    if (error) {
+        // There will be no confirmation for this message
+        stats.driverErrors[ESPNOW_DRIVER_ERROR_OTHER]++;
+        readyToSend = true;
+        completeMessage (ESP_NOW_SEND_FAIL);
+    } else {
+        stats.txFrames++;
+        stats.txBytes += message->payload_len;
+    }
 
     return error;
 }
 
+espnow_tx_class_t* QuickEspNow::nextClass () {
+    espnow_tx_class_t* selected = NULL;
+
+    // Strict priority. A class that has been passed over too many times goes first, so that it is never starved
+    for (int i = ESPNOW_PRIORITY_CLASSES - 1; i >= 0 && !selected; i--) {
+        if (!txClasses[i].queue->empty () && txClasses[i].skipped >= ESPNOW_TX_STARVATION_LIMIT) {
+            selected = &txClasses[i];
+        }
+    }
+    for (int i = 0; i < ESPNOW_PRIORITY_CLASSES && !selected; i++) {
+        if (!txClasses[i].queue->empty ()) {
+            selected = &txClasses[i];
+        }
+    }
+    for (int i = 0; i < ESPNOW_PRIORITY_CLASSES; i++) {
+        if (&txClasses[i] == selected) {
+            txClasses[i].skipped = 0;
+        } else if (!txClasses[i].queue->empty () && txClasses[i].skipped < UINT8_MAX) {
+            txClasses[i].skipped++;
+        }
+    }
+    return selected;
+}
+
 void QuickEspNow::espnowTxHandle () {
+    if (!readyToSend && millis () - inflightSendTime > ESPNOW_TX_CONFIRM_TIMEOUT_MS) {
+        DEBUG_WARN (QESPNOW_TAG, "Confirmation timeout");
+        stats.txTimeouts++;
+        readyToSend = true;
+        completeMessage (ESP_NOW_SEND_FAIL);
+    }
     if (readyToSend) {
         //DEBUG_WARN ("Process queue: Elements: %d", tx_queue.size ());
         comms_tx_queue_item_t* message;
-        while (!tx_queue.empty ()) {
-            if (!readyToSend) return;
-            message = tx_queue.front ();
-            DEBUG_DBG (QESPNOW_TAG, "Comms message got from queue. %d left", tx_queue.size ());
+        espnow_tx_class_t* txClass;
+        int32_t error;
+        // Only one message is in flight. Next one is sent when it is confirmed
+        while (readyToSend && (txClass = nextClass ())) {
+            message = (comms_tx_queue_item_t*)txClass->queue->front ();
+            DEBUG_DBG (QESPNOW_TAG, "Comms message got from queue. %d bytes in queue", txClass->queue->bytesUsed ());
             DEBUG_VERBOSE (QESPNOW_TAG, "Ready to send is %s", readyToSend ? "true" : "false");
             DEBUG_VERBOSE (QESPNOW_TAG, "synchrnousSend is %s", synchronousSend ? "true" : "false");
-            if (!sendEspNowMessage (message)) {
-                DEBUG_DBG (QESPNOW_TAG, "Message to " MACSTR " sent. Len: %u", MAC2STR (message->dstAddress), message->payload_len);
+            inflightEnqueueTime = message->enqueue_time;
+            inflightTracking = message->tracking;
+            memcpy (inflightDstAddress, message->dstAddress, ESP_NOW_ETH_ALEN);
+            if (txClass->maxAge_ms && (micros () - message->enqueue_time) / 1000 > txClass->maxAge_ms) {
+                // Stale message is not worth air time
+                DEBUG_DBG (QESPNOW_TAG, "Message to " MACSTR " expired", MAC2STR (message->dstAddress));
+                stats.drops[txClass - txClasses][ESPNOW_DROP_EXPIRED]++;
+                trace.record (ESPNOW_TRACE_DEQUEUE, message->dstAddress, message->enqueue_time, message->payload_len, ESPNOW_DROP_EXPIRED + 1, txClass - txClasses);
+                completeMessage (ESP_NOW_SEND_FAIL);
             } else {
-                DEBUG_WARN (QESPNOW_TAG, "Error sending message to " MACSTR ". Len: %u", MAC2STR (message->dstAddress), message->payload_len);
+                trace.record (ESPNOW_TRACE_DEQUEUE, message->dstAddress, message->enqueue_time, message->payload_len, 0, txClass - txClasses);
+                // tx_cb cannot run before this handler returns, so send record always comes before confirmation
+                error = sendEspNowMessage (message);
+                trace.record (ESPNOW_TRACE_SEND, message->dstAddress, message->enqueue_time, message->payload_len, error ? ESPNOW_DRIVER_ERROR_OTHER + 1 : 0, txClass - txClasses);
+                if (!error) {
+                    DEBUG_DBG (QESPNOW_TAG, "Message to " MACSTR " sent. Len: %u", MAC2STR (message->dstAddress), message->payload_len);
+                } else {
+                    DEBUG_WARN (QESPNOW_TAG, "Error sending message to " MACSTR ". Len: %u", MAC2STR (message->dstAddress), message->payload_len);
+                }
             }
-            message->payload_len = 0;
-            tx_queue.pop ();
-            DEBUG_DBG (QESPNOW_TAG, "Comms message pop. Queue size %d", tx_queue.size ());
+            txClass->queue->pop ();
+            DEBUG_DBG (QESPNOW_TAG, "Comms message pop. %d bytes in queue", txClass->queue->bytesUsed ());
+            checkWatermarks ((espnow_queue_id_t)(txClass - txClasses), *txClass->queue);
         }
 
     } else {
         DEBUG_DBG (QESPNOW_TAG, "Not ready to send");
     }
+    if (queueRamBudget && txTuner.periodElapsed ()) {
+        tuneQueue (tx_queue, txTuner, 2 * ESPNOW_TX_RECORD_LEN);
+    }
 }
 
 void QuickEspNow::enableTransmit (bool enable) {
@@ -281,12 +804,6 @@ void QuickEspNow::initComms () {
 
     os_timer_setfn (&espnowRxTask, espnowRxTask_cb, NULL);
     os_timer_arm (&espnowRxTask, TASK_PERIOD, true);
-
-#ifdef MEAS_TPUT
-    os_timer_setfn (&dataTPTimer, tp_timer_cb, NULL);
-    os_timer_arm (&dataTPTimer, MEAS_TP_EVERY_MS, true);
-#endif // MEAS_TPUT
-
 }
 
 void QuickEspNow::espnowTxTask_cb (void* param) {
@@ -298,30 +815,55 @@ void QuickEspNow::rx_cb (uint8_t* mac_addr, uint8_t* data, uint8_t len) {
     wifi_promiscuous_pkt_t* promiscuous_pkt = (wifi_promiscuous_pkt_t*)(data - sizeof (wifi_pkt_rx_ctrl_t) - sizeof (espnow_frame_format_t));
     wifi_pkt_rx_ctrl_t* rx_ctrl = &promiscuous_pkt->rx_ctrl;
 
-    comms_rx_queue_item_t message;
+    comms_rx_queue_item_t* message;
+    bool compressed = quickEspNow.compression && len > 1 && data[0] == ESPNOW_COMPRESSED_MAGIC;
 
     DEBUG_DBG (QESPNOW_TAG, "Received message with RSSI %d from " MACSTR " Len: %u", rx_ctrl->rssi, MAC2STR (mac_addr), len);
 
-    memcpy (message.srcAddress, mac_addr, ESP_NOW_ETH_ALEN);
-    memcpy (message.payload, data, len);
-    message.payload_len = len;
-    message.rssi = rx_ctrl->rssi - 100;
-    memcpy (message.dstAddress, espnow_data->destination_address, ESP_NOW_ETH_ALEN);
-    
-    if (quickEspNow.rx_queue.size () >= ESPNOW_QUEUE_SIZE) {
-        quickEspNow.tx_queue.pop ();
+    // Nothing preempts rx handler here, so oldest messages may be popped unless one of them is being delivered now
+    if (quickEspNow.overflow[ESPNOW_QUEUE_RX].policy == ESPNOW_OVERFLOW_DROP_OLDEST && !quickEspNow.rxDispatching) {
+        while (!quickEspNow.rx_queue.fits (sizeof (comms_rx_queue_item_t) + (compressed ? ESPNOW_MAX_MESSAGE_LENGTH : len)) && !quickEspNow.rx_queue.empty ()) {
+            comms_rx_queue_item_t* oldest = (comms_rx_queue_item_t*)quickEspNow.rx_queue.front ();
+            quickEspNow.stats.drops[ESPNOW_QUEUE_RX][ESPNOW_DROP_OLDEST]++;
+            quickEspNow.trace.record (ESPNOW_TRACE_DISPATCH, oldest->srcAddress, oldest->rx_time, oldest->payload_len, ESPNOW_DROP_OLDEST + 1, ESPNOW_QUEUE_RX);
+            quickEspNow.rxOverflow = true;
+            quickEspNow.rx_queue.pop ();
+        }
+    }
+    if (!(message = (comms_rx_queue_item_t*)quickEspNow.rx_queue.reserve (sizeof (comms_rx_queue_item_t) + (compressed ? ESPNOW_MAX_MESSAGE_LENGTH : len)))) {
+        quickEspNow.rxTuner.recordDrop ();
+        quickEspNow.rxOverflow = true;
+        quickEspNow.stats.drops[ESPNOW_QUEUE_RX][ESPNOW_DROP_NEWEST]++;
+        quickEspNow.trace.record (ESPNOW_TRACE_RX_CB, mac_addr, micros (), len, ESPNOW_DROP_NEWEST + 1, ESPNOW_QUEUE_RX);
         DEBUG_DBG (QESPNOW_TAG, "Rx Message dropped");
+        return;
     }
-    
-#ifdef MEAS_TPUT
-    quickEspNow.rxDataReceived += len;
-#endif // MEAS_TPUT
 
-    if (quickEspNow.rx_queue.push (&message)) {
-        DEBUG_DBG (QESPNOW_TAG, "Message pushed to queue");
+    // Message is written in place and handed to user callback from queue storage. Compressed ones are expanded in place
+    if (compressed) {
+        size_t expanded = LzCodec::decompress (data + 1, len - 1, message->payload, ESPNOW_MAX_MESSAGE_LENGTH, quickEspNow.compressionDictionary, quickEspNow.compressionDictLen);
+        if (!expanded) {
+            DEBUG_DBG (QESPNOW_TAG, "Wrong compressed message from " MACSTR, MAC2STR (mac_addr));
+            quickEspNow.stats.drops[ESPNOW_QUEUE_RX][ESPNOW_DROP_DECODE]++;
+            quickEspNow.trace.record (ESPNOW_TRACE_RX_CB, mac_addr, micros (), len, ESPNOW_DROP_DECODE + 1, ESPNOW_QUEUE_RX);
+            return;
+        }
+        len = expanded;
     } else {
-        DEBUG_WARN (QESPNOW_TAG, "Error queuing message");
+        memcpy (message->payload, data, len);
     }
+    message->rx_time = micros ();
+    memcpy (message->srcAddress, mac_addr, ESP_NOW_ETH_ALEN);
+    message->payload_len = len;
+    message->rssi = rx_ctrl->rssi - 100;
+    memcpy (message->dstAddress, espnow_data->destination_address, ESP_NOW_ETH_ALEN);
+    quickEspNow.trace.record (ESPNOW_TRACE_RX_CB, mac_addr, message->rx_time, len, 0, ESPNOW_QUEUE_RX);
+    quickEspNow.rx_queue.commit (sizeof (comms_rx_queue_item_t) + len);
+    quickEspNow.rxTuner.recordUsage (quickEspNow.rx_queue.bytesUsed ());
+    quickEspNow.recordQueueUsage (ESPNOW_QUEUE_RX, quickEspNow.rx_queue.bytesUsed ());
+    quickEspNow.stats.rxFrames++;
+    quickEspNow.stats.rxBytes += len;
+    DEBUG_DBG (QESPNOW_TAG, "Message pushed to queue");
 }
 
 void QuickEspNow::espnowRxTask_cb (void* param) {
@@ -331,35 +873,63 @@ void QuickEspNow::espnowRxTask_cb (void* param) {
 void QuickEspNow::espnowRxHandle () {
     comms_rx_queue_item_t *rxMessage;
 
+    // rx_cb runs in WiFi context, so its watermark events are reported from here
+    checkWatermarks (ESPNOW_QUEUE_RX, rx_queue, rxOverflow);
+    rxOverflow = false;
     if (!rx_queue.empty ()) {
-        rxMessage = rx_queue.front ();
-        DEBUG_DBG (QESPNOW_TAG, "Comms message got from queue. %d left", rx_queue.size ());
+        rxMessage = (comms_rx_queue_item_t*)rx_queue.front ();
+        DEBUG_DBG (QESPNOW_TAG, "Comms message got from queue. %d bytes in queue", rx_queue.bytesUsed ());
         DEBUG_VERBOSE (QESPNOW_TAG, "Received message from " MACSTR " Len: %u", MAC2STR (rxMessage->srcAddress), rxMessage->payload_len);
         DEBUG_VERBOSE (QESPNOW_TAG, "Message: %.*s", rxMessage->payload_len, rxMessage->payload);
 
 
+        if (latencyProbe) {
+            latencyProbe (ESPNOW_RX_LATENCY, micros () - rxMessage->rx_time);
+        }
+        trace.record (ESPNOW_TRACE_DISPATCH, rxMessage->srcAddress, rxMessage->rx_time, rxMessage->payload_len, 0, ESPNOW_QUEUE_RX);
         if (quickEspNow.dataRcvd) {
             bool broadcast = ! memcmp (rxMessage->dstAddress, ESPNOW_BROADCAST_ADDRESS, ESP_NOW_ETH_ALEN);
+            rxDispatching = true;
         // quickEspNow.dataRcvd (mac_addr, data, len, rx_ctrl->rssi - 98); // rssi should be in dBm but it has added almost 100 dB. Do not know why
             quickEspNow.dataRcvd (rxMessage->srcAddress, rxMessage->payload, rxMessage->payload_len, rxMessage->rssi, broadcast); // rssi should be in dBm but it has added almost 100 dB. Do not know why
+            rxDispatching = false;
         }
 
-        rxMessage->payload_len = 0;
         rx_queue.pop ();
-        DEBUG_DBG (QESPNOW_TAG, "RX Comms message pop. Queue size %d", rx_queue.size ());
+        DEBUG_DBG (QESPNOW_TAG, "RX Comms message pop. %d bytes in queue", rx_queue.bytesUsed ());
+        checkWatermarks (ESPNOW_QUEUE_RX, rx_queue);
+    }
+    if (queueRamBudget && rxTuner.periodElapsed ()) {
+        tuneQueue (rx_queue, rxTuner, 2 * ESPNOW_RX_RECORD_LEN);
     }
 
 }
 
 void QuickEspNow::tx_cb (uint8_t* mac_addr, uint8_t status) {
+    uint32_t latency = micros () - quickEspNow.inflightEnqueueTime;
+    uint8_t bucket = 0;
+
+    quickEspNow.trace.record (ESPNOW_TRACE_TX_CB, mac_addr, quickEspNow.inflightEnqueueTime, 0, status, 0);
     quickEspNow.readyToSend = true;
-    quickEspNow.sentStatus = status;
     DEBUG_DBG (QESPNOW_TAG, "-------------- Tx Confirmed %s", status == ESP_NOW_SEND_SUCCESS ? "true" : "false");
-    quickEspNow.waitingForConfirmation = false;
     DEBUG_DBG (QESPNOW_TAG, "-------------- Ready to send: true");
+    if (status == ESP_NOW_SEND_SUCCESS) {
+        quickEspNow.stats.txConfirmed++;
+    } else {
+        quickEspNow.stats.txFailed++;
+    }
+    // Logarithmic buckets. First one takes everything under 512 us
+    while (bucket < ESPNOW_LATENCY_BUCKETS - 1 && latency >= (512UL << bucket)) {
+        bucket++;
+    }
+    quickEspNow.stats.txLatency[bucket]++;
+    if (quickEspNow.latencyProbe) {
+        quickEspNow.latencyProbe (ESPNOW_TX_LATENCY, latency);
+    }
     if (quickEspNow.sentResult) {
         quickEspNow.sentResult (mac_addr, status);
     }
+    quickEspNow.completeMessage (status);
 }
 
 #endif // ESP8266
\ No newline at end of file
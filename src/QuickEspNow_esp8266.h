@@ -6,8 +6,13 @@
 #include "Comms_hal.h"
 
 #include <espnow.h>
+#include <coredecls.h>
 #include <ESP8266WiFi.h>
-#include "RingBuffer.h"
+#include "BipBuffer.h"
+#include "QueueTuner.h"
+#include "SendTracker.h"
+#include "LzCodec.h"
+#include "EspNowTrace.h"
 // Disable debug dependency if debug level is 0
 #if DEBUG_LEVEL > 0
 #include <QuickDebug.h>
@@ -20,19 +25,13 @@ constexpr auto QESPNOW_TAG = "QESPNOW";
 #define DEBUG_DBG(...)
 #endif
 
-//#define MEAS_TPUT
-
 static const uint8_t ESPNOW_BROADCAST_ADDRESS[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 static const uint8_t MIN_WIFI_CHANNEL = 0;
 static const uint8_t MAX_WIFI_CHANNEL = 14;
 static const uint8_t CURRENT_WIFI_CHANNEL = 255;
 static const size_t ESPNOW_MAX_MESSAGE_LENGTH = 255; ///< @brief Maximum message length
 static const uint8_t ESPNOW_ADDR_LEN = 6; ///< @brief Address length
-static const uint8_t ESPNOW_QUEUE_SIZE = 3; ///< @brief Queue size
 static const int TASK_PERIOD = 10; ///< @brief Rx and Tx tasks period
-#ifdef MEAS_TPUT
-static const time_t MEAS_TP_EVERY_MS = 10000; ///< @brief Measurement time period
-#endif // MEAS_TPUT
 
 #define ESP_NOW_ETH_ALEN 6
 #define ESP_NOW_MAX_DATA_LEN 250
@@ -65,72 +64,472 @@ typedef struct {
     } vendor_specific_content;
 } __attribute__ ((packed)) espnow_frame_format_t;
 
+#ifndef ESPNOW_TX_QUEUE_BYTES
+#define ESPNOW_TX_QUEUE_BYTES 768 ///< @brief Transmission queue size in bytes. Holds at least 2 messages of maximum length
+#endif
+#ifndef ESPNOW_TX_CONTROL_QUEUE_BYTES
+#define ESPNOW_TX_CONTROL_QUEUE_BYTES 576 ///< @brief Transmission queue size in bytes for control class. Holds at least 2 messages of maximum length
+#endif
+#ifndef ESPNOW_TX_BULK_QUEUE_BYTES
+#define ESPNOW_TX_BULK_QUEUE_BYTES 768 ///< @brief Transmission queue size in bytes for bulk class. Holds at least 2 messages of maximum length
+#endif
+#ifndef ESPNOW_TX_STARVATION_LIMIT
+#define ESPNOW_TX_STARVATION_LIMIT 16 ///< @brief A waiting class gets a message sent after this many messages of higher classes, so that it is never starved
+#endif
+#ifndef ESPNOW_RX_QUEUE_BYTES
+#define ESPNOW_RX_QUEUE_BYTES 768 ///< @brief Reception queue size in bytes. Holds at least 2 messages of maximum length
+#endif
+#ifndef ESPNOW_TX_CONFIRM_TIMEOUT_MS
+#define ESPNOW_TX_CONFIRM_TIMEOUT_MS 100 ///< @brief Maximum time to wait for transmission confirmation before message is given as failed
+#endif
+#ifndef ESPNOW_COMPRESSION_MIN_LEN
+#define ESPNOW_COMPRESSION_MIN_LEN 16 ///< @brief Shorter messages are not worth compressing
+#endif
+static const uint8_t ESPNOW_COMPRESSED_MAGIC = 0xF8; ///< @brief First byte of compressed frames
+static const size_t ESPNOW_COMPRESSED_MAGIC_MAX_LEN = 247; ///< @brief With compression enabled, longest message starting with `ESPNOW_COMPRESSED_MAGIC` that always fits in a frame
+static_assert (1 + ESPNOW_COMPRESSED_MAGIC_MAX_LEN + (ESPNOW_COMPRESSED_MAGIC_MAX_LEN + LzCodec::MAX_LITERALS - 1) / LzCodec::MAX_LITERALS <= ESP_NOW_MAX_DATA_LEN,
+               "Incompressible message starting with compression magic must fit in a frame");
+
+/**
+  * @brief Transmission queue record. Only `payload_len` bytes of payload are stored
+  */
 typedef struct {
-    uint8_t dstAddress[ESPNOW_ADDR_LEN]; /**< Message topic*/
-    uint8_t payload[ESPNOW_MAX_MESSAGE_LENGTH]; /**< Message payload*/
-    size_t payload_len; /**< Payload length*/
+    uint32_t enqueue_time; /**< Time when message was queued, in microseconds */
+    uint8_t dstAddress[ESPNOW_ADDR_LEN]; /**< Destination Address */
+    uint8_t payload_len; /**< Payload length */
+    uint8_t tracking; /**< Slot in send tracker. `ESPNOW_UNTRACKED` if nobody waits for result */
+    uint8_t payload[]; /**< Message payload */
 } comms_tx_queue_item_t;
 
+/**
+  * @brief Priority class of a message. Every class has its own transmission queue
+  */
+typedef enum {
+    ESPNOW_PRIORITY_CONTROL = 0, /**< Alarms and commands. Served before any other class */
+    ESPNOW_PRIORITY_NORMAL = 1, /**< Default class. Its queue is the one sized by `begin` and by adaptive queues */
+    ESPNOW_PRIORITY_BULK = 2, /**< Telemetry and transfers. Served when other classes have nothing to send */
+} espnow_priority_t;
+
+static const uint8_t ESPNOW_PRIORITY_CLASSES = 3; ///< @brief Number of priority classes
+
+/**
+  * @brief Transmission queue of a priority class. Messages of a class are sent in order
+  */
+typedef struct {
+    BipBuffer* queue; /**< Messages of this class */
+    uint32_t maxAge_ms; /**< Messages that have waited longer are dropped instead of sent. 0 to send them all */
+    uint8_t skipped; /**< Messages of higher classes sent while this one was waiting */
+} espnow_tx_class_t;
+
+/**
+  * @brief Message of a batch given to `sendBatch`
+  */
+typedef struct {
+    const uint8_t* dstAddress; /**< Destination address */
+    const uint8_t* payload; /**< Message payload */
+    size_t payload_len; /**< Payload length */
+    comms_send_error_t status; /**< Result for this message. Set by `sendBatch` */
+} espnow_batch_entry_t;
+
+/**
+  * @brief Reception queue record. Only `payload_len` bytes of payload are stored
+  */
 typedef struct {
+    uint32_t rx_time; /**< Time when message was received, in microseconds */
     uint8_t srcAddress[ESPNOW_ADDR_LEN]; /**< Source Address */
     uint8_t dstAddress[ESPNOW_ADDR_LEN]; /**< Destination Address */
-    uint8_t payload[ESPNOW_MAX_MESSAGE_LENGTH]; /**< Message payload */
-    size_t payload_len; /**< Payload length */
     int8_t rssi; /**< RSSI */
+    uint8_t payload_len; /**< Payload length */
+    uint8_t reserved[2];
+    uint8_t payload[]; /**< Message payload */
 } comms_rx_queue_item_t;
 
+static const size_t ESPNOW_TX_RECORD_LEN = BipBuffer::footprint (sizeof (comms_tx_queue_item_t) + ESPNOW_MAX_MESSAGE_LENGTH); ///< @brief Queue bytes used by a message of maximum length
+static const size_t ESPNOW_RX_RECORD_LEN = BipBuffer::footprint (sizeof (comms_rx_queue_item_t) + ESPNOW_MAX_MESSAGE_LENGTH); ///< @brief Queue bytes used by a message of maximum length
+static const size_t ESPNOW_QUEUE_RAM_BYTES = ESPNOW_TX_QUEUE_BYTES + ESPNOW_TX_CONTROL_QUEUE_BYTES + ESPNOW_TX_BULK_QUEUE_BYTES + ESPNOW_RX_QUEUE_BYTES; ///< @brief RAM allocated for message queues
+
+typedef enum {
+    ESPNOW_TX_LATENCY = 0, /**< Time from message queued by `send` until its transmission is confirmed */
+    ESPNOW_RX_LATENCY = 1, /**< Time from message received by radio until it is passed to `dataRcvd` callback */
+} espnow_latency_type_t;
+
+typedef std::function<void (espnow_latency_type_t type, uint32_t latency_us)> espnow_latency_probe_t;
+
+/**
+  * @brief Queues that may report watermarks. Transmission ones match their priority class
+  */
+typedef enum {
+    ESPNOW_QUEUE_TX_CONTROL = ESPNOW_PRIORITY_CONTROL, /**< Control class transmission queue */
+    ESPNOW_QUEUE_TX = ESPNOW_PRIORITY_NORMAL, /**< Normal class transmission queue */
+    ESPNOW_QUEUE_TX_BULK = ESPNOW_PRIORITY_BULK, /**< Bulk class transmission queue */
+    ESPNOW_QUEUE_RX = ESPNOW_PRIORITY_BULK + 1, /**< Reception queue */
+} espnow_queue_id_t;
+
+static const uint8_t ESPNOW_QUEUES = ESPNOW_QUEUE_RX + 1; ///< @brief Number of queues
+
+typedef enum {
+    ESPNOW_WATERMARK_LOW = 0, /**< Queue has drained down to its low watermark after reaching the high one */
+    ESPNOW_WATERMARK_HIGH = 1, /**< Queue has filled up to its high watermark, or it has rejected a message */
+} espnow_watermark_t;
+
+typedef std::function<void (espnow_queue_id_t queue, espnow_watermark_t level, size_t bytesUsed)> espnow_watermark_cb_t;
+
+/**
+  * @brief What a queue does when a message does not fit in it
+  */
+typedef enum {
+    ESPNOW_OVERFLOW_DROP_NEWEST = 0, /**< New message is rejected. Default */
+    ESPNOW_OVERFLOW_DROP_OLDEST = 1, /**< Oldest messages are dropped to make room, so latest data wins */
+    ESPNOW_OVERFLOW_BLOCK = 2, /**< Producer waits for room up to a timeout. Only for transmission queues */
+} espnow_overflow_policy_t;
+
+/**
+  * @brief Reasons why a message is dropped
+  */
+typedef enum {
+    ESPNOW_DROP_NEWEST = 0, /**< New message did not fit in queue */
+    ESPNOW_DROP_OLDEST = 1, /**< Queued message was dropped to make room for a new one */
+    ESPNOW_DROP_TIMEOUT = 2, /**< Producer waited for room until timeout */
+    ESPNOW_DROP_EXPIRED = 3, /**< Message waited longer than maximum age of its class */
+    ESPNOW_DROP_RESIZE = 4, /**< Message arrived while queue was being resized */
+    ESPNOW_DROP_DECODE = 5, /**< Compressed message could not be expanded */
+} espnow_drop_reason_t;
+
+static const uint8_t ESPNOW_DROP_REASONS = ESPNOW_DROP_DECODE + 1; ///< @brief Number of drop reasons
+
+/**
+  * @brief Overflow policy of a queue
+  */
+typedef struct {
+    espnow_overflow_policy_t policy; /**< What to do when a message does not fit */
+    uint32_t timeout_ms; /**< Maximum time a producer waits for room with `ESPNOW_OVERFLOW_BLOCK` */
+} espnow_overflow_t;
+
+/**
+  * @brief Watermarks of a queue. High and low events always alternate, starting with a high one
+  */
+typedef struct {
+    uint8_t high; /**< Percentage of queue size. 0 if watermarks are disabled */
+    uint8_t low; /**< Percentage of queue size */
+    bool above; /**< High watermark has been reported and low one has not */
+} espnow_queue_watermark_t;
+
+#ifndef ESPNOW_LATENCY_BUCKETS
+#define ESPNOW_LATENCY_BUCKETS 12 ///< @brief Buckets of transmission latency histogram. Bucket `i` counts latencies from `2^(i+8)` to `2^(i+9)` microseconds. First and last ones are open
+#endif
+
+/**
+  * @brief Errors returned by radio driver when a frame is handed to it. ESP8266 SDK does not tell them apart, so they are all `ESPNOW_DRIVER_ERROR_OTHER`
+  */
+typedef enum {
+    ESPNOW_DRIVER_ERROR_NO_MEM = 0, /**< Driver has no buffer for the frame. Channel is congested */
+    ESPNOW_DRIVER_ERROR_NOT_FOUND = 1, /**< Peer is not registered, or it is on another channel */
+    ESPNOW_DRIVER_ERROR_ARG = 2, /**< Wrong argument or interface */
+    ESPNOW_DRIVER_ERROR_OTHER = 3, /**< Any other error */
+} espnow_driver_error_t;
+
+static const uint8_t ESPNOW_DRIVER_ERRORS = ESPNOW_DRIVER_ERROR_OTHER + 1; ///< @brief Number of driver error kinds
+
+/**
+  * @brief Snapshot of engine statistics. Counters wrap around, so rates should be taken from differences between snapshots
+  */
+typedef struct {
+    uint32_t txFrames; /**< Frames accepted by driver */
+    uint32_t txBytes; /**< Payload bytes of frames accepted by driver */
+    uint32_t rxFrames; /**< Frames received and queued */
+    uint32_t rxBytes; /**< Payload bytes of frames received and queued */
+    uint32_t txConfirmed; /**< Frames confirmed by tx_cb */
+    uint32_t txFailed; /**< Frames given as failed by tx_cb */
+    uint32_t txTimeouts; /**< Frames whose confirmation did not arrive in `ESPNOW_TX_CONFIRM_TIMEOUT_MS` */
+    uint32_t driverErrors[ESPNOW_DRIVER_ERRORS]; /**< Frames rejected by driver, by error */
+    uint32_t drops[ESPNOW_QUEUES][ESPNOW_DROP_REASONS]; /**< Dropped messages by queue and reason */
+    uint32_t queueHighWater[ESPNOW_QUEUES]; /**< Maximum bytes used by every queue */
+    uint32_t peersAdded; /**< Peers registered in driver. Always 0, as ESP8266 sends without peers */
+    uint32_t peersEvicted; /**< Peers deleted from driver to make room for others. Always 0 */
+    uint32_t txLatency[ESPNOW_LATENCY_BUCKETS]; /**< Histogram of time from message queued until its transmission is confirmed */
+} espnow_stats_t;
+
+/**
+  * @brief Quality of the link with a peer. ESP8266 keeps no peer list, so it is not tracked there
+  */
+typedef struct {
+    int8_t rssi; /**< Moving average of RSSI of received frames, in dBm. 0 if nothing has been received */
+    uint8_t txSuccess; /**< Moving average of confirmed transmissions, in percent. 100 if nothing has been sent */
+    uint16_t txRate; /**< Frames per second sent in last period */
+    uint16_t rxRate; /**< Frames per second received in last period */
+    uint32_t txFrames; /**< Frames sent, confirmed or not */
+    uint32_t txFailures; /**< Frames not confirmed */
+    uint32_t txRetries; /**< Frames sent again after driver ran out of memory */
+    uint32_t rxFrames; /**< Frames received */
+} espnow_link_quality_t;
+
 class QuickEspNow : public Comms_halClass {
 public:
-    QuickEspNow () :
-        tx_queue (ESPNOW_QUEUE_SIZE), rx_queue (ESPNOW_QUEUE_SIZE) {}
+    QuickEspNow ();
     bool begin (uint8_t channel = 255, uint32_t interface = 0, bool synchronousSend = true) override;
+    /**
+      * @brief Starts ESP-NOW with given queue sizes
+      * @param txQueueBytes Transmission queue size in bytes. It has to hold at least 2 messages of maximum length (`ESPNOW_TX_RECORD_LEN` bytes each)
+      * @param rxQueueBytes Reception queue size in bytes. It has to hold at least 2 messages of maximum length (`ESPNOW_RX_RECORD_LEN` bytes each)
+      * @return Returns `true` if ESP-NOW was started, `false` otherwise
+      */
+    bool begin (uint8_t channel, uint32_t interface, bool synchronousSend, size_t txQueueBytes, size_t rxQueueBytes);
     void stop () override;
     comms_send_error_t send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len) override;
+    /**
+      * @brief Sends a message and gets a handle to learn its result
+      * @param dstAddress Destination address
+      * @param payload Message payload
+      * @param payload_len Payload length
+      * @param handle If not `NULL`, it gets message handle. Result has to be collected with `wait`
+      * @param ctx User context passed to `onSendComplete` callback
+      * @return Same result as `send`. `COMMS_SEND_QUEUE_FULL_ERROR` also if `ESPNOW_MAX_TRACKED_MESSAGES` are already tracked
+      */
+    comms_send_error_t send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len, espnow_send_handle_t* handle, void* ctx = NULL);
+    /**
+      * @brief Sends a message with given priority class
+      * @param dstAddress Destination address
+      * @param payload Message payload
+      * @param payload_len Payload length
+      * @param priority Priority class. Message goes to queue of that class
+      * @param handle If not `NULL`, it gets message handle. Result has to be collected with `wait`
+      * @param ctx User context passed to `onSendComplete` callback
+      * @return Same result as `send`. `COMMS_SEND_QUEUE_FULL_ERROR` refers to queue of given class
+      */
+    comms_send_error_t send (const uint8_t* dstAddress, const uint8_t* payload, size_t payload_len, espnow_priority_t priority, espnow_send_handle_t* handle = NULL, void* ctx = NULL);
+    /**
+      * @brief Queues several messages at once. Either all of them are queued or none is.
+      * Queue space for the whole batch is taken before any message is visible to tx task
+      * @param entries Messages to send. Their `status` gets the result of each one
+      * @param count Number of messages
+      * @param priority Priority class of all messages in batch
+      * @return `COMMS_SEND_OK` if every message was queued, or confirmed in synchronous mode. Otherwise, error of the
+      * first failed message. Whole batch fails with `COMMS_SEND_QUEUE_FULL_ERROR` if it does not fit in queue. Batch
+      * may need one more message of space when it wraps around the end of queue storage, so it only fits for sure if
+      * it takes less than queue size minus `ESPNOW_TX_RECORD_LEN`. In synchronous mode a batch may have up to
+      * `ESPNOW_MAX_TRACKED_MESSAGES` messages
+      */
+    comms_send_error_t sendBatch (espnow_batch_entry_t* entries, size_t count, espnow_priority_t priority = ESPNOW_PRIORITY_NORMAL);
     comms_send_error_t sendBcast (const uint8_t* payload, size_t payload_len) {
         return send (ESPNOW_BROADCAST_ADDRESS, payload, payload_len);
     }
+    /**
+      * @brief Gets a buffer inside transmission queue so that message can be written in place, without copies.
+      * Every successful call has to be followed by `commit` or `cancel`
+      * @param dstAddress Destination address
+      * @param maxLen Maximum number of bytes that will be written. Up to `ESP_NOW_MAX_DATA_LEN`, as radio cannot send longer frames
+      * @param priority Priority class. Buffer is taken from queue of that class
+      * @return Pointer to payload buffer. `NULL` if parameters are wrong or queue is full
+      */
+    uint8_t* reserve (const uint8_t* dstAddress, size_t maxLen = ESP_NOW_MAX_DATA_LEN, espnow_priority_t priority = ESPNOW_PRIORITY_NORMAL);
+    /**
+      * @brief Queues message written in buffer got with `reserve`. Messages written in place are not compressed, so
+      * with compression enabled a message that starts with `ESPNOW_COMPRESSED_MAGIC` is rejected with `COMMS_SEND_PARAM_ERROR`
+      * and reservation is cancelled, as receiver would take it as a compressed one. Use `send` for those
+      * @param payload_len Number of bytes actually written. Must not be greater than `maxLen` given to `reserve`
+      * @param handle If not `NULL`, it gets message handle. Result has to be collected with `wait`
+      * @param ctx User context passed to `onSendComplete` callback
+      * @return Same result as `send` would give
+      */
+    comms_send_error_t commit (size_t payload_len, espnow_send_handle_t* handle = NULL, void* ctx = NULL);
+    /**
+      * @brief Waits for a message to be confirmed or given as failed, and collects its result. Handle is not valid after that.
+      * In synchronous mode `send` collects result itself
+      * @param handle Handle got from `send` or `commit`
+      * @param timeout_ms Maximum time to wait. 0 just checks if result is ready
+      * @return `COMMS_SEND_OK` if message was confirmed, `COMMS_SEND_CONFIRM_ERROR` if it failed,
+      * `COMMS_SEND_TIMEOUT_ERROR` if it has not completed yet and `COMMS_SEND_PARAM_ERROR` if handle is not valid
+      */
+    comms_send_error_t wait (espnow_send_handle_t handle, uint32_t timeout_ms);
+    /**
+      * @brief Releases buffer got with `reserve` without sending anything
+      */
+    void cancel ();
     void onDataRcvd (comms_hal_rcvd_data dataRcvd) override;
     void onDataSent (comms_hal_sent_data sentResult) override;
+    /**
+      * @brief Attach a function to be called when every message sent with a handle or a context completes
+      * @param sendComplete Callback function. It is called from tx task and should return quickly
+      */
+    void onSendComplete (espnow_send_complete_cb_t sendComplete);
+    /**
+      * @brief Attach a function to be called with latency of every message that goes through the queues
+      * @param latencyProbe Callback function. Transmission latency is reported from WiFi task context, it should return quickly
+      */
+    void onLatencySample (espnow_latency_probe_t latencyProbe);
     uint8_t getAddressLength ()  override { return ESPNOW_ADDR_LEN; }
     uint8_t getMaxMessageLength ()  override { return ESPNOW_MAX_MESSAGE_LENGTH; }
     void enableTransmit (bool enable) override;
     bool setChannel (uint8_t channel);
     bool readyToSendData ();
+    /**
+      * @brief Waits until a message of maximum length fits in transmission queue of a priority class, so that
+      * producers do not have to poll `readyToSendData`. Transmission handler runs while waiting
+      * @param timeout_ms Maximum time to wait. 0 just checks if there is space
+      * @param priority Priority class
+      * @return `true` if there is space, `false` on timeout
+      */
+    bool waitForQueueSpace (uint32_t timeout_ms, espnow_priority_t priority = ESPNOW_PRIORITY_NORMAL);
+    /**
+      * @brief Sets watermarks of a queue. A high event is reported when queue usage reaches `highPercent` of its size
+      * or when it rejects a message, and a low event when usage goes down to `lowPercent` after that
+      * @param queue Queue to watch
+      * @param highPercent High watermark, as a percentage of queue size. 0 disables watermarks of this queue
+      * @param lowPercent Low watermark, as a percentage of queue size. Must be lower than `highPercent`
+      * @return `false` if parameters are wrong
+      */
+    bool setQueueWatermarks (espnow_queue_id_t queue, uint8_t highPercent, uint8_t lowPercent);
+    /**
+      * @brief Attach a function to be called when a queue crosses its watermarks. High transmission events come from
+      * `send` and the rest from queue handlers. It should not block nor send in synchronous mode
+      * @param queueWatermark Callback function
+      */
+    void onQueueWatermark (espnow_watermark_cb_t queueWatermark);
+    /**
+      * @brief Lets queues grow when messages are dropped and shrink when they stay mostly empty.
+      * Queues are only resized while they are empty
+      * @param ramBudget Maximum RAM that both queues may use together, in bytes. 0 disables adaptive sizing
+      */
+    void enableAdaptiveQueues (size_t ramBudget);
+    /**
+      * @brief Returns current transmission queue size in bytes
+      */
+    size_t getTxQueueBytes () { return tx_queue.capacity (); }
+    /**
+      * @brief Sets queue size and drop policy of a priority class. Must be called before `begin` or while stopped.
+      * A full queue rejects new messages with `COMMS_SEND_QUEUE_FULL_ERROR`
+      * @param priority Priority class
+      * @param bytes Queue size in bytes. It has to hold at least 2 messages of maximum length (`ESPNOW_TX_RECORD_LEN` bytes each).
+      * Normal class size may also be given to `begin`
+      * @param maxAge_ms Messages that have waited longer than this are dropped instead of sent, and complete as failed. 0 sends them all
+      * @return `false` if size is too small or there is not enough memory
+      */
+    bool setPriorityQueue (espnow_priority_t priority, size_t bytes, uint32_t maxAge_ms = 0);
+    /**
+      * @brief Number of messages of a priority class dropped because they waited longer than its maximum age
+      */
+    uint32_t getExpiredMessages (espnow_priority_t priority) { return getDroppedMessages ((espnow_queue_id_t)priority, ESPNOW_DROP_EXPIRED); }
+    /**
+      * @brief Sets what a queue does when a message does not fit. Transmission queues may block the producer, that
+      * then gets `COMMS_SEND_QUEUE_FULL_ERROR` only after timeout. Oldest messages dropped from a transmission queue
+      * complete as failed. A reception queue that drops oldest messages skips stale ones when user callback falls behind
+      * @param queue Queue to configure
+      * @param policy Overflow policy
+      * @param timeout_ms Maximum time to wait with `ESPNOW_OVERFLOW_BLOCK`
+      * @return `false` if queue cannot use that policy
+      */
+    bool setOverflowPolicy (espnow_queue_id_t queue, espnow_overflow_policy_t policy, uint32_t timeout_ms = 0);
+    /**
+      * @brief Number of messages of a queue dropped for a reason
+      * @param queue Queue
+      * @param reason Drop reason
+      */
+    uint32_t getDroppedMessages (espnow_queue_id_t queue, espnow_drop_reason_t reason) {
+        return queue < ESPNOW_QUEUES && reason < ESPNOW_DROP_REASONS ? stats.drops[queue][reason] : 0;
+    }
+    /**
+      * @brief Gets a snapshot of engine statistics. Counters are always kept
+      * @param snapshot Statistics are copied here
+      */
+    void getStats (espnow_stats_t& snapshot) { snapshot = stats; }
+    /**
+      * @brief Sets every statistics counter to 0, including drop counters and queue high-water marks
+      */
+    void resetStats () { memset (&stats, 0, sizeof (stats)); }
+    /**
+      * @brief Gets quality of the link with a peer. Only ESP32 tracks it, as ESP8266 keeps no peer list
+      * @return Always `false`
+      */
+    bool getLinkQuality (const uint8_t* address, espnow_link_quality_t& quality) { return false; }
+    /**
+      * @brief Starts recording a binary trace of every message at enqueue, dequeue, driver send, tx_cb, rx_cb and
+      * dispatch. Use `tools/trace_decode.py` to render dumps as per message timelines
+      * @param records Trace size in records. It is only used on first call. 0 pauses recording
+      * @return `false` if there is not enough memory
+      */
+    bool enableTrace (size_t records = ESPNOW_TRACE_RECORDS) { return trace.enable (records); }
+    /**
+      * @brief Writes records taken since previous dump, after an `espnow_trace_header_t`
+      * @param write Function that gets dump bytes, i.e. to write them to serial port
+      * @return Number of records written
+      */
+    size_t dumpTrace (espnow_trace_writer_t write) { return trace.dump (write); }
+    /**
+      * @brief Returns current reception queue size in bytes
+      */
+    size_t getRxQueueBytes () { return rx_queue.capacity (); }
+    /**
+      * @brief Compresses messages given to `send` and `sendBatch` when that makes them smaller, and decompresses
+      * received ones before they reach callbacks. Compressed frames start with `ESPNOW_COMPRESSED_MAGIC`, other frames
+      * are sent unchanged. Both ends need it enabled with the same dictionary. Messages written with `reserve` are not compressed,
+      * so `commit` rejects them if they start with `ESPNOW_COMPRESSED_MAGIC`. A message given to `send` that starts with
+      * `ESPNOW_COMPRESSED_MAGIC` is always sent compressed, so that receiver does not take it as compressed. Up to
+      * `ESPNOW_COMPRESSED_MAGIC_MAX_LEN` bytes it always fits. Longer ones fail with `COMMS_SEND_PAYLOAD_LENGTH_ERROR`
+      * unless they compress
+      * @param enable `true` to enable compression
+      * @param dictionary Static dictionary. `NULL` uses `LZ_DEFAULT_DICTIONARY`
+      * @param dictLen Dictionary length. Up to `LzCodec::MAX_DICTIONARY`
+      */
+    void enableCompression (bool enable, const uint8_t* dictionary = NULL, size_t dictLen = 0);
 
 protected:
     uint8_t wifi_if;
     ETSTimer espnowTxTask;
     ETSTimer espnowRxTask;
-#ifdef MEAS_TPUT
-    ETSTimer dataTPTimer;
-    unsigned long txDataSent = 0;
-    unsigned long rxDataReceived = 0;
-    unsigned long txDataDropped = 0;
-    time_t lastDataTPMeas = 0;
-    float txDataTP = 0;
-    float rxDataTP = 0;
-    float txDroppedDataRatio = 0;
-
-    static void tp_timer_cb (void* param);
-    void calculateDataTP ();
-#endif // MEAS_TPUT
 
     bool readyToSend = true;
 
-    bool waitingForConfirmation = false;
     bool synchronousSend = false;
     uint8_t sentStatus;
-    int queueSize = ESPNOW_QUEUE_SIZE;
+    uint32_t inflightEnqueueTime = 0;
+    uint32_t inflightSendTime = 0; ///< @brief Time when message waiting for confirmation was sent, in milliseconds
+    uint8_t inflightTracking = ESPNOW_UNTRACKED; ///< @brief Tracking slot of message waiting for confirmation
+    uint8_t inflightDstAddress[ESPNOW_ADDR_LEN]; ///< @brief Destination of message waiting for confirmation. It has been popped from queue already
+    SendTrackerClass sendTracker;
+    espnow_send_complete_cb_t sendComplete = 0;
+    espnow_latency_probe_t latencyProbe = 0;
+    espnow_watermark_cb_t queueWatermark = 0;
+    espnow_queue_watermark_t watermarks[ESPNOW_QUEUES];
+    bool rxOverflow = false; ///< @brief rx_cb has dropped a message since rx handler last checked watermarks
+    espnow_overflow_t overflow[ESPNOW_QUEUES];
+    espnow_stats_t stats; ///< @brief Timers and WiFi callbacks do not preempt each other, so counters need no atomics
+    EspNowTraceClass trace;
+    bool rxDispatching = false; ///< @brief Front of rx queue is being handed to user callback, which may yield to rx_cb
 
-    RingBuffer<comms_tx_queue_item_t> tx_queue;
-    RingBuffer<comms_rx_queue_item_t> rx_queue;
+    BipBuffer tx_queue; ///< @brief Normal class queue
+    BipBuffer txControlQueue;
+    BipBuffer txBulkQueue;
+    espnow_tx_class_t txClasses[ESPNOW_PRIORITY_CLASSES]; ///< @brief Served in strict priority order, with starvation protection
+    comms_tx_queue_item_t* reservedMessage = NULL; ///< @brief Slot got by `reserve` and not committed yet
+    BipBuffer* reservedQueue = NULL; ///< @brief Queue where `reservedMessage` lives
+    espnow_priority_t reservedPriority = ESPNOW_PRIORITY_NORMAL; ///< @brief Priority class of `reservedQueue`
+    size_t reservedLen = 0;
+    bool compression = false;
+    const uint8_t* compressionDictionary = NULL;
+    size_t compressionDictLen = 0;
+    BipBuffer rx_queue;
+    size_t queueRamBudget = 0; ///< @brief RAM budget for adaptive queues. 0 if they are disabled
+    size_t queueRamBytes = 0; ///< @brief RAM used by both queues
+    QueueTunerClass txTuner;
+    QueueTunerClass rxTuner;
     //uint8_t channel;
     bool followWiFiChannel = false;
 
     void initComms ();
+    size_t encodedMaxLength (const uint8_t* payload, size_t payload_len);
+    size_t encodePayload (uint8_t* buffer, const uint8_t* payload, size_t payload_len);
+    comms_send_error_t commitMessage (size_t payload_len, espnow_send_handle_t* handle, void* ctx);
+    bool resizeQueue (BipBuffer& queue, size_t bytes);
+    void tuneQueue (BipBuffer& queue, QueueTunerClass& tuner, size_t minBytes);
+    void checkWatermarks (espnow_queue_id_t queue, BipBuffer& buffer, bool full = false);
+    void recordQueueUsage (espnow_queue_id_t queue, size_t bytesUsed);
     static void espnowTxTask_cb (void* param);
     static void espnowRxTask_cb (void* param);
     int32_t sendEspNowMessage (comms_tx_queue_item_t* message);
+    bool makeRoom (espnow_priority_t priority, size_t len, size_t messages);
+    void completeMessage (uint8_t status);
+    void completeMessage (uint8_t slot, const uint8_t* dstAddress, uint8_t status);
+    espnow_tx_class_t* nextClass ();
     void espnowTxHandle ();
     void espnowRxHandle ();
 
@@ -0,0 +1,360 @@
+#include "QuickEspNow.h"
+
+#ifdef QESPNOW_HOST
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+HostSerialClass Serial;
+
+static const std::chrono::steady_clock::time_point hostStartTime = std::chrono::steady_clock::now ();
+static const TickType_t HOST_WAIT_SLICE_MS = 10; ///< @brief Blocking calls wake up this often to check task deletion
+
+unsigned long millis () {
+    return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - hostStartTime).count ();
+}
+
+unsigned long micros () {
+    return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - hostStartTime).count ();
+}
+
+int HostSerialClass::printf (const char* format, ...) {
+    va_list args;
+    va_start (args, format);
+    int len = vprintf (format, args);
+    va_end (args);
+    return len;
+}
+
+// ---------------- Tasks ----------------
+
+struct HostTask {
+    std::thread thread;
+    std::atomic<bool> deleted { false };
+    std::atomic<bool> suspended { false };
+    bool selfDeleted = false;
+    std::mutex notifyMutex;
+    std::condition_variable notifyCv;
+    uint32_t notifyValue = 0;
+};
+
+/**
+  * @brief Thrown inside a task thread to unwind it after `vTaskDelete`
+  */
+struct HostTaskDeleted {};
+
+static thread_local HostTask* currentTask = NULL;
+
+/**
+  * @brief Called from every blocking point. Ends current task if it has been deleted and holds it while suspended
+  */
+static void hostTaskCheckpoint () {
+    if (!currentTask) {
+        return;
+    }
+    while (currentTask->suspended && !currentTask->deleted) {
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    }
+    if (currentTask->deleted) {
+        throw HostTaskDeleted ();
+    }
+}
+
+BaseType_t xTaskCreateUniversal (TaskFunction_t function, const char* name, uint32_t stackDepth, void* param, UBaseType_t priority, TaskHandle_t* handle, BaseType_t core) {
+    HostTask* task = new HostTask ();
+    task->thread = std::thread ([task, function, param] () {
+        currentTask = task;
+        try {
+            function (param);
+        } catch (const HostTaskDeleted&) {
+        }
+        if (task->selfDeleted) {
+            delete task;
+        }
+    });
+    if (handle) {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete (TaskHandle_t task) {
+    if (!task) {
+        task = currentTask;
+    }
+    if (!task) {
+        return;
+    }
+    if (task == currentTask) {
+        currentTask->selfDeleted = true;
+        currentTask->deleted = true;
+        currentTask->thread.detach ();
+        throw HostTaskDeleted ();
+    }
+    task->deleted = true;
+    if (task->thread.joinable ()) {
+        task->thread.join ();
+    }
+    delete task;
+}
+
+void vTaskSuspend (TaskHandle_t task) {
+    if (!task) {
+        task = currentTask;
+    }
+    if (task) {
+        task->suspended = true;
+        hostTaskCheckpoint ();
+    }
+}
+
+void vTaskResume (TaskHandle_t task) {
+    if (task) {
+        task->suspended = false;
+    }
+}
+
+void hostTaskYield () {
+    hostTaskCheckpoint ();
+    std::this_thread::yield ();
+}
+
+void delay (unsigned long ms) {
+    hostTaskCheckpoint ();
+    if (!ms) {
+        std::this_thread::yield ();
+        return;
+    }
+    unsigned long start = millis ();
+    while (millis () - start < ms) {
+        unsigned long left = ms - (millis () - start);
+        std::this_thread::sleep_for (std::chrono::milliseconds (left < HOST_WAIT_SLICE_MS ? left : HOST_WAIT_SLICE_MS));
+        hostTaskCheckpoint ();
+    }
+}
+
+/**
+  * @brief Waits on a condition variable in slices, so that deleted tasks can exit while blocked
+  */
+template <typename Tpredicate>
+static bool hostWait (std::unique_lock<std::mutex>& lock, std::condition_variable& cv, TickType_t ticksToWait, Tpredicate ready) {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now () + std::chrono::milliseconds (ticksToWait);
+    while (!ready ()) {
+        if (ticksToWait != portMAX_DELAY && std::chrono::steady_clock::now () >= deadline) {
+            return false;
+        }
+        cv.wait_for (lock, std::chrono::milliseconds (HOST_WAIT_SLICE_MS));
+        if (currentTask && (currentTask->deleted || currentTask->suspended)) {
+            lock.unlock ();
+            hostTaskCheckpoint ();
+            lock.lock ();
+        }
+    }
+    return true;
+}
+
+// ---------------- Notifications ----------------
+
+BaseType_t xTaskNotifyGive (TaskHandle_t task) {
+    if (!task) {
+        return pdFAIL;
+    }
+    {
+        std::lock_guard<std::mutex> lock (task->notifyMutex);
+        task->notifyValue++;
+    }
+    task->notifyCv.notify_one ();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake (BaseType_t clearCountOnExit, TickType_t ticksToWait) {
+    HostTask* task = currentTask;
+    if (!task) {
+        return 0;
+    }
+    std::unique_lock<std::mutex> lock (task->notifyMutex);
+    if (!hostWait (lock, task->notifyCv, ticksToWait, [task] () { return task->notifyValue > 0; })) {
+        return 0;
+    }
+    uint32_t value = task->notifyValue;
+    task->notifyValue = clearCountOnExit ? 0 : value - 1;
+    return value;
+}
+
+// ---------------- Semaphores ----------------
+
+struct HostSemaphore {
+    std::mutex mutex;
+    std::condition_variable available;
+    UBaseType_t count;
+};
+
+static SemaphoreHandle_t hostSemaphoreCreate (UBaseType_t initialCount) {
+    HostSemaphore* semaphore = new HostSemaphore ();
+    semaphore->count = initialCount;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex () {
+    return hostSemaphoreCreate (1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary () {
+    return hostSemaphoreCreate (0);
+}
+
+BaseType_t xSemaphoreTake (SemaphoreHandle_t semaphore, TickType_t ticksToWait) {
+    std::unique_lock<std::mutex> lock (semaphore->mutex);
+    if (!hostWait (lock, semaphore->available, ticksToWait, [semaphore] () { return semaphore->count > 0; })) {
+        return pdFAIL;
+    }
+    semaphore->count--;
+    return pdPASS;
+}
+
+BaseType_t xSemaphoreGive (SemaphoreHandle_t semaphore) {
+    {
+        std::lock_guard<std::mutex> lock (semaphore->mutex);
+        if (semaphore->count) {
+            return pdFAIL;
+        }
+        semaphore->count = 1;
+    }
+    semaphore->available.notify_one ();
+    return pdPASS;
+}
+
+void vSemaphoreDelete (SemaphoreHandle_t semaphore) {
+    delete semaphore;
+}
+
+// ---------------- Event groups ----------------
+
+struct HostEventGroup {
+    std::mutex mutex;
+    std::condition_variable changed;
+    EventBits_t bits = 0;
+};
+
+static const EventBits_t HOST_EVENT_BITS_MASK = 0x00FFFFFF;
+
+EventGroupHandle_t xEventGroupCreate () {
+    return new HostEventGroup ();
+}
+
+EventBits_t xEventGroupSetBits (EventGroupHandle_t group, EventBits_t bits) {
+    EventBits_t value;
+    {
+        std::lock_guard<std::mutex> lock (group->mutex);
+        group->bits |= bits & HOST_EVENT_BITS_MASK;
+        value = group->bits;
+    }
+    group->changed.notify_all ();
+    return value;
+}
+
+EventBits_t xEventGroupClearBits (EventGroupHandle_t group, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock (group->mutex);
+    EventBits_t value = group->bits;
+    group->bits &= ~bits;
+    return value;
+}
+
+EventBits_t xEventGroupWaitBits (EventGroupHandle_t group, EventBits_t bits, BaseType_t clearOnExit, BaseType_t waitForAllBits, TickType_t ticksToWait) {
+    std::unique_lock<std::mutex> lock (group->mutex);
+    bool ready = hostWait (lock, group->changed, ticksToWait, [group, bits, waitForAllBits] () {
+        return waitForAllBits ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+    });
+    EventBits_t value = group->bits;
+    if (ready && clearOnExit) {
+        group->bits &= ~bits;
+    }
+    return value;
+}
+
+void vEventGroupDelete (EventGroupHandle_t group) {
+    delete group;
+}
+
+// ---------------- Queues ----------------
+
+struct HostQueue {
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::vector<uint8_t> storage;
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    UBaseType_t head = 0;
+    UBaseType_t count = 0;
+};
+
+QueueHandle_t xQueueCreate (UBaseType_t length, UBaseType_t itemSize) {
+    HostQueue* queue = new HostQueue ();
+    queue->length = length;
+    queue->itemSize = itemSize;
+    queue->storage.resize ((size_t)length * itemSize);
+    return queue;
+}
+
+void vQueueDelete (QueueHandle_t queue) {
+    delete queue;
+}
+
+BaseType_t xQueueSend (QueueHandle_t queue, const void* item, TickType_t ticksToWait) {
+    std::unique_lock<std::mutex> lock (queue->mutex);
+    if (!hostWait (lock, queue->notFull, ticksToWait, [queue] () { return queue->count < queue->length; })) {
+        return pdFAIL;
+    }
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    memcpy (&queue->storage[(size_t)tail * queue->itemSize], item, queue->itemSize);
+    queue->count++;
+    queue->notEmpty.notify_one ();
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive (QueueHandle_t queue, void* buffer, TickType_t ticksToWait) {
+    std::unique_lock<std::mutex> lock (queue->mutex);
+    if (!hostWait (lock, queue->notEmpty, ticksToWait, [queue] () { return queue->count > 0; })) {
+        return pdFAIL;
+    }
+    memcpy (buffer, &queue->storage[(size_t)queue->head * queue->itemSize], queue->itemSize);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    queue->notFull.notify_one ();
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting (QueueHandle_t queue) {
+    std::lock_guard<std::mutex> lock (queue->mutex);
+    return queue->count;
+}
+
+// ---------------- ESP-IDF ----------------
+
+const char* esp_err_to_name (esp_err_t code) {
+    switch (code) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_ESPNOW_NOT_INIT: return "ESP_ERR_ESPNOW_NOT_INIT";
+    case ESP_ERR_ESPNOW_ARG: return "ESP_ERR_ESPNOW_ARG";
+    case ESP_ERR_ESPNOW_NO_MEM: return "ESP_ERR_ESPNOW_NO_MEM";
+    case ESP_ERR_ESPNOW_FULL: return "ESP_ERR_ESPNOW_FULL";
+    case ESP_ERR_ESPNOW_NOT_FOUND: return "ESP_ERR_ESPNOW_NOT_FOUND";
+    case ESP_ERR_ESPNOW_INTERNAL: return "ESP_ERR_ESPNOW_INTERNAL";
+    case ESP_ERR_ESPNOW_EXIST: return "ESP_ERR_ESPNOW_EXIST";
+    case ESP_ERR_ESPNOW_IF: return "ESP_ERR_ESPNOW_IF";
+    case ESP_ERR_ESPNOW_CHAN: return "ESP_ERR_ESPNOW_CHAN";
+    default: return "UNKNOWN ERROR";
+    }
+}
+
+#endif // QESPNOW_HOST
@@ -0,0 +1,192 @@
+/**
+  * @file QuickEspNow_host.h
+  * @author German Martin
+  * @brief Host (Linux) compatibility layer for QuickEspNow
+  *
+  * Provides the small subset of Arduino, FreeRTOS and ESP-IDF API that QuickEspNow engine uses, so that it
+  * can be built natively and profiled with regular tools. Radio is provided by drivers in QuickEspNow_driver_host.h
+  */
+#ifndef _QUICK_ESPNOW_HOST_h
+#define _QUICK_ESPNOW_HOST_h
+#ifdef QESPNOW_HOST
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <functional>
+
+// ---------------- Arduino ----------------
+
+unsigned long millis ();
+unsigned long micros ();
+void delay (unsigned long ms);
+
+#ifndef ICACHE_FLASH_ATTR
+#define ICACHE_FLASH_ATTR
+#endif
+
+/**
+  * @brief Minimal replacement of Arduino `Serial` that writes to stdout
+  */
+class HostSerialClass {
+public:
+    void begin (unsigned long baud) {}
+    int printf (const char* format, ...) __attribute__ ((format (printf, 2, 3)));
+    size_t println (const char* str) { return ::printf ("%s\n", str); }
+};
+
+extern HostSerialClass Serial;
+
+// ---------------- FreeRTOS ----------------
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void (*TaskFunction_t)(void*);
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define CONFIG_ARDUINO_RUNNING_CORE 1
+
+typedef struct HostQueue* QueueHandle_t;
+typedef struct HostTask* TaskHandle_t;
+typedef struct HostSemaphore* SemaphoreHandle_t;
+typedef struct HostEventGroup* EventGroupHandle_t;
+typedef uint32_t EventBits_t;
+
+QueueHandle_t xQueueCreate (UBaseType_t length, UBaseType_t itemSize);
+void vQueueDelete (QueueHandle_t queue);
+BaseType_t xQueueSend (QueueHandle_t queue, const void* item, TickType_t ticksToWait);
+BaseType_t xQueueReceive (QueueHandle_t queue, void* buffer, TickType_t ticksToWait);
+UBaseType_t uxQueueMessagesWaiting (QueueHandle_t queue);
+
+/**
+  * @brief Starts a task as a host thread. Priority and core are ignored
+  */
+BaseType_t xTaskCreateUniversal (TaskFunction_t function, const char* name, uint32_t stackDepth, void* param, UBaseType_t priority, TaskHandle_t* handle, BaseType_t core);
+
+/**
+  * @brief Deletes a task. Host threads cannot be killed, so task exits next time it blocks, yields or delays.
+  * Calling thread waits for that to happen
+  */
+void vTaskDelete (TaskHandle_t task);
+void vTaskSuspend (TaskHandle_t task);
+void vTaskResume (TaskHandle_t task);
+void hostTaskYield ();
+#define taskYIELD() hostTaskYield()
+
+/**
+  * @brief Increments notification value of a task, waking it up if it is waiting in `ulTaskNotifyTake`
+  */
+BaseType_t xTaskNotifyGive (TaskHandle_t task);
+
+/**
+  * @brief Waits for notification value of calling task to be non zero
+  * @return Notification value before it was cleared or decremented. 0 on timeout
+  */
+uint32_t ulTaskNotifyTake (BaseType_t clearCountOnExit, TickType_t ticksToWait);
+
+/**
+  * @brief Semaphores are emulated as counters. Mutex is a semaphore that starts given, with no priority inheritance
+  */
+SemaphoreHandle_t xSemaphoreCreateMutex ();
+SemaphoreHandle_t xSemaphoreCreateBinary ();
+BaseType_t xSemaphoreTake (SemaphoreHandle_t semaphore, TickType_t ticksToWait);
+BaseType_t xSemaphoreGive (SemaphoreHandle_t semaphore);
+void vSemaphoreDelete (SemaphoreHandle_t semaphore);
+
+/**
+  * @brief Event groups hold 24 bits, as in FreeRTOS
+  */
+EventGroupHandle_t xEventGroupCreate ();
+EventBits_t xEventGroupSetBits (EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupClearBits (EventGroupHandle_t group, EventBits_t bits);
+/**
+  * @brief Waits for any or all of given bits to be set
+  * @return Event group bits when wait ended, before they were cleared
+  */
+EventBits_t xEventGroupWaitBits (EventGroupHandle_t group, EventBits_t bits, BaseType_t clearOnExit, BaseType_t waitForAllBits, TickType_t ticksToWait);
+void vEventGroupDelete (EventGroupHandle_t group);
+
+// ---------------- ESP-IDF ----------------
+
+typedef int32_t esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_ESPNOW_BASE 0x3066
+#define ESP_ERR_ESPNOW_NOT_INIT (ESP_ERR_ESPNOW_BASE + 1)
+#define ESP_ERR_ESPNOW_ARG (ESP_ERR_ESPNOW_BASE + 2)
+#define ESP_ERR_ESPNOW_NO_MEM (ESP_ERR_ESPNOW_BASE + 3)
+#define ESP_ERR_ESPNOW_FULL (ESP_ERR_ESPNOW_BASE + 4)
+#define ESP_ERR_ESPNOW_NOT_FOUND (ESP_ERR_ESPNOW_BASE + 5)
+#define ESP_ERR_ESPNOW_INTERNAL (ESP_ERR_ESPNOW_BASE + 6)
+#define ESP_ERR_ESPNOW_EXIST (ESP_ERR_ESPNOW_BASE + 7)
+#define ESP_ERR_ESPNOW_IF (ESP_ERR_ESPNOW_BASE + 8)
+#define ESP_ERR_ESPNOW_CHAN (ESP_ERR_ESPNOW_BASE + 9)
+
+const char* esp_err_to_name (esp_err_t code);
+
+#define ESP_ERROR_CHECK_WITHOUT_ABORT(x) ({                                                         \
+        esp_err_t err_rc_ = (x);                                                                    \
+        if (err_rc_ != ESP_OK) {                                                                    \
+            fprintf (stderr, "ESP_ERROR_CHECK failed: %s at %s:%d\n", esp_err_to_name (err_rc_),   \
+                     __FILE__, __LINE__);                                                           \
+        }                                                                                           \
+        err_rc_;                                                                                    \
+    })
+#define ESP_ERROR_CHECK(x) do {                                                                     \
+        if (ESP_ERROR_CHECK_WITHOUT_ABORT (x) != ESP_OK) {                                          \
+            abort ();                                                                               \
+        }                                                                                           \
+    } while (0)
+
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_KEY_LEN 16
+#define ESP_NOW_MAX_TOTAL_PEER_NUM 20
+#define ESP_NOW_MAX_DATA_LEN 250
+
+typedef enum {
+    ESP_NOW_SEND_SUCCESS = 0,       /**< Send ESPNOW data successfully */
+    ESP_NOW_SEND_FAIL,              /**< Send ESPNOW data fail */
+} esp_now_send_status_t;
+
+typedef enum {
+    WIFI_IF_STA = 0,
+    WIFI_IF_AP,
+} wifi_interface_t;
+
+typedef enum {
+    WIFI_SECOND_CHAN_NONE = 0,
+    WIFI_SECOND_CHAN_ABOVE,
+    WIFI_SECOND_CHAN_BELOW,
+} wifi_second_chan_t;
+
+typedef enum {
+    WIFI_BW_HT20 = 1,
+    WIFI_BW_HT40,
+} wifi_bandwidth_t;
+
+typedef struct {
+    uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+    uint8_t lmk[ESP_NOW_KEY_LEN];
+    uint8_t channel;
+    wifi_interface_t ifidx;
+    bool encrypt;
+    void* priv;
+} esp_now_peer_info_t;
+
+#endif // QESPNOW_HOST
+#endif // _QUICK_ESPNOW_HOST_h
@@ -9,9 +9,12 @@
 
 #if defined(ARDUINO) && ARDUINO >= 100
 #include "Arduino.h"
+#elif defined QESPNOW_HOST
+#include "QuickEspNow_host.h"
 #else
 #include "WProgram.h"
 #endif
+#include <atomic>
 // Disable debug dependency if debug level is 0
 #if DEBUG_LEVEL > 0
 #include <QuickDebug.h>
@@ -26,29 +29,40 @@ static const char* RINGBUFFER_DEBUG_TAG = "RINGBUFFER";
 
 
 /**
-  * @brief Ring buffer class. Used to implement message buffer
+  * @brief Lock-free single producer, single consumer ring buffer. Used to implement message buffer
   *
+  * One context may call `try_push` while other one calls `try_pop`, `front` and `pop` without any lock.
+  * Storage is rounded up to a power of two so that indexes are masked instead of using modulo. Head and tail
+  * run freely and only their difference is compared against buffer depth
   */
 template <typename Telement>
 class RingBuffer {
 protected:
-    int maxSize; ///< @brief Buffer size
-    int numElements = 0; ///< @brief Number of elements that buffer currently has
-    int readIndex = 0; ///< @brief Pointer to next item to be read
-    int writeIndex = 0; ///< @brief Pointer to next position to write onto
+    size_t maxSize; ///< @brief Buffer depth
+    size_t mask; ///< @brief Storage size minus one. Storage size is a power of two
+    std::atomic<size_t> head; ///< @brief Next position to write onto. Only modified by producer
+    std::atomic<size_t> tail; ///< @brief Next item to be read. Only modified by consumer
     Telement* buffer; ///< @brief Actual buffer
 
+    static size_t storageSize (size_t range) {
+        size_t size = 1;
+        while (size < range) {
+            size <<= 1;
+        }
+        return size;
+    }
+
 public:
     /**
       * @brief Creates a ring buffer to hold `Telement` objects
       * @param range Buffer depth
       */
-    RingBuffer <Telement> (int range) : maxSize (range) {
-        buffer = new Telement[maxSize];
+    RingBuffer (size_t range) : maxSize (range), mask (storageSize (range) - 1), head (0), tail (0) {
+        buffer = new Telement[mask + 1];
     }
 
     /**
-      * @brief EnigmaIOTRingBuffer destructor
+      * @brief RingBuffer destructor
       * @param range Free up buffer memory
       */
     ~RingBuffer () {
@@ -60,85 +74,115 @@ public:
       * @brief Returns actual number of elements that buffer holds
       * @return Returns Actual number of elements that buffer holds
       */
-    int size () { return numElements; }
+    size_t size () { return head.load (std::memory_order_acquire) - tail.load (std::memory_order_acquire); }
+
+    /**
+      * @brief Returns buffer depth
+      */
+    size_t capacity () { return maxSize; }
 
     /**
       * @brief Checks if buffer is full
       * @return Returns `true`if buffer is full, `false` otherwise
       */
-    bool isFull () { return numElements == maxSize; }
+    bool isFull () { return size () >= maxSize; }
 
     /**
       * @brief Checks if buffer is empty
       * @return Returns `true`if buffer has no elements stored, `false` otherwise
       */
-    bool empty () { return (numElements == 0); }
+    bool empty () { return size () == 0; }
+
+    /**
+      * @brief Changes buffer depth. Stored elements are discarded.
+      * Must not be called while producer or consumer are using the buffer
+      * @param range New buffer depth
+      */
+    void setCapacity (size_t range) {
+        delete[] (buffer);
+        maxSize = range;
+        mask = storageSize (range) - 1;
+        head.store (0);
+        tail.store (0);
+        buffer = new Telement[mask + 1];
+    }
 
     /**
-      * @brief Adds a new item to buffer, deleting older element if it is full
+      * @brief Gets a pointer to next free slot so that producer can fill it in place. Producer side.
+      * Slot is not visible to consumer until `commit` is called. Calling `reserve` again before `commit` returns the same slot
+      * @return Returns pointer to free slot or `NULL` if buffer is full
+      */
+    Telement* reserve () {
+        size_t writeIndex = head.load (std::memory_order_relaxed);
+        if (writeIndex - tail.load (std::memory_order_acquire) >= maxSize) {
+            DEBUG_DBG (RINGBUFFER_DEBUG_TAG, "Buffer full. ReadIdx: %u. WriteIdx: %u", tail.load (), writeIndex);
+            return NULL;
+        }
+        return &(buffer[writeIndex & mask]);
+    }
+
+    /**
+      * @brief Makes slot got with `reserve` available to consumer. Producer side
+      */
+    void commit () {
+        head.store (head.load (std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /**
+      * @brief Adds a copy of item to buffer. Producer side
       * @param item Element to add to buffer
-      * @return Returns `false` if buffer was full before inserting the new element, `true` otherwise
+      * @return Returns `false` if buffer was full and element was not added, `true` otherwise
       */
-    bool push (Telement* item) {
-        bool wasFull = isFull ();
-        DEBUG_DBG (RINGBUFFER_DEBUG_TAG, "Add element. Buffer was %s", wasFull ? "full" : "not full");
-        DEBUG_DBG (RINGBUFFER_DEBUG_TAG, "Before -- > ReadIdx: %d. WriteIdx: %d. Size: %d", readIndex, writeIndex, numElements);
-#ifdef ESP32
-        portMUX_TYPE myMutex = portMUX_INITIALIZER_UNLOCKED;
-        portENTER_CRITICAL (&myMutex);
-#endif
-        memcpy (&(buffer[writeIndex]), item, sizeof (Telement));
-        //Serial.printf ("Copied: %d bytes\n", sizeof (Telement));
-        writeIndex++;
-        if (writeIndex >= maxSize) {
-            writeIndex %= maxSize;
+    bool try_push (const Telement& item) {
+        Telement* slot = reserve ();
+        if (!slot) {
+            return false;
         }
-        if (wasFull) { // old value is no longer valid
-            readIndex++;
-            if (readIndex >= maxSize) {
-                readIndex %= maxSize;
-            }
-        } else {
-            numElements++;
+        *slot = item;
+        commit ();
+        return true;
+    }
+
+    /**
+      * @brief Moves older item out of buffer. Consumer side
+      * @param item Element where older item is copied to
+      * @return Returns `false` if buffer was empty, `true` otherwise
+      */
+    bool try_pop (Telement& item) {
+        size_t readIndex = tail.load (std::memory_order_relaxed);
+        if (head.load (std::memory_order_acquire) == readIndex) {
+            return false;
         }
-#ifdef ESP32
-        portEXIT_CRITICAL (&myMutex);
-#endif
-        DEBUG_DBG (RINGBUFFER_DEBUG_TAG, "After -- > ReadIdx: %d. WriteIdx: %d. Size: %d", readIndex, writeIndex, numElements);
-        return !wasFull;
+        item = buffer[readIndex & mask];
+        tail.store (readIndex + 1, std::memory_order_release);
+        return true;
     }
 
     /**
-      * @brief Deletes older item from buffer, if buffer is not empty
+      * @brief Deletes older item from buffer, if buffer is not empty. Consumer side
       * @return Returns `false` if buffer was empty before trying to delete element, `true` otherwise
       */
     bool pop () {
-        bool wasEmpty = empty ();
-        DEBUG_DBG (RINGBUFFER_DEBUG_TAG, "Remove element. Buffer was %s", wasEmpty ? "empty" : "not empty");
-        DEBUG_DBG (RINGBUFFER_DEBUG_TAG, "Before -- > ReadIdx: %d. WriteIdx: %d. Size: %d", readIndex, writeIndex, numElements);
-        if (!wasEmpty) {
-            readIndex++;
-            if (readIndex >= maxSize) {
-                readIndex %= maxSize;
-            }
-            numElements--;
+        size_t readIndex = tail.load (std::memory_order_relaxed);
+        if (head.load (std::memory_order_acquire) == readIndex) {
+            return false;
         }
-        DEBUG_DBG (RINGBUFFER_DEBUG_TAG, "After -- > ReadIdx: %d. WriteIdx: %d. Size: %d", readIndex, writeIndex, numElements);
-        return !wasEmpty;
+        tail.store (readIndex + 1, std::memory_order_release);
+        return true;
     }
 
     /**
-      * @brief Gets a pointer to older item in buffer, if buffer is not empty
+      * @brief Gets a pointer to older item in buffer, if buffer is not empty. Consumer side.
+      * Item stays valid and is not overwritten until `pop` is called
       * @return Returns pointer to element. If buffer was empty before calling this method it returns `NULL`
       */
     Telement* front () {
-        DEBUG_DBG (RINGBUFFER_DEBUG_TAG, "Read element. ReadIdx: %d. WriteIdx: %d. Size: %d", readIndex, writeIndex, numElements);
-        if (!empty ()) {
-            return &(buffer[readIndex]);
-        } else {
+        size_t readIndex = tail.load (std::memory_order_relaxed);
+        if (head.load (std::memory_order_acquire) == readIndex) {
             return NULL;
         }
+        return &(buffer[readIndex & mask]);
     }
 };
 
-#endif // _RINGBUFFER_h
\ No newline at end of file
+#endif // _RINGBUFFER_h
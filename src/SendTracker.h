@@ -0,0 +1,167 @@
+/**
+  * @file SendTracker.h
+  * @author German Martin
+  * @brief Per message completion tracking for QuickEspNow
+  */
+
+#ifndef _SENDTRACKER_h
+#define _SENDTRACKER_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#elif defined QESPNOW_HOST
+#include "QuickEspNow_host.h"
+#else
+#include "WProgram.h"
+#endif
+#include <atomic>
+#include <functional>
+
+#ifndef ESPNOW_MAX_TRACKED_MESSAGES
+#define ESPNOW_MAX_TRACKED_MESSAGES 16 ///< @brief Messages that may be tracked at the same time. Up to 24
+#endif
+
+typedef uint32_t espnow_send_handle_t; ///< @brief Identifies a message sent with `send` or `commit` until its result is collected
+static const espnow_send_handle_t ESPNOW_NO_HANDLE = 0; ///< @brief Never returned as a valid handle
+static const uint8_t ESPNOW_UNTRACKED = 0xFF; ///< @brief Tracking slot of messages that nobody waits for
+
+/**
+  * @brief Called by tx task for every tracked message once it is confirmed or given as failed
+  * @param handle Message handle. It is still valid inside callback
+  * @param dstAddress Destination address
+  * @param status `ESP_NOW_SEND_SUCCESS` or `ESP_NOW_SEND_FAIL`
+  * @param ctx User context given to `send` or `commit`
+  */
+typedef std::function<void (espnow_send_handle_t handle, const uint8_t* dstAddress, uint8_t status, void* ctx)> espnow_send_complete_cb_t;
+
+/**
+  * @brief Fixed table of messages whose result is awaited.
+  *
+  * A slot is taken by a producer when message is queued and its index travels inside the queue record. Tx task
+  * completes it with transmission result. If a handle was given to user, result is kept until it is collected.
+  * Otherwise slot is freed at once. Handles carry a generation number, so that a stale handle never matches a
+  * reused slot.
+  */
+class SendTrackerClass {
+public:
+    typedef enum {
+        SLOT_FREE = 0, /**< Slot may be taken */
+        SLOT_PENDING = 1, /**< Message is queued or in flight. Its result will be collected */
+        SLOT_DETACHED = 2, /**< Message is queued or in flight. Nobody collects its result */
+        SLOT_DONE = 3, /**< Result is ready to be collected */
+    } slot_state_t;
+
+protected:
+    typedef struct {
+        std::atomic<uint8_t> state;
+        uint8_t status;
+        uint16_t generation;
+        void* ctx;
+    } send_slot_t;
+
+    send_slot_t slots[ESPNOW_MAX_TRACKED_MESSAGES];
+
+    void freeSlot (uint8_t slot) { slots[slot].state.store (SLOT_FREE, std::memory_order_release); }
+
+public:
+    SendTrackerClass () {
+        for (int i = 0; i < ESPNOW_MAX_TRACKED_MESSAGES; i++) {
+            slots[i].state = SLOT_FREE;
+            slots[i].generation = 0;
+            slots[i].ctx = NULL;
+        }
+    }
+
+    /**
+      * @brief Takes a free slot. Any task may call it
+      * @param ctx User context passed to completion callback
+      * @param collect `true` if result will be collected with a handle
+      * @return Slot index. `ESPNOW_UNTRACKED` if all slots are in use
+      */
+    uint8_t allocate (void* ctx, bool collect) {
+        for (uint8_t i = 0; i < ESPNOW_MAX_TRACKED_MESSAGES; i++) {
+            uint8_t expected = SLOT_FREE;
+            if (slots[i].state.compare_exchange_strong (expected, collect ? SLOT_PENDING : SLOT_DETACHED)) {
+                if (++slots[i].generation == 0) {
+                    slots[i].generation = 1;
+                }
+                slots[i].ctx = ctx;
+                return i;
+            }
+        }
+        return ESPNOW_UNTRACKED;
+    }
+
+    /**
+      * @brief Frees a slot whose message was never queued
+      */
+    void cancel (uint8_t slot) { freeSlot (slot); }
+
+    /**
+      * @brief Handle that identifies current use of a slot
+      */
+    espnow_send_handle_t handle (uint8_t slot) { return ((uint32_t)slots[slot].generation << 8) | slot; }
+
+    /**
+      * @brief User context of a slot
+      */
+    void* context (uint8_t slot) { return slots[slot].ctx; }
+
+    /**
+      * @brief Gets slot of a handle
+      * @return Slot index. `ESPNOW_UNTRACKED` if handle is not valid or its result has already been collected
+      */
+    uint8_t find (espnow_send_handle_t handle) {
+        uint8_t slot = handle & 0xFF;
+        if (slot >= ESPNOW_MAX_TRACKED_MESSAGES || slots[slot].generation != (uint16_t)(handle >> 8)
+            || slots[slot].state.load (std::memory_order_acquire) == SLOT_FREE) {
+            return ESPNOW_UNTRACKED;
+        }
+        return slot;
+    }
+
+    /**
+      * @brief Stores transmission result. Called by tx task
+      * @return `true` if result is kept for collection, so that waiters have to be woken up
+      */
+    bool complete (uint8_t slot, uint8_t status) {
+        uint8_t expected = SLOT_PENDING;
+        slots[slot].status = status;
+        if (slots[slot].state.compare_exchange_strong (expected, SLOT_DONE)) {
+            return true;
+        }
+        freeSlot (slot);
+        return false;
+    }
+
+    /**
+      * @brief Gives up collecting result. Slot is freed when message completes
+      */
+    void detach (uint8_t slot) {
+        uint8_t expected = SLOT_PENDING;
+        if (!slots[slot].state.compare_exchange_strong (expected, SLOT_DETACHED) && expected == SLOT_DONE) {
+            freeSlot (slot);
+        }
+    }
+
+    /**
+      * @brief Checks if result is ready
+      */
+    bool completed (uint8_t slot) { return slots[slot].state.load (std::memory_order_acquire) == SLOT_DONE; }
+
+    /**
+      * @brief Gets result and frees slot
+      * @param status Gets transmission result if message has completed
+      * @return `false` if message has not completed yet
+      */
+    bool collect (uint8_t slot, uint8_t& status) {
+        if (!completed (slot)) {
+            return false;
+        }
+        status = slots[slot].status;
+        freeSlot (slot);
+        return true;
+    }
+};
+
+#endif // _SENDTRACKER_h
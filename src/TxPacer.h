@@ -0,0 +1,110 @@
+/**
+  * @file TxPacer.h
+  * @author German Martin
+  * @brief Token bucket used to pace QuickEspNow transmissions
+  */
+
+#ifndef _TXPACER_h
+#define _TXPACER_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#elif defined QESPNOW_HOST
+#include "QuickEspNow_host.h"
+#else
+#include "WProgram.h"
+#endif
+
+#ifndef ESPNOW_PACING_BURST
+#define ESPNOW_PACING_BURST 4 ///< @brief Frames that may be sent back to back after an idle period
+#endif
+#ifndef ESPNOW_PACING_STEP
+#define ESPNOW_PACING_STEP 4 ///< @brief Frames per second added to rate after every confirmed frame
+#endif
+#ifndef ESPNOW_PACING_MIN_RATE
+#define ESPNOW_PACING_MIN_RATE 10 ///< @brief Rate never goes below this many frames per second
+#endif
+
+/**
+  * @brief Token bucket with AIMD rate. It fills at `rate` frames per second and holds up to `ESPNOW_PACING_BURST` tokens.
+  *
+  * Bucket is kept as the time when its next token is due, so that it takes 8 bytes and no periodic refill.
+  * Rate grows by a fixed step after every success and it is cut by a factor after every congestion signal.
+  * It is not thread safe. Only tx task uses it
+  */
+class TokenBucketClass {
+protected:
+    uint32_t rate = 0; ///< @brief Frames per second. 0 if bucket is not paced
+    uint32_t due = 0; ///< @brief Time when next token is due, in microseconds
+
+    uint32_t interval () { return 1000000UL / rate; }
+
+public:
+    /**
+      * @brief Starts with full bucket
+      * @param rate Frames per second. 0 lets every frame go
+      * @param now Current time in microseconds
+      */
+    void begin (uint32_t rate, uint32_t now) {
+        this->rate = rate;
+        due = now;
+    }
+
+    /**
+      * @brief Checks if a frame may be sent
+      * @param now Current time in microseconds
+      * @return Time until next token, in microseconds. 0 if there is one now
+      */
+    uint32_t wait (uint32_t now) {
+        int32_t ahead;
+
+        if (!rate) {
+            return 0;
+        }
+        ahead = (int32_t)(due - now) - (int32_t)((ESPNOW_PACING_BURST - 1) * interval ());
+        return ahead > 0 ? ahead : 0;
+    }
+
+    /**
+      * @brief Takes a token for a frame that is being sent
+      * @param now Current time in microseconds
+      */
+    void take (uint32_t now) {
+        if (!rate) {
+            return;
+        }
+        // Tokens do not pile up over burst size while bucket is idle
+        if ((int32_t)(now - due) > 0) {
+            due = now;
+        }
+        due += interval ();
+    }
+
+    /**
+      * @brief Additive increase, after a frame has been confirmed
+      * @param maxRate Rate does not go over this value
+      */
+    void increase (uint32_t maxRate) {
+        if (rate) {
+            rate = rate + ESPNOW_PACING_STEP < maxRate ? rate + ESPNOW_PACING_STEP : maxRate;
+        }
+    }
+
+    /**
+      * @brief Multiplicative decrease, after a congestion signal
+      * @param minRate Rate does not go under this value
+      * @param factor Rate is multiplied by `factor / 8`
+      */
+    void decrease (uint32_t minRate, uint8_t factor) {
+        if (rate) {
+            rate = rate * factor / 8 > minRate ? rate * factor / 8 : minRate;
+        }
+    }
+
+    /**
+      * @brief Current rate in frames per second. 0 if bucket is not paced
+      */
+    uint32_t getRate () { return rate; }
+};
+
+#endif // _TXPACER_h
@@ -0,0 +1,214 @@
+#define UNIT_TEST
+
+#include <QuickEspNow.h>
+#include <BipBuffer.h>
+#include <unity.h>
+
+#ifndef ARDUINO
+#include <thread>
+#endif
+
+void setUp (void) {
+    // set stuff up here
+    Serial.begin (115200);
+}
+
+void tearDown (void) {
+    // clean stuff up here
+}
+
+bool pushRecord (BipBuffer& buffer, uint8_t value, size_t len) {
+    uint8_t* record = buffer.reserve (len);
+    if (!record) {
+        return false;
+    }
+    memset (record, value, len);
+    buffer.commit (len);
+    return true;
+}
+
+void test_variable_records () {
+    BipBuffer buffer (256);
+    size_t len;
+    TEST_ASSERT_TRUE (buffer.empty ());
+    TEST_ASSERT_NULL (buffer.front ());
+    TEST_ASSERT_TRUE (pushRecord (buffer, 1, 1));
+    TEST_ASSERT_TRUE (pushRecord (buffer, 2, 12));
+    TEST_ASSERT_TRUE (pushRecord (buffer, 3, 100));
+    TEST_ASSERT_EQUAL (BipBuffer::footprint (1) + BipBuffer::footprint (12) + BipBuffer::footprint (100), buffer.bytesUsed ());
+    for (uint8_t value = 1; value <= 3; value++) {
+        uint8_t* record = buffer.front (&len);
+        TEST_ASSERT_NOT_NULL (record);
+        TEST_ASSERT_EQUAL (0, (uintptr_t)record % 4);
+        TEST_ASSERT_EQUAL (value, record[0]);
+        TEST_ASSERT_EQUAL (value, record[len - 1]);
+        TEST_ASSERT_TRUE (buffer.pop ());
+    }
+    TEST_ASSERT_TRUE (buffer.empty ());
+    TEST_ASSERT_FALSE (buffer.pop ());
+}
+
+void test_small_records_fill_bytes () {
+    BipBuffer buffer (768);
+    int count = 0;
+    while (pushRecord (buffer, count, 12 + 12)) {
+        count++;
+    }
+    // A 12 byte message in transmission queue takes 28 bytes: record header, message header and payload
+    TEST_ASSERT_EQUAL (768 / 28, count);
+    TEST_ASSERT_FALSE (buffer.fits (24));
+}
+
+void test_wrap_with_padding () {
+    BipBuffer buffer (100);
+    size_t len = 0;
+    TEST_ASSERT_TRUE (pushRecord (buffer, 1, 40));
+    TEST_ASSERT_TRUE (pushRecord (buffer, 2, 40));
+    // Only 12 bytes left at the end. Next record has to wait for first one to be freed
+    TEST_ASSERT_FALSE (buffer.fits (20));
+    TEST_ASSERT_TRUE (buffer.pop ());
+    TEST_ASSERT_TRUE (buffer.fits (20));
+    TEST_ASSERT_TRUE (pushRecord (buffer, 3, 20));
+    TEST_ASSERT_EQUAL (2, buffer.front (&len)[0]);
+    TEST_ASSERT_TRUE (buffer.pop ());
+    uint8_t* record = buffer.front (&len);
+    TEST_ASSERT_EQUAL_PTR (record, buffer.reserve (0) - BipBuffer::footprint (20));
+    TEST_ASSERT_EQUAL (3, record[0]);
+    TEST_ASSERT_EQUAL (20, len);
+    TEST_ASSERT_TRUE (buffer.pop ());
+    TEST_ASSERT_TRUE (buffer.empty ());
+}
+
+void test_max_record_fits_empty_buffer () {
+    BipBuffer buffer (300);
+    size_t maxLen = buffer.maxRecordLen ();
+    for (int i = 0; i < 20; i++) {
+        TEST_ASSERT_TRUE (pushRecord (buffer, i, i % 2 ? maxLen : 7));
+        TEST_ASSERT_TRUE (buffer.pop ());
+    }
+}
+
+void test_walk_and_release () {
+    BipBuffer buffer (256);
+    size_t position = buffer.readPosition ();
+    for (uint8_t value = 0; value < 5; value++) {
+        TEST_ASSERT_TRUE (pushRecord (buffer, value, 10));
+    }
+    // Consumer reads records ahead of the ones it keeps
+    for (uint8_t value = 0; value < 5; value++) {
+        uint8_t* record = buffer.read (position);
+        TEST_ASSERT_NOT_NULL (record);
+        TEST_ASSERT_EQUAL (value, record[0]);
+        position = buffer.next (position);
+    }
+    TEST_ASSERT_NULL (buffer.read (position));
+    TEST_ASSERT_EQUAL (0, buffer.front ()[0]);
+    buffer.release (position);
+    TEST_ASSERT_TRUE (buffer.empty ());
+}
+
+void test_staged_records () {
+    BipBuffer buffer (100);
+    uint8_t* record;
+    // Staged records are hidden from consumer but take producer space
+    for (uint8_t value = 1; value <= 2; value++) {
+        TEST_ASSERT_NOT_NULL (record = buffer.reserve (40));
+        memset (record, value, 40);
+        buffer.commit (40, false);
+    }
+    TEST_ASSERT_TRUE (buffer.empty ());
+    TEST_ASSERT_FALSE (buffer.fits (20));
+    buffer.rollback ();
+    TEST_ASSERT_TRUE (buffer.empty ());
+    TEST_ASSERT_TRUE (buffer.fits (40));
+    // Staged records become visible all together
+    for (uint8_t value = 3; value <= 4; value++) {
+        TEST_ASSERT_NOT_NULL (record = buffer.reserve (40));
+        memset (record, value, 40);
+        buffer.commit (40, false);
+    }
+    TEST_ASSERT_NULL (buffer.front ());
+    buffer.publish ();
+    TEST_ASSERT_EQUAL (2 * BipBuffer::footprint (40), buffer.bytesUsed ());
+    for (uint8_t value = 3; value <= 4; value++) {
+        TEST_ASSERT_EQUAL (value, buffer.front ()[0]);
+        TEST_ASSERT_TRUE (buffer.pop ());
+    }
+    TEST_ASSERT_TRUE (buffer.empty ());
+}
+
+#ifndef ARDUINO
+void test_spsc_threads () {
+    const uint32_t RECORDS = 50000;
+    BipBuffer buffer (1024);
+    uint32_t errors = 0;
+
+    std::thread consumer ([&buffer, &errors, RECORDS] () {
+        uint32_t expected = 0;
+        size_t len;
+        while (expected < RECORDS) {
+            uint8_t* record = buffer.front (&len);
+            if (!record) {
+                std::this_thread::yield ();
+                continue;
+            }
+            if (len != 5 + expected % 250 || memcmp (record, &expected, 4) || record[len - 1] != (uint8_t)expected) {
+                errors++;
+            }
+            buffer.pop ();
+            expected++;
+        }
+    });
+    for (uint32_t i = 0; i < RECORDS; i++) {
+        size_t len = 5 + i % 250;
+        uint8_t* record;
+        while (!(record = buffer.reserve (len))) {
+            std::this_thread::yield ();
+        }
+        memset (record, (uint8_t)i, len);
+        memcpy (record, &i, 4);
+        buffer.commit (len);
+    }
+    consumer.join ();
+    TEST_ASSERT_EQUAL (0, errors);
+    TEST_ASSERT_TRUE (buffer.empty ());
+}
+#endif
+
+void process () {
+    UNITY_BEGIN ();
+    RUN_TEST (test_variable_records);
+    RUN_TEST (test_small_records_fill_bytes);
+    RUN_TEST (test_wrap_with_padding);
+    RUN_TEST (test_max_record_fits_empty_buffer);
+    RUN_TEST (test_walk_and_release);
+    RUN_TEST (test_staged_records);
+#ifndef ARDUINO
+    RUN_TEST (test_spsc_threads);
+#endif
+    UNITY_END ();
+}
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+void setup () {
+    // NOTE!!! Wait for >2 secs
+    // if board doesn't support software reset via Serial.DTR/RTS
+    delay (2000);
+
+    process ();
+}
+
+void loop () {
+    delay (1);
+}
+
+#else
+
+int main (int argc, char** argv) {
+    process ();
+    return 0;
+}
+
+#endif
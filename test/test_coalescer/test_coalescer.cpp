@@ -0,0 +1,203 @@
+#define UNIT_TEST
+
+#include <QuickEspNow.h>
+#include <EspNowCoalescer.h>
+#include <unity.h>
+
+static uint8_t source[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+static uint8_t lengths[200];
+static uint8_t firstBytes[200];
+static int messages;
+
+/**
+  * @brief Gives access to reception path without a radio
+  */
+class TestCoalescer : public EspNowCoalescerClass {
+public:
+    TestCoalescer () : EspNowCoalescerClass (quickEspNow) {}
+
+    using EspNowCoalescerClass::processFrame;
+};
+
+void dataReceived (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    if (messages < (int)sizeof (lengths)) {
+        lengths[messages] = len;
+        firstBytes[messages] = data[0];
+    }
+    messages++;
+}
+
+void setUp (void) {
+    // set stuff up here
+    Serial.begin (115200);
+    messages = 0;
+}
+
+void tearDown (void) {
+    // clean stuff up here
+}
+
+void test_unpack () {
+    TestCoalescer coalescer;
+    uint8_t frame[] = { ESPNOW_COALESCE_MAGIC, 2, 'a', 'b', 1, 'c', 3, 'd', 'e', 'f' };
+    uint8_t plain[] = { 'h', 'i' };
+    coalescer.onDataRcvd (dataReceived);
+    coalescer.processFrame (source, frame, sizeof (frame), -50, false);
+    TEST_ASSERT_EQUAL (3, messages);
+    TEST_ASSERT_EQUAL (2, lengths[0]);
+    TEST_ASSERT_EQUAL ('c', firstBytes[1]);
+    TEST_ASSERT_EQUAL (3, lengths[2]);
+    // Frames without packed header are passed through
+    coalescer.processFrame (source, plain, sizeof (plain), -50, false);
+    TEST_ASSERT_EQUAL (4, messages);
+    TEST_ASSERT_EQUAL ('h', firstBytes[3]);
+}
+
+void test_malformed_frame_dropped () {
+    TestCoalescer coalescer;
+    uint8_t overrun[] = { ESPNOW_COALESCE_MAGIC, 2, 'a', 'b', 4, 'c' };
+    uint8_t empty[] = { ESPNOW_COALESCE_MAGIC, 1, 'a', 0 };
+    coalescer.onDataRcvd (dataReceived);
+    coalescer.processFrame (source, overrun, sizeof (overrun), -50, false);
+    coalescer.processFrame (source, empty, sizeof (empty), -50, false);
+    TEST_ASSERT_EQUAL (0, messages);
+    TEST_ASSERT_EQUAL (2, coalescer.getDroppedFrames ());
+}
+
+#ifndef ARDUINO
+void test_pack_over_bus () {
+    const int MESSAGES = 100;
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    EspNowCoalescerClass senderCoalescer (sender);
+    EspNowCoalescerClass receiverCoalescer (receiver);
+    uint8_t payload[ESP_NOW_MAX_DATA_LEN];
+
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiverCoalescer.onDataRcvd (dataReceived);
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, false);
+    senderCoalescer.begin (1000);
+    for (int i = 0; i < MESSAGES; i++) {
+        comms_send_error_t error;
+        payload[0] = i;
+        // Message is not packed if a full frame cannot be queued to make room for it
+        while ((error = senderCoalescer.send (receiverMac, payload, 12)) == COMMS_SEND_QUEUE_FULL_ERROR) {
+            delay (1);
+        }
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, error);
+    }
+    // Long messages are sent after pending ones
+    payload[0] = MESSAGES;
+    comms_send_error_t error;
+    while ((error = senderCoalescer.send (receiverMac, payload, ESP_NOW_MAX_DATA_LEN)) == COMMS_SEND_QUEUE_FULL_ERROR) {
+        delay (1);
+    }
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, error);
+    for (int i = 0; i < 2000 && messages < MESSAGES + 1; i++) {
+        delay (1);
+    }
+    TEST_ASSERT_EQUAL (MESSAGES + 1, messages);
+    for (int i = 0; i <= MESSAGES; i++) {
+        TEST_ASSERT_EQUAL (i, firstBytes[i]);
+    }
+    TEST_ASSERT_EQUAL (ESP_NOW_MAX_DATA_LEN, lengths[MESSAGES]);
+    TEST_ASSERT_EQUAL (MESSAGES, senderCoalescer.getPackedMessages ());
+    // 19 records of 13 bytes fit in a frame
+    TEST_ASSERT_EQUAL (6, senderCoalescer.getSentFrames ());
+
+    // A lone message waits for flush delay
+    messages = 0;
+    senderCoalescer.begin (50);
+    senderCoalescer.send (receiverMac, payload, 12);
+    delay (20);
+    TEST_ASSERT_EQUAL (0, messages);
+    delay (100);
+    TEST_ASSERT_EQUAL (1, messages);
+    senderCoalescer.stop ();
+    sender.stop ();
+    receiver.stop ();
+}
+
+void test_full_frame () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x21 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x22 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    EspNowCoalescerClass senderCoalescer (sender);
+    EspNowCoalescerClass receiverCoalescer (receiver);
+    uint8_t payload[ESPNOW_COALESCE_MAX_RECORD];
+
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiverCoalescer.onDataRcvd (dataReceived);
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, false);
+    senderCoalescer.begin (1000);
+    // Longest record fills a frame up to radio limit, so it is sent without waiting for flush delay
+    memset (payload, 0x5A, sizeof (payload));
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, senderCoalescer.send (receiverMac, payload, ESPNOW_COALESCE_MAX_RECORD));
+    TEST_ASSERT_EQUAL (1, senderCoalescer.getSentFrames ());
+    // Records that add up to radio limit are sent too
+    for (int i = 0; i < 5; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, senderCoalescer.send (receiverMac, payload, i < 4 ? 49 : 48));
+    }
+    TEST_ASSERT_EQUAL (2, senderCoalescer.getSentFrames ());
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, senderCoalescer.flush ());
+    for (int i = 0; i < 2000 && messages < 6; i++) {
+        delay (1);
+    }
+    TEST_ASSERT_EQUAL (6, messages);
+    TEST_ASSERT_EQUAL (ESPNOW_COALESCE_MAX_RECORD, lengths[0]);
+    TEST_ASSERT_EQUAL (48, lengths[5]);
+    TEST_ASSERT_EQUAL (COMMS_SEND_PAYLOAD_LENGTH_ERROR, senderCoalescer.send (receiverMac, payload, ESP_NOW_MAX_DATA_LEN + 1));
+    senderCoalescer.stop ();
+    sender.stop ();
+    receiver.stop ();
+}
+#endif
+
+void process () {
+    UNITY_BEGIN ();
+    RUN_TEST (test_unpack);
+    RUN_TEST (test_malformed_frame_dropped);
+#ifndef ARDUINO
+    RUN_TEST (test_pack_over_bus);
+    RUN_TEST (test_full_frame);
+#endif
+    UNITY_END ();
+}
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+void setup () {
+    // NOTE!!! Wait for >2 secs
+    // if board doesn't support software reset via Serial.DTR/RTS
+    delay (2000);
+
+    process ();
+}
+
+void loop () {
+    delay (1);
+}
+
+#else
+
+int main (int argc, char** argv) {
+    process ();
+    return 0;
+}
+
+#endif
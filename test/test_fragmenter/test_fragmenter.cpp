@@ -0,0 +1,188 @@
+#define UNIT_TEST
+
+#include <QuickEspNow.h>
+#include <EspNowFragmenter.h>
+#include <unity.h>
+
+static uint8_t sourceA[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static uint8_t sourceB[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+static uint8_t sourceC[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x03 };
+
+static uint8_t message[ESPNOW_MAX_FRAGMENTS * ESPNOW_FRAGMENT_PAYLOAD];
+static uint8_t lastMessage[ESPNOW_MAX_FRAGMENTED_LENGTH];
+static size_t lastLen;
+static int messages;
+
+/**
+  * @brief Gives access to reception path without a radio
+  */
+class TestFragmenter : public EspNowFragmenterClass {
+public:
+    TestFragmenter () : EspNowFragmenterClass (quickEspNow) {}
+
+    using EspNowFragmenterClass::processFrame;
+
+    void feed (uint8_t* address, uint8_t id, uint8_t index, uint8_t count, size_t len) {
+        uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+        espnow_fragment_header_t* header = (espnow_fragment_header_t*)frame;
+        header->magic = ESPNOW_FRAGMENT_MAGIC;
+        header->id = id;
+        header->index = index;
+        header->count = count;
+        memcpy (frame + sizeof (espnow_fragment_header_t), message + index * ESPNOW_FRAGMENT_PAYLOAD, len);
+        processFrame (address, frame, sizeof (espnow_fragment_header_t) + len, -50, false);
+    }
+
+    void feedMessage (uint8_t* address, uint8_t id, size_t len, int skip = -1) {
+        uint8_t count = (len + ESPNOW_FRAGMENT_PAYLOAD - 1) / ESPNOW_FRAGMENT_PAYLOAD;
+        for (uint8_t i = 0; i < count; i++) {
+            if (i != skip) {
+                feed (address, id, i, count, i < count - 1 ? ESPNOW_FRAGMENT_PAYLOAD : len - i * ESPNOW_FRAGMENT_PAYLOAD);
+            }
+        }
+    }
+};
+
+void dataReceived (uint8_t* address, uint8_t* data, size_t len, signed int rssi, bool broadcast) {
+    memcpy (lastMessage, data, len);
+    lastLen = len;
+    messages++;
+}
+
+void setUp (void) {
+    // set stuff up here
+    Serial.begin (115200);
+    for (size_t i = 0; i < sizeof (message); i++) {
+        message[i] = (uint8_t)(i * 7 + i / 256);
+    }
+    messages = 0;
+    lastLen = 0;
+}
+
+void tearDown (void) {
+    // clean stuff up here
+}
+
+void test_reassemble_out_of_order () {
+    TestFragmenter fragmenter;
+    fragmenter.onDataRcvd (dataReceived);
+    // Last fragment first, and a duplicate
+    fragmenter.feed (sourceA, 1, 2, 3, 100);
+    fragmenter.feed (sourceA, 1, 0, 3, ESPNOW_FRAGMENT_PAYLOAD);
+    fragmenter.feed (sourceA, 1, 0, 3, ESPNOW_FRAGMENT_PAYLOAD);
+    TEST_ASSERT_EQUAL (0, messages);
+    fragmenter.feed (sourceA, 1, 1, 3, ESPNOW_FRAGMENT_PAYLOAD);
+    TEST_ASSERT_EQUAL (1, messages);
+    TEST_ASSERT_EQUAL (2 * ESPNOW_FRAGMENT_PAYLOAD + 100, lastLen);
+    TEST_ASSERT_EQUAL_MEMORY (message, lastMessage, lastLen);
+}
+
+void test_wrong_fragments_dropped () {
+    TestFragmenter fragmenter;
+    uint8_t plain[] = { 'h', 'i' };
+    fragmenter.onDataRcvd (dataReceived);
+    // Short middle fragment, index out of range and message longer than maximum
+    fragmenter.feed (sourceA, 1, 0, 3, 10);
+    fragmenter.feed (sourceA, 1, 3, 3, 10);
+    fragmenter.feed (sourceA, 1, ESPNOW_MAX_FRAGMENTS - 1, ESPNOW_MAX_FRAGMENTS, ESPNOW_FRAGMENT_PAYLOAD);
+    TEST_ASSERT_EQUAL (3, fragmenter.getDroppedFragments ());
+    TEST_ASSERT_EQUAL (0, messages);
+    // Frames without fragment header are passed through
+    fragmenter.processFrame (sourceA, plain, sizeof (plain), -50, false);
+    TEST_ASSERT_EQUAL (1, messages);
+    TEST_ASSERT_EQUAL (2, lastLen);
+}
+
+void test_new_message_replaces_incomplete () {
+    TestFragmenter fragmenter;
+    fragmenter.onDataRcvd (dataReceived);
+    fragmenter.feedMessage (sourceA, 1, 1000, 2);
+    fragmenter.feedMessage (sourceA, 2, 1000);
+    TEST_ASSERT_EQUAL (1, messages);
+    TEST_ASSERT_EQUAL (1000, lastLen);
+    // Missing fragment of message 1 arrives too late
+    fragmenter.feed (sourceA, 1, 2, 5, ESPNOW_FRAGMENT_PAYLOAD);
+    TEST_ASSERT_EQUAL (1, messages);
+}
+
+void test_buffers_are_bounded () {
+    TestFragmenter fragmenter;
+    fragmenter.onDataRcvd (dataReceived);
+    // Every buffer is taken by an incomplete message
+    fragmenter.feedMessage (sourceA, 1, 1000, 0);
+    fragmenter.feedMessage (sourceB, 1, 1000, 0);
+    fragmenter.feedMessage (sourceC, 1, 1000);
+    TEST_ASSERT_EQUAL (0, messages);
+    TEST_ASSERT_EQUAL (5, fragmenter.getDroppedFragments ());
+    // Buffer is given to a new source after timeout
+    delay (ESPNOW_REASSEMBLY_TIMEOUT_MS + 10);
+    fragmenter.feedMessage (sourceC, 2, 1000);
+    TEST_ASSERT_EQUAL (1, messages);
+    TEST_ASSERT_EQUAL_MEMORY (message, lastMessage, 1000);
+}
+
+#ifndef ARDUINO
+void test_send_over_bus () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    EspNowFragmenterClass senderFragmenter (sender);
+    EspNowFragmenterClass receiverFragmenter (receiver);
+
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiverFragmenter.onDataRcvd (dataReceived);
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, false);
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, senderFragmenter.send (receiverMac, message, ESPNOW_MAX_FRAGMENTED_LENGTH - i * 100));
+    }
+    delay (200);
+    sender.stop ();
+    receiver.stop ();
+    TEST_ASSERT_EQUAL (10, messages);
+    TEST_ASSERT_EQUAL (ESPNOW_MAX_FRAGMENTED_LENGTH - 900, lastLen);
+    TEST_ASSERT_EQUAL_MEMORY (message, lastMessage, lastLen);
+    TEST_ASSERT_EQUAL (COMMS_SEND_PAYLOAD_LENGTH_ERROR, senderFragmenter.send (receiverMac, message, ESPNOW_MAX_FRAGMENTED_LENGTH + 1));
+}
+#endif
+
+void process () {
+    UNITY_BEGIN ();
+    RUN_TEST (test_reassemble_out_of_order);
+    RUN_TEST (test_wrong_fragments_dropped);
+    RUN_TEST (test_new_message_replaces_incomplete);
+    RUN_TEST (test_buffers_are_bounded);
+#ifndef ARDUINO
+    RUN_TEST (test_send_over_bus);
+#endif
+    UNITY_END ();
+}
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+void setup () {
+    // NOTE!!! Wait for >2 secs
+    // if board doesn't support software reset via Serial.DTR/RTS
+    delay (2000);
+
+    process ();
+}
+
+void loop () {
+    delay (1);
+}
+
+#else
+
+int main (int argc, char** argv) {
+    process ();
+    return 0;
+}
+
+#endif
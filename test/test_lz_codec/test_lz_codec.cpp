@@ -0,0 +1,168 @@
+#define UNIT_TEST
+
+#include <QuickEspNow.h>
+#include <LzCodec.h>
+#include <unity.h>
+
+static const char JSON_MESSAGE[] = "{\"id\":12,\"type\":\"sensor\",\"data\":[{\"temp\":21.50,\"humidity\":40.00},{\"temp\":21.75,\"humidity\":40.25}],\"status\":\"ok\"}";
+static const uint8_t* dictionary = (const uint8_t*)LZ_DEFAULT_DICTIONARY;
+static const size_t dictLen = sizeof (LZ_DEFAULT_DICTIONARY) - 1;
+
+static uint8_t lastMessage[ESPNOW_MAX_MESSAGE_LENGTH];
+static size_t lastLen;
+static int messages;
+
+void setUp (void) {
+    // set stuff up here
+    Serial.begin (115200);
+    messages = 0;
+}
+
+void tearDown (void) {
+    // clean stuff up here
+}
+
+void test_round_trip () {
+    uint8_t compressed[ESPNOW_MAX_MESSAGE_LENGTH];
+    uint8_t output[ESPNOW_MAX_MESSAGE_LENGTH];
+    uint8_t runs[200];
+    size_t len;
+
+    len = LzCodec::compress ((const uint8_t*)JSON_MESSAGE, sizeof (JSON_MESSAGE), compressed, sizeof (compressed), dictionary, dictLen);
+    TEST_ASSERT_GREATER_THAN (0, len);
+    TEST_ASSERT_LESS_THAN (sizeof (JSON_MESSAGE) * 3 / 4, len);
+    TEST_ASSERT_EQUAL (sizeof (JSON_MESSAGE), LzCodec::decompress (compressed, len, output, sizeof (output), dictionary, dictLen));
+    TEST_ASSERT_EQUAL_MEMORY (JSON_MESSAGE, output, sizeof (JSON_MESSAGE));
+
+    // Long runs need overlapping matches, and no dictionary
+    for (size_t i = 0; i < sizeof (runs); i++) {
+        runs[i] = i < 150 ? 'a' : (uint8_t)i;
+    }
+    len = LzCodec::compress (runs, sizeof (runs), compressed, sizeof (compressed));
+    TEST_ASSERT_LESS_THAN (80, len);
+    TEST_ASSERT_EQUAL (sizeof (runs), LzCodec::decompress (compressed, len, output, sizeof (output)));
+    TEST_ASSERT_EQUAL_MEMORY (runs, output, sizeof (runs));
+}
+
+void test_incompressible_and_corrupt () {
+    uint8_t random[ESPNOW_MAX_MESSAGE_LENGTH];
+    uint8_t compressed[ESPNOW_MAX_MESSAGE_LENGTH + 4];
+    uint8_t output[ESPNOW_MAX_MESSAGE_LENGTH];
+    uint32_t seed = 12345;
+    size_t len;
+
+    for (size_t i = 0; i < sizeof (random); i++) {
+        seed = seed * 1103515245 + 12345;
+        random[i] = seed >> 16;
+    }
+    // Output must fit in given size
+    TEST_ASSERT_EQUAL (0, LzCodec::compress (random, sizeof (random), compressed, sizeof (random) - 1, dictionary, dictLen));
+    len = LzCodec::compress (random, sizeof (random), compressed, sizeof (compressed), dictionary, dictLen);
+    TEST_ASSERT_EQUAL (sizeof (random), LzCodec::decompress (compressed, len, output, sizeof (output), dictionary, dictLen));
+
+    // Match before start of dictionary, truncated token and output too long
+    uint8_t farMatch[] = { 0x83, 0xFF };
+    uint8_t truncated[] = { 0x05, 'a', 'b' };
+    TEST_ASSERT_EQUAL (0, LzCodec::decompress (farMatch, sizeof (farMatch), output, sizeof (output), dictionary, dictLen));
+    TEST_ASSERT_EQUAL (0, LzCodec::decompress (truncated, sizeof (truncated), output, sizeof (output)));
+    TEST_ASSERT_EQUAL (0, LzCodec::decompress (compressed, len, output, sizeof (output) - 1, dictionary, dictLen));
+}
+
+#ifndef ARDUINO
+void dataReceived (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    memcpy (lastMessage, data, len);
+    lastLen = len;
+    messages++;
+}
+
+void test_compressed_send () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    uint8_t magic[ESPNOW_MAX_MESSAGE_LENGTH];
+    espnow_batch_entry_t entries[2] = { { receiverMac, (const uint8_t*)JSON_MESSAGE, sizeof (JSON_MESSAGE) },
+                                        { receiverMac, (const uint8_t*)"plain", 5 } };
+
+    memset (magic, ESPNOW_COMPRESSED_MAGIC, sizeof (magic));
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (dataReceived);
+    sender.enableCompression (true);
+    receiver.enableCompression (true);
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, true);
+
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, (const uint8_t*)JSON_MESSAGE, sizeof (JSON_MESSAGE)));
+    delay (20);
+    TEST_ASSERT_EQUAL (1, messages);
+    TEST_ASSERT_EQUAL (sizeof (JSON_MESSAGE), lastLen);
+    TEST_ASSERT_EQUAL_MEMORY (JSON_MESSAGE, lastMessage, lastLen);
+
+    // Messages that start like a compressed frame are wrapped, unless that makes them too long
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, magic, 3));
+    delay (20);
+    TEST_ASSERT_EQUAL (2, messages);
+    TEST_ASSERT_EQUAL (3, lastLen);
+    TEST_ASSERT_EQUAL (ESPNOW_COMPRESSED_MAGIC, lastMessage[0]);
+    for (size_t i = 1; i < sizeof (magic); i++) {
+        magic[i] = (uint8_t)(i * 151 + i / 7);
+    }
+    TEST_ASSERT_EQUAL (COMMS_SEND_PAYLOAD_LENGTH_ERROR, sender.send (receiverMac, magic, sizeof (magic)));
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, magic, ESPNOW_COMPRESSED_MAGIC_MAX_LEN));
+    delay (20);
+    TEST_ASSERT_EQUAL (3, messages);
+    TEST_ASSERT_EQUAL (ESPNOW_COMPRESSED_MAGIC_MAX_LEN, lastLen);
+    TEST_ASSERT_EQUAL_MEMORY (magic, lastMessage, lastLen);
+
+    // Messages written in place are not compressed, so they cannot look like a compressed frame
+    uint8_t* buffer = sender.reserve (receiverMac, 3);
+    TEST_ASSERT_NOT_NULL (buffer);
+    memset (buffer, ESPNOW_COMPRESSED_MAGIC, 3);
+    TEST_ASSERT_EQUAL (COMMS_SEND_PARAM_ERROR, sender.commit (3));
+
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.sendBatch (entries, 2));
+    delay (20);
+    TEST_ASSERT_EQUAL (5, messages);
+    TEST_ASSERT_EQUAL (5, lastLen);
+    sender.stop ();
+    receiver.stop ();
+}
+#endif
+
+void process () {
+    UNITY_BEGIN ();
+    RUN_TEST (test_round_trip);
+    RUN_TEST (test_incompressible_and_corrupt);
+#ifndef ARDUINO
+    RUN_TEST (test_compressed_send);
+#endif
+    UNITY_END ();
+}
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+void setup () {
+    // NOTE!!! Wait for >2 secs
+    // if board doesn't support software reset via Serial.DTR/RTS
+    delay (2000);
+
+    process ();
+}
+
+void loop () {
+    delay (1);
+}
+
+#else
+
+int main (int argc, char** argv) {
+    process ();
+    return 0;
+}
+
+#endif
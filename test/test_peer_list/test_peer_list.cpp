@@ -101,12 +101,262 @@ void test_add_max_peers_plus_1 () {
     // PeerList.dump_peer_list ();
 }
 
+void test_least_recently_used_evicted () {
+    for (uint8_t i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
+        TEST_ASSERT_TRUE (PeerList.add_peer (macs[i]));
+    }
+    // Using a peer makes it the newest one
+    TEST_ASSERT_TRUE (PeerList.peer_exists (macs[0]));
+    TEST_ASSERT_EQUAL_MEMORY (macs[1], PeerList.delete_peer (), 6);
+    TEST_ASSERT_EQUAL_MEMORY (macs[2], PeerList.delete_peer (), 6);
+    // Deleted peers are still known, so their state is kept
+    TEST_ASSERT_FALSE (PeerList.peer_exists (macs[1]));
+    TEST_ASSERT_NULL (PeerList.get_peer (macs[1]));
+    TEST_ASSERT_NOT_NULL (PeerList.find_peer (macs[1]));
+    TEST_ASSERT_TRUE (PeerList.add_peer (macs[1]));
+    TEST_ASSERT_EQUAL (ESP_NOW_MAX_TOTAL_PEER_NUM - 1, PeerList.get_peer_number ());
+    TEST_ASSERT_EQUAL_MEMORY (macs[3], PeerList.delete_peer (), 6);
+    while (PeerList.delete_peer ()) {
+    }
+    TEST_ASSERT_EQUAL (0, PeerList.get_peer_number ());
+}
+
+void test_churn () {
+    const int NODES = 200;
+    uint8_t node[6] = { 0x24, 0x6F, 0x28, 0x00, 0x00, 0x00 };
+    uint16_t model[ESP_NOW_MAX_TOTAL_PEER_NUM]; // Registered nodes, newest first
+    int registered = 0;
+    uint32_t seed = 1;
+
+    // Gateway sends to 200 nodes, some of them much more often than others
+    for (int i = 0; i < 20000; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint16_t id = (seed >> 16) % 8 ? (seed >> 8) % 16 : (seed >> 8) % NODES;
+        int position;
+        node[4] = id >> 8;
+        node[5] = id & 0xFF;
+        for (position = 0; position < registered && model[position] != id; position++) {
+        }
+        if (PeerList.peer_exists (node)) {
+            TEST_ASSERT_TRUE (position < registered);
+        } else {
+            TEST_ASSERT_EQUAL (registered, position);
+            if (PeerList.get_peer_number () >= ESP_NOW_MAX_TOTAL_PEER_NUM) {
+                uint8_t* evicted = PeerList.delete_peer ();
+                TEST_ASSERT_NOT_NULL (evicted);
+                TEST_ASSERT_EQUAL (model[registered - 1], (evicted[4] << 8) | evicted[5]);
+                position = --registered;
+            }
+            TEST_ASSERT_TRUE (PeerList.add_peer (node));
+            registered++;
+        }
+        memmove (&model[1], &model[0], position * sizeof (model[0]));
+        model[0] = id;
+        TEST_ASSERT_EQUAL (registered, PeerList.get_peer_number ());
+    }
+
+    // Every remembered node is still found after many insertions and deletions
+    int known = 0;
+    for (uint16_t id = 0; id < NODES; id++) {
+        node[4] = id >> 8;
+        node[5] = id & 0xFF;
+        if (PeerList.find_peer (node)) {
+            known++;
+        }
+    }
+    TEST_ASSERT_EQUAL (ESPNOW_MAX_PEERS, PeerList.get_known_peer_number ());
+    TEST_ASSERT_EQUAL (ESPNOW_MAX_PEERS, known);
+    for (int i = 0; i < registered; i++) {
+        node[4] = model[i] >> 8;
+        node[5] = model[i] & 0xFF;
+        TEST_ASSERT_NOT_NULL (PeerList.get_peer (node));
+        TEST_ASSERT_TRUE (PeerList.delete_peer (node));
+    }
+    TEST_ASSERT_EQUAL (0, PeerList.get_peer_number ());
+}
+
+#ifndef ARDUINO
+/**
+  * @brief Counts peer state queries that engine makes to driver
+  */
+class CountingDriver : public EspNowBusDriverClass {
+public:
+    CountingDriver (EspNowBusClass& bus, const uint8_t* mac) : EspNowBusDriverClass (bus, mac) {}
+    int getPeerCalls = 0;
+    int getChannelCalls = 0;
+    int addPeerCalls = 0;
+    int addPeerErrors = 0;
+
+    esp_err_t addPeer (const esp_now_peer_info_t* peer) override {
+        esp_err_t error = EspNowBusDriverClass::addPeer (peer);
+        addPeerCalls++;
+        if (error != ESP_OK) {
+            addPeerErrors++;
+        }
+        return error;
+    }
+
+    esp_err_t getPeer (const uint8_t* mac, esp_now_peer_info_t* peer) override {
+        getPeerCalls++;
+        return EspNowBusDriverClass::getPeer (mac, peer);
+    }
+    esp_err_t getChannel (uint8_t* primary, wifi_second_chan_t* second) override {
+        getChannelCalls++;
+        return EspNowBusDriverClass::getChannel (primary, second);
+    }
+};
+
+static int received;
+
+void countReceived (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    received++;
+}
+
+void test_driver_peer_state_cached () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t payload[] = { 1, 2, 3 };
+    EspNowBusClass bus;
+    CountingDriver senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+
+    received = 0;
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (countReceived);
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, true);
+    for (int i = 0; i < 50; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, payload, sizeof (payload)));
+    }
+    TEST_ASSERT_EQUAL (0, senderRadio.getPeerCalls);
+    TEST_ASSERT_EQUAL (0, senderRadio.getChannelCalls);
+
+    // Channel change makes peer to be checked once
+    TEST_ASSERT_TRUE (receiver.setChannel (6));
+    TEST_ASSERT_TRUE (sender.setChannel (6));
+    for (int i = 0; i < 50; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, payload, sizeof (payload)));
+    }
+    TEST_ASSERT_EQUAL (1, senderRadio.getPeerCalls);
+
+    // Driver forgets peers on restart
+    sender.stop ();
+    sender.begin (6, 0, true);
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, payload, sizeof (payload)));
+    delay (20);
+    TEST_ASSERT_EQUAL (101, received);
+    sender.stop ();
+    receiver.stop ();
+}
+
+void test_broadcast_fast_path () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t unicastMac[] = { 0x02, 0x00, 0x00, 0x00, 0x01, 0x00 };
+    uint8_t payload[] = { 1, 2, 3 };
+    EspNowBusClass bus;
+    CountingDriver senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+
+    received = 0;
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (countReceived);
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, true);
+    TEST_ASSERT_EQUAL (1, senderRadio.addPeerCalls);
+    for (int i = 0; i < 50; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.sendBcast (payload, sizeof (payload)));
+    }
+    // Broadcast peer follows radio channel
+    TEST_ASSERT_TRUE (receiver.setChannel (6));
+    TEST_ASSERT_TRUE (sender.setChannel (6));
+    for (int i = 0; i < 50; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.sendBcast (payload, sizeof (payload)));
+    }
+    TEST_ASSERT_EQUAL (1, senderRadio.addPeerCalls);
+    TEST_ASSERT_EQUAL (0, senderRadio.getPeerCalls);
+    TEST_ASSERT_EQUAL (0, senderRadio.getChannelCalls);
+
+    // Unicast peers never take broadcast peer slot
+    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM + 5; i++) {
+        unicastMac[5] = i;
+        sender.send (unicastMac, payload, sizeof (payload));
+    }
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.sendBcast (payload, sizeof (payload)));
+    delay (20);
+    TEST_ASSERT_EQUAL (0, senderRadio.addPeerErrors);
+    TEST_ASSERT_EQUAL (101, received);
+    sender.stop ();
+    receiver.stop ();
+}
+
+void test_link_quality () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t payload[] = { 1, 2, 3 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    espnow_link_quality_t link;
+
+    received = 0;
+    bus.setLossRatio (0.3);
+    bus.setRssi (-60);
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (countReceived);
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, true);
+    TEST_ASSERT_FALSE (sender.getLinkQuality (receiverMac, link));
+    for (int i = 0; i < 40; i++) {
+        sender.send (receiverMac, payload, sizeof (payload));
+    }
+    delay (20);
+
+    TEST_ASSERT_TRUE (sender.getLinkQuality (receiverMac, link));
+    TEST_ASSERT_EQUAL (40, link.txFrames);
+    TEST_ASSERT_EQUAL (40 - received, link.txFailures);
+    TEST_ASSERT_LESS_THAN (100, link.txSuccess);
+    TEST_ASSERT_EQUAL (0, link.rxFrames);
+
+    // Receiver has never sent anything to sender, but it remembers it from its frames
+    TEST_ASSERT_TRUE (receiver.getLinkQuality (senderMac, link));
+    TEST_ASSERT_EQUAL (received, link.rxFrames);
+    TEST_ASSERT_EQUAL (-60, link.rssi);
+    TEST_ASSERT_EQUAL (0, link.txFrames);
+    TEST_ASSERT_EQUAL (100, link.txSuccess);
+
+    // Rate of a period that is over is measured even if no frame closes it
+    delay (ESPNOW_LINK_RATE_PERIOD_MS);
+    TEST_ASSERT_TRUE (receiver.getLinkQuality (senderMac, link));
+    TEST_ASSERT_GREATER_THAN (0, link.rxRate);
+    TEST_ASSERT_LESS_OR_EQUAL (received, link.rxRate);
+    sender.stop ();
+    receiver.stop ();
+}
+#endif
+
 void process () {
     UNITY_BEGIN ();
     RUN_TEST (test_add_one_peer);
     RUN_TEST (test_add_existing_peer);
     RUN_TEST (test_add_max_peers);
     RUN_TEST (test_add_max_peers_plus_1);
+    RUN_TEST (test_least_recently_used_evicted);
+    RUN_TEST (test_churn);
+#ifndef ARDUINO
+    RUN_TEST (test_driver_peer_state_cached);
+    RUN_TEST (test_broadcast_fast_path);
+    RUN_TEST (test_link_quality);
+#endif
     UNITY_END ();
 }
 
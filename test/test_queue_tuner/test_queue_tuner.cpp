@@ -0,0 +1,83 @@
+#define UNIT_TEST
+
+#include <QuickEspNow.h>
+#include <QueueTuner.h>
+#include <unity.h>
+
+void setUp (void) {
+    // set stuff up here
+    Serial.begin (115200);
+}
+
+void tearDown (void) {
+    // clean stuff up here
+}
+
+void test_grow_on_drops () {
+    QueueTunerClass tuner;
+    tuner.reset ();
+    tuner.recordUsage (1000);
+    tuner.recordDrop ();
+    TEST_ASSERT_EQUAL (2048, tuner.evaluate (1024, 512, 8192));
+    // Drop counter starts again in every period
+    TEST_ASSERT_EQUAL (2048, tuner.evaluate (2048, 512, 8192));
+    tuner.recordDrop ();
+    TEST_ASSERT_EQUAL (3000, tuner.evaluate (2048, 512, 3000));
+}
+
+void test_shrink_when_quiet () {
+    QueueTunerClass tuner;
+    tuner.reset ();
+    for (int i = 1; i < ESPNOW_QUEUE_SHRINK_PERIODS; i++) {
+        tuner.recordUsage (100);
+        TEST_ASSERT_EQUAL (4096, tuner.evaluate (4096, 512, 8192));
+    }
+    tuner.recordUsage (100);
+    TEST_ASSERT_EQUAL (2048, tuner.evaluate (4096, 512, 8192));
+    // Never below minimum, even if queue is not used at all
+    for (int i = 1; i < ESPNOW_QUEUE_SHRINK_PERIODS; i++) {
+        tuner.evaluate (600, 536, 8192);
+    }
+    TEST_ASSERT_EQUAL (536, tuner.evaluate (600, 536, 8192));
+}
+
+void test_busy_queue_keeps_size () {
+    QueueTunerClass tuner;
+    tuner.reset ();
+    for (int i = 0; i < 3 * ESPNOW_QUEUE_SHRINK_PERIODS; i++) {
+        tuner.recordUsage (i % ESPNOW_QUEUE_SHRINK_PERIODS ? 100 : 1500);
+        TEST_ASSERT_EQUAL (4096, tuner.evaluate (4096, 512, 8192));
+    }
+}
+
+void process () {
+    UNITY_BEGIN ();
+    RUN_TEST (test_grow_on_drops);
+    RUN_TEST (test_shrink_when_quiet);
+    RUN_TEST (test_busy_queue_keeps_size);
+    UNITY_END ();
+}
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+void setup () {
+    // NOTE!!! Wait for >2 secs
+    // if board doesn't support software reset via Serial.DTR/RTS
+    delay (2000);
+
+    process ();
+}
+
+void loop () {
+    delay (1);
+}
+
+#else
+
+int main (int argc, char** argv) {
+    process ();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,193 @@
+#define UNIT_TEST
+
+#include <QuickEspNow.h>
+#include <EspNowReliable.h>
+#include <unity.h>
+#include <set>
+#include <string>
+
+static uint8_t source[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+static uint8_t received[1000];
+static int messages;
+static int errors;
+
+/**
+  * @brief Gives access to reception path without a radio
+  */
+class TestReliable : public EspNowReliableClass {
+public:
+    TestReliable () : EspNowReliableClass (quickEspNow) {}
+
+    void feed (uint8_t session, uint16_t seq, uint16_t base) {
+        uint8_t frame[sizeof (espnow_reliable_header_t) + 1];
+        espnow_reliable_header_t header = { ESPNOW_RELIABLE_MAGIC, ESPNOW_RELIABLE_DATA, session, 0, seq, base };
+        memcpy (frame, &header, sizeof (header));
+        frame[sizeof (header)] = (uint8_t)seq;
+        processFrame (source, frame, sizeof (frame), -50, false);
+    }
+};
+
+void dataReceived (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    if (messages < (int)sizeof (received)) {
+        received[messages] = data[0];
+    }
+    messages++;
+}
+
+void setUp (void) {
+    // set stuff up here
+    Serial.begin (115200);
+    messages = 0;
+    errors = 0;
+}
+
+void tearDown (void) {
+    // clean stuff up here
+}
+
+void test_deliver_in_order () {
+    TestReliable reliable;
+    reliable.onDataRcvd (dataReceived);
+    reliable.feed (1, 1, 0);
+    reliable.feed (1, 2, 0);
+    TEST_ASSERT_EQUAL (0, messages);
+    reliable.feed (1, 0, 0);
+    TEST_ASSERT_EQUAL (3, messages);
+    // Duplicates and messages beyond window are not delivered
+    reliable.feed (1, 1, 0);
+    reliable.feed (1, 3 + ESPNOW_RELIABLE_WINDOW, 0);
+    TEST_ASSERT_EQUAL (3, messages);
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL (i, received[i]);
+    }
+}
+
+void test_skip_failed_messages () {
+    TestReliable reliable;
+    reliable.onDataRcvd (dataReceived);
+    reliable.feed (1, 0, 0);
+    reliable.feed (1, 2, 0);
+    reliable.feed (1, 4, 0);
+    TEST_ASSERT_EQUAL (1, messages);
+    // Sender gave up message 1 and 3
+    reliable.feed (1, 5, 4);
+    TEST_ASSERT_EQUAL (4, messages);
+    TEST_ASSERT_EQUAL (2, received[1]);
+    TEST_ASSERT_EQUAL (4, received[2]);
+    TEST_ASSERT_EQUAL (5, received[3]);
+}
+
+void test_new_session_resets () {
+    TestReliable reliable;
+    reliable.onDataRcvd (dataReceived);
+    reliable.feed (1, 0, 0);
+    reliable.feed (1, 1, 0);
+    TEST_ASSERT_EQUAL (2, messages);
+    // Sender restarted. Its sequence numbers start again
+    reliable.feed (2, 0, 0);
+    TEST_ASSERT_EQUAL (3, messages);
+    TEST_ASSERT_EQUAL (0, received[2]);
+}
+
+#ifndef ARDUINO
+/**
+  * @brief Sends messages over a link that loses first transmission of every fifth one
+  * @param synchronousSend Mode of both QuickEspNow instances. Acks then wait for their confirmation in reception task
+  * @param total Number of messages
+  */
+void lossyLink (bool synchronousSend, int total) {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    EspNowReliableClass senderChannel (sender);
+    EspNowReliableClass receiverChannel (receiver);
+    std::set<std::string> seen;
+
+    // First transmission of every fifth message is lost. Payloads are all different, and retransmissions always
+    // arrive, so that no message is given up whatever thread timing is
+    bus.setLossFilter ([&seen] (const espnow_host_frame_t* frame) {
+        const espnow_reliable_header_t* header = (const espnow_reliable_header_t*)frame->payload;
+        if (header->type != ESPNOW_RELIABLE_DATA) {
+            return false;
+        }
+        std::string content ((const char*)frame->payload + sizeof (espnow_reliable_header_t), frame->payload_len - sizeof (espnow_reliable_header_t));
+        return seen.insert (content).second && seen.size () % 5 == 0;
+    });
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    senderChannel.onDataRcvd (dataReceived);
+    receiverChannel.onDataRcvd ([] (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+        if (data[0] != (uint8_t)messages || len != 1 + messages % 200) {
+            errors++;
+        }
+        messages++;
+    });
+    receiver.begin (1, 0, synchronousSend);
+    sender.begin (1, 0, synchronousSend);
+    receiverChannel.begin ();
+    senderChannel.begin ();
+    for (int i = 0; i < total; i++) {
+        uint8_t payload[200];
+        memset (payload, (uint8_t)i, sizeof (payload));
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, senderChannel.send (receiverMac, payload, 1 + i % 200));
+    }
+    TEST_ASSERT_TRUE (senderChannel.flush (5000));
+    senderChannel.stop ();
+    receiverChannel.stop ();
+    sender.stop ();
+    receiver.stop ();
+    TEST_ASSERT_EQUAL (total, messages);
+    TEST_ASSERT_EQUAL (0, errors);
+    TEST_ASSERT_EQUAL (0, senderChannel.getFailedMessages ());
+    TEST_ASSERT_GREATER_OR_EQUAL (total / 5, senderChannel.getRetransmissions ());
+}
+
+void test_lossy_link () {
+    lossyLink (false, 500);
+}
+
+void test_lossy_link_synchronous () {
+    lossyLink (true, 100);
+}
+#endif
+
+void process () {
+    UNITY_BEGIN ();
+    RUN_TEST (test_deliver_in_order);
+    RUN_TEST (test_skip_failed_messages);
+    RUN_TEST (test_new_session_resets);
+#ifndef ARDUINO
+    RUN_TEST (test_lossy_link);
+    RUN_TEST (test_lossy_link_synchronous);
+#endif
+    UNITY_END ();
+}
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+void setup () {
+    // NOTE!!! Wait for >2 secs
+    // if board doesn't support software reset via Serial.DTR/RTS
+    delay (2000);
+
+    process ();
+}
+
+void loop () {
+    delay (1);
+}
+
+#else
+
+int main (int argc, char** argv) {
+    process ();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,155 @@
+#define UNIT_TEST
+
+#include <QuickEspNow.h>
+#include <RingBuffer.h>
+#include <unity.h>
+
+#ifndef ARDUINO
+#include <thread>
+#endif
+
+void setUp (void) {
+    // set stuff up here
+    Serial.begin (115200);
+}
+
+void tearDown (void) {
+    // clean stuff up here
+}
+
+void test_push_pop () {
+    RingBuffer<int> buffer (4);
+    int item = 0;
+    TEST_ASSERT_TRUE (buffer.empty ());
+    TEST_ASSERT_NULL (buffer.front ());
+    TEST_ASSERT_FALSE (buffer.try_pop (item));
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_TRUE (buffer.try_push (i));
+        TEST_ASSERT_EQUAL (i + 1, buffer.size ());
+    }
+    TEST_ASSERT_TRUE (buffer.isFull ());
+    TEST_ASSERT_FALSE (buffer.try_push (4));
+    TEST_ASSERT_EQUAL (0, *buffer.front ());
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_TRUE (buffer.try_pop (item));
+        TEST_ASSERT_EQUAL (i, item);
+    }
+    TEST_ASSERT_TRUE (buffer.empty ());
+    TEST_ASSERT_FALSE (buffer.pop ());
+}
+
+void test_depth_not_power_of_two () {
+    RingBuffer<int> buffer (3);
+    TEST_ASSERT_EQUAL (3, buffer.capacity ());
+    TEST_ASSERT_TRUE (buffer.try_push (1));
+    TEST_ASSERT_TRUE (buffer.try_push (2));
+    TEST_ASSERT_TRUE (buffer.try_push (3));
+    TEST_ASSERT_FALSE (buffer.try_push (4));
+    TEST_ASSERT_TRUE (buffer.pop ());
+    TEST_ASSERT_TRUE (buffer.try_push (4));
+    TEST_ASSERT_EQUAL (2, *buffer.front ());
+}
+
+void test_wraparound () {
+    RingBuffer<int> buffer (5);
+    int item;
+    int next = 0;
+    for (int i = 0; i < 1000; i++) {
+        TEST_ASSERT_TRUE (buffer.try_push (i));
+        if (i % 3 != 0) {
+            TEST_ASSERT_TRUE (buffer.try_push (-i));
+        }
+        while (buffer.size () > 2) {
+            TEST_ASSERT_TRUE (buffer.try_pop (item));
+            next++;
+        }
+    }
+    TEST_ASSERT_TRUE (next > 0);
+    TEST_ASSERT_TRUE (buffer.size () <= 2);
+}
+
+void test_reserve_commit () {
+    RingBuffer<int> buffer (2);
+    int* slot = buffer.reserve ();
+    TEST_ASSERT_NOT_NULL (slot);
+    *slot = 10;
+    TEST_ASSERT_TRUE (buffer.empty ());
+    TEST_ASSERT_NULL (buffer.front ());
+    TEST_ASSERT_EQUAL_PTR (slot, buffer.reserve ());
+    buffer.commit ();
+    TEST_ASSERT_EQUAL (1, buffer.size ());
+    TEST_ASSERT_EQUAL (10, *buffer.front ());
+    *buffer.reserve () = 11;
+    buffer.commit ();
+    TEST_ASSERT_NULL (buffer.reserve ());
+    TEST_ASSERT_TRUE (buffer.pop ());
+    TEST_ASSERT_NOT_NULL (buffer.reserve ());
+    TEST_ASSERT_EQUAL (11, *buffer.front ());
+}
+
+#ifndef ARDUINO
+void test_spsc_threads () {
+    const uint32_t ITEMS = 100000;
+    RingBuffer<uint32_t> buffer (8);
+    uint32_t errors = 0;
+
+    std::thread consumer ([&buffer, &errors, ITEMS] () {
+        uint32_t expected = 0;
+        uint32_t item;
+        while (expected < ITEMS) {
+            if (buffer.try_pop (item)) {
+                if (item != expected) {
+                    errors++;
+                }
+                expected++;
+            } else {
+                std::this_thread::yield ();
+            }
+        }
+    });
+    for (uint32_t i = 0; i < ITEMS; i++) {
+        while (!buffer.try_push (i)) {
+            std::this_thread::yield ();
+        }
+    }
+    consumer.join ();
+    TEST_ASSERT_EQUAL (0, errors);
+    TEST_ASSERT_TRUE (buffer.empty ());
+}
+#endif
+
+void process () {
+    UNITY_BEGIN ();
+    RUN_TEST (test_push_pop);
+    RUN_TEST (test_depth_not_power_of_two);
+    RUN_TEST (test_wraparound);
+    RUN_TEST (test_reserve_commit);
+#ifndef ARDUINO
+    RUN_TEST (test_spsc_threads);
+#endif
+    UNITY_END ();
+}
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+void setup () {
+    // NOTE!!! Wait for >2 secs
+    // if board doesn't support software reset via Serial.DTR/RTS
+    delay (2000);
+
+    process ();
+}
+
+void loop () {
+    delay (1);
+}
+
+#else
+
+int main (int argc, char** argv) {
+    process ();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#define UNIT_TEST
+
+#include <QuickEspNow.h>
+#include <SendTracker.h>
+#include <unity.h>
+
+void setUp (void) {
+    // set stuff up here
+    Serial.begin (115200);
+}
+
+void tearDown (void) {
+    // clean stuff up here
+}
+
+void test_collect_result () {
+    SendTrackerClass tracker;
+    uint8_t status = 0xAA;
+    int ctx;
+    uint8_t slot = tracker.allocate (&ctx, true);
+    espnow_send_handle_t handle = tracker.handle (slot);
+    TEST_ASSERT_NOT_EQUAL (ESPNOW_NO_HANDLE, handle);
+    TEST_ASSERT_EQUAL (slot, tracker.find (handle));
+    TEST_ASSERT_EQUAL_PTR (&ctx, tracker.context (slot));
+    TEST_ASSERT_FALSE (tracker.collect (slot, status));
+    TEST_ASSERT_TRUE (tracker.complete (slot, ESP_NOW_SEND_FAIL));
+    TEST_ASSERT_TRUE (tracker.collect (slot, status));
+    TEST_ASSERT_EQUAL (ESP_NOW_SEND_FAIL, status);
+    // Result can only be collected once
+    TEST_ASSERT_EQUAL (ESPNOW_UNTRACKED, tracker.find (handle));
+}
+
+void test_stale_handle () {
+    SendTrackerClass tracker;
+    uint8_t status;
+    uint8_t slot = tracker.allocate (NULL, true);
+    espnow_send_handle_t first = tracker.handle (slot);
+    tracker.complete (slot, ESP_NOW_SEND_SUCCESS);
+    tracker.collect (slot, status);
+    // Same slot is reused with a different handle
+    TEST_ASSERT_EQUAL (slot, tracker.allocate (NULL, true));
+    TEST_ASSERT_NOT_EQUAL (first, tracker.handle (slot));
+    TEST_ASSERT_EQUAL (ESPNOW_UNTRACKED, tracker.find (first));
+    TEST_ASSERT_EQUAL (ESPNOW_UNTRACKED, tracker.find (ESPNOW_NO_HANDLE));
+}
+
+void test_detached_slots_are_freed () {
+    SendTrackerClass tracker;
+    uint8_t slots[ESPNOW_MAX_TRACKED_MESSAGES];
+    for (int i = 0; i < ESPNOW_MAX_TRACKED_MESSAGES; i++) {
+        slots[i] = tracker.allocate (NULL, i % 2);
+        TEST_ASSERT_NOT_EQUAL (ESPNOW_UNTRACKED, slots[i]);
+    }
+    TEST_ASSERT_EQUAL (ESPNOW_UNTRACKED, tracker.allocate (NULL, true));
+    // Nobody waits for even slots. Odd slots are given up before or after they complete
+    for (int i = 0; i < ESPNOW_MAX_TRACKED_MESSAGES; i++) {
+        if (i % 4 == 1) {
+            tracker.detach (slots[i]);
+        }
+        TEST_ASSERT_EQUAL (i % 4 == 3, tracker.complete (slots[i], ESP_NOW_SEND_SUCCESS));
+        if (i % 4 == 3) {
+            tracker.detach (slots[i]);
+        }
+    }
+    for (int i = 0; i < ESPNOW_MAX_TRACKED_MESSAGES; i++) {
+        TEST_ASSERT_NOT_EQUAL (ESPNOW_UNTRACKED, tracker.allocate (NULL, false));
+    }
+}
+
+void process () {
+    UNITY_BEGIN ();
+    RUN_TEST (test_collect_result);
+    RUN_TEST (test_stale_handle);
+    RUN_TEST (test_detached_slots_are_freed);
+    UNITY_END ();
+}
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+void setup () {
+    // NOTE!!! Wait for >2 secs
+    // if board doesn't support software reset via Serial.DTR/RTS
+    delay (2000);
+
+    process ();
+}
+
+void loop () {
+    delay (1);
+}
+
+#else
+
+int main (int argc, char** argv) {
+    process ();
+    return 0;
+}
+
+#endif
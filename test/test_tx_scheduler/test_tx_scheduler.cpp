@@ -0,0 +1,502 @@
+#define UNIT_TEST
+
+#include <QuickEspNow.h>
+#include <unity.h>
+#include <functional>
+#include <vector>
+
+static uint8_t completed[32];
+static int completions;
+static uint8_t lastSequence[2];
+static int received;
+static bool outOfOrder;
+static uint8_t order[64];
+
+void setUp (void) {
+    // set stuff up here
+    Serial.begin (115200);
+    completions = 0;
+    received = 0;
+    outOfOrder = false;
+}
+
+void tearDown (void) {
+    // clean stuff up here
+}
+
+#ifndef ARDUINO
+/**
+  * @brief Waits until a condition holds, so that checks do not depend on thread timing
+  */
+bool waitFor (std::function<bool ()> condition, uint32_t timeout_ms = 2000) {
+    uint32_t start = millis ();
+    while (!condition ()) {
+        if (millis () - start > timeout_ms) {
+            return false;
+        }
+        delay (1);
+    }
+    return true;
+}
+
+void dataSent (uint8_t* address, uint8_t status) {
+    if (completions < (int)sizeof (completed)) {
+        completed[completions] = address[5];
+    }
+    completions++;
+}
+
+void dataReceived (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    uint8_t source = address[5] & 1;
+    if (data[0] != lastSequence[source] + 1) {
+        outOfOrder = true;
+    }
+    lastSequence[source] = data[0];
+    received++;
+}
+
+void test_dead_peer_does_not_block_others () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t liveMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t deadMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x13 };
+    uint8_t payload[10] = { 0 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass liveRadio (bus, liveMac);
+    QuickEspNow sender;
+    QuickEspNow live;
+
+    // Every frame to a node that is not there takes a full retry sequence
+    bus.setRetryTime (20000);
+    lastSequence[0] = lastSequence[1] = 0;
+    sender.setDriver (&senderRadio);
+    live.setDriver (&liveRadio);
+    sender.onDataSent (dataSent);
+    live.onDataRcvd (dataReceived);
+    live.begin (1, 0, false);
+    sender.begin (1, 0, false);
+
+    for (int i = 1; i <= 4; i++) {
+        payload[0] = i;
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (deadMac, payload, sizeof (payload)));
+    }
+    for (int i = 1; i <= 4; i++) {
+        payload[0] = i;
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (liveMac, payload, sizeof (payload)));
+    }
+    delay (150);
+    TEST_ASSERT_EQUAL (8, completions);
+    TEST_ASSERT_EQUAL (4, received);
+    TEST_ASSERT_FALSE (outOfOrder);
+    // A failure ends turn of dead node, so all messages to live one go before its second message
+    int deadFirst = 0;
+    for (int i = 0, liveDone = 0; liveDone < 4; i++) {
+        if (completed[i] == 0x12) {
+            liveDone++;
+        } else {
+            deadFirst++;
+        }
+    }
+    TEST_ASSERT_LESS_OR_EQUAL (1, deadFirst);
+    sender.stop ();
+    live.stop ();
+}
+
+void classReceived (uint8_t* address, uint8_t* data, uint8_t len, signed int rssi, bool broadcast) {
+    if (received < (int)sizeof (order)) {
+        order[received] = data[0];
+    }
+    received++;
+}
+
+void test_control_before_bulk () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t payload[20] = { 'B' };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    int bulk = 0;
+
+    bus.setAirtime (2000, 0);
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (classReceived);
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, false);
+
+    // Bulk queue is saturated, control message still goes next
+    while (bulk < 40 && sender.send (receiverMac, payload, sizeof (payload), ESPNOW_PRIORITY_BULK) == COMMS_SEND_OK) {
+        bulk++;
+    }
+    TEST_ASSERT_GREATER_THAN (8, bulk);
+    payload[0] = 'C';
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, payload, sizeof (payload), ESPNOW_PRIORITY_CONTROL));
+    delay (bulk * 2 + 100);
+    TEST_ASSERT_EQUAL (bulk + 1, received);
+    int position = 0;
+    while (order[position] != 'C') {
+        position++;
+    }
+    TEST_ASSERT_LESS_OR_EQUAL (2, position);
+    sender.stop ();
+
+    // Bulk messages that wait for too long are dropped
+    received = 0;
+    TEST_ASSERT_FALSE (sender.setPriorityQueue (ESPNOW_PRIORITY_BULK, ESPNOW_TX_RECORD_LEN));
+    TEST_ASSERT_TRUE (sender.setPriorityQueue (ESPNOW_PRIORITY_BULK, ESPNOW_TX_BULK_QUEUE_BYTES, 10));
+    sender.begin (1, 0, false);
+    payload[0] = 'B';
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, payload, sizeof (payload), ESPNOW_PRIORITY_BULK));
+    }
+    delay (100);
+    TEST_ASSERT_GREATER_THAN (0, sender.getExpiredMessages (ESPNOW_PRIORITY_BULK));
+    TEST_ASSERT_EQUAL (10, received + sender.getExpiredMessages (ESPNOW_PRIORITY_BULK));
+    sender.stop ();
+
+    // Long maximum age does not overflow when it is compared with message age
+    received = 0;
+    uint32_t expired = sender.getExpiredMessages (ESPNOW_PRIORITY_BULK);
+    TEST_ASSERT_TRUE (sender.setPriorityQueue (ESPNOW_PRIORITY_BULK, ESPNOW_TX_BULK_QUEUE_BYTES, 4294968));
+    sender.begin (1, 0, false);
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, payload, sizeof (payload), ESPNOW_PRIORITY_BULK));
+    }
+    delay (100);
+    TEST_ASSERT_EQUAL (expired, sender.getExpiredMessages (ESPNOW_PRIORITY_BULK));
+    TEST_ASSERT_EQUAL (10, received);
+    sender.stop ();
+    receiver.stop ();
+}
+
+void test_pacing () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t liveMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t deadMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x13 };
+    uint8_t payload[10] = { 0 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass liveRadio (bus, liveMac);
+    QuickEspNow sender;
+    QuickEspNow live;
+
+    sender.setDriver (&senderRadio);
+    live.setDriver (&liveRadio);
+    live.onDataRcvd (classReceived);
+    sender.enablePacing (200);
+    live.begin (1, 0, false);
+    sender.begin (1, 0, false);
+
+    // 25 frames at 200 frames per second take more than 100 ms
+    for (int i = 0; i < 25; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (liveMac, payload, sizeof (payload)));
+    }
+    delay (60);
+    TEST_ASSERT_LESS_THAN (20, received);
+    delay (200);
+    TEST_ASSERT_EQUAL (25, received);
+    TEST_ASSERT_EQUAL (200, sender.getTxRate (liveMac));
+
+    // Rate to a dead node is halved on every failure. Global rate is only cut by first one
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (deadMac, payload, sizeof (payload)));
+    }
+    delay (100);
+    TEST_ASSERT_EQUAL (25, sender.getTxRate (deadMac));
+    TEST_ASSERT_EQUAL (150, sender.getTxRate ());
+    sender.stop ();
+    live.stop ();
+}
+
+void test_watermarks () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t payload[100] = { 0 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    int events = 0;
+    espnow_watermark_t lastLevel = ESPNOW_WATERMARK_LOW;
+    bool alternate = true;
+
+    bus.setAirtime (2000, 0);
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (classReceived);
+    TEST_ASSERT_FALSE (sender.waitForQueueSpace (0));
+    TEST_ASSERT_FALSE (sender.setQueueWatermarks (ESPNOW_QUEUE_TX, 50, 50));
+    TEST_ASSERT_TRUE (sender.setQueueWatermarks (ESPNOW_QUEUE_TX, 75, 25));
+    sender.onQueueWatermark ([&] (espnow_queue_id_t queue, espnow_watermark_t level, size_t bytesUsed) {
+        alternate = alternate && queue == ESPNOW_QUEUE_TX && level != lastLevel;
+        lastLevel = level;
+        events++;
+    });
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, false);
+
+    // Producer runs as fast as link takes messages and never gets a full queue
+    for (int i = 0; i < 30; i++) {
+        TEST_ASSERT_TRUE (sender.waitForQueueSpace (1000));
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, payload, sizeof (payload)));
+    }
+    // Low mark is crossed when last message leaves queue, that may be after it has been received
+    TEST_ASSERT_TRUE (waitFor ([&] () { return received == 30 && lastLevel == ESPNOW_WATERMARK_LOW; }));
+    TEST_ASSERT_EQUAL (30, received);
+    TEST_ASSERT_GREATER_THAN (1, events);
+    TEST_ASSERT_TRUE (alternate);
+    TEST_ASSERT_EQUAL (ESPNOW_WATERMARK_LOW, lastLevel);
+    sender.stop ();
+    receiver.stop ();
+}
+
+void test_overflow_policies () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t payload[100] = { 0 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    uint32_t dropped;
+    int queued = 0;
+
+    // Link is slower than producer
+    sender.enablePacing (200);
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (classReceived);
+    TEST_ASSERT_FALSE (receiver.setOverflowPolicy (ESPNOW_QUEUE_RX, ESPNOW_OVERFLOW_BLOCK, 100));
+    TEST_ASSERT_TRUE (sender.setOverflowPolicy (ESPNOW_QUEUE_TX, ESPNOW_OVERFLOW_BLOCK, 1000));
+    TEST_ASSERT_TRUE (sender.setOverflowPolicy (ESPNOW_QUEUE_TX_BULK, ESPNOW_OVERFLOW_DROP_OLDEST));
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, false);
+
+    // Default policy rejects newest message
+    while (sender.send (receiverMac, payload, sizeof (payload), ESPNOW_PRIORITY_CONTROL) == COMMS_SEND_OK) {
+        queued++;
+    }
+    TEST_ASSERT_EQUAL (1, sender.getDroppedMessages (ESPNOW_QUEUE_TX_CONTROL, ESPNOW_DROP_NEWEST));
+    TEST_ASSERT_TRUE (waitFor ([&] () { return received == queued; }));
+
+    // Blocked producer loses nothing
+    received = 0;
+    for (int i = 0; i < 30; i++) {
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, payload, sizeof (payload)));
+    }
+    TEST_ASSERT_TRUE (waitFor ([] () { return received == 30; }));
+    TEST_ASSERT_EQUAL (0, sender.getDroppedMessages (ESPNOW_QUEUE_TX, ESPNOW_DROP_TIMEOUT));
+
+    // Latest data wins
+    received = 0;
+    for (int i = 1; i <= 30; i++) {
+        payload[0] = i;
+        TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (receiverMac, payload, sizeof (payload), ESPNOW_PRIORITY_BULK));
+    }
+    TEST_ASSERT_TRUE (waitFor ([&] () { return received + sender.getDroppedMessages (ESPNOW_QUEUE_TX_BULK, ESPNOW_DROP_OLDEST) == 30; }));
+    dropped = sender.getDroppedMessages (ESPNOW_QUEUE_TX_BULK, ESPNOW_DROP_OLDEST);
+    TEST_ASSERT_GREATER_THAN (0, dropped);
+    TEST_ASSERT_EQUAL (30, received + dropped);
+    TEST_ASSERT_EQUAL (30, order[received - 1]);
+    sender.stop ();
+    receiver.stop ();
+}
+
+void test_stats () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t payload[100] = { 0 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    espnow_stats_t txStats;
+    espnow_stats_t rxStats;
+    uint32_t samples = 0;
+
+    bus.setLossRatio (0.3);
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (classReceived);
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, true);
+
+    for (int i = 0; i < 20; i++) {
+        sender.send (receiverMac, payload, sizeof (payload));
+    }
+    // Sends are synchronous, so only reception may still be running
+    TEST_ASSERT_TRUE (waitFor ([&] () { receiver.getStats (rxStats); return rxStats.rxFrames == (uint32_t)received; }));
+    sender.getStats (txStats);
+    receiver.getStats (rxStats);
+    TEST_ASSERT_EQUAL (20, txStats.txFrames);
+    TEST_ASSERT_EQUAL (20 * sizeof (payload), txStats.txBytes);
+    TEST_ASSERT_EQUAL (20, txStats.txConfirmed + txStats.txFailed);
+    TEST_ASSERT_GREATER_THAN (0, txStats.txFailed);
+    TEST_ASSERT_EQUAL (received, rxStats.rxFrames);
+    TEST_ASSERT_EQUAL (received * sizeof (payload), rxStats.rxBytes);
+    TEST_ASSERT_EQUAL (1, txStats.peersAdded);
+    TEST_ASSERT_GREATER_THAN (0, txStats.queueHighWater[ESPNOW_QUEUE_TX]);
+    TEST_ASSERT_GREATER_THAN (0, rxStats.queueHighWater[ESPNOW_QUEUE_RX]);
+    for (int i = 0; i < ESPNOW_LATENCY_BUCKETS; i++) {
+        samples += txStats.txLatency[i];
+    }
+    TEST_ASSERT_EQUAL (20, samples);
+
+    sender.resetStats ();
+    sender.getStats (txStats);
+    TEST_ASSERT_EQUAL (0, txStats.txFrames);
+    TEST_ASSERT_EQUAL (0, txStats.txLatency[0]);
+    TEST_ASSERT_EQUAL (0, txStats.queueHighWater[ESPNOW_QUEUE_TX]);
+    sender.stop ();
+    receiver.stop ();
+}
+
+void test_trace () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t receiverMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t payload[50] = { 0 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass receiverRadio (bus, receiverMac);
+    QuickEspNow sender;
+    QuickEspNow receiver;
+    std::vector<uint8_t> dump;
+    espnow_trace_header_t header;
+    espnow_trace_record_t records[12];
+    auto writer = [&dump] (const uint8_t* data, size_t len) { dump.insert (dump.end (), data, data + len); };
+
+    sender.setDriver (&senderRadio);
+    receiver.setDriver (&receiverRadio);
+    receiver.onDataRcvd (classReceived);
+    receiver.begin (1, 0, false);
+    sender.begin (1, 0, true);
+    TEST_ASSERT_TRUE (sender.enableTrace ());
+    TEST_ASSERT_TRUE (receiver.enableTrace (4));
+
+    for (int i = 0; i < 3; i++) {
+        sender.send (receiverMac, payload, sizeof (payload));
+    }
+    TEST_ASSERT_TRUE (waitFor ([] () { return received == 3; }));
+
+    // Every message leaves one record per stage, in pipeline order
+    TEST_ASSERT_EQUAL (12, sender.dumpTrace (writer));
+    TEST_ASSERT_EQUAL (sizeof (header) + sizeof (records), dump.size ());
+    memcpy (&header, dump.data (), sizeof (header));
+    memcpy (records, dump.data () + sizeof (header), sizeof (records));
+    TEST_ASSERT_EQUAL_MEMORY ("QETR", header.magic, 4);
+    TEST_ASSERT_EQUAL (ESPNOW_TRACE_VERSION, header.version);
+    TEST_ASSERT_EQUAL (sizeof (espnow_trace_record_t), header.recordSize);
+    TEST_ASSERT_EQUAL (12, header.records);
+    TEST_ASSERT_EQUAL (0, header.lost);
+    for (int i = 0; i < 12; i++) {
+        TEST_ASSERT_EQUAL (i % 4, records[i].event);
+        TEST_ASSERT_EQUAL (records[i - i % 4].id, records[i].id);
+        TEST_ASSERT_EQUAL (EspNowTraceClass::macHash (receiverMac), records[i].macHash);
+        TEST_ASSERT_EQUAL (0, records[i].status);
+    }
+    TEST_ASSERT_EQUAL (sizeof (payload), records[2].len);
+    TEST_ASSERT_EQUAL (ESPNOW_QUEUE_TX, records[0].queue);
+
+    // Ring keeps newest records only
+    dump.clear ();
+    TEST_ASSERT_EQUAL (4, receiver.dumpTrace (writer));
+    memcpy (&header, dump.data (), sizeof (header));
+    memcpy (records, dump.data () + sizeof (header), 4 * sizeof (espnow_trace_record_t));
+    TEST_ASSERT_EQUAL (2, header.lost);
+    TEST_ASSERT_EQUAL (ESPNOW_TRACE_RX_CB, records[0].event);
+    TEST_ASSERT_EQUAL (ESPNOW_TRACE_DISPATCH, records[3].event);
+    TEST_ASSERT_EQUAL (EspNowTraceClass::macHash (senderMac), records[3].macHash);
+    TEST_ASSERT_EQUAL (0, receiver.dumpTrace (writer));
+
+    // Paused trace records nothing
+    sender.enableTrace (0);
+    sender.send (receiverMac, payload, sizeof (payload));
+    TEST_ASSERT_TRUE (waitFor ([] () { return received == 4; }));
+    TEST_ASSERT_EQUAL (0, sender.dumpTrace (writer));
+    sender.stop ();
+    receiver.stop ();
+}
+
+void test_late_confirmation_ignored () {
+    uint8_t senderMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x11 };
+    uint8_t firstMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x12 };
+    uint8_t secondMac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x13 };
+    uint8_t payload[10] = { 0 };
+    EspNowBusClass bus;
+    EspNowBusDriverClass senderRadio (bus, senderMac);
+    EspNowBusDriverClass firstRadio (bus, firstMac);
+    EspNowBusDriverClass secondRadio (bus, secondMac);
+    QuickEspNow sender;
+    QuickEspNow first;
+    QuickEspNow second;
+    espnow_stats_t txStats;
+
+    // Confirmations come after tx task has given up on them, while next message is waiting for its own
+    bus.setAirtime (ESPNOW_TX_CONFIRM_TIMEOUT_MS * 1500, 0);
+    sender.setDriver (&senderRadio);
+    first.setDriver (&firstRadio);
+    second.setDriver (&secondRadio);
+    first.onDataRcvd (classReceived);
+    second.onDataRcvd (classReceived);
+    first.begin (1, 0, false);
+    second.begin (1, 0, false);
+    sender.begin (1, 0, false);
+
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (firstMac, payload, sizeof (payload)));
+    TEST_ASSERT_EQUAL (COMMS_SEND_OK, sender.send (secondMac, payload, sizeof (payload)));
+    TEST_ASSERT_TRUE (waitFor ([&] () { sender.getStats (txStats); return txStats.txTimeouts == 2 && received == 2; }));
+    // Driver is stopped after its last confirmation
+    sender.stop ();
+    sender.getStats (txStats);
+    TEST_ASSERT_EQUAL (2, txStats.txTimeouts);
+    TEST_ASSERT_EQUAL (0, txStats.txConfirmed);
+    TEST_ASSERT_EQUAL (0, txStats.txFailed);
+    first.stop ();
+    second.stop ();
+}
+#endif
+
+void process () {
+    UNITY_BEGIN ();
+#ifndef ARDUINO
+    RUN_TEST (test_dead_peer_does_not_block_others);
+    RUN_TEST (test_control_before_bulk);
+    RUN_TEST (test_pacing);
+    RUN_TEST (test_watermarks);
+    RUN_TEST (test_overflow_policies);
+    RUN_TEST (test_stats);
+    RUN_TEST (test_trace);
+    RUN_TEST (test_late_confirmation_ignored);
+#endif
+    UNITY_END ();
+}
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+void setup () {
+    // NOTE!!! Wait for >2 secs
+    // if board doesn't support software reset via Serial.DTR/RTS
+    delay (2000);
+
+    process ();
+}
+
+void loop () {
+    delay (1);
+}
+
+#else
+
+int main (int argc, char** argv) {
+    process ();
+    return 0;
+}
+
+#endif
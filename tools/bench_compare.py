@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Compares two result files of throughput_bench example and reports regressions.
+
+Usage: bench_compare.py baseline.jsonl current.jsonl [--threshold 10]
+
+Runs are matched by configuration. Exit code is 1 if any metric got worse by more than threshold percent.
+"""
+import argparse
+import json
+import sys
+
+# (path in result, True if higher is better)
+METRICS = [
+    (("tx", "msgs_per_s"), True),
+    (("rx", "msgs_per_s"), True),
+    (("rx", "goodput_kbps"), True),
+    (("drop_ratio",), False),
+    (("latency_us", "enqueue_to_tx_cb", "p50"), False),
+    (("latency_us", "enqueue_to_tx_cb", "p99"), False),
+    (("latency_us", "rx_cb_to_dispatch", "p50"), False),
+    (("latency_us", "rx_cb_to_dispatch", "p99"), False),
+]
+
+
+def load(path):
+    runs = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith("{"):
+                continue
+            result = json.loads(line)
+            config = dict(result["config"])
+            config.pop("duration_ms", None)
+            # Results of versions without pacing ran unpaced
+            config.setdefault("pacing", 0)
+            runs[json.dumps(config, sort_keys=True)] = result
+    return runs
+
+
+def get(result, path):
+    for key in path:
+        if not isinstance(result, dict) or key not in result:
+            return None
+        result = result[key]
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=10.0, help="allowed change in percent")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+    regressions = 0
+    for key, base in sorted(baseline.items()):
+        if key not in current:
+            print("missing run %s" % key)
+            continue
+        for path, higher_is_better in METRICS:
+            old = get(base, path)
+            new = get(current[key], path)
+            if old is None or new is None:
+                continue
+            change = (new - old) * 100.0 / old if old else (100.0 if new else 0.0)
+            worse = -change if higher_is_better else change
+            flag = "REGRESSION" if worse > args.threshold else ""
+            regressions += bool(flag)
+            print("%-60s %-40s %12.2f -> %12.2f (%+.1f%%) %s" % (key, ".".join(path), old, new, change, flag))
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+"""Decodes trace dumps written by QuickEspNow::dumpTrace and renders per message timelines.
+
+Usage: trace_decode.py dump.bin [--hex] [--mac AA:BB:CC:DD:EE:FF ...] [--raw] [--summary]
+
+A file may hold several dumps one after another. With --hex, file is text, i.e. a serial log, where dump bytes
+were printed as hexadecimal digits; anything that is not a hex digit is skipped. Records of a message share
+direction, address hash and id. Stage times are shown relative to previous stage of the same message.
+"""
+import argparse
+import re
+import struct
+import sys
+
+HEADER = struct.Struct("<4sBBHII")
+RECORD = struct.Struct("<IHHBBBB")
+MAGIC = b"QETR"
+VERSION = 1
+
+EVENTS = ["ENQUEUE", "DEQUEUE", "SEND", "TX_CB", "RX_CB", "DISPATCH"]
+TX_EVENTS = range(0, 4)
+QUEUES = ["CONTROL", "TX", "BULK", "RX"]
+DROP_REASONS = ["newest", "oldest", "timeout", "expired", "resize", "decode"]
+DRIVER_ERRORS = ["no_mem", "not_found", "arg", "other"]
+
+
+def mac_hash(mac):
+    value = 2166136261
+    for byte in mac:
+        value = ((value ^ byte) * 16777619) & 0xFFFFFFFF
+    return (value ^ (value >> 16)) & 0xFFFF
+
+
+def status_text(event, status):
+    if event == 3:
+        return "ok" if status == 0 else "fail"
+    if status == 0:
+        return ""
+    if event in (1, 4, 5) and status <= len(DROP_REASONS):
+        return "dropped: " + DROP_REASONS[status - 1]
+    if event == 2 and status <= len(DRIVER_ERRORS):
+        return "error: " + DRIVER_ERRORS[status - 1]
+    return "status %d" % status
+
+
+def read_dumps(data):
+    """Yields (lost, records) for every dump in data"""
+    offset = 0
+    while offset + HEADER.size <= len(data):
+        magic, version, record_size, _, count, lost = HEADER.unpack_from(data, offset)
+        if magic != MAGIC:
+            # Serial logs may have noise between dumps
+            next_dump = data.find(MAGIC, offset + 1)
+            if next_dump < 0:
+                return
+            offset = next_dump
+            continue
+        if version != VERSION or record_size < RECORD.size:
+            sys.exit("Unsupported trace version %d, record size %d" % (version, record_size))
+        offset += HEADER.size
+        records = []
+        for _ in range(count):
+            if offset + record_size > len(data):
+                print("Dump is truncated", file=sys.stderr)
+                break
+            records.append(RECORD.unpack_from(data, offset))
+            offset += record_size
+        yield lost, records
+
+
+def finishes(event, status):
+    """Checks if a record is last one of its message. Sends rejected for lack of driver memory are tried again"""
+    return event in (3, 5) or (status != 0 and event in (1, 4)) or (event == 2 and status > 1)
+
+
+def group_messages(records):
+    """Groups records by message. Ids repeat after 65 ms and messages queued in the same microsecond share them,
+    so records go to oldest unfinished message with their key"""
+    messages = []
+    unfinished = {}
+    for record in records:
+        time, msg_id, mac, event, length, status, queue = record
+        key = (event in TX_EVENTS, mac, msg_id)
+        pending = unfinished.setdefault(key, [])
+        # Messages queued before trace started show up without their first records
+        if event in (0, 4) or not pending:
+            message = {"tx": key[0], "mac": mac, "id": msg_id, "len": length, "queue": queue, "events": []}
+            messages.append(message)
+            pending.append(message)
+        message = pending[-1] if event in (0, 4) else pending[0]
+        if event != 3:
+            message["len"] = length
+            message["queue"] = queue
+        message["events"].append((time, event, status))
+        if finishes(event, status):
+            pending.remove(message)
+    return messages
+
+
+def percentile(values, ratio):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * ratio))]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("dump", nargs="+")
+    parser.add_argument("--hex", action="store_true", help="dump is hexadecimal text")
+    parser.add_argument("--mac", action="append", default=[], help="label records of this address")
+    parser.add_argument("--raw", action="store_true", help="list records in time order")
+    parser.add_argument("--summary", action="store_true", help="only show stage latencies")
+    args = parser.parse_args()
+
+    labels = {}
+    for mac in args.mac:
+        labels[mac_hash(bytes(int(byte, 16) for byte in re.split("[:-]", mac)))] = mac.upper()
+
+    for path in args.dump:
+        with open(path, "rb") as f:
+            data = f.read()
+        if args.hex:
+            digits = re.sub(rb"[^0-9a-fA-F]", b"", data).decode()
+            data = bytes.fromhex(digits[: len(digits) // 2 * 2])
+        records = []
+        lost = 0
+        for dump_lost, dump_records in read_dumps(data):
+            lost += dump_lost
+            records.extend(dump_records)
+        print("%s: %d records, %d lost" % (path, len(records), lost))
+
+        if args.raw:
+            start = records[0][0] if records else 0
+            for time, msg_id, mac, event, length, status, queue in records:
+                print("%10d  %-8s %-17s id %04x len %3d %-7s %s" % ((time - start) & 0xFFFFFFFF, EVENTS[event] if event < len(EVENTS) else event,
+                      labels.get(mac, "%04x" % mac), msg_id, length, QUEUES[queue] if queue < len(QUEUES) else queue, status_text(event, status)))
+            continue
+
+        messages = group_messages(records)
+        transitions = {}
+        for message in messages:
+            line = []
+            previous = None
+            for time, event, status in message["events"]:
+                name = EVENTS[event] if event < len(EVENTS) else str(event)
+                if previous is None:
+                    line.append(name)
+                else:
+                    delta = (time - previous[0]) & 0xFFFFFFFF
+                    line.append("%s +%d" % (name, delta))
+                    transitions.setdefault((EVENTS[previous[1]], name), []).append(delta)
+                text = status_text(event, status)
+                if text:
+                    line[-1] += " (%s)" % text
+                previous = (time, event)
+            if not args.summary:
+                print("%s %-17s id %04x len %3d %-7s %s" % ("tx to  " if message["tx"] else "rx from", labels.get(message["mac"], "%04x" % message["mac"]), message["id"],
+                      message["len"], QUEUES[message["queue"]] if message["queue"] < len(QUEUES) else message["queue"], " -> ".join(line)))
+
+        print("\n%-22s %8s %10s %10s %10s" % ("stage (us)", "count", "p50", "p99", "max"))
+        for (first, second), deltas in sorted(transitions.items(), key=lambda item: (EVENTS.index(item[0][0]), EVENTS.index(item[0][1]))):
+            print("%-22s %8d %10d %10d %10d" % (first + " -> " + second, len(deltas), percentile(deltas, 0.5), percentile(deltas, 0.99), max(deltas)))
+
+
+if __name__ == "__main__":
+    main()